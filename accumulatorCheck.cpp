@@ -0,0 +1,94 @@
+/*
+ * accumulatorCheck.cpp
+ *
+ *  Created on: Apr 18, 2016
+ *      Author: hrvoje
+ */
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+extern "C" {
+#include "image.h"
+#include "lucas_kanade.h"
+}
+
+#include "accumulatorCheck.h"
+
+using namespace cv;
+using namespace std;
+
+accumulatorCheckResult runAccumulatorCheck(uint16_t half_window_size, uint32_t subpixel_factor, int motion_x, int motion_y)
+{
+	const uint16_t width = 320, height = 240;
+	const uint8_t pyramid_level = 2;
+	const int margin = 16;                 // texture around the frames, more than the motion
+	struct lk_level_params params = { half_window_size, 20, 3, NULL, NULL };
+	vector<struct lk_level_params> levels(pyramid_level + 1, params);
+	uint8_t border_size = opticFlowLK_levels_border_size(&levels[0], pyramid_level);
+
+	accumulatorCheckResult result;
+	struct lk_accumulators acc;
+	opticFlowLK_accumulators(half_window_size, subpixel_factor, &acc);
+	result.blend_bits = acc.blend_bits;
+	result.beyond_int16 = max(abs(motion_x), abs(motion_y)) * int64_t(subpixel_factor) > 0x7FFF;
+
+	// Blurred so the gradients are smooth at the window scale
+	Mat texture(height + 2 * margin, width + 2 * margin, CV_8UC1);
+	RNG rng(0x4321);
+	rng.fill(texture, RNG::UNIFORM, 0, 256);
+	GaussianBlur(texture, texture, Size(0, 0), 2.0);
+
+	// The content of the old frame is at (x + motion_x, y + motion_y) in the new frame
+	vector<struct image_t> pyramid_old(pyramid_level + 1), pyramid_new(pyramid_level + 1);
+	struct image_t frame;
+	image_create(&frame, width, height, IMAGE_GRAYSCALE);
+	Mat frame_mat(height, width, CV_8UC1, frame.buf);
+	texture(Rect(margin, margin, width, height)).copyTo(frame_mat);
+	pyramid_build(&frame, &pyramid_old[0], pyramid_level, border_size);
+	texture(Rect(margin - motion_x, margin - motion_y, width, height)).copyTo(frame_mat);
+	pyramid_build(&frame, &pyramid_new[0], pyramid_level, border_size);
+	image_free(&frame);
+
+	// Far enough from the edges that the windows of the coarsest level stay inside the image
+	vector<struct point_t> points;
+	for (uint32_t y = 3 * margin; y + 3 * margin < height; y += 16)
+		for (uint32_t x = 3 * margin; x + 3 * margin < width; x += 16) {
+			struct point_t point = { x, y };
+			points.push_back(point);
+		}
+
+	uint16_t points_cnt = points.size();
+	struct flow_t *vectors = opticFlowLK_levels(&pyramid_new[0], &pyramid_old[0], &points[0], &points_cnt, &levels[0],
+			border_size, subpixel_factor, points.size(), pyramid_level);
+
+	result.points = points.size();
+	result.points_tracked = points_cnt;
+	result.max_error = 0;
+	for (uint16_t i = 0; i < points_cnt; i++) {
+		double error_x = double(vectors[i].flow_x) / subpixel_factor - motion_x;
+		double error_y = double(vectors[i].flow_y) / subpixel_factor - motion_y;
+		result.max_error = max(result.max_error, sqrt(error_x * error_x + error_y * error_y));
+	}
+	result.passed = result.points_tracked == result.points && result.max_error < 0.1;
+	free(vectors);
+
+	for (uint8_t l = 0; l <= pyramid_level; l++) {
+		image_free(&pyramid_old[l]);
+		image_free(&pyramid_new[l]);
+	}
+	return result;
+}
+
+void printAccumulatorCheck(uint16_t half_window_size, uint32_t subpixel_factor, const accumulatorCheckResult& result)
+{
+	cout << "Accumulator check, window " << 2 * half_window_size + 1 << " subpixel factor " << subpixel_factor
+			<< " (blend " << int(result.blend_bits) << " bit" << (result.beyond_int16 ? ", flow beyond int16" : "") << "): "
+			<< result.points_tracked << "/" << result.points << " points, max error " << result.max_error << " px, "
+			<< (result.passed ? "passed" : "FAILED") << endl;
+}
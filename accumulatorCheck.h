@@ -0,0 +1,31 @@
+/*
+ * accumulatorCheck.h
+ *
+ *  Created on: Apr 18, 2016
+ *      Author: hrvoje
+ */
+
+#ifndef ACCUMULATORCHECK_H_
+#define ACCUMULATORCHECK_H_
+
+#include <stdint.h>
+
+/* Result of runAccumulatorCheck() */
+struct accumulatorCheckResult {
+	uint8_t blend_bits;        // accumulator width opticFlowLK_accumulators() picked for the bilinear blend
+	uint16_t points;           // points that were tracked
+	uint16_t points_tracked;   // points the tracker kept
+	double max_error;          // largest distance of a kept vector from the true motion in pixels
+	bool beyond_int16;         // the true motion in subpixels does not fit the old int16 flow_t fields
+	bool passed;               // all points kept within 0.1 pixel of the true motion
+};
+
+/* Fixed-point LK at a window size and subpixel factor where the accumulators have to be wide: a blurred noise
+ * texture moved by (motion_x, motion_y) pixels is tracked on a grid of points with opticFlowLK_levels(). With
+ * a subpixel factor above 2901 the blend is done in 64 bit, and with more than 3.3 pixels of motion at factor
+ * 10000 the flow no longer fits int16, so an overflow anywhere shows up as lost points or wrong vectors.
+ */
+accumulatorCheckResult runAccumulatorCheck(uint16_t half_window_size, uint32_t subpixel_factor, int motion_x, int motion_y);
+void printAccumulatorCheck(uint16_t half_window_size, uint32_t subpixel_factor, const accumulatorCheckResult& result);
+
+#endif /* ACCUMULATORCHECK_H_ */
@@ -0,0 +1,140 @@
+/*
+ * autoTuner.cpp
+ *
+ *  Created on: Apr 4, 2016
+ *      Author: hrvoje
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include "autoTuner.h"
+
+using namespace std;
+
+trackerAutoTuner::trackerAutoTuner(float target_ms, const tunerBounds& bounds)
+	: target_ms(target_ms),
+	  headroom(0.8),
+	  adjust_interval(10),
+	  history_size(100),
+	  window_size(bounds.max_window_size),
+	  max_iterations(bounds.max_iterations),
+	  pyramid_level(bounds.max_pyramid_level),
+	  max_points(bounds.max_points),
+	  bounds(bounds),
+	  requested_sum(0),
+	  left_sum(0),
+	  frames_since_adjust(0),
+	  hold(0),
+	  hold_length(1)
+{
+}
+
+/* Latency (in miliseconds) below which the given fraction of the remembered frames are */
+float trackerAutoTuner::latencyPercentile(float percentile) const
+{
+	if (latencies.empty())
+		return 0;
+
+	vector<float> sorted(latencies.begin(), latencies.end());
+	vector<float>::size_type n = min(sorted.size() - 1, vector<float>::size_type(percentile * sorted.size()));
+	nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+	return sorted[n];
+}
+
+void trackerAutoTuner::update(float frame_ms, uint16_t points_requested, uint16_t points_left)
+{
+	latencies.push_back(frame_ms);
+	if (latencies.size() > history_size)
+		latencies.pop_front();
+
+	requested_sum += points_requested;
+	left_sum += points_left;
+
+	if (++frames_since_adjust < adjust_interval)
+		return;
+	frames_since_adjust = 0;
+
+	float p99 = latencyPercentile(0.99);
+	float survival = requested_sum ? float(left_sum) / requested_sum : 1;
+
+	bool changed = false;
+	if (p99 > target_ms) {
+		changed = reduceCost();
+		if (changed) {
+			hold = hold_length;
+			hold_length = min(2 * hold_length, 64u);
+		}
+	} else if (hold > 0) {
+		hold--;
+	} else if (p99 < headroom * target_ms) {
+		changed = increaseQuality(survival);
+	}
+
+	if (changed)
+		clearHistory();
+}
+
+void trackerAutoTuner::apply(paparazziBackend& backend) const
+{
+	backend.window_size = window_size;
+	backend.max_iterations = max_iterations;
+	backend.pyramid_level = pyramid_level;
+}
+
+/* Lower one parameter, the one that costs least tracking quality first */
+bool trackerAutoTuner::reduceCost()
+{
+	if (max_iterations > bounds.min_iterations) {
+		max_iterations = max(int(bounds.min_iterations), max_iterations - 5);
+		return true;
+	}
+	if (max_points > bounds.min_points) {
+		max_points = max(int(bounds.min_points), max_points * 4 / 5);
+		return true;
+	}
+	if (window_size > bounds.min_window_size) {
+		window_size = max(int(bounds.min_window_size), window_size - 2);
+		return true;
+	}
+	if (pyramid_level > bounds.min_pyramid_level) {
+		pyramid_level--;
+		return true;
+	}
+	return false;
+}
+
+/* Spend spare time on tracking robustness when points get lost, otherwise on more points */
+bool trackerAutoTuner::increaseQuality(float survival)
+{
+	if (survival < 0.7) {
+		if (pyramid_level < bounds.max_pyramid_level) {
+			pyramid_level++;
+			return true;
+		}
+		if (window_size < bounds.max_window_size) {
+			window_size = min(int(bounds.max_window_size), window_size + 2);
+			return true;
+		}
+		if (max_iterations < bounds.max_iterations) {
+			max_iterations = min(int(bounds.max_iterations), max_iterations + 5);
+			return true;
+		}
+	}
+	if (max_points < bounds.max_points) {
+		max_points = min(int(bounds.max_points), max_points * 5 / 4 + 1);
+		return true;
+	}
+	if (max_iterations < bounds.max_iterations) {
+		max_iterations = min(int(bounds.max_iterations), max_iterations + 5);
+		return true;
+	}
+	return false;
+}
+
+void trackerAutoTuner::clearHistory()
+{
+	latencies.clear();
+	requested_sum = 0;
+	left_sum = 0;
+}
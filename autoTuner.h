@@ -0,0 +1,63 @@
+/*
+ * autoTuner.h
+ *
+ *  Created on: Apr 4, 2016
+ *      Author: hrvoje
+ */
+
+#ifndef AUTOTUNER_H_
+#define AUTOTUNER_H_
+
+#include <deque>
+#include "optFlow_paparazzi.h"
+
+/* Limits within which the tuner may move the tracker parameters */
+struct tunerBounds {
+	uint16_t min_window_size, max_window_size;
+	uint8_t min_iterations, max_iterations;
+	uint8_t min_pyramid_level, max_pyramid_level;
+	uint16_t min_points, max_points;
+};
+
+/* Online tuning of the paparazzi tracker parameters.
+ * After every frame update() is given the frame latency and how many of the requested points survived.
+ * Every adjust_interval frames the p99 latency over the last frames is compared with the target:
+ * above it the cheapest parameter to give up is reduced (iterations, then points, then window size,
+ * then pyramid levels); well below it the spare time is spent on window size and pyramid levels when
+ * many points are lost, or on more points otherwise. The latency history is cleared after every change
+ * so the next decision is based on the new settings only. After every reduction increases are held off
+ * for a number of adjustments that doubles each time, so the tuner settles instead of oscillating
+ * around the target.
+ */
+class trackerAutoTuner {
+public:
+	trackerAutoTuner(float target_ms, const tunerBounds& bounds);
+
+	void update(float frame_ms, uint16_t points_requested, uint16_t points_left);
+	void apply(paparazziBackend& backend) const;
+	float latencyPercentile(float percentile) const;
+
+	float target_ms;          // p99 latency target
+	float headroom;           // only spend more time while p99 < headroom * target_ms
+	unsigned int adjust_interval;   // frames between adjustments (and minimum history)
+	unsigned int history_size;      // frames the percentile is computed over
+
+	// Current settings, start at the upper bounds
+	uint16_t window_size;
+	uint8_t max_iterations;
+	uint8_t pyramid_level;
+	uint16_t max_points;
+
+private:
+	bool reduceCost();
+	bool increaseQuality(float survival);
+	void clearHistory();
+
+	tunerBounds bounds;
+	std::deque<float> latencies;
+	unsigned int requested_sum, left_sum;
+	unsigned int frames_since_adjust;
+	unsigned int hold, hold_length;    // adjustments left without increases, and the next hold off
+};
+
+#endif /* AUTOTUNER_H_ */
@@ -0,0 +1,141 @@
+/*
+ * block_matching.c
+ *
+ *  Created on: Mar 31, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file block_matching.c
+ * @brief integer-pixel optical flow by sum-of-absolute-differences block matching
+ */
+
+#include <stdlib.h>
+#include "block_matching.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Sum of absolute differences between two square blocks.
+ * With SSE2 every row is processed 16 pixels at a time with psadbw, the rest of the row is done in C.
+ * @param[in] *a Top left pixel of the first block
+ * @param[in] a_stride Row stride of the image of the first block
+ * @param[in] *b Top left pixel of the second block
+ * @param[in] b_stride Row stride of the image of the second block
+ * @param[in] block_size Width and height of the blocks
+ * @param[in] max_sad Stop early once the sum (checked after every row) reaches this value
+ * @return The sum of absolute differences (or a value >= max_sad if stopped early)
+ */
+uint32_t block_sad(uint8_t *a, uint16_t a_stride, uint8_t *b, uint16_t b_stride, uint8_t block_size, uint32_t max_sad)
+{
+  uint32_t sad = 0;
+
+  for (uint8_t y = 0; y < block_size; y++) {
+    uint8_t x = 0;
+
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    for (; x + 16 <= block_size; x += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+      acc = _mm_add_epi32(acc, _mm_sad_epu8(va, vb));
+    }
+    // psadbw leaves two partial sums, one in each 64 bit half
+    sad += _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+
+    for (; x < block_size; x++) {
+      sad += abs((int16_t)a[x] - (int16_t)b[x]);
+    }
+
+    if (sad >= max_sad) {
+      return sad;
+    }
+
+    a += a_stride;
+    b += b_stride;
+  }
+
+  return sad;
+}
+
+/**
+ * Compute the integer-pixel flow of several points with block matching on one pyramid level.
+ * @param[in] *pyramid_new Padded pyramid of the newest image (as built by pyramid_build)
+ * @param[in] *pyramid_old Padded pyramid of the old image
+ * @param[in] *points Points to start tracking from (level 0 pixel coordinates)
+ * @param[in,out] points_cnt The amount of points and it returns the amount of points tracked
+ * @param[in] border_size The padding the pyramids were built with
+ * @param[in] level The pyramid level to search on
+ * @param[in] block_size Width and height of the compared blocks (multiples of 16 use SIMD only)
+ * @param[in] search_range Maximum displacement searched in both directions, in pixels on the searched level
+ * @param[in] subpixel_factor The subpixel factor of the returned vectors
+ * @return The vectors from the original *points in subpixels at level 0 (same format as opticFlowLK)
+ */
+struct flow_t *block_matching_flow(struct image_t *pyramid_new, struct image_t *pyramid_old, struct point_t *points, uint16_t *points_cnt,
+                                   uint8_t border_size, uint8_t level, uint8_t block_size, uint8_t search_range, uint32_t subpixel_factor)
+{
+  struct image_t *img_old = &pyramid_old[level];
+  struct image_t *img_new = &pyramid_new[level];
+  uint8_t *old_buf = (uint8_t *)img_old->buf;
+  uint8_t *new_buf = (uint8_t *)img_new->buf;
+  int32_t half_block = block_size / 2;
+
+  struct flow_t *vectors = malloc(sizeof(struct flow_t) * *points_cnt);
+  uint16_t new_p = 0;
+
+  for (uint16_t i = 0; i < *points_cnt; i++) {
+    // Top left of the block in the padded level
+    int32_t x = (int32_t)(points[i].x >> level) + border_size - half_block;
+    int32_t y = (int32_t)(points[i].y >> level) + border_size - half_block;
+
+    // The reference block has to be completely inside the padded image
+    if (x < 0 || y < 0 || x + block_size > img_old->w || y + block_size > img_old->h) {
+      continue;
+    }
+
+    uint8_t *ref = &old_buf[y * img_old->w + x];
+    uint32_t best_sad = UINT32_MAX;
+    int32_t best_dx = 0, best_dy = 0;
+
+    // Exhaustive search, the zero displacement goes first so ties keep the smallest motion
+    for (int32_t r = 0; r <= search_range; r++) {
+      for (int32_t dy = -r; dy <= r; dy++) {
+        for (int32_t dx = -r; dx <= r; dx++) {
+          // Only visit the ring at distance r
+          if (abs(dx) != r && abs(dy) != r) {
+            continue;
+          }
+
+          int32_t cx = x + dx;
+          int32_t cy = y + dy;
+          if (cx < 0 || cy < 0 || cx + block_size > img_new->w || cy + block_size > img_new->h) {
+            continue;
+          }
+
+          uint32_t sad = block_sad(ref, img_old->w, &new_buf[cy * img_new->w + cx], img_new->w, block_size, best_sad);
+          if (sad < best_sad) {
+            best_sad = sad;
+            best_dx = dx;
+            best_dy = dy;
+          }
+        }
+      }
+    }
+
+    if (best_sad == UINT32_MAX) {
+      continue;
+    }
+
+    vectors[new_p].pos.x = points[i].x * subpixel_factor;
+    vectors[new_p].pos.y = points[i].y * subpixel_factor;
+    vectors[new_p].flow_x = best_dx * (1 << level) * (int32_t)subpixel_factor;
+    vectors[new_p].flow_y = best_dy * (1 << level) * (int32_t)subpixel_factor;
+    new_p++;
+  }
+
+  *points_cnt = new_p;
+  return vectors;
+}
@@ -0,0 +1,28 @@
+/*
+ * block_matching.h
+ *
+ *  Created on: Mar 31, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file block_matching.h
+ * @brief integer-pixel optical flow by sum-of-absolute-differences block matching
+ *
+ * Exhaustive SAD search in a fixed range around every point on one pyramid level. The cost per point
+ * is bounded by (2 * search_range + 1)^2 block comparisons, which makes it a robust and predictable
+ * coarse estimate for large motions where Lucas-Kanade loses the point. The result can be refined to
+ * subpixel accuracy with opticFlowLK_refine().
+ */
+
+#ifndef BLOCK_MATCHING_H
+#define BLOCK_MATCHING_H
+
+#include "std.h"
+#include "image.h"
+
+uint32_t block_sad(uint8_t *a, uint16_t a_stride, uint8_t *b, uint16_t b_stride, uint8_t block_size, uint32_t max_sad);
+struct flow_t *block_matching_flow(struct image_t *pyramid_new, struct image_t *pyramid_old, struct point_t *points, uint16_t *points_cnt,
+                                   uint8_t border_size, uint8_t level, uint8_t block_size, uint8_t search_range, uint32_t subpixel_factor);
+
+#endif /* BLOCK_MATCHING_H */
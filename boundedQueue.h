@@ -0,0 +1,154 @@
+/*
+ * boundedQueue.h
+ *
+ *  Created on: Apr 12, 2016
+ *      Author: hrvoje
+ */
+
+#ifndef BOUNDEDQUEUE_H_
+#define BOUNDEDQUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/* Bounded lock-free queue of trivially copyable values (pointers in practice).
+ * try_push() fails when the queue is full, try_pop() when it is empty, the caller decides how to wait.
+ * depth() is a snapshot, exact only when no other thread is using the queue.
+ */
+template<typename T>
+class boundedQueue {
+public:
+	virtual ~boundedQueue() {}
+	virtual bool try_push(const T& value) = 0;
+	virtual bool try_pop(T& value) = 0;
+	virtual size_t depth() const = 0;
+	virtual size_t capacity() const = 0;
+};
+
+/* Single producer, single consumer ring. Head and tail are only written by one side each, so a push and a pop
+ * are a load of the other side's index and a release store of their own. */
+template<typename T>
+class spscQueue : public boundedQueue<T> {
+public:
+	explicit spscQueue(size_t capacity) : slots(capacity + 1), head(0), tail(0) {}
+
+	bool try_push(const T& value)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t next = (t + 1 == slots.size()) ? 0 : t + 1;
+		if (next == head.load(std::memory_order_acquire))
+			return false;
+		slots[t] = value;
+		tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	bool try_pop(T& value)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		value = slots[h];
+		head.store((h + 1 == slots.size()) ? 0 : h + 1, std::memory_order_release);
+		return true;
+	}
+
+	size_t depth() const
+	{
+		size_t h = head.load(std::memory_order_acquire), t = tail.load(std::memory_order_acquire);
+		return (t >= h) ? t - h : t + slots.size() - h;
+	}
+
+	size_t capacity() const { return slots.size() - 1; }
+
+private:
+	// The indices sit on their own cache lines so producer and consumer do not invalidate each other's
+	// line on every operation (padding, over-aligned new needs C++17)
+	std::vector<T> slots;                   // one slot stays empty to tell full from empty
+	char pad_slots[64];
+	std::atomic<size_t> head;               // next slot to pop, written by the consumer
+	char pad_head[64];
+	std::atomic<size_t> tail;               // next slot to push, written by the producer
+	char pad_tail[64];
+};
+
+/* Multiple producer, multiple consumer ring (Vyukov). Every slot carries a sequence number that tells whether it
+ * is free for the push of a position or filled for the pop of it, so producers and consumers only contend on
+ * their own position counter. Used where several threads feed or drain one queue. */
+template<typename T>
+class mpmcQueue : public boundedQueue<T> {
+public:
+	explicit mpmcQueue(size_t capacity) : slots(capacity), push_pos(0), pop_pos(0)
+	{
+		for (size_t i = 0; i < slots.size(); i++)
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	bool try_push(const T& value)
+	{
+		size_t pos = push_pos.load(std::memory_order_relaxed);
+		for (;;) {
+			slot& s = slots[pos % slots.size()];
+			size_t seq = s.sequence.load(std::memory_order_acquire);
+			ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+			if (diff == 0) {
+				if (push_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					s.value = value;
+					s.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = push_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool try_pop(T& value)
+	{
+		size_t pos = pop_pos.load(std::memory_order_relaxed);
+		for (;;) {
+			slot& s = slots[pos % slots.size()];
+			size_t seq = s.sequence.load(std::memory_order_acquire);
+			ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+			if (diff == 0) {
+				if (pop_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					value = s.value;
+					s.sequence.store(pos + slots.size(), std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = pop_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	size_t depth() const
+	{
+		size_t pushed = push_pos.load(std::memory_order_acquire), popped = pop_pos.load(std::memory_order_acquire);
+		return (pushed > popped) ? pushed - popped : 0;
+	}
+
+	size_t capacity() const { return slots.size(); }
+
+private:
+	struct slot {
+		slot() : sequence(0), value() {}
+		slot(const slot&) : sequence(0), value() {}
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::vector<slot> slots;
+	char pad_slots[64];
+	std::atomic<size_t> push_pos;
+	char pad_push[64];
+	std::atomic<size_t> pop_pos;
+	char pad_pop[64];
+};
+
+#endif /* BOUNDEDQUEUE_H_ */
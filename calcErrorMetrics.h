@@ -15,6 +15,9 @@ struct flowResults {
 	float angErr;
 	float magErr;
 	float time;
+	float prepare_time;
+	float pyramid_time;
+	float fit_time;
 	uint16_t points_left;
 	cv::Mat flow_viz;
 };
@@ -0,0 +1,96 @@
+/*
+ * cpu_dispatch.c
+ *
+ *  Created on: Apr 5, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file cpu_dispatch.c
+ * @brief runtime detection of the vector instruction sets the CPU and OS support
+ */
+
+#include "cpu_dispatch.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+
+/**
+ * Read the extended control register 0, which tells which register states the OS saves
+ * @return The lower 32 bits of XCR0
+ */
+static uint32_t cpu_xgetbv(void)
+{
+  uint32_t eax, edx;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return eax;
+}
+#endif
+
+/**
+ * Detect the highest instruction set level that can be used.
+ * Besides the cpuid feature bits this checks that the OS saves the wider registers on context
+ * switches (OSXSAVE and XCR0), otherwise AVX code would fault even on a capable CPU.
+ * @return The highest usable level
+ */
+enum cpu_level cpu_detect_level(void)
+{
+  enum cpu_level level = CPU_LEVEL_SCALAR;
+
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return level;
+  }
+
+  uint32_t ecx_leaf1 = ecx;
+  if (!(ecx & bit_SSE4_1)) {
+    return level;
+  }
+  level = CPU_LEVEL_SSE41;
+
+  // AVX needs the OS to save the XMM and YMM state
+  if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX) || (cpu_xgetbv() & 0x06) != 0x06) {
+    return level;
+  }
+
+  if (__get_cpuid_max(0, NULL) < 7) {
+    return level;
+  }
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+  // The AVX2 kernels may also use FMA, which every AVX2 CPU so far has but is a separate feature bit
+  if (!(ebx & bit_AVX2) || !(ecx_leaf1 & bit_FMA)) {
+    return level;
+  }
+  level = CPU_LEVEL_AVX2;
+
+  // AVX-512 also needs the opmask and both halves of the ZMM state
+  if ((ebx & bit_AVX512F) && (ebx & bit_AVX512BW) && (cpu_xgetbv() & 0xE6) == 0xE6) {
+    level = CPU_LEVEL_AVX512;
+  }
+#endif
+
+  return level;
+}
+
+/**
+ * Human readable name of a level
+ * @param[in] level The level
+ * @return The name
+ */
+const char *cpu_level_name(enum cpu_level level)
+{
+  switch (level) {
+    case CPU_LEVEL_SCALAR:
+      return "scalar";
+    case CPU_LEVEL_SSE41:
+      return "SSE4.1";
+    case CPU_LEVEL_AVX2:
+      return "AVX2";
+    case CPU_LEVEL_AVX512:
+      return "AVX-512";
+    default:
+      return "unknown";
+  }
+}
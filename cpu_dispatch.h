@@ -0,0 +1,33 @@
+/*
+ * cpu_dispatch.h
+ *
+ *  Created on: Apr 5, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file cpu_dispatch.h
+ * @brief runtime detection of the vector instruction sets the CPU and OS support
+ *
+ * The build only assumes the baseline of .cproject (-msse3). Faster variants of the hot kernels are
+ * compiled with per-function target attributes and are selected at startup with the level found here.
+ */
+
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+#include "std.h"
+
+/* Instruction set levels, every level includes the ones below it */
+enum cpu_level {
+  CPU_LEVEL_SCALAR,   ///< Plain C reference kernels
+  CPU_LEVEL_SSE41,    ///< SSE4.1 (128 bit)
+  CPU_LEVEL_AVX2,     ///< AVX2 and FMA (256 bit)
+  CPU_LEVEL_AVX512,   ///< AVX-512 F and BW (512 bit, masked tails)
+  CPU_LEVELS
+};
+
+enum cpu_level cpu_detect_level(void);
+const char *cpu_level_name(enum cpu_level level);
+
+#endif /* CPU_DISPATCH_H */
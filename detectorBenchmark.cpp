@@ -0,0 +1,160 @@
+/*
+ * detectorBenchmark.cpp
+ *
+ *  Created on: Apr 13, 2016
+ *      Author: hrvoje
+ */
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+
+extern "C" {
+#include "fast_rosten.h"
+#include "fast_simd.h"
+#include "good_features.h"
+#include "image.h"
+}
+
+#include "detectorBenchmark.h"
+
+using namespace cv;
+using namespace std;
+
+/* Corners of a native detector as points, the buffer is freed */
+static vector<Point2f> toPoints(struct point_t *corners, uint16_t corner_cnt, unsigned int max_corners)
+{
+	vector<Point2f> points;
+	for (uint16_t i = 0; i < corner_cnt && i < max_corners; i++)
+		points.push_back(Point2f(corners[i].x, corners[i].y));
+	free(corners);
+	return points;
+}
+
+static detectorBenchmarkResult timeDetector(const string& name, const function<vector<Point2f>()>& detect,
+		unsigned int repeats, const vector<Point2f> *reference, vector<Point2f>& points)
+{
+	detectorBenchmarkResult result;
+	result.name = name;
+	result.time_ms = -1;
+
+	for (unsigned int r = 0; r < max(repeats, 1u); r++) {
+		double time = (double)getTickCount();
+		points = detect();
+		double ms = (((double)getTickCount() - time)/getTickFrequency())*1000; //in miliseconds
+		if (result.time_ms < 0 || ms < result.time_ms)
+			result.time_ms = ms;
+	}
+	result.corners = points.size();
+
+	unsigned int matched = 0;
+	for (vector<Point2f>::size_type p = 0; reference != NULL && p != points.size(); p++) {
+		for (vector<Point2f>::size_type q = 0; q != reference->size(); q++) {
+			float dx = points[p].x - (*reference)[q].x, dy = points[p].y - (*reference)[q].y;
+			if (dx * dx + dy * dy <= 1.5f * 1.5f) {
+				matched++;
+				break;
+			}
+		}
+	}
+	result.matched = (reference == NULL || points.empty()) ? 1 : double(matched) / points.size();
+
+	return result;
+}
+
+vector<detectorBenchmarkResult> runDetectorBenchmark(const preloadedFrame& frame, unsigned int max_corners, unsigned int repeats)
+{
+	vector<detectorBenchmarkResult> results;
+	struct image_t *gray = const_cast<struct image_t*>(&frame.gray_img);
+	vector<Point2f> reference, points;
+
+	results.push_back(timeDetector("opencv goodFeaturesToTrack", [&] {
+		vector<Point2f> corners;
+		goodFeaturesToTrack(frame.gray, corners, max_corners, 0.01, 10, Mat(), 3, false, 0.04);
+		return corners;
+	}, repeats, NULL, reference));
+
+	results.push_back(timeDetector("native min eigenvalue", [&] {
+		uint16_t corner_cnt;
+		struct point_t *corners = good_features_detect(gray, max_corners, 0.01f, 10, 3, CORNER_MIN_EIGEN, 0.04f, &corner_cnt);
+		return toPoints(corners, corner_cnt, max_corners);
+	}, repeats, &reference, points));
+
+	results.push_back(timeDetector("opencv harris", [&] {
+		vector<Point2f> corners;
+		goodFeaturesToTrack(frame.gray, corners, max_corners, 0.01, 10, Mat(), 3, true, 0.04);
+		return corners;
+	}, repeats, &reference, points));
+
+	results.push_back(timeDetector("native harris", [&] {
+		uint16_t corner_cnt;
+		struct point_t *corners = good_features_detect(gray, max_corners, 0.01f, 10, 3, CORNER_HARRIS, 0.04f, &corner_cnt);
+		return toPoints(corners, corner_cnt, max_corners);
+	}, repeats, &reference, points));
+
+	results.push_back(timeDetector("fast9", [&] {
+		uint16_t corner_cnt;
+		struct point_t *corners = fast9_detect(gray, 20, 10, 0, 0, &corner_cnt);
+		return toPoints(corners, corner_cnt, max_corners);
+	}, repeats, &reference, points));
+
+	// The vectorized detectors for every arc length on the grayscale copy, FAST-9 directly on the UYVY camera
+	// image as well, and the tree on UYVY to show what the strided accesses cost it
+	for (uint8_t arc_length = FAST_MIN_ARC; arc_length <= FAST_MAX_ARC; arc_length++) {
+		stringstream name;
+		name << "fast" << int(arc_length) << " simd";
+		results.push_back(timeDetector(name.str(), [&] {
+			uint16_t corner_cnt;
+			struct point_t *corners = fast_detect_simd(gray, arc_length, 20, 10, 0, 0, &corner_cnt);
+			return toPoints(corners, corner_cnt, max_corners);
+		}, repeats, &reference, points));
+	}
+
+	struct image_t *yuv = const_cast<struct image_t*>(&frame.yuv);
+
+	results.push_back(timeDetector("fast9 uyvy", [&] {
+		uint16_t corner_cnt;
+		struct point_t *corners = fast9_detect(yuv, 20, 10, 0, 0, &corner_cnt);
+		return toPoints(corners, corner_cnt, max_corners);
+	}, repeats, &reference, points));
+
+	results.push_back(timeDetector("fast9 simd uyvy", [&] {
+		uint16_t corner_cnt;
+		struct point_t *corners = fast9_detect_simd(yuv, 20, 10, 0, 0, &corner_cnt);
+		return toPoints(corners, corner_cnt, max_corners);
+	}, repeats, &reference, points));
+
+	// On the levels of a tracking pyramid, built outside the measurement as the tracker builds it anyway
+	const uint8_t levels = 2, border_size = 6;
+	vector<struct image_t> pyramid(levels + 1);
+	pyramid_build(gray, &pyramid[0], levels, border_size);
+	for (uint8_t first_level = 0; first_level <= 1; first_level++) {
+		stringstream name;
+		name << "fast9 pyramid levels " << int(first_level) << "-" << int(levels);
+		results.push_back(timeDetector(name.str(), [&] {
+			uint16_t corner_cnt;
+			struct point_t *corners = fast9_detect_pyramid(&pyramid[0], first_level, levels, border_size, 20, 10, &corner_cnt);
+			return toPoints(corners, corner_cnt, max_corners);
+		}, repeats, &reference, points));
+	}
+	for (uint8_t l = 0; l <= levels; l++)
+		image_free(&pyramid[l]);
+
+	return results;
+}
+
+void printDetectorBenchmark(const vector<detectorBenchmarkResult>& results)
+{
+	cout << "Feature detectors (matched: corners within 1.5 pixels of " << (results.empty() ? "" : results[0].name) << "):" << endl;
+	for (vector<detectorBenchmarkResult>::size_type r = 0; r != results.size(); r++) {
+		cout << "  " << left << setw(28) << results[r].name << right
+				<< fixed << setprecision(3) << setw(9) << results[r].time_ms << " ms  "
+				<< setw(5) << results[r].corners << " corners  "
+				<< setprecision(0) << setw(4) << 100 * results[r].matched << "% matched" << endl;
+	}
+	cout.unsetf(ios::fixed);
+}
@@ -0,0 +1,32 @@
+/*
+ * detectorBenchmark.h
+ *
+ *  Created on: Apr 13, 2016
+ *      Author: hrvoje
+ */
+
+#ifndef DETECTORBENCHMARK_H_
+#define DETECTORBENCHMARK_H_
+
+#include <string>
+#include <vector>
+
+#include "optFlow_backend.h"
+
+/* Result of one detector in runDetectorBenchmark() */
+struct detectorBenchmarkResult {
+	std::string name;
+	double time_ms;            // per detection, best of the repeats
+	unsigned int corners;
+	double matched;            // fraction of the corners within 1.5 pixels of a corner of the first detector
+};
+
+/* Feature detectors on the same frame: OpenCV goodFeaturesToTrack (the reference the others are matched
+ * against), the native Shi-Tomasi and Harris detectors of good_features.c, FAST-9 (decision tree and
+ * vectorized, on the grayscale and the UYVY image), the vectorized FAST-7 to FAST-12 and FAST-9 on the
+ * levels of a tracking pyramid, all asked for max_corners corners with the settings main.cpp uses.
+ */
+std::vector<detectorBenchmarkResult> runDetectorBenchmark(const preloadedFrame& frame, unsigned int max_corners, unsigned int repeats);
+void printDetectorBenchmark(const std::vector<detectorBenchmarkResult>& results);
+
+#endif /* DETECTORBENCHMARK_H_ */
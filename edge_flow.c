@@ -0,0 +1,135 @@
+/*
+ * edge_flow.c
+ *
+ *  Created on: Apr 1, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file edge_flow.c
+ * @brief global optical flow and divergence from edge histograms (EdgeFlow)
+ */
+
+#include <stdlib.h>
+#include "edge_flow.h"
+
+/**
+ * Match two edge histograms and fit a line through the local displacements
+ * @param[in] *hist_old Edge histogram of the old image
+ * @param[in] *hist_new Edge histogram of the new image
+ * @param[in] size The amount of elements in the histograms
+ * @param[in] window Half size of the histogram window compared for every position
+ * @param[in] max_disp Maximum displacement searched in both directions, in pixels
+ * @param[in] subpixel_factor The subpixel factor of the results
+ * @param[in] *buf Work buffer of at least EDGEFLOW_BUFFER_SIZE(size) elements, reused between calls
+ * @param[out] *translation Displacement at the center of the histogram in subpixels
+ * @param[out] *divergence Change of the displacement per element in subpixels, times subpixel_factor
+ */
+void edgeflow_displacement(int32_t *hist_old, int32_t *hist_new, uint16_t size, uint8_t window, uint8_t max_disp,
+                           uint32_t subpixel_factor, uint32_t *buf, int32_t *translation, int32_t *divergence)
+{
+  // Only positions for which the whole window can be shifted over the full range
+  int32_t first = window + max_disp;
+  int32_t last = (int32_t)size - window - max_disp;
+  int32_t center = size / 2;
+
+  *translation = 0;
+  *divergence = 0;
+  if (last <= first) {
+    return;
+  }
+
+  // Per position: best SAD, its shift and the SADs of the neighbouring shifts
+  uint32_t *sad = buf, *sad_prev = buf + size;
+  uint32_t *best_sad = buf + 2 * size, *sad_m = buf + 3 * size, *sad_p = buf + 4 * size;
+  int32_t *best_d = (int32_t *)(buf + 5 * size);
+
+  for (int32_t x = first; x < last; x++) {
+    best_sad[x] = UINT32_MAX;
+    best_d[x] = 0;
+  }
+
+  for (int32_t d = -max_disp; d <= max_disp; d++) {
+    // Window sums for all positions with a running sum, so every shift costs O(size)
+    uint32_t s = 0;
+    for (int32_t k = -window; k <= window; k++) {
+      s += abs(hist_old[first + k] - hist_new[first + k + d]);
+    }
+    for (int32_t x = first; x < last; x++) {
+      sad[x] = s;
+      if (x + 1 < last) {
+        s += abs(hist_old[x + window + 1] - hist_new[x + window + 1 + d]);
+        s -= abs(hist_old[x - window] - hist_new[x - window + d]);
+      }
+    }
+
+    for (int32_t x = first; x < last; x++) {
+      if (best_d[x] == d - 1) {
+        sad_p[x] = sad[x];
+      }
+
+      // Prefer the smallest displacement on ties
+      if (sad[x] < best_sad[x] || (sad[x] == best_sad[x] && abs(d) < abs(best_d[x]))) {
+        best_sad[x] = sad[x];
+        best_d[x] = d;
+        sad_m[x] = sad_prev[x];
+      }
+    }
+
+    uint32_t *tmp = sad_prev;
+    sad_prev = sad;
+    sad = tmp;
+  }
+
+  int64_t sum_x = 0, sum_d = 0, sum_xd = 0, sum_xx = 0;
+  int64_t cnt = last - first;
+
+  for (int32_t x = first; x < last; x++) {
+    // Subpixel displacement from a parabola through the minimum and its neighbours
+    int32_t disp = best_d[x] * (int32_t)subpixel_factor;
+    if (best_d[x] > -max_disp && best_d[x] < max_disp) {
+      int64_t s_m = sad_m[x];
+      int64_t s_0 = best_sad[x];
+      int64_t s_p = sad_p[x];
+      int64_t denom = 2 * (s_m - 2 * s_0 + s_p);
+      if (denom > 0) {
+        disp += ((s_m - s_p) * (int64_t)subpixel_factor) / denom;
+      }
+    }
+
+    int32_t dx = x - center;
+    sum_x += dx;
+    sum_d += disp;
+    sum_xd += (int64_t)dx * disp;
+    sum_xx += (int64_t)dx * dx;
+  }
+
+  // Least squares line fit: disp = translation + divergence * (x - center)
+  // The slope is scaled once more by the subpixel factor to keep a useful resolution for small divergences
+  int64_t var_x = sum_xx * cnt - sum_x * sum_x;
+  int64_t slope_num = sum_xd * cnt - sum_x * sum_d;
+
+  *divergence = (var_x > 0) ? (slope_num * (int64_t)subpixel_factor) / var_x : 0;
+  *translation = (sum_d - (*divergence * sum_x) / (int64_t)subpixel_factor) / cnt;
+}
+
+/**
+ * Calculate the global flow and divergence between two frames from their edge histograms
+ * @param[in] *hist_old_x Horizontal edge histogram of the old image (w elements)
+ * @param[in] *hist_old_y Vertical edge histogram of the old image (h elements)
+ * @param[in] *hist_new_x Horizontal edge histogram of the new image (w elements)
+ * @param[in] *hist_new_y Vertical edge histogram of the new image (h elements)
+ * @param[in] w The image width
+ * @param[in] h The image height
+ * @param[in] window Half size of the histogram window compared for every position
+ * @param[in] max_disp Maximum displacement searched in both directions, in pixels
+ * @param[in] subpixel_factor The subpixel factor of the results
+ * @param[in] *buf Work buffer of at least EDGEFLOW_BUFFER_SIZE(max(w, h)) elements, reused between calls
+ * @param[out] *result The global flow
+ */
+void edgeflow_calc(int32_t *hist_old_x, int32_t *hist_old_y, int32_t *hist_new_x, int32_t *hist_new_y, uint16_t w, uint16_t h,
+                   uint8_t window, uint8_t max_disp, uint32_t subpixel_factor, uint32_t *buf, struct edgeflow_t *result)
+{
+  edgeflow_displacement(hist_old_x, hist_new_x, w, window, max_disp, subpixel_factor, buf, &result->flow_x, &result->div_x);
+  edgeflow_displacement(hist_old_y, hist_new_y, h, window, max_disp, subpixel_factor, buf, &result->flow_y, &result->div_y);
+}
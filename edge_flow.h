@@ -0,0 +1,40 @@
+/*
+ * edge_flow.h
+ *
+ *  Created on: Apr 1, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file edge_flow.h
+ * @brief global optical flow and divergence from edge histograms (EdgeFlow)
+ *
+ * The image is reduced to one edge histogram per direction (image_edge_histogram). The histograms of
+ * two frames are matched locally with SAD over a range of shifts, which gives a displacement for
+ * every column (row). A line fitted through these displacements gives the global translation
+ * (offset at the image center) and divergence (slope) in that direction.
+ */
+
+#ifndef EDGE_FLOW_H
+#define EDGE_FLOW_H
+
+#include "std.h"
+#include "image.h"
+
+/* Global flow in one image */
+struct edgeflow_t {
+  int32_t flow_x;       ///< Translation in the x direction at the image center in subpixels
+  int32_t flow_y;       ///< Translation in the y direction at the image center in subpixels
+  int32_t div_x;        ///< Change of flow_x per pixel in the x direction in subpixels, times subpixel_factor (divergence)
+  int32_t div_y;        ///< Change of flow_y per pixel in the y direction in subpixels, times subpixel_factor (divergence)
+};
+
+/* Elements of the work buffer for histograms of size elements (best SAD, its shift and the SADs around it) */
+#define EDGEFLOW_BUFFER_SIZE(size) (6 * (uint32_t)(size))
+
+void edgeflow_displacement(int32_t *hist_old, int32_t *hist_new, uint16_t size, uint8_t window, uint8_t max_disp,
+                           uint32_t subpixel_factor, uint32_t *buf, int32_t *translation, int32_t *divergence);
+void edgeflow_calc(int32_t *hist_old_x, int32_t *hist_old_y, int32_t *hist_new_x, int32_t *hist_new_y, uint16_t w, uint16_t h,
+                   uint8_t window, uint8_t max_disp, uint32_t subpixel_factor, uint32_t *buf, struct edgeflow_t *result);
+
+#endif /* EDGE_FLOW_H */
@@ -3637,6 +3637,92 @@ struct point_t *fast9_detect(struct image_t *img, uint8_t threshold, uint16_t mi
   return ret_corners;
 }
 
+/**
+ * Do a FAST9 corner detection on the levels of an image pyramid as built by pyramid_build()
+ * The pixel (x, y) of level l is the pixel (2^l x, 2^l y) of level 0, so the corners of the coarse levels are
+ * mapped back exactly. The finer levels go first; a corner of a coarser level is only kept if no corner found
+ * so far is within min_dist (in level 0 pixels), so the same structure is not reported once per level.
+ * @param[in] *pyramid The pyramid levels (with border)
+ * @param[in] first_level The finest level to detect on (0 for the full resolution)
+ * @param[in] last_level The coarsest level to detect on
+ * @param[in] border_size The border of the pyramid levels, not scanned for corners
+ * @param[in] threshold The threshold which we use for FAST9
+ * @param[in] min_dist The minimum distance in level 0 pixels between detections
+ * @param[out] *num_corners The amount of corners found
+ * @return The corners found, in level 0 coordinates without border
+ */
+struct point_t *fast9_detect_pyramid(struct image_t *pyramid, uint8_t first_level, uint8_t last_level, uint8_t border_size,
+                                     uint8_t threshold, uint16_t min_dist, uint16_t *num_corners)
+{
+  uint32_t corner_cnt = 0;
+  uint32_t rsize = 512;
+  struct point_t *ret_corners = malloc(sizeof(struct point_t) * rsize);
+
+  // Accepted corners in a grid with cells of min_dist, to check the corners of the coarser levels against
+  uint16_t cell = (min_dist > 0) ? min_dist : 1;
+  uint16_t grid_w = (pyramid[0].w - 2 * border_size + cell - 1) / cell;
+  uint16_t grid_h = (pyramid[0].h - 2 * border_size + cell - 1) / cell;
+  int32_t *cell_head = malloc(sizeof(int32_t) * grid_w * grid_h);
+  int32_t *next = malloc(sizeof(int32_t) * rsize);
+  for (uint32_t i = 0; i < (uint32_t)grid_w * grid_h; i++) {
+    cell_head[i] = -1;
+  }
+
+  for (uint8_t l = first_level; l <= last_level; l++) {
+    // The minimum distance in the pixels of this level
+    uint16_t level_dist = (min_dist + (1 << l) - 1) >> l;
+    uint16_t level_cnt;
+    struct point_t *level_corners = fast9_detect(&pyramid[l], threshold, level_dist, border_size, border_size, &level_cnt);
+
+    for (uint16_t c = 0; c < level_cnt; c++) {
+      uint32_t x = (level_corners[c].x - border_size) << l;
+      uint32_t y = (level_corners[c].y - border_size) << l;
+      uint16_t cx = x / cell, cy = y / cell;
+      if (cx >= grid_w || cy >= grid_h) {
+        continue;
+      }
+
+      // Same level corners are already min_dist apart
+      bool_t free_spot = TRUE;
+      for (int32_t gy = (int32_t)cy - 1; free_spot && l > first_level && min_dist > 0 && gy <= cy + 1; gy++) {
+        for (int32_t gx = (int32_t)cx - 1; free_spot && gx <= cx + 1; gx++) {
+          if (gx < 0 || gy < 0 || gx >= grid_w || gy >= grid_h) {
+            continue;
+          }
+          for (int32_t p = cell_head[gy * grid_w + gx]; p >= 0; p = next[p]) {
+            int32_t dx = (int32_t)ret_corners[p].x - (int32_t)x, dy = (int32_t)ret_corners[p].y - (int32_t)y;
+            if (dx * dx + dy * dy < (int32_t)min_dist * min_dist) {
+              free_spot = FALSE;
+              break;
+            }
+          }
+        }
+      }
+      if (!free_spot) {
+        continue;
+      }
+
+      // When we have more corner than allocted space reallocate
+      if (corner_cnt == rsize) {
+        rsize *= 2;
+        ret_corners = realloc(ret_corners, sizeof(struct point_t) * rsize);
+        next = realloc(next, sizeof(int32_t) * rsize);
+      }
+      ret_corners[corner_cnt].x = x;
+      ret_corners[corner_cnt].y = y;
+      next[corner_cnt] = cell_head[cy * grid_w + cx];
+      cell_head[cy * grid_w + cx] = corner_cnt;
+      corner_cnt++;
+    }
+    free(level_corners);
+  }
+
+  free(cell_head);
+  free(next);
+  *num_corners = corner_cnt;
+  return ret_corners;
+}
+
 /**
  * Make offsets for FAST9 calculation
  * @param[out] *pixel The offset array of the different pixels
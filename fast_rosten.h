@@ -38,5 +38,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "image.h"
 
 struct point_t *fast9_detect(struct image_t *img, uint8_t threshold, uint16_t min_dist, uint16_t x_padding, uint16_t y_padding, uint16_t *num_corners);
+struct point_t *fast9_detect_pyramid(struct image_t *pyramid, uint8_t first_level, uint8_t last_level, uint8_t border_size,
+                                     uint8_t threshold, uint16_t min_dist, uint16_t *num_corners);
 
 #endif
@@ -0,0 +1,333 @@
+/*
+ * fast_simd.c
+ *
+ *  Created on: Apr 14, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file fast_simd.c
+ * @brief vectorized FAST-N corner detection on grayscale and UYVY images
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "fast_simd.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* The Bresenham circle of radius 3, in the order of fast_make_offsets() in fast_rosten.c */
+static const int8_t fast_circle[16][2] = {
+  { 0,  3}, { 1,  3}, { 2,  2}, { 3,  1}, { 3,  0}, { 3, -1}, { 2, -2}, { 1, -3},
+  { 0, -3}, {-1, -3}, {-2, -2}, {-3, -1}, {-3,  0}, {-3,  1}, {-2,  2}, {-1,  3}
+};
+
+/* Corner flags of one row: flags[x] is set for the FAST-N corners among the pixels [x0, x1) */
+typedef void (*fast_row_func)(const uint8_t *row, int32_t stride, uint8_t pixel_size, uint16_t x0, uint16_t x1,
+                              uint8_t threshold, uint8_t arc_length, uint8_t *flags);
+
+/**
+ * Whether a 16 bit circle mask has arc_length contiguous bits set, wrapping around
+ * Runs of 1, 2, 4 and 8 bits are made by doubling and the ones in the binary representation of arc_length
+ * are put after each other, so 9 is a run of 8 followed by a run of 1.
+ */
+static inline bool_t fast_arc(uint32_t mask, uint8_t arc_length)
+{
+  uint32_t run = mask | (mask << 16), arc = 0xFFFFFFFF;
+  uint8_t run_length = 1, arc_so_far = 0;
+  for (;;) {
+    if (arc_length & run_length) {
+      arc &= run >> arc_so_far;
+      arc_so_far += run_length;
+    }
+    if (arc_so_far == arc_length) {
+      break;
+    }
+    run &= run >> run_length;
+    run_length *= 2;
+  }
+  return (arc & 0xFFFF) != 0;
+}
+
+/**
+ * Corner flags of one row in plain C, for the CPUs without vectors and the tails of the rows
+ * @param[in] *row Y byte of the first pixel of the row
+ * @param[in] stride Bytes from one row to the next
+ * @param[in] pixel_size Bytes from one pixel to the next (2 for UYVY)
+ * @param[in] x0 First pixel
+ * @param[in] x1 End pixel
+ * @param[in] threshold The FAST threshold
+ * @param[in] arc_length The amount of contiguous brighter or darker circle pixels of a corner (1 to 16)
+ * @param[out] *flags The corner flags, indexed by pixel
+ */
+static void fast_row_c(const uint8_t *row, int32_t stride, uint8_t pixel_size, uint16_t x0, uint16_t x1,
+                       uint8_t threshold, uint8_t arc_length, uint8_t *flags)
+{
+  int32_t offsets[16];
+  for (uint8_t i = 0; i < 16; i++) {
+    offsets[i] = fast_circle[i][0] * pixel_size + fast_circle[i][1] * stride;
+  }
+
+  for (uint16_t x = x0; x < x1; x++) {
+    const uint8_t *p = row + x * pixel_size;
+    int16_t cb = *p + threshold;
+    int16_t c_b = *p - threshold;
+    uint32_t bright = 0, dark = 0;
+    for (uint8_t i = 0; i < 16; i++) {
+      bright |= (uint32_t)(p[offsets[i]] > cb) << i;
+      dark |= (uint32_t)(p[offsets[i]] < c_b) << i;
+    }
+    flags[x] = fast_arc(bright, arc_length) || fast_arc(dark, arc_length);
+  }
+}
+
+#ifdef __SSE2__
+/**
+ * 16 Y values from pixel p on, taken out of the UYVY pairs (Y is the high byte of every 16 bit pair)
+ */
+static inline __m128i fast_load_sse2(const uint8_t *p, uint8_t pixel_size)
+{
+  if (pixel_size == 1) {
+    return _mm_loadu_si128((const __m128i *)p);
+  }
+  __m128i lo = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(p - 1)), 8);
+  __m128i hi = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(p + 15)), 8);
+  return _mm_packus_epi16(lo, hi);
+}
+
+/**
+ * Lanes with arc_length contiguous set masks among every step-th of the 16 circle masks, wrapping around
+ * The same runs as fast_arc(), on whole vectors. It is used for the full circle and for its even and
+ * cardinal pixels, and is inlined with constant lengths so the unused runs and parts drop out.
+ */
+__attribute__((always_inline))
+static inline __m128i fast_arc_sse2(const __m128i *m, uint8_t step, uint8_t arc_length)
+{
+  const uint8_t len = 16 / step, wrap = len - 1;
+  __m128i r2[16], r4[16], r8[16];
+  __m128i any = _mm_setzero_si128();
+  for (uint8_t i = 0; arc_length >= 2 && i < len; i++) {
+    r2[i] = _mm_and_si128(m[i * step], m[((i + 1) & wrap) * step]);
+  }
+  for (uint8_t i = 0; arc_length >= 4 && i < len; i++) {
+    r4[i] = _mm_and_si128(r2[i], r2[(i + 2) & wrap]);
+  }
+  for (uint8_t i = 0; arc_length >= 8 && i < len; i++) {
+    r8[i] = _mm_and_si128(r4[i], r4[(i + 4) & wrap]);
+  }
+  for (uint8_t i = 0; i < len; i++) {
+    __m128i arc = _mm_set1_epi8(-1);
+    uint8_t j = i;
+    if (arc_length & 8) {
+      arc = r8[j];
+      j = (j + 8) & wrap;
+    }
+    if (arc_length & 4) {
+      arc = _mm_and_si128(arc, r4[j]);
+      j = (j + 4) & wrap;
+    }
+    if (arc_length & 2) {
+      arc = _mm_and_si128(arc, r2[j]);
+      j = (j + 2) & wrap;
+    }
+    if (arc_length & 1) {
+      arc = _mm_and_si128(arc, m[j * step]);
+    }
+    any = _mm_or_si128(any, arc);
+  }
+  return any;
+}
+
+/**
+ * Corner flags of one row with SSE2, 16 pixels at a time, same parameters as fast_row_c()
+ * Every arc of N contains N/4 neighbouring pixels of 0, 4, 8 and 12 and N/2 neighbouring even pixels. The
+ * pixels of a block are tested in that order and the block is left as soon as no lane can be a corner,
+ * so most blocks only load 4 or 8 of the circle pixels. For arcs shorter than 4 the first test is skipped.
+ */
+__attribute__((always_inline))
+static inline void fast_row_sse2(const uint8_t *row, int32_t stride, uint8_t pixel_size, uint16_t x0, uint16_t x1,
+                                 uint8_t threshold, uint8_t arc_length, uint8_t *flags)
+{
+  const __m128i t = _mm_set1_epi8((char)threshold);
+  const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi8(-1);
+  int32_t offsets[16];
+  for (uint8_t i = 0; i < 16; i++) {
+    offsets[i] = fast_circle[i][0] * pixel_size + fast_circle[i][1] * stride;
+  }
+
+  uint16_t x = x0;
+  for (; x + 16 <= x1; x += 16) {
+    const uint8_t *p = row + x * pixel_size;
+    __m128i c = fast_load_sse2(p, pixel_size);
+    __m128i cb = _mm_adds_epu8(c, t), c_b = _mm_subs_epu8(c, t);
+
+    // p > cb and p < c_b of unsigned bytes, saturation makes them false where c + t or c - t is out of range
+    __m128i bright[16], dark[16];
+    for (uint8_t i = 0; i < 16; i += 4) {
+      __m128i v = fast_load_sse2(p + offsets[i], pixel_size);
+      bright[i] = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(v, cb), zero), ones);
+      dark[i] = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(c_b, v), zero), ones);
+    }
+    if (arc_length >= 4 && _mm_movemask_epi8(_mm_or_si128(fast_arc_sse2(bright, 4, arc_length / 4), fast_arc_sse2(dark, 4, arc_length / 4))) == 0) {
+      _mm_storeu_si128((__m128i *)(flags + x), zero);
+      continue;
+    }
+
+    for (uint8_t i = 2; i < 16; i += 4) {
+      __m128i v = fast_load_sse2(p + offsets[i], pixel_size);
+      bright[i] = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(v, cb), zero), ones);
+      dark[i] = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(c_b, v), zero), ones);
+    }
+    if (_mm_movemask_epi8(_mm_or_si128(fast_arc_sse2(bright, 2, arc_length / 2), fast_arc_sse2(dark, 2, arc_length / 2))) == 0) {
+      _mm_storeu_si128((__m128i *)(flags + x), zero);
+      continue;
+    }
+
+    for (uint8_t i = 1; i < 16; i += 2) {
+      __m128i v = fast_load_sse2(p + offsets[i], pixel_size);
+      bright[i] = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(v, cb), zero), ones);
+      dark[i] = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(c_b, v), zero), ones);
+    }
+    __m128i corner = _mm_or_si128(fast_arc_sse2(bright, 1, arc_length), fast_arc_sse2(dark, 1, arc_length));
+    _mm_storeu_si128((__m128i *)(flags + x), _mm_and_si128(corner, _mm_set1_epi8(1)));
+  }
+
+  fast_row_c(row, stride, pixel_size, x, x1, threshold, arc_length, flags);
+}
+
+/* One row function per arc length, with the length a constant so the arc tests unroll */
+#define FAST_ROW_SSE2(N) \
+  static void fast_row_sse2_##N(const uint8_t *row, int32_t stride, uint8_t pixel_size, uint16_t x0, uint16_t x1, \
+                                uint8_t threshold, uint8_t arc_length, uint8_t *flags) \
+  { \
+    (void)arc_length; \
+    fast_row_sse2(row, stride, pixel_size, x0, x1, threshold, N, flags); \
+  }
+FAST_ROW_SSE2(7)
+FAST_ROW_SSE2(8)
+FAST_ROW_SSE2(9)
+FAST_ROW_SSE2(10)
+FAST_ROW_SSE2(11)
+FAST_ROW_SSE2(12)
+
+static const fast_row_func fast_rows_sse2[FAST_MAX_ARC - FAST_MIN_ARC + 1] = {
+  fast_row_sse2_7, fast_row_sse2_8, fast_row_sse2_9, fast_row_sse2_10, fast_row_sse2_11, fast_row_sse2_12
+};
+#endif
+
+/**
+ * Do a FAST9 corner detection with vectors, same arguments and result as fast9_detect()
+ * @param[in] *img The image to do the corner detection on (grayscale or UYVY)
+ * @param[in] threshold The threshold which we use for FAST9
+ * @param[in] min_dist The minimum distance in pixels between detections
+ * @param[in] x_padding The padding in the x direction to not scan for corners
+ * @param[in] y_padding The padding in the y direction to not scan for corners
+ * @param[out] *num_corners The amount of corners found
+ * @return The corners found
+ */
+struct point_t *fast9_detect_simd(struct image_t *img, uint8_t threshold, uint16_t min_dist, uint16_t x_padding, uint16_t y_padding,
+                                  uint16_t *num_corners)
+{
+  return fast_detect_simd(img, 9, threshold, min_dist, x_padding, y_padding, num_corners);
+}
+
+/**
+ * Do a FAST-N corner detection with vectors: a pixel is a corner when arc_length contiguous pixels of the
+ * circle around it are all brighter or all darker by more than the threshold. Raster order and minimum
+ * distance as in fast9_detect().
+ * @param[in] *img The image to do the corner detection on (grayscale or UYVY)
+ * @param[in] arc_length N, from FAST_MIN_ARC to FAST_MAX_ARC
+ * @param[in] threshold The threshold which we use for FAST
+ * @param[in] min_dist The minimum distance in pixels between detections
+ * @param[in] x_padding The padding in the x direction to not scan for corners
+ * @param[in] y_padding The padding in the y direction to not scan for corners
+ * @param[out] *num_corners The amount of corners found
+ * @return The corners found, NULL for an arc length out of range
+ */
+struct point_t *fast_detect_simd(struct image_t *img, uint8_t arc_length, uint8_t threshold, uint16_t min_dist,
+                                 uint16_t x_padding, uint16_t y_padding, uint16_t *num_corners)
+{
+  *num_corners = 0;
+  if (arc_length < FAST_MIN_ARC || arc_length > FAST_MAX_ARC) {
+    return NULL;
+  }
+
+  fast_row_func row_flags = fast_row_c;
+#ifdef __SSE2__
+  row_flags = fast_rows_sse2[arc_length - FAST_MIN_ARC];
+#endif
+
+  uint32_t corner_cnt = 0;
+  uint32_t rsize = 512;
+  struct point_t *ret_corners = malloc(sizeof(struct point_t) * rsize);
+  uint8_t *flags = malloc(img->w);
+  int16_t *blocked = malloc((img->w + 1) * sizeof(int16_t));   // difference array of the boxes of one row
+  uint32_t window = 0;                                          // first corner that can be in a box of this row
+
+  uint8_t pixel_size = (img->type == IMAGE_YUV422) ? 2 : 1;
+  int32_t stride = img->w * pixel_size;
+  const uint8_t *buf = (const uint8_t *)img->buf + pixel_size / 2;
+
+  // The vectors read 3 pixels left and right of the tested ones, the scan area of fast9_detect() leaves that room
+  int32_t x0 = 3 + x_padding, x1 = img->w - 3 - x_padding;
+  for (int32_t y = 3 + y_padding; x0 < x1 && y < img->h - 3 - y_padding; y++) {
+    row_flags(buf + y * stride, stride, pixel_size, x0, x1, threshold, arc_length, flags);
+
+    // Minimum distance exactly as fast9_detect() applies it: raster order, pixels inside the box of min_dist
+    // around an earlier corner are skipped, and so are the min_dist pixels after a detection or a box hit.
+    // Corners of the same row can not be hit (their skip jumps over their box), so the boxes of the corners
+    // of the previous rows are marked once per row. fast9_detect() compares x - min_dist and y - min_dist
+    // as unsigned, which never hits near the top and left edges; the same here.
+    if (min_dist > 0) {
+      memset(blocked, 0, (img->w + 1) * sizeof(int16_t));
+      while (window < corner_cnt && !(ret_corners[window].y + min_dist > (uint32_t)y)) {
+        window++;
+      }
+      for (uint32_t i = window; y >= min_dist && i < corner_cnt; i++) {
+        int32_t lo = (int32_t)ret_corners[i].x - min_dist + 1, hi = (int32_t)ret_corners[i].x + min_dist;
+        lo = (lo > min_dist) ? lo : min_dist;
+        hi = (hi < x1) ? hi : x1;
+        if (lo < hi) {
+          blocked[lo]++;
+          blocked[hi]--;
+        }
+      }
+    }
+
+    int32_t in_box = 0, marked = 0;
+    for (int32_t x = x0; x < x1; x++) {
+      if (min_dist > 0) {
+        for (; marked <= x; marked++) {
+          in_box += blocked[marked];
+        }
+        if (in_box > 0) {
+          x += min_dist;
+          continue;
+        }
+      }
+
+      if (!flags[x]) {
+        continue;
+      }
+
+      // When we have more corner than allocted space reallocate
+      if (corner_cnt == rsize) {
+        rsize *= 2;
+        ret_corners = realloc(ret_corners, sizeof(struct point_t) * rsize);
+      }
+      ret_corners[corner_cnt].x = x;
+      ret_corners[corner_cnt].y = y;
+      corner_cnt++;
+
+      // Skip some in the width direction
+      x += min_dist;
+    }
+  }
+
+  free(flags);
+  free(blocked);
+  *num_corners = corner_cnt;
+  return ret_corners;
+}
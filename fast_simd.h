@@ -0,0 +1,39 @@
+/*
+ * fast_simd.h
+ *
+ *  Created on: Apr 14, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file fast_simd.h
+ * @brief vectorized FAST-N corner detection on grayscale and UYVY images
+ *
+ * Instead of the decision tree of fast_rosten.c per pixel, 16 pixels of a row are tested at once with SSE2:
+ * the circle pixels are compared with the center in saturating byte arithmetic and the arc of N contiguous
+ * brighter or darker pixels is found with AND-combinations of the comparison masks, runs of 1, 2, 4 and 8
+ * put after each other. The same arc test rejects blocks early on the 4 cardinal and the 8 even circle
+ * pixels (an arc of N contains N/4 and N/2 neighbouring ones), and the detectors for every N from
+ * FAST_MIN_ARC to FAST_MAX_ARC are instances of one row function. Shorter arcs find more corners, also on
+ * edges, and reject fewer blocks early; longer arcs are more selective and faster.
+ *
+ * UYVY (IMAGE_YUV422) buffers are read directly, the Y bytes are taken out of the loaded pixel pairs with a
+ * shift and a pack, so the camera image can be scanned without making a grayscale copy first. For N = 9 the
+ * corners and their order are the same as those of fast9_detect() with the same arguments.
+ */
+
+#ifndef FAST_SIMD_H
+#define FAST_SIMD_H
+
+#include "std.h"
+#include "image.h"
+
+#define FAST_MIN_ARC 7     ///< Shortest arc length fast_detect_simd() supports
+#define FAST_MAX_ARC 12    ///< Longest arc length fast_detect_simd() supports
+
+struct point_t *fast_detect_simd(struct image_t *img, uint8_t arc_length, uint8_t threshold, uint16_t min_dist,
+                                 uint16_t x_padding, uint16_t y_padding, uint16_t *num_corners);
+struct point_t *fast9_detect_simd(struct image_t *img, uint8_t threshold, uint16_t min_dist, uint16_t x_padding, uint16_t y_padding,
+                                  uint16_t *num_corners);
+
+#endif /* FAST_SIMD_H */
@@ -0,0 +1,334 @@
+/*
+ * flow_fit.c
+ *
+ *  Created on: Apr 2, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file flow_fit.c
+ * @brief robust ego-motion fit (translation, divergence, rotation) over tracked flow vectors
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "flow_fit.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Flow vectors in structure of arrays layout, padded to a multiple of 4 for the SSE scoring */
+struct flow_fit_data {
+  float *x;
+  float *y;
+  float *u;
+  float *v;
+  uint16_t count;         ///< Amount of real vectors
+  uint16_t padded;        ///< Amount of vectors including the padding
+};
+
+static uint16_t flow_fit_score(struct flow_fit_data *data, float *a, float threshold2, uint16_t best);
+static bool_t flow_fit_hypothesis(struct flow_fit_data *data, uint16_t *idx, enum flow_fit_model model, float *a);
+static bool_t flow_fit_least_squares(struct flow_fit_data *data, float *a, float threshold2, enum flow_fit_model model);
+
+/**
+ * Small deterministic random generator, so the fit (and its run time) is repeatable
+ * @param[in,out] *state The generator state
+ * @return A pseudo random number
+ */
+static inline uint32_t flow_fit_rand(uint32_t *state)
+{
+  *state = *state * 1103515245 + 12345;
+  return (*state >> 16) & 0x7FFF;
+}
+
+/**
+ * Fit a flow field model to the flow vectors with RANSAC
+ * @param[in] *vectors The flow vectors (as returned by opticFlowLK)
+ * @param[in] count The amount of vectors
+ * @param[in] subpixel_factor The subpixel factor of the vectors
+ * @param[in] center_x The x coordinate (in pixels) the model is relative to, usually the image center
+ * @param[in] center_y The y coordinate (in pixels) the model is relative to
+ * @param[in] model The flow field model to fit
+ * @param[in] inlier_threshold Maximum distance in pixels between a vector and the model for it to be an inlier
+ * @param[in] max_iterations The iteration budget
+ * @param[in] confidence Stop once the best model is found with this probability (e.g. 0.99)
+ * @param[out] *result The fitted model
+ * @return TRUE if a model was found
+ */
+bool_t flow_fit(struct flow_t *vectors, uint16_t count, uint32_t subpixel_factor, float center_x, float center_y,
+                enum flow_fit_model model, float inlier_threshold, uint16_t max_iterations, float confidence,
+                struct flow_fit_t *result)
+{
+  uint8_t sample_size = (model == FLOW_FIT_AFFINE) ? 3 : 2;
+  float threshold2 = inlier_threshold * inlier_threshold;
+
+  memset(result, 0, sizeof(struct flow_fit_t));
+  if (count < sample_size) {
+    return FALSE;
+  }
+
+  // Convert to floats in pixels, relative to the center
+  struct flow_fit_data data;
+  data.count = count;
+  data.padded = (count + 3) & ~3;
+  float *buf = malloc(sizeof(float) * 4 * data.padded);
+  data.x = buf;
+  data.y = buf + data.padded;
+  data.u = buf + 2 * data.padded;
+  data.v = buf + 3 * data.padded;
+
+  for (uint16_t i = 0; i < count; i++) {
+    data.x[i] = (float)vectors[i].pos.x / subpixel_factor - center_x;
+    data.y[i] = (float)vectors[i].pos.y / subpixel_factor - center_y;
+    data.u[i] = (float)vectors[i].flow_x / subpixel_factor;
+    data.v[i] = (float)vectors[i].flow_y / subpixel_factor;
+  }
+
+  // Padding can never be an inlier (NaN compares false)
+  for (uint16_t i = count; i < data.padded; i++) {
+    data.x[i] = 0;
+    data.y[i] = 0;
+    data.u[i] = NAN;
+    data.v[i] = NAN;
+  }
+
+  float best_a[6] = {0};
+  uint16_t best_inliers = 0;
+  uint16_t needed_iterations = max_iterations;
+  uint32_t rand_state = 42;
+  uint16_t it;
+
+  for (it = 0; it < needed_iterations; it++) {
+    // Pick distinct random vectors
+    uint16_t idx[3];
+    for (uint8_t s = 0; s < sample_size; s++) {
+      bool_t unique;
+      do {
+        idx[s] = flow_fit_rand(&rand_state) % count;
+        unique = TRUE;
+        for (uint8_t t = 0; t < s; t++) {
+          if (idx[t] == idx[s]) {
+            unique = FALSE;
+          }
+        }
+      } while (!unique);
+    }
+
+    float a[6];
+    if (!flow_fit_hypothesis(&data, idx, model, a)) {
+      continue;
+    }
+
+    uint16_t inliers = flow_fit_score(&data, a, threshold2, best_inliers);
+    if (inliers > best_inliers) {
+      best_inliers = inliers;
+      memcpy(best_a, a, sizeof(best_a));
+
+      // Early termination: iterations needed to draw an all inlier sample with the given confidence
+      float w = (float)best_inliers / count;
+      float p_good = powf(w, sample_size);
+      if (p_good >= 1.f) {
+        needed_iterations = it + 1;
+      } else if (p_good > 0.f) {
+        float n = logf(1.f - confidence) / logf(1.f - p_good);
+        if (n < needed_iterations) {
+          needed_iterations = (uint16_t)ceilf(n);
+        }
+      }
+    }
+  }
+
+  if (best_inliers < sample_size) {
+    free(buf);
+    return FALSE;
+  }
+
+  // Refit on the inliers of the best hypothesis
+  flow_fit_least_squares(&data, best_a, threshold2, model);
+
+  memcpy(result->a, best_a, sizeof(best_a));
+  result->flow_x = best_a[0];
+  result->flow_y = best_a[3];
+  result->divergence = (best_a[1] + best_a[5]) / 2;
+  result->rotation = (best_a[4] - best_a[2]) / 2;
+  result->inliers = flow_fit_score(&data, best_a, threshold2, 0);
+  result->iterations = it;
+
+  free(buf);
+  return TRUE;
+}
+
+/**
+ * Count the vectors that are within the threshold of a model
+ * With SSE2 four vectors are scored at once. Scoring stops when the remaining vectors can no
+ * longer give more inliers than the current best.
+ * @param[in] *data The flow vectors
+ * @param[in] *a The model
+ * @param[in] threshold2 The squared inlier threshold
+ * @param[in] best The inlier count to beat
+ * @return The amount of inliers (or less, if the model can not beat best)
+ */
+static uint16_t flow_fit_score(struct flow_fit_data *data, float *a, float threshold2, uint16_t best)
+{
+  uint16_t inliers = 0;
+  uint16_t i = 0;
+
+#ifdef __SSE2__
+  __m128 a0 = _mm_set1_ps(a[0]), a1 = _mm_set1_ps(a[1]), a2 = _mm_set1_ps(a[2]);
+  __m128 a3 = _mm_set1_ps(a[3]), a4 = _mm_set1_ps(a[4]), a5 = _mm_set1_ps(a[5]);
+  __m128 thres = _mm_set1_ps(threshold2);
+
+  for (; i < data->padded; i += 4) {
+    __m128 x = _mm_loadu_ps(&data->x[i]);
+    __m128 y = _mm_loadu_ps(&data->y[i]);
+    __m128 ru = _mm_sub_ps(_mm_loadu_ps(&data->u[i]), _mm_add_ps(a0, _mm_add_ps(_mm_mul_ps(a1, x), _mm_mul_ps(a2, y))));
+    __m128 rv = _mm_sub_ps(_mm_loadu_ps(&data->v[i]), _mm_add_ps(a3, _mm_add_ps(_mm_mul_ps(a4, x), _mm_mul_ps(a5, y))));
+    __m128 e = _mm_add_ps(_mm_mul_ps(ru, ru), _mm_mul_ps(rv, rv));
+    int mask = _mm_movemask_ps(_mm_cmplt_ps(e, thres));
+    inliers += (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1);
+
+    if (inliers + (data->count - Min(i + 4, data->count)) <= best) {
+      return inliers;
+    }
+  }
+#else
+  for (; i < data->count; i++) {
+    float ru = data->u[i] - (a[0] + a[1] * data->x[i] + a[2] * data->y[i]);
+    float rv = data->v[i] - (a[3] + a[4] * data->x[i] + a[5] * data->y[i]);
+    if (ru * ru + rv * rv < threshold2) {
+      inliers++;
+    }
+
+    if (inliers + (data->count - i - 1) <= best) {
+      return inliers;
+    }
+  }
+#endif
+
+  return inliers;
+}
+
+/**
+ * Calculate the model through a minimal sample
+ * @param[in] *data The flow vectors
+ * @param[in] *idx The indices of the sample (2 for similarity, 3 for affine)
+ * @param[in] model The flow field model
+ * @param[out] *a The model
+ * @return FALSE if the sample is degenerate
+ */
+static bool_t flow_fit_hypothesis(struct flow_fit_data *data, uint16_t *idx, enum flow_fit_model model, float *a)
+{
+  float x0 = data->x[idx[0]], y0 = data->y[idx[0]], u0 = data->u[idx[0]], v0 = data->v[idx[0]];
+  float dx1 = data->x[idx[1]] - x0, dy1 = data->y[idx[1]] - y0;
+  float du1 = data->u[idx[1]] - u0, dv1 = data->v[idx[1]] - v0;
+
+  if (model == FLOW_FIT_SIMILARITY) {
+    // du = d*dx - r*dy, dv = r*dx + d*dy
+    float det = dx1 * dx1 + dy1 * dy1;
+    if (det < 1.f) {
+      return FALSE;
+    }
+    float d = (du1 * dx1 + dv1 * dy1) / det;
+    float r = (dv1 * dx1 - du1 * dy1) / det;
+    a[0] = u0 - d * x0 + r * y0;
+    a[1] = d;
+    a[2] = -r;
+    a[3] = v0 - r * x0 - d * y0;
+    a[4] = r;
+    a[5] = d;
+    return TRUE;
+  }
+
+  // Affine: solve [dx1 dy1; dx2 dy2] [a1 a4; a2 a5] = [du1 dv1; du2 dv2]
+  float dx2 = data->x[idx[2]] - x0, dy2 = data->y[idx[2]] - y0;
+  float du2 = data->u[idx[2]] - u0, dv2 = data->v[idx[2]] - v0;
+  float det = dx1 * dy2 - dx2 * dy1;
+  if (fabsf(det) < 1.f) {
+    return FALSE;
+  }
+  a[1] = (du1 * dy2 - du2 * dy1) / det;
+  a[2] = (dx1 * du2 - dx2 * du1) / det;
+  a[4] = (dv1 * dy2 - dv2 * dy1) / det;
+  a[5] = (dx1 * dv2 - dx2 * dv1) / det;
+  a[0] = u0 - a[1] * x0 - a[2] * y0;
+  a[3] = v0 - a[4] * x0 - a[5] * y0;
+  return TRUE;
+}
+
+/**
+ * Least squares fit of the model on the inliers of the given model
+ * @param[in] *data The flow vectors
+ * @param[in,out] *a The model to take the inliers from, returns the refitted model
+ * @param[in] threshold2 The squared inlier threshold
+ * @param[in] model The flow field model
+ * @return FALSE if the inliers are degenerate (a is then unchanged)
+ */
+static bool_t flow_fit_least_squares(struct flow_fit_data *data, float *a, float threshold2, enum flow_fit_model model)
+{
+  // Means of the inliers
+  double n = 0, mx = 0, my = 0, mu = 0, mv = 0;
+  for (uint16_t i = 0; i < data->count; i++) {
+    float ru = data->u[i] - (a[0] + a[1] * data->x[i] + a[2] * data->y[i]);
+    float rv = data->v[i] - (a[3] + a[4] * data->x[i] + a[5] * data->y[i]);
+    if (ru * ru + rv * rv < threshold2) {
+      n++;
+      mx += data->x[i];
+      my += data->y[i];
+      mu += data->u[i];
+      mv += data->v[i];
+    }
+  }
+  if (n < 3) {
+    return FALSE;
+  }
+  mx /= n;
+  my /= n;
+  mu /= n;
+  mv /= n;
+
+  // Centered second order sums of the inliers
+  double sxx = 0, sxy = 0, syy = 0, sxu = 0, syu = 0, sxv = 0, syv = 0;
+  for (uint16_t i = 0; i < data->count; i++) {
+    float ru = data->u[i] - (a[0] + a[1] * data->x[i] + a[2] * data->y[i]);
+    float rv = data->v[i] - (a[3] + a[4] * data->x[i] + a[5] * data->y[i]);
+    if (ru * ru + rv * rv < threshold2) {
+      double x = data->x[i] - mx, y = data->y[i] - my;
+      double u = data->u[i] - mu, v = data->v[i] - mv;
+      sxx += x * x;
+      sxy += x * y;
+      syy += y * y;
+      sxu += x * u;
+      syu += y * u;
+      sxv += x * v;
+      syv += y * v;
+    }
+  }
+
+  if (model == FLOW_FIT_SIMILARITY) {
+    double s = sxx + syy;
+    if (s < 1e-6) {
+      return FALSE;
+    }
+    double d = (sxu + syv) / s;
+    double r = (sxv - syu) / s;
+    a[1] = d;
+    a[2] = -r;
+    a[4] = r;
+    a[5] = d;
+  } else {
+    double det = sxx * syy - sxy * sxy;
+    if (fabs(det) < 1e-6) {
+      return FALSE;
+    }
+    a[1] = (sxu * syy - syu * sxy) / det;
+    a[2] = (syu * sxx - sxu * sxy) / det;
+    a[4] = (sxv * syy - syv * sxy) / det;
+    a[5] = (syv * sxx - sxv * sxy) / det;
+  }
+  a[0] = mu - a[1] * mx - a[2] * my;
+  a[3] = mv - a[4] * mx - a[5] * my;
+  return TRUE;
+}
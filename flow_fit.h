@@ -0,0 +1,45 @@
+/*
+ * flow_fit.h
+ *
+ *  Created on: Apr 2, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file flow_fit.h
+ * @brief robust ego-motion fit (translation, divergence, rotation) over tracked flow vectors
+ *
+ * RANSAC fit of a linear flow field u = a0 + a1*x + a2*y, v = a3 + a4*x + a5*y, with x and y
+ * relative to a given center. Hypotheses are scored 4 vectors at a time (SSE), the loop stops as
+ * soon as the best model is found with the requested confidence or the iteration budget is used up,
+ * and the final model is a least squares fit on the inliers.
+ */
+
+#ifndef FLOW_FIT_H
+#define FLOW_FIT_H
+
+#include "std.h"
+#include "image.h"
+
+/* Flow field models that can be fitted */
+enum flow_fit_model {
+  FLOW_FIT_SIMILARITY,    ///< Translation, divergence and rotation (4 parameters, 2 vectors per hypothesis)
+  FLOW_FIT_AFFINE         ///< Full affine flow field (6 parameters, 3 vectors per hypothesis)
+};
+
+/* Result of the fit, flow in pixels */
+struct flow_fit_t {
+  float a[6];             ///< u = a[0] + a[1]*x + a[2]*y, v = a[3] + a[4]*x + a[5]*y
+  float flow_x;           ///< Translation in the x direction at the center (a[0])
+  float flow_y;           ///< Translation in the y direction at the center (a[3])
+  float divergence;       ///< (a[1] + a[5]) / 2
+  float rotation;         ///< (a[4] - a[2]) / 2, in radians per frame for small rotations
+  uint16_t inliers;       ///< Amount of vectors within the inlier threshold of the final model
+  uint16_t iterations;    ///< Amount of RANSAC iterations done
+};
+
+bool_t flow_fit(struct flow_t *vectors, uint16_t count, uint32_t subpixel_factor, float center_x, float center_y,
+                enum flow_fit_model model, float inlier_threshold, uint16_t max_iterations, float confidence,
+                struct flow_fit_t *result);
+
+#endif /* FLOW_FIT_H */
@@ -0,0 +1,404 @@
+/*
+ * good_features.c
+ *
+ *  Created on: Apr 13, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file good_features.c
+ * @brief Shi-Tomasi (minimum eigenvalue) and Harris corner detector on image_t
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "good_features.h"
+#include "cpu_dispatch.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GF_X86
+#include <immintrin.h>
+#endif
+
+/* Corner candidate, a local maximum above the quality threshold */
+struct gf_candidate {
+  float response;
+  uint16_t x, y;
+};
+
+/* Structure tensor sums of the rows in the block, one value per column */
+struct gf_sums {
+  int32_t *xx, *xy, *yy;
+};
+
+/* Sobel products of one row, added to the sums while the ones of the row leaving the block are taken off */
+typedef void (*gf_products_func)(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2, uint16_t w,
+                                 struct gf_sums *row, struct gf_sums *sums);
+
+/* Corner response of one row from the sums, for the columns [x0, x1) */
+typedef void (*gf_response_func)(const struct gf_sums *sums, uint16_t x0, uint16_t x1, uint8_t radius,
+                                 enum corner_response response, float harris_k, float *out);
+
+/**
+ * Sobel gradient products of one column, the same in every variant
+ * @param[in] *r0 The row above
+ * @param[in] *r1 The row
+ * @param[in] *r2 The row below
+ * @param[in] x The column, 1 to w - 2
+ * @param[out] *xx dx * dx
+ * @param[out] *xy dx * dy
+ * @param[out] *yy dy * dy
+ */
+static inline void gf_products(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2, uint16_t x,
+                               int32_t *xx, int32_t *xy, int32_t *yy)
+{
+  int32_t dx = (r0[x + 1] - r0[x - 1]) + 2 * (r1[x + 1] - r1[x - 1]) + (r2[x + 1] - r2[x - 1]);
+  int32_t dy = (r2[x - 1] + 2 * r2[x] + r2[x + 1]) - (r0[x - 1] + 2 * r0[x] + r0[x + 1]);
+  *xx = dx * dx;
+  *xy = dx * dy;
+  *yy = dy * dy;
+}
+
+/**
+ * Products of one row in plain C. The first and last column have no gradient and stay 0.
+ * @param[in] *r0 The row above
+ * @param[in] *r1 The row
+ * @param[in] *r2 The row below
+ * @param[in] w The image width
+ * @param[in,out] *row Products of the row leaving the block, replaced by the ones of this row
+ * @param[in,out] *sums The sums over the block
+ */
+static void gf_products_c(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2, uint16_t w,
+                          struct gf_sums *row, struct gf_sums *sums)
+{
+  for (uint16_t x = 1; x + 1 < w; x++) {
+    int32_t xx, xy, yy;
+    gf_products(r0, r1, r2, x, &xx, &xy, &yy);
+    sums->xx[x] += xx - row->xx[x];
+    sums->xy[x] += xy - row->xy[x];
+    sums->yy[x] += yy - row->yy[x];
+    row->xx[x] = xx;
+    row->xy[x] = xy;
+    row->yy[x] = yy;
+  }
+}
+
+/**
+ * Response of one tensor, the same float operations in every variant
+ */
+static inline float gf_response(int32_t sxx, int32_t sxy, int32_t syy, enum corner_response response, float harris_k)
+{
+  float a = (float)sxx, b = (float)sxy, c = (float)syy;
+  if (response == CORNER_HARRIS) {
+    float t = a + c;
+    return (a * c - b * b) - harris_k * (t * t);
+  }
+  float d = a - c;
+  return 0.5f * ((a + c) - sqrtf(d * d + 4.f * (b * b)));
+}
+
+/**
+ * Response of one row in plain C
+ * @param[in] *sums The block sums of the rows around this one
+ * @param[in] x0 First column
+ * @param[in] x1 End column
+ * @param[in] radius Half of the block size
+ * @param[in] response Minimum eigenvalue or Harris
+ * @param[in] harris_k The k of the Harris response
+ * @param[out] *out The responses of the row
+ */
+static void gf_response_c(const struct gf_sums *sums, uint16_t x0, uint16_t x1, uint8_t radius,
+                          enum corner_response response, float harris_k, float *out)
+{
+  for (uint16_t x = x0; x < x1; x++) {
+    int32_t sxx = 0, sxy = 0, syy = 0;
+    for (int16_t k = -radius; k <= radius; k++) {
+      sxx += sums->xx[x + k];
+      sxy += sums->xy[x + k];
+      syy += sums->yy[x + k];
+    }
+    out[x] = gf_response(sxx, sxy, syy, response, harris_k);
+  }
+}
+
+#ifdef GF_X86
+__attribute__((target("avx2")))
+static inline __m256i gf_load8_avx2(const uint8_t *p)
+{
+  return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p));
+}
+
+/**
+ * Products of one row with AVX2, 8 columns at a time, same parameters as gf_products_c()
+ */
+__attribute__((target("avx2")))
+static void gf_products_avx2(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2, uint16_t w,
+                             struct gf_sums *row, struct gf_sums *sums)
+{
+  uint16_t x = 1;
+  for (; x + 8 < w; x += 8) {
+    __m256i t_l = gf_load8_avx2(r0 + x - 1), t_c = gf_load8_avx2(r0 + x), t_r = gf_load8_avx2(r0 + x + 1);
+    __m256i m_l = gf_load8_avx2(r1 + x - 1), m_r = gf_load8_avx2(r1 + x + 1);
+    __m256i b_l = gf_load8_avx2(r2 + x - 1), b_c = gf_load8_avx2(r2 + x), b_r = gf_load8_avx2(r2 + x + 1);
+
+    __m256i dx = _mm256_add_epi32(_mm256_add_epi32(_mm256_sub_epi32(t_r, t_l), _mm256_sub_epi32(b_r, b_l)),
+                                  _mm256_slli_epi32(_mm256_sub_epi32(m_r, m_l), 1));
+    __m256i dy = _mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(b_l, b_r), _mm256_slli_epi32(b_c, 1)),
+                                  _mm256_add_epi32(_mm256_add_epi32(t_l, t_r), _mm256_slli_epi32(t_c, 1)));
+    __m256i xx = _mm256_mullo_epi32(dx, dx);
+    __m256i xy = _mm256_mullo_epi32(dx, dy);
+    __m256i yy = _mm256_mullo_epi32(dy, dy);
+
+    __m256i *row_xx = (__m256i *)(row->xx + x), *row_xy = (__m256i *)(row->xy + x), *row_yy = (__m256i *)(row->yy + x);
+    __m256i *sum_xx = (__m256i *)(sums->xx + x), *sum_xy = (__m256i *)(sums->xy + x), *sum_yy = (__m256i *)(sums->yy + x);
+    _mm256_storeu_si256(sum_xx, _mm256_add_epi32(_mm256_loadu_si256(sum_xx), _mm256_sub_epi32(xx, _mm256_loadu_si256(row_xx))));
+    _mm256_storeu_si256(sum_xy, _mm256_add_epi32(_mm256_loadu_si256(sum_xy), _mm256_sub_epi32(xy, _mm256_loadu_si256(row_xy))));
+    _mm256_storeu_si256(sum_yy, _mm256_add_epi32(_mm256_loadu_si256(sum_yy), _mm256_sub_epi32(yy, _mm256_loadu_si256(row_yy))));
+    _mm256_storeu_si256(row_xx, xx);
+    _mm256_storeu_si256(row_xy, xy);
+    _mm256_storeu_si256(row_yy, yy);
+  }
+
+  for (; x + 1 < w; x++) {
+    int32_t xx, xy, yy;
+    gf_products(r0, r1, r2, x, &xx, &xy, &yy);
+    sums->xx[x] += xx - row->xx[x];
+    sums->xy[x] += xy - row->xy[x];
+    sums->yy[x] += yy - row->yy[x];
+    row->xx[x] = xx;
+    row->xy[x] = xy;
+    row->yy[x] = yy;
+  }
+}
+
+/**
+ * Response of one row with AVX2, 8 columns at a time, same parameters as gf_response_c()
+ */
+__attribute__((target("avx2")))
+static void gf_response_avx2(const struct gf_sums *sums, uint16_t x0, uint16_t x1, uint8_t radius,
+                             enum corner_response response, float harris_k, float *out)
+{
+  uint16_t x = x0;
+  for (; x + 8 <= x1; x += 8) {
+    __m256i sxx = _mm256_setzero_si256(), sxy = _mm256_setzero_si256(), syy = _mm256_setzero_si256();
+    for (int16_t k = -radius; k <= radius; k++) {
+      sxx = _mm256_add_epi32(sxx, _mm256_loadu_si256((const __m256i *)(sums->xx + x + k)));
+      sxy = _mm256_add_epi32(sxy, _mm256_loadu_si256((const __m256i *)(sums->xy + x + k)));
+      syy = _mm256_add_epi32(syy, _mm256_loadu_si256((const __m256i *)(sums->yy + x + k)));
+    }
+
+    __m256 a = _mm256_cvtepi32_ps(sxx), b = _mm256_cvtepi32_ps(sxy), c = _mm256_cvtepi32_ps(syy);
+    __m256 r;
+    if (response == CORNER_HARRIS) {
+      __m256 t = _mm256_add_ps(a, c);
+      r = _mm256_sub_ps(_mm256_sub_ps(_mm256_mul_ps(a, c), _mm256_mul_ps(b, b)),
+                        _mm256_mul_ps(_mm256_set1_ps(harris_k), _mm256_mul_ps(t, t)));
+    } else {
+      __m256 d = _mm256_sub_ps(a, c);
+      __m256 root = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(d, d), _mm256_mul_ps(_mm256_set1_ps(4.f), _mm256_mul_ps(b, b))));
+      r = _mm256_mul_ps(_mm256_set1_ps(0.5f), _mm256_sub_ps(_mm256_add_ps(a, c), root));
+    }
+    _mm256_storeu_ps(out + x, r);
+  }
+
+  gf_response_c(sums, x, x1, radius, response, harris_k, out);
+}
+#endif
+
+/**
+ * Strongest first, ties in raster order so the result does not depend on the sort
+ */
+static int gf_candidate_cmp(const void *a, const void *b)
+{
+  const struct gf_candidate *ca = (const struct gf_candidate *)a;
+  const struct gf_candidate *cb = (const struct gf_candidate *)b;
+  if (ca->response != cb->response) {
+    return (ca->response > cb->response) ? -1 : 1;
+  }
+  if (ca->y != cb->y) {
+    return (ca->y < cb->y) ? -1 : 1;
+  }
+  return (ca->x < cb->x) ? -1 : (ca->x > cb->x);
+}
+
+/**
+ * Fill the response image row by row. Rows and columns closer than 1 + radius to the border have no
+ * complete block and stay 0.
+ * @param[in] *img The grayscale image
+ * @param[in] radius Half of the block size
+ * @param[in] response Minimum eigenvalue or Harris
+ * @param[in] harris_k The k of the Harris response
+ * @param[out] *resp The response image, w * h
+ * @return FALSE when the buffers could not be allocated
+ */
+static bool_t gf_response_image(struct image_t *img, uint8_t radius, enum corner_response response, float harris_k, float *resp)
+{
+  gf_products_func products = gf_products_c;
+  gf_response_func row_response = gf_response_c;
+#ifdef GF_X86
+  if (cpu_detect_level() >= CPU_LEVEL_AVX2) {
+    products = gf_products_avx2;
+    row_response = gf_response_avx2;
+  }
+#endif
+
+  uint16_t w = img->w, h = img->h;
+  uint8_t block = 2 * radius + 1;
+  const uint8_t *buf = (const uint8_t *)img->buf;
+
+  // A ring of the products of the last block rows and their sums, all zero to start with
+  int32_t *mem = calloc((size_t)(block + 1) * 3 * w, sizeof(int32_t));
+  if (mem == NULL) {
+    return FALSE;
+  }
+  struct gf_sums sums = { mem, mem + w, mem + 2 * w };
+  struct gf_sums ring[block];
+  for (uint8_t i = 0; i < block; i++) {
+    int32_t *r = mem + (size_t)(i + 1) * 3 * w;
+    ring[i].xx = r;
+    ring[i].xy = r + w;
+    ring[i].yy = r + 2 * w;
+  }
+
+  memset(resp, 0, (size_t)w * h * sizeof(float));
+  uint16_t x0 = 1 + radius, x1 = w - 1 - radius;
+  for (uint16_t y = 1; y + 1 < h; y++) {
+    products(buf + (y - 1) * w, buf + y * w, buf + (y + 1) * w, w, &ring[(y - 1) % block], &sums);
+
+    // The block of the row radius above is complete
+    if (y >= block) {
+      row_response(&sums, x0, x1, radius, response, harris_k, resp + (y - radius) * w);
+    }
+  }
+
+  free(mem);
+  return TRUE;
+}
+
+/**
+ * Detect corners with the Shi-Tomasi or Harris response, strongest first
+ * @param[in] *img The grayscale image
+ * @param[in] max_corners Maximum amount of corners returned
+ * @param[in] quality_level Corners weaker than this fraction of the strongest response are rejected (e.g. 0.01)
+ * @param[in] min_distance Minimum distance in pixels between two corners, 0 for none
+ * @param[in] block_size Size of the block the structure tensor is summed over, odd (3 for goodFeaturesToTrack)
+ * @param[in] response Minimum eigenvalue (goodFeaturesToTrack default) or Harris
+ * @param[in] harris_k The k of the Harris response (e.g. 0.04)
+ * @param[out] *num_corners The amount of corners found
+ * @return The corners, to be freed by the caller (NULL when none were found)
+ */
+struct point_t *good_features_detect(struct image_t *img, uint16_t max_corners, float quality_level, uint16_t min_distance,
+                                     uint8_t block_size, enum corner_response response, float harris_k, uint16_t *num_corners)
+{
+  *num_corners = 0;
+  uint8_t radius = block_size / 2;
+  if (img->type != IMAGE_GRAYSCALE || max_corners == 0 || img->w < 2 * radius + 5 || img->h < 2 * radius + 5) {
+    return NULL;
+  }
+
+  uint16_t w = img->w, h = img->h;
+  float *resp = malloc((size_t)w * h * sizeof(float));
+  if (resp == NULL || !gf_response_image(img, radius, response, harris_k, resp)) {
+    free(resp);
+    return NULL;
+  }
+
+  // Threshold relative to the strongest response, like goodFeaturesToTrack
+  float max_response = 0;
+  for (uint32_t i = 0; i < (uint32_t)w * h; i++) {
+    if (resp[i] > max_response) {
+      max_response = resp[i];
+    }
+  }
+  float threshold = quality_level * max_response;
+
+  // Local maxima in 3x3 above the threshold, plateaus keep all their pixels
+  uint32_t cand_cnt = 0, cand_size = 256;
+  struct gf_candidate *cand = malloc(cand_size * sizeof(struct gf_candidate));
+  for (uint16_t y = 2 + radius; cand != NULL && y + 2 + radius < h; y++) {
+    const float *r = resp + y * w;
+    for (uint16_t x = 2 + radius; x + 2 + radius < w; x++) {
+      float v = r[x];
+      if (v <= threshold || v <= 0 ||
+          v < r[x - 1] || v < r[x + 1] ||
+          v < r[x - w - 1] || v < r[x - w] || v < r[x - w + 1] ||
+          v < r[x + w - 1] || v < r[x + w] || v < r[x + w + 1]) {
+        continue;
+      }
+
+      if (cand_cnt == cand_size) {
+        cand_size *= 2;
+        struct gf_candidate *grown = realloc(cand, cand_size * sizeof(struct gf_candidate));
+        if (grown == NULL) {
+          break;
+        }
+        cand = grown;
+      }
+      cand[cand_cnt].response = v;
+      cand[cand_cnt].x = x;
+      cand[cand_cnt].y = y;
+      cand_cnt++;
+    }
+  }
+  free(resp);
+  if (cand == NULL || cand_cnt == 0) {
+    free(cand);
+    return NULL;
+  }
+  qsort(cand, cand_cnt, sizeof(struct gf_candidate), gf_candidate_cmp);
+
+  // Accept the strongest candidates that have no accepted corner within min_distance. Accepted corners are
+  // kept in a grid with cells of min_distance, so only the 3x3 cells around a candidate have to be checked.
+  struct point_t *corners = malloc(max_corners * sizeof(struct point_t));
+  uint16_t cell = (min_distance > 0) ? min_distance : 1;
+  uint16_t grid_w = (w + cell - 1) / cell, grid_h = (h + cell - 1) / cell;
+  int32_t *cell_head = malloc((size_t)grid_w * grid_h * sizeof(int32_t));
+  int32_t *next = malloc(max_corners * sizeof(int32_t));
+  if (corners == NULL || cell_head == NULL || next == NULL) {
+    free(corners);
+    free(cell_head);
+    free(next);
+    free(cand);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < (uint32_t)grid_w * grid_h; i++) {
+    cell_head[i] = -1;
+  }
+
+  uint32_t min_dist2 = (uint32_t)min_distance * min_distance;
+  uint16_t cnt = 0;
+  for (uint32_t c = 0; c < cand_cnt && cnt < max_corners; c++) {
+    uint16_t cx = cand[c].x / cell, cy = cand[c].y / cell;
+    bool_t free_spot = TRUE;
+    for (int32_t gy = (int32_t)cy - 1; free_spot && min_distance > 0 && gy <= cy + 1; gy++) {
+      for (int32_t gx = (int32_t)cx - 1; free_spot && gx <= cx + 1; gx++) {
+        if (gx < 0 || gy < 0 || gx >= grid_w || gy >= grid_h) {
+          continue;
+        }
+        for (int32_t p = cell_head[gy * grid_w + gx]; p >= 0; p = next[p]) {
+          int32_t dx = (int32_t)corners[p].x - cand[c].x, dy = (int32_t)corners[p].y - cand[c].y;
+          if ((uint32_t)(dx * dx + dy * dy) < min_dist2) {
+            free_spot = FALSE;
+            break;
+          }
+        }
+      }
+    }
+    if (!free_spot) {
+      continue;
+    }
+
+    corners[cnt].x = cand[c].x;
+    corners[cnt].y = cand[c].y;
+    next[cnt] = cell_head[cy * grid_w + cx];
+    cell_head[cy * grid_w + cx] = cnt;
+    cnt++;
+  }
+
+  free(cell_head);
+  free(next);
+  free(cand);
+  *num_corners = cnt;
+  return corners;
+}
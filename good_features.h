@@ -0,0 +1,35 @@
+/*
+ * good_features.h
+ *
+ *  Created on: Apr 13, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file good_features.h
+ * @brief Shi-Tomasi (minimum eigenvalue) and Harris corner detector on image_t
+ *
+ * The native counterpart of OpenCV goodFeaturesToTrack(): Sobel gradients, the structure tensor summed over
+ * a block around every pixel, its minimum eigenvalue or Harris response, 3x3 non-maximum suppression, a
+ * threshold relative to the strongest response and a minimum distance between the accepted corners, checked
+ * on a grid with cells of that distance. The image is processed row by row with a ring of gradient products,
+ * so apart from the response image the memory use is a few rows. The row kernels use AVX2 when
+ * cpu_detect_level() allows it and give the same responses as the C ones (no FMA).
+ */
+
+#ifndef GOOD_FEATURES_H
+#define GOOD_FEATURES_H
+
+#include "std.h"
+#include "image.h"
+
+/* Corner response of the structure tensor [a b; b c] */
+enum corner_response {
+  CORNER_MIN_EIGEN,   ///< Shi-Tomasi: the smaller eigenvalue, (a + c - sqrt((a - c)^2 + 4 b^2)) / 2
+  CORNER_HARRIS       ///< a c - b^2 - k (a + c)^2
+};
+
+struct point_t *good_features_detect(struct image_t *img, uint16_t max_corners, float quality_level, uint16_t min_distance,
+                                     uint8_t block_size, enum corner_response response, float harris_k, uint16_t *num_corners);
+
+#endif /* GOOD_FEATURES_H */
@@ -25,6 +25,7 @@
  */
 
 #include "image.h"
+#include "image_kernels.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h> //ADDED
@@ -116,6 +117,14 @@ void image_switch(struct image_t *a, struct image_t *b)
  * @param[out] *output The output image
  */
 void image_to_grayscale(struct image_t *input, struct image_t *output)
+{
+  image_kernels.to_grayscale(input, output);
+}
+
+/**
+ * C reference implementation of image_to_grayscale(), see image_kernels.h
+ */
+void image_to_grayscale_c(struct image_t *input, struct image_t *output)
 {
   uint8_t *source = input->buf;
   uint8_t *dest = output->buf;
@@ -376,6 +385,33 @@ void pyramid_build(struct image_t *input, struct image_t *output_array, uint8_t
  * 						      Example: f e d c b a | a b c d e f | f e d c b a
  */
 void image_subpixel_window(struct image_t *input, struct image_t *output, struct point_t *center, uint32_t subpixel_factor, uint8_t border_size)
+{
+  image_kernels.subpixel_window(input, output, center, subpixel_factor, border_size);
+}
+
+/**
+ * Narrowest accumulator that can hold the bilinear blend of image_subpixel_window() for a subpixel factor.
+ * The blend is at most 255 * subpixel_factor^2 and the weights are at most subpixel_factor^2.
+ * @param[in] subpixel_factor The subpixel factor per pixel
+ * @return 16 when the weights fit in int16 lanes (subpixel_factor <= 181), 32 when the blend fits in
+ *         int32 lanes (subpixel_factor <= 2901) and 64 otherwise
+ */
+uint8_t image_subpixel_blend_bits(uint32_t subpixel_factor)
+{
+  uint64_t weight_max = (uint64_t)subpixel_factor * subpixel_factor;
+  if (weight_max <= INT16_MAX) {
+    return 16;
+  }
+  if (255 * weight_max <= INT32_MAX) {
+    return 32;
+  }
+  return 64;
+}
+
+/**
+ * C reference implementation of image_subpixel_window(), see image_kernels.h
+ */
+void image_subpixel_window_c(struct image_t *input, struct image_t *output, struct point_t *center, uint32_t subpixel_factor, uint8_t border_size)
 {
 	// first call: image_subpixel_window(old_img, &window_I, &vectors[new_p].pos, subpixel_factor);
   uint8_t *input_buf = (uint8_t *)input->buf; //contains original gray image values in range 0-255
@@ -386,6 +422,7 @@ void image_subpixel_window(struct image_t *input, struct image_t *output, struct
 
   uint32_t subpixel_w = (uint32_t)input->w * subpixel_factor;
   uint32_t subpixel_h = (uint32_t)input->h * subpixel_factor; //window sizes overflow for s_f = 1000; CHANGED 16 -> 32
+  bool_t wide_blend = (image_subpixel_blend_bits(subpixel_factor) == 64);
 
   //printf("Win size %u %u turned to %u %u for subpixel calc. \n", input->w, input->h, subpixel_w, subpixel_h);
   //uint16 goes up to 65000. If width of 70 is multiplied with 100, we get 7000, it ok
@@ -423,6 +460,17 @@ void image_subpixel_window(struct image_t *input, struct image_t *output, struct
         uint32_t alpha_y = (y - tl_y); // CHANGED for (100 000) 16 -> 32
         //printf("alpha_x %u, alpha_y %u \n", alpha_x, alpha_y); // works (numbers below 1000);
 
+        // The 64 bit blend is only needed for large subpixel factors (10000 for the high accuracy settings)
+        if (wide_blend) {
+          uint64_t sf = subpixel_factor, ax = alpha_x, ay = alpha_y;
+          uint64_t blend = (sf - ax) * (sf - ay) * input_buf[input->w * orig_y + orig_x];
+          blend += ax * (sf - ay) * input_buf[input->w * orig_y + (orig_x + 1)];
+          blend += (sf - ax) * ay * input_buf[input->w * (orig_y + 1) + orig_x];
+          blend += ax * ay * input_buf[input->w * (orig_y + 1) + (orig_x + 1)];
+          output_buf[output->w * j + i] = blend / (sf * sf);
+          continue;
+        }
+
         // Blend from the 4 surrounding pixels; if int32 - max value of subfixel factor is 1000; for more convert and cast each line
         //	to int64
         uint32_t blend = (subpixel_factor - alpha_x) * (subpixel_factor - alpha_y) * input_buf[input->w * orig_y + orig_x];
@@ -475,6 +523,44 @@ void image_gradients(struct image_t *input, struct image_t *dx, struct image_t *
   }
 }
 
+/**
+ * Calculate an edge histogram with the same [-1 0 1] kernel as image_gradients().
+ * The absolute gradients are summed over every column (horizontal histogram, for flow in the
+ * x direction) or over every row (vertical histogram, for flow in the y direction).
+ * The image is scanned row by row so the inner loop runs over contiguous pixels.
+ * @param[in] *input Input grayscale image
+ * @param[out] *edge_histogram Output histogram with input->w (horizontal) or input->h (vertical) elements
+ * @param[in] horizontal TRUE for the horizontal (per column) histogram, FALSE for the vertical one
+ */
+void image_edge_histogram(struct image_t *input, int32_t *edge_histogram, bool_t horizontal)
+{
+  uint8_t *input_buf = (uint8_t *)input->buf;
+  uint16_t w = input->w;
+
+  if (horizontal) {
+    memset(edge_histogram, 0, sizeof(int32_t) * input->w);
+
+    for (uint16_t y = 0; y < input->h; y++) {
+      uint8_t *row = &input_buf[y * w];
+      for (uint16_t x = 1; x < w - 1; x++) {
+        edge_histogram[x] += abs((int16_t)row[x + 1] - (int16_t)row[x - 1]);
+      }
+    }
+  } else {
+    memset(edge_histogram, 0, sizeof(int32_t) * input->h);
+
+    for (uint16_t y = 1; y < input->h - 1; y++) {
+      uint8_t *above = &input_buf[(y - 1) * w];
+      uint8_t *below = &input_buf[(y + 1) * w];
+      int32_t sum = 0;
+      for (uint16_t x = 0; x < w; x++) {
+        sum += abs((int16_t)below[x] - (int16_t)above[x]);
+      }
+      edge_histogram[y] = sum;
+    }
+  }
+}
+
 /**
  * Calculate the G vector of an image gradient
  * This is used for optical flow calculation.
@@ -483,6 +569,14 @@ void image_gradients(struct image_t *input, struct image_t *dx, struct image_t *
  * @param[out] *g The G[4] vector devided by 255 to keep in range
  */
 void image_calculate_g(struct image_t *dx, struct image_t *dy, int32_t *g)
+{
+  image_kernels.calculate_g(dx, dy, g);
+}
+
+/**
+ * C reference implementation of image_calculate_g(), see image_kernels.h
+ */
+void image_calculate_g_c(struct image_t *dx, struct image_t *dy, int32_t *g)
 {
   int32_t sum_dxx = 0, sum_dxy = 0, sum_dyy = 0;
 
@@ -517,6 +611,14 @@ void image_calculate_g(struct image_t *dx, struct image_t *dy, int32_t *g)
  * @return The squared difference summed
  */
 uint32_t image_difference(struct image_t *img_a, struct image_t *img_b, struct image_t *diff)
+{
+  return image_kernels.difference(img_a, img_b, diff);
+}
+
+/**
+ * C reference implementation of image_difference(), see image_kernels.h
+ */
+uint32_t image_difference_c(struct image_t *img_a, struct image_t *img_b, struct image_t *diff)
 {
 	//uint32_t error = image_difference(&window_I, &window_J, &window_diff);
   uint32_t sum_diff2 = 0;
@@ -557,6 +659,14 @@ uint32_t image_difference(struct image_t *img_a, struct image_t *img_b, struct i
  * @return The sum of the multiplcation
  */
 int32_t image_multiply(struct image_t *img_a, struct image_t *img_b, struct image_t *mult)
+{
+  return image_kernels.multiply(img_a, img_b, mult);
+}
+
+/**
+ * C reference implementation of image_multiply(), see image_kernels.h
+ */
+int32_t image_multiply_c(struct image_t *img_a, struct image_t *img_b, struct image_t *mult)
 {
 	//int32_t b_x = image_multiply(&window_diff, &window_DX, NULL) / 255;
   int32_t sum = 0;
@@ -56,11 +56,13 @@ struct point_t {
   uint32_t y;             ///< The y coordinate of the point // CHANGED 16 -> 32
 };
 
-/* Vector structure for point differences */
+/* Vector structure for point differences.
+ * The flow is int32: at large subpixel factors (10000 for window 31) int16 only covered +-3.3 pixels.
+ */
 struct flow_t {
   struct point_t pos;         ///< The original position the flow comes from
-  int16_t flow_x;             ///< The x direction flow in subpixels // CHANGED 16 -> 32
-  int16_t flow_y;             ///< The y direction flow in subpixels // CHANGED 16 -> 32
+  int32_t flow_x;             ///< The x direction flow in subpixels
+  int32_t flow_y;             ///< The y direction flow in subpixels
 };
 
 /* Usefull image functions */
@@ -74,7 +76,9 @@ void image_to_grayscale(struct image_t *input, struct image_t *output);
 uint16_t image_yuv422_colorfilt(struct image_t *input, struct image_t *output, uint8_t y_m, uint8_t y_M, uint8_t u_m, uint8_t u_M, uint8_t v_m, uint8_t v_M);
 void image_yuv422_downsample(struct image_t *input, struct image_t *output, uint16_t downsample);
 void image_subpixel_window(struct image_t *input, struct image_t *output, struct point_t *center, uint32_t subpixel_factor, uint8_t border_size);
+uint8_t image_subpixel_blend_bits(uint32_t subpixel_factor);
 void image_gradients(struct image_t *input, struct image_t *dx, struct image_t *dy);
+void image_edge_histogram(struct image_t *input, int32_t *edge_histogram, bool_t horizontal);
 void image_calculate_g(struct image_t *dx, struct image_t *dy, int32_t *g);
 uint32_t image_difference(struct image_t *img_a, struct image_t *img_b, struct image_t *diff);
 int32_t image_multiply(struct image_t *img_a, struct image_t *img_b, struct image_t *mult);
@@ -0,0 +1,882 @@
+/*
+ * image_kernels.c
+ *
+ *  Created on: Apr 5, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file image_kernels.c
+ * @brief instruction set specific variants of the hot image.c kernels and their runtime dispatch
+ *
+ * Every variant is compiled with a target attribute, so the file builds with the baseline flags and the
+ * variants are only executed when cpu_detect_level() found the instruction set. All variants give
+ * exactly the same results as the C reference (integer arithmetic only, the float estimates of the
+ * subpixel window divisions are corrected to the exact integer quotient).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "image_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define IMAGE_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+/* Until image_kernels_init() is called the reference kernels are used */
+struct image_kernels_t image_kernels = {
+  image_to_grayscale_c,
+  image_calculate_g_c,
+  image_difference_c,
+  image_multiply_c,
+  image_subpixel_window_c
+};
+
+static struct image_kernels_t image_kernels_selected;
+static enum cpu_level image_kernels_selected_level = CPU_LEVEL_SCALAR;
+// Only accessed with the __atomic builtins (C99 has no atomics), the self-check runs in every thread that calls the kernels
+static uint32_t image_kernels_check_cnt = 0;
+static uint32_t image_kernels_mismatch_cnt = 0;
+
+#ifdef IMAGE_KERNELS_X86
+
+/* Bilinear weights of a subpixel window that does not touch the image edge, see image_subpixel_window_c() */
+struct subpixel_window_setup {
+  uint32_t x, y;              ///< Top left pixel of the first window pixel
+  uint32_t w00, w01;          ///< Weights of the top left and top right pixels
+  uint32_t w10, w11;          ///< Weights of the bottom left and bottom right pixels
+  uint32_t divisor;           ///< subpixel_factor^2
+};
+
+/**
+ * Calculate the weights of a subpixel window. All window pixels share the same weights as long as no
+ * coordinate is clamped, only that case is vectorized.
+ * @return TRUE if the window is not clamped and the SIMD lanes of the blend can not overflow
+ */
+static bool_t image_subpixel_window_setup(struct image_t *input, struct image_t *output, struct point_t *center,
+    uint32_t subpixel_factor, uint8_t border_size, struct subpixel_window_setup *s)
+{
+  if (image_subpixel_blend_bits(subpixel_factor) == 64) {
+    return FALSE;
+  }
+
+  int64_t sf = subpixel_factor;
+  int64_t half_window = output->w / 2;
+  int64_t x = (int64_t)center->x + (border_size - half_window) * sf;
+  int64_t y = (int64_t)center->y + (border_size - half_window) * sf;
+  if (x < 0 || y < 0
+      || x + (output->w - 1) * sf > (int64_t)input->w * sf - border_size - 1
+      || y + (output->h - 1) * sf > (int64_t)input->h * sf - border_size - 1) {
+    return FALSE;
+  }
+
+  s->x = x / sf;
+  s->y = y / sf;
+  // The blend also reads the pixels right of and below the window
+  if (s->x + output->w >= input->w || s->y + output->h >= input->h) {
+    return FALSE;
+  }
+
+  uint32_t alpha_x = x - s->x * sf;
+  uint32_t alpha_y = y - s->y * sf;
+  s->w00 = (subpixel_factor - alpha_x) * (subpixel_factor - alpha_y);
+  s->w01 = alpha_x * (subpixel_factor - alpha_y);
+  s->w10 = (subpixel_factor - alpha_x) * alpha_y;
+  s->w11 = alpha_x * alpha_y;
+  s->divisor = subpixel_factor * subpixel_factor;
+  return TRUE;
+}
+
+/**
+ * Blend a single window pixel, for the tails of the SIMD loops
+ */
+static inline uint8_t subpixel_blend(const struct subpixel_window_setup *s, const uint8_t *top, const uint8_t *bottom)
+{
+  return (s->w00 * top[0] + s->w01 * top[1] + s->w10 * bottom[0] + s->w11 * bottom[1]) / s->divisor;
+}
+
+static inline int32_t load_u32(const uint8_t *p)
+{
+  int32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* SSE4.1 */
+
+__attribute__((target("sse4.1")))
+static inline int32_t hsum_epi32_sse41(__m128i v)
+{
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse4.1")))
+static void image_to_grayscale_sse41(struct image_t *input, struct image_t *output)
+{
+  if (output->type == IMAGE_YUV422) {
+    image_to_grayscale_c(input, output);
+    return;
+  }
+
+  uint8_t *source = input->buf;
+  uint8_t *dest = output->buf;
+  uint32_t n = (uint32_t)output->w * output->h;
+  uint32_t i = 0;
+
+  memcpy(&output->ts, &input->ts, sizeof(struct timeval));
+
+  // UYVY: the Y bytes are the high bytes of every 16 bit word
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(source + 2 * i)), 8);
+    __m128i b = _mm_srli_epi16(_mm_loadu_si128((const __m128i *)(source + 2 * i + 16)), 8);
+    _mm_storeu_si128((__m128i *)(dest + i), _mm_packus_epi16(a, b));
+  }
+  for (; i < n; i++) {
+    dest[i] = source[2 * i + 1];
+  }
+}
+
+__attribute__((target("sse4.1")))
+static void image_calculate_g_sse41(struct image_t *dx, struct image_t *dy, int32_t *g)
+{
+  // Both gradients have the same layout, so the window is summed as one long row
+  int16_t *dx_buf = (int16_t *)dx->buf;
+  int16_t *dy_buf = (int16_t *)dy->buf;
+  uint32_t n = (uint32_t)dx->w * dx->h;
+  uint32_t i = 0;
+
+  __m128i xx = _mm_setzero_si128(), xy = _mm_setzero_si128(), yy = _mm_setzero_si128();
+  for (; i + 8 <= n; i += 8) {
+    __m128i vx = _mm_loadu_si128((const __m128i *)(dx_buf + i));
+    __m128i vy = _mm_loadu_si128((const __m128i *)(dy_buf + i));
+    xx = _mm_add_epi32(xx, _mm_madd_epi16(vx, vx));
+    xy = _mm_add_epi32(xy, _mm_madd_epi16(vx, vy));
+    yy = _mm_add_epi32(yy, _mm_madd_epi16(vy, vy));
+  }
+
+  int32_t sum_dxx = hsum_epi32_sse41(xx), sum_dxy = hsum_epi32_sse41(xy), sum_dyy = hsum_epi32_sse41(yy);
+  for (; i < n; i++) {
+    sum_dxx += (int32_t)dx_buf[i] * dx_buf[i];
+    sum_dxy += (int32_t)dx_buf[i] * dy_buf[i];
+    sum_dyy += (int32_t)dy_buf[i] * dy_buf[i];
+  }
+
+  g[0] = sum_dxx / 255;
+  g[1] = sum_dxy / 255;
+  g[2] = g[1];
+  g[3] = sum_dyy / 255;
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t image_difference_sse41(struct image_t *img_a, struct image_t *img_b, struct image_t *diff)
+{
+  uint8_t *img_a_buf = (uint8_t *)img_a->buf;
+  uint8_t *img_b_buf = (uint8_t *)img_b->buf;
+  int16_t *diff_buf = (diff != NULL) ? (int16_t *)diff->buf : NULL;
+  uint32_t sum_diff2 = 0;
+
+  for (uint16_t y = 0; y < img_b->h; y++) {
+    // img_a is the padded window, one pixel larger on every side
+    uint8_t *a = &img_a_buf[(y + 1) * img_a->w + 1];
+    uint8_t *b = &img_b_buf[y * img_b->w];
+    int16_t *d = (diff_buf != NULL) ? &diff_buf[y * diff->w] : NULL;
+    uint16_t x = 0;
+
+    __m128i acc = _mm_setzero_si128();
+    for (; x + 8 <= img_b->w; x += 8) {
+      __m128i va = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(a + x)));
+      __m128i vb = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(b + x)));
+      __m128i vd = _mm_sub_epi16(va, vb);
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(vd, vd));
+      if (d != NULL) {
+        _mm_storeu_si128((__m128i *)(d + x), vd);
+      }
+    }
+    sum_diff2 += hsum_epi32_sse41(acc);
+
+    for (; x < img_b->w; x++) {
+      int16_t diff_c = a[x] - b[x];
+      sum_diff2 += diff_c * diff_c;
+      if (d != NULL) {
+        d[x] = diff_c;
+      }
+    }
+  }
+
+  return sum_diff2;
+}
+
+__attribute__((target("sse4.1")))
+static int32_t image_multiply_row_sse41(int16_t *a, int16_t *b, int16_t *m, uint32_t n)
+{
+  uint32_t i = 0;
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 8 <= n; i += 8) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(va, vb));
+    if (m != NULL) {
+      _mm_storeu_si128((__m128i *)(m + i), _mm_mullo_epi16(va, vb));
+    }
+  }
+
+  int32_t sum = hsum_epi32_sse41(acc);
+  for (; i < n; i++) {
+    int32_t mult_c = a[i] * b[i];
+    sum += mult_c;
+    if (m != NULL) {
+      m[i] = mult_c;
+    }
+  }
+  return sum;
+}
+
+__attribute__((target("sse4.1")))
+static int32_t image_multiply_sse41(struct image_t *img_a, struct image_t *img_b, struct image_t *mult)
+{
+  int16_t *img_a_buf = (int16_t *)img_a->buf;
+  int16_t *img_b_buf = (int16_t *)img_b->buf;
+  int16_t *mult_buf = (mult != NULL) ? (int16_t *)mult->buf : NULL;
+
+  // Windows of the same width are one long row
+  if (img_b->w == img_a->w && (mult == NULL || mult->w == img_a->w)) {
+    return image_multiply_row_sse41(img_a_buf, img_b_buf, mult_buf, (uint32_t)img_a->w * img_a->h);
+  }
+
+  int32_t sum = 0;
+  for (uint16_t y = 0; y < img_a->h; y++) {
+    sum += image_multiply_row_sse41(&img_a_buf[y * img_a->w], &img_b_buf[y * img_b->w],
+                                    (mult_buf != NULL) ? &mult_buf[y * mult->w] : NULL, img_a->w);
+  }
+  return sum;
+}
+
+/**
+ * Exact n / d for 0 <= n <= INT32_MAX: the float estimate is at most 1 off, the remainder corrects it
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i div_epu32_sse41(__m128i n, __m128i d, __m128i d_min_1, __m128 inv_d)
+{
+  __m128i q = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(n), inv_d));
+  __m128i r = _mm_sub_epi32(n, _mm_mullo_epi32(q, d));
+  q = _mm_add_epi32(q, _mm_srai_epi32(r, 31));
+  return _mm_sub_epi32(q, _mm_cmpgt_epi32(r, d_min_1));
+}
+
+/**
+ * Subpixel window with 16 bit weights (madd, 8 pixels per step) or 32 bit weights (4 pixels per step)
+ */
+__attribute__((target("sse4.1")))
+static void image_subpixel_window_sse41(struct image_t *input, struct image_t *output, struct point_t *center,
+                                        uint32_t subpixel_factor, uint8_t border_size)
+{
+  struct subpixel_window_setup s;
+  if (!image_subpixel_window_setup(input, output, center, subpixel_factor, border_size, &s)) {
+    image_subpixel_window_c(input, output, center, subpixel_factor, border_size);
+    return;
+  }
+
+  uint8_t *input_buf = (uint8_t *)input->buf;
+  uint8_t *output_buf = (uint8_t *)output->buf;
+  bool_t weights16 = (image_subpixel_blend_bits(subpixel_factor) == 16);
+  const __m128i d = _mm_set1_epi32(s.divisor);
+  const __m128i d_min_1 = _mm_set1_epi32(s.divisor - 1);
+  const __m128 inv_d = _mm_set1_ps(1.0f / s.divisor);
+  const __m128i w_top = _mm_set1_epi32(s.w00 | (s.w01 << 16));
+  const __m128i w_bottom = _mm_set1_epi32(s.w10 | (s.w11 << 16));
+  const __m128i w00 = _mm_set1_epi32(s.w00), w01 = _mm_set1_epi32(s.w01);
+  const __m128i w10 = _mm_set1_epi32(s.w10), w11 = _mm_set1_epi32(s.w11);
+
+  for (uint16_t j = 0; j < output->h; j++) {
+    const uint8_t *top = &input_buf[(s.y + j) * input->w + s.x];
+    const uint8_t *bottom = top + input->w;
+    uint8_t *out = &output_buf[j * output->w];
+    uint16_t i = 0;
+
+    if (weights16) {
+      for (; i + 8 <= output->w; i += 8) {
+        // Interleave every pixel with its right neighbour, so madd blends a pair at once
+        __m128i t = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)&top[i]), _mm_loadl_epi64((const __m128i *)&top[i + 1]));
+        __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)&bottom[i]), _mm_loadl_epi64((const __m128i *)&bottom[i + 1]));
+        __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_cvtepu8_epi16(t), w_top), _mm_madd_epi16(_mm_cvtepu8_epi16(b), w_bottom));
+        __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(t, 8)), w_top),
+                                   _mm_madd_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(b, 8)), w_bottom));
+        lo = div_epu32_sse41(lo, d, d_min_1, inv_d);
+        hi = div_epu32_sse41(hi, d, d_min_1, inv_d);
+        _mm_storel_epi64((__m128i *)&out[i], _mm_packus_epi16(_mm_packus_epi32(lo, hi), _mm_setzero_si128()));
+      }
+    } else {
+      for (; i + 4 <= output->w; i += 4) {
+        __m128i blend = _mm_mullo_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(load_u32(&top[i]))), w00);
+        blend = _mm_add_epi32(blend, _mm_mullo_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(load_u32(&top[i + 1]))), w01));
+        blend = _mm_add_epi32(blend, _mm_mullo_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(load_u32(&bottom[i]))), w10));
+        blend = _mm_add_epi32(blend, _mm_mullo_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(load_u32(&bottom[i + 1]))), w11));
+        blend = div_epu32_sse41(blend, d, d_min_1, inv_d);
+        blend = _mm_packus_epi16(_mm_packus_epi32(blend, blend), blend);
+        int32_t packed = _mm_cvtsi128_si32(blend);
+        memcpy(&out[i], &packed, sizeof(packed));
+      }
+    }
+
+    for (; i < output->w; i++) {
+      out[i] = subpixel_blend(&s, &top[i], &bottom[i]);
+    }
+  }
+}
+
+/* AVX2 */
+
+__attribute__((target("avx2")))
+static inline int32_t hsum_epi32_avx2(__m256i v)
+{
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2")))
+static void image_to_grayscale_avx2(struct image_t *input, struct image_t *output)
+{
+  if (output->type == IMAGE_YUV422) {
+    image_to_grayscale_c(input, output);
+    return;
+  }
+
+  uint8_t *source = input->buf;
+  uint8_t *dest = output->buf;
+  uint32_t n = (uint32_t)output->w * output->h;
+  uint32_t i = 0;
+
+  memcpy(&output->ts, &input->ts, sizeof(struct timeval));
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(source + 2 * i)), 8);
+    __m256i b = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i *)(source + 2 * i + 32)), 8);
+    // packus works per 128 bit lane, put the 64 bit quarters back in order
+    __m256i y = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256((__m256i *)(dest + i), y);
+  }
+  for (; i < n; i++) {
+    dest[i] = source[2 * i + 1];
+  }
+}
+
+__attribute__((target("avx2")))
+static void image_calculate_g_avx2(struct image_t *dx, struct image_t *dy, int32_t *g)
+{
+  int16_t *dx_buf = (int16_t *)dx->buf;
+  int16_t *dy_buf = (int16_t *)dy->buf;
+  uint32_t n = (uint32_t)dx->w * dx->h;
+  uint32_t i = 0;
+
+  __m256i xx = _mm256_setzero_si256(), xy = _mm256_setzero_si256(), yy = _mm256_setzero_si256();
+  for (; i + 16 <= n; i += 16) {
+    __m256i vx = _mm256_loadu_si256((const __m256i *)(dx_buf + i));
+    __m256i vy = _mm256_loadu_si256((const __m256i *)(dy_buf + i));
+    xx = _mm256_add_epi32(xx, _mm256_madd_epi16(vx, vx));
+    xy = _mm256_add_epi32(xy, _mm256_madd_epi16(vx, vy));
+    yy = _mm256_add_epi32(yy, _mm256_madd_epi16(vy, vy));
+  }
+
+  int32_t sum_dxx = hsum_epi32_avx2(xx), sum_dxy = hsum_epi32_avx2(xy), sum_dyy = hsum_epi32_avx2(yy);
+  for (; i < n; i++) {
+    sum_dxx += (int32_t)dx_buf[i] * dx_buf[i];
+    sum_dxy += (int32_t)dx_buf[i] * dy_buf[i];
+    sum_dyy += (int32_t)dy_buf[i] * dy_buf[i];
+  }
+
+  g[0] = sum_dxx / 255;
+  g[1] = sum_dxy / 255;
+  g[2] = g[1];
+  g[3] = sum_dyy / 255;
+}
+
+__attribute__((target("avx2")))
+static uint32_t image_difference_avx2(struct image_t *img_a, struct image_t *img_b, struct image_t *diff)
+{
+  uint8_t *img_a_buf = (uint8_t *)img_a->buf;
+  uint8_t *img_b_buf = (uint8_t *)img_b->buf;
+  int16_t *diff_buf = (diff != NULL) ? (int16_t *)diff->buf : NULL;
+  uint32_t sum_diff2 = 0;
+
+  for (uint16_t y = 0; y < img_b->h; y++) {
+    uint8_t *a = &img_a_buf[(y + 1) * img_a->w + 1];
+    uint8_t *b = &img_b_buf[y * img_b->w];
+    int16_t *d = (diff_buf != NULL) ? &diff_buf[y * diff->w] : NULL;
+    uint16_t x = 0;
+
+    __m256i acc = _mm256_setzero_si256();
+    __m128i acc_half = _mm_setzero_si128();
+    for (; x + 16 <= img_b->w; x += 16) {
+      __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(a + x)));
+      __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(b + x)));
+      __m256i vd = _mm256_sub_epi16(va, vb);
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(vd, vd));
+      if (d != NULL) {
+        _mm256_storeu_si256((__m256i *)(d + x), vd);
+      }
+    }
+    // Windows are often narrower than 16 pixels, so also take 8 at a time
+    for (; x + 8 <= img_b->w; x += 8) {
+      __m128i va = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(a + x)));
+      __m128i vb = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(b + x)));
+      __m128i vd = _mm_sub_epi16(va, vb);
+      acc_half = _mm_add_epi32(acc_half, _mm_madd_epi16(vd, vd));
+      if (d != NULL) {
+        _mm_storeu_si128((__m128i *)(d + x), vd);
+      }
+    }
+    sum_diff2 += hsum_epi32_avx2(acc) + hsum_epi32_sse41(acc_half);
+
+    for (; x < img_b->w; x++) {
+      int16_t diff_c = a[x] - b[x];
+      sum_diff2 += diff_c * diff_c;
+      if (d != NULL) {
+        d[x] = diff_c;
+      }
+    }
+  }
+
+  return sum_diff2;
+}
+
+__attribute__((target("avx2")))
+static int32_t image_multiply_row_avx2(int16_t *a, int16_t *b, int16_t *m, uint32_t n)
+{
+  uint32_t i = 0;
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 16 <= n; i += 16) {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    if (m != NULL) {
+      _mm256_storeu_si256((__m256i *)(m + i), _mm256_mullo_epi16(va, vb));
+    }
+  }
+
+  int32_t sum = hsum_epi32_avx2(acc);
+  for (; i < n; i++) {
+    int32_t mult_c = a[i] * b[i];
+    sum += mult_c;
+    if (m != NULL) {
+      m[i] = mult_c;
+    }
+  }
+  return sum;
+}
+
+__attribute__((target("avx2")))
+static int32_t image_multiply_avx2(struct image_t *img_a, struct image_t *img_b, struct image_t *mult)
+{
+  int16_t *img_a_buf = (int16_t *)img_a->buf;
+  int16_t *img_b_buf = (int16_t *)img_b->buf;
+  int16_t *mult_buf = (mult != NULL) ? (int16_t *)mult->buf : NULL;
+
+  if (img_b->w == img_a->w && (mult == NULL || mult->w == img_a->w)) {
+    return image_multiply_row_avx2(img_a_buf, img_b_buf, mult_buf, (uint32_t)img_a->w * img_a->h);
+  }
+
+  int32_t sum = 0;
+  for (uint16_t y = 0; y < img_a->h; y++) {
+    sum += image_multiply_row_avx2(&img_a_buf[y * img_a->w], &img_b_buf[y * img_b->w],
+                                   (mult_buf != NULL) ? &mult_buf[y * mult->w] : NULL, img_a->w);
+  }
+  return sum;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i div_epu32_avx2(__m256i n, __m256i d, __m256i d_min_1, __m256 inv_d)
+{
+  __m256i q = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(n), inv_d));
+  __m256i r = _mm256_sub_epi32(n, _mm256_mullo_epi32(q, d));
+  q = _mm256_add_epi32(q, _mm256_srai_epi32(r, 31));
+  return _mm256_sub_epi32(q, _mm256_cmpgt_epi32(r, d_min_1));
+}
+
+/**
+ * Subpixel window with 16 or 32 bit weights, 8 pixels per step. Also used on AVX-512, the windows
+ * are too narrow for wider vectors.
+ */
+__attribute__((target("avx2")))
+static void image_subpixel_window_avx2(struct image_t *input, struct image_t *output, struct point_t *center,
+                                       uint32_t subpixel_factor, uint8_t border_size)
+{
+  struct subpixel_window_setup s;
+  if (!image_subpixel_window_setup(input, output, center, subpixel_factor, border_size, &s)) {
+    image_subpixel_window_c(input, output, center, subpixel_factor, border_size);
+    return;
+  }
+
+  uint8_t *input_buf = (uint8_t *)input->buf;
+  uint8_t *output_buf = (uint8_t *)output->buf;
+  bool_t weights16 = (image_subpixel_blend_bits(subpixel_factor) == 16);
+  const __m256i d = _mm256_set1_epi32(s.divisor);
+  const __m256i d_min_1 = _mm256_set1_epi32(s.divisor - 1);
+  const __m256 inv_d = _mm256_set1_ps(1.0f / s.divisor);
+  const __m256i w_top = _mm256_set1_epi32(s.w00 | (s.w01 << 16));
+  const __m256i w_bottom = _mm256_set1_epi32(s.w10 | (s.w11 << 16));
+  const __m256i w00 = _mm256_set1_epi32(s.w00), w01 = _mm256_set1_epi32(s.w01);
+  const __m256i w10 = _mm256_set1_epi32(s.w10), w11 = _mm256_set1_epi32(s.w11);
+
+  for (uint16_t j = 0; j < output->h; j++) {
+    const uint8_t *top = &input_buf[(s.y + j) * input->w + s.x];
+    const uint8_t *bottom = top + input->w;
+    uint8_t *out = &output_buf[j * output->w];
+    uint16_t i = 0;
+
+    for (; i + 8 <= output->w; i += 8) {
+      __m256i blend;
+      if (weights16) {
+        __m128i t = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)&top[i]), _mm_loadl_epi64((const __m128i *)&top[i + 1]));
+        __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)&bottom[i]), _mm_loadl_epi64((const __m128i *)&bottom[i + 1]));
+        blend = _mm256_add_epi32(_mm256_madd_epi16(_mm256_cvtepu8_epi16(t), w_top), _mm256_madd_epi16(_mm256_cvtepu8_epi16(b), w_bottom));
+      } else {
+        blend = _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&top[i])), w00);
+        blend = _mm256_add_epi32(blend, _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&top[i + 1])), w01));
+        blend = _mm256_add_epi32(blend, _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&bottom[i])), w10));
+        blend = _mm256_add_epi32(blend, _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&bottom[i + 1])), w11));
+      }
+      blend = div_epu32_avx2(blend, d, d_min_1, inv_d);
+      __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(blend), _mm256_extracti128_si256(blend, 1));
+      _mm_storel_epi64((__m128i *)&out[i], _mm_packus_epi16(packed, _mm_setzero_si128()));
+    }
+
+    for (; i < output->w; i++) {
+      out[i] = subpixel_blend(&s, &top[i], &bottom[i]);
+    }
+  }
+}
+
+/* AVX-512, the tails are done with masked loads and stores instead of scalar loops */
+
+#define AVX512_TARGET __attribute__((target("avx512f,avx512bw")))
+
+AVX512_TARGET
+static inline __mmask32 mask32_first(uint32_t n)
+{
+  return (n >= 32) ? (__mmask32)0xFFFFFFFF : (__mmask32)((1u << n) - 1);
+}
+
+AVX512_TARGET
+static inline __mmask64 mask64_first(uint32_t n)
+{
+  return (n >= 64) ? (__mmask64)~0ULL : (__mmask64)((1ULL << n) - 1);
+}
+
+AVX512_TARGET
+static void image_to_grayscale_avx512(struct image_t *input, struct image_t *output)
+{
+  if (output->type == IMAGE_YUV422) {
+    image_to_grayscale_c(input, output);
+    return;
+  }
+
+  uint8_t *source = input->buf;
+  uint8_t *dest = output->buf;
+  uint32_t n = (uint32_t)output->w * output->h;
+  uint32_t i = 0;
+  const __m512i order = _mm512_set_epi64(7, 5, 3, 1, 6, 4, 2, 0);
+
+  memcpy(&output->ts, &input->ts, sizeof(struct timeval));
+
+  for (; i + 64 <= n; i += 64) {
+    __m512i a = _mm512_srli_epi16(_mm512_loadu_si512((const void *)(source + 2 * i)), 8);
+    __m512i b = _mm512_srli_epi16(_mm512_loadu_si512((const void *)(source + 2 * i + 64)), 8);
+    _mm512_storeu_si512((void *)(dest + i), _mm512_permutexvar_epi64(order, _mm512_packus_epi16(a, b)));
+  }
+  for (; i < n; i++) {
+    dest[i] = source[2 * i + 1];
+  }
+}
+
+AVX512_TARGET
+static void image_calculate_g_avx512(struct image_t *dx, struct image_t *dy, int32_t *g)
+{
+  int16_t *dx_buf = (int16_t *)dx->buf;
+  int16_t *dy_buf = (int16_t *)dy->buf;
+  uint32_t n = (uint32_t)dx->w * dx->h;
+
+  __m512i xx = _mm512_setzero_si512(), xy = _mm512_setzero_si512(), yy = _mm512_setzero_si512();
+  for (uint32_t i = 0; i < n; i += 32) {
+    __mmask32 k = mask32_first(n - i);
+    __m512i vx = _mm512_maskz_loadu_epi16(k, dx_buf + i);
+    __m512i vy = _mm512_maskz_loadu_epi16(k, dy_buf + i);
+    xx = _mm512_add_epi32(xx, _mm512_madd_epi16(vx, vx));
+    xy = _mm512_add_epi32(xy, _mm512_madd_epi16(vx, vy));
+    yy = _mm512_add_epi32(yy, _mm512_madd_epi16(vy, vy));
+  }
+
+  g[0] = _mm512_reduce_add_epi32(xx) / 255;
+  g[1] = _mm512_reduce_add_epi32(xy) / 255;
+  g[2] = g[1];
+  g[3] = _mm512_reduce_add_epi32(yy) / 255;
+}
+
+AVX512_TARGET
+static uint32_t image_difference_avx512(struct image_t *img_a, struct image_t *img_b, struct image_t *diff)
+{
+  uint8_t *img_a_buf = (uint8_t *)img_a->buf;
+  uint8_t *img_b_buf = (uint8_t *)img_b->buf;
+  int16_t *diff_buf = (diff != NULL) ? (int16_t *)diff->buf : NULL;
+
+  __m512i acc = _mm512_setzero_si512();
+  for (uint16_t y = 0; y < img_b->h; y++) {
+    uint8_t *a = &img_a_buf[(y + 1) * img_a->w + 1];
+    uint8_t *b = &img_b_buf[y * img_b->w];
+    int16_t *d = (diff_buf != NULL) ? &diff_buf[y * diff->w] : NULL;
+
+    for (uint16_t x = 0; x < img_b->w; x += 32) {
+      __mmask64 k = mask64_first((img_b->w - x < 32) ? img_b->w - x : 32);
+      __m512i va = _mm512_cvtepu8_epi16(_mm512_castsi512_si256(_mm512_maskz_loadu_epi8(k, a + x)));
+      __m512i vb = _mm512_cvtepu8_epi16(_mm512_castsi512_si256(_mm512_maskz_loadu_epi8(k, b + x)));
+      __m512i vd = _mm512_sub_epi16(va, vb);
+      acc = _mm512_add_epi32(acc, _mm512_madd_epi16(vd, vd));
+      if (d != NULL) {
+        _mm512_mask_storeu_epi16(d + x, mask32_first(img_b->w - x), vd);
+      }
+    }
+  }
+
+  return (uint32_t)_mm512_reduce_add_epi32(acc);
+}
+
+AVX512_TARGET
+static int32_t image_multiply_row_avx512(int16_t *a, int16_t *b, int16_t *m, uint32_t n)
+{
+  __m512i acc = _mm512_setzero_si512();
+  for (uint32_t i = 0; i < n; i += 32) {
+    __mmask32 k = mask32_first(n - i);
+    __m512i va = _mm512_maskz_loadu_epi16(k, a + i);
+    __m512i vb = _mm512_maskz_loadu_epi16(k, b + i);
+    acc = _mm512_add_epi32(acc, _mm512_madd_epi16(va, vb));
+    if (m != NULL) {
+      _mm512_mask_storeu_epi16(m + i, k, _mm512_mullo_epi16(va, vb));
+    }
+  }
+  return _mm512_reduce_add_epi32(acc);
+}
+
+AVX512_TARGET
+static int32_t image_multiply_avx512(struct image_t *img_a, struct image_t *img_b, struct image_t *mult)
+{
+  int16_t *img_a_buf = (int16_t *)img_a->buf;
+  int16_t *img_b_buf = (int16_t *)img_b->buf;
+  int16_t *mult_buf = (mult != NULL) ? (int16_t *)mult->buf : NULL;
+
+  if (img_b->w == img_a->w && (mult == NULL || mult->w == img_a->w)) {
+    return image_multiply_row_avx512(img_a_buf, img_b_buf, mult_buf, (uint32_t)img_a->w * img_a->h);
+  }
+
+  int32_t sum = 0;
+  for (uint16_t y = 0; y < img_a->h; y++) {
+    sum += image_multiply_row_avx512(&img_a_buf[y * img_a->w], &img_b_buf[y * img_b->w],
+                                     (mult_buf != NULL) ? &mult_buf[y * mult->w] : NULL, img_a->w);
+  }
+  return sum;
+}
+
+#endif /* IMAGE_KERNELS_X86 */
+
+/* Self-check: run the selected variant and the reference on the same data and compare */
+
+/**
+ * Count a checked call and report it if the results differed
+ * @param[in] *kernel Name of the kernel
+ * @param[in] same TRUE if the results were identical
+ */
+static void image_kernels_report(const char *kernel, bool_t same)
+{
+  uint32_t checks = __atomic_add_fetch(&image_kernels_check_cnt, 1, __ATOMIC_RELAXED);
+  if (same) {
+    return;
+  }
+
+  uint32_t mismatches = __atomic_add_fetch(&image_kernels_mismatch_cnt, 1, __ATOMIC_RELAXED);
+  if (mismatches <= 10) {
+    fprintf(stderr, "image_kernels: %s (%s) differs from the C reference (mismatch %u in %u calls)\n", kernel,
+            cpu_level_name(image_kernels_selected_level), mismatches, checks);
+  }
+}
+
+/**
+ * Compare the first w x h elements of two images with the given strides
+ */
+static bool_t image_kernels_same(struct image_t *a, struct image_t *b, uint16_t w, uint16_t h, uint8_t pixel_size)
+{
+  for (uint16_t y = 0; y < h; y++) {
+    if (memcmp((uint8_t *)a->buf + (uint32_t)y * a->w * pixel_size, (uint8_t *)b->buf + (uint32_t)y * b->w * pixel_size,
+               (uint32_t)w * pixel_size)) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static void image_to_grayscale_check(struct image_t *input, struct image_t *output)
+{
+  struct image_t ref;
+  image_create(&ref, output->w, output->h, output->type);
+
+  image_kernels_selected.to_grayscale(input, output);
+  image_to_grayscale_c(input, &ref);
+  image_kernels_report("image_to_grayscale", memcmp(output->buf, ref.buf, output->buf_size) == 0);
+
+  image_free(&ref);
+}
+
+static void image_calculate_g_check(struct image_t *dx, struct image_t *dy, int32_t *g)
+{
+  int32_t ref[4];
+
+  image_kernels_selected.calculate_g(dx, dy, g);
+  image_calculate_g_c(dx, dy, ref);
+  image_kernels_report("image_calculate_g", memcmp(g, ref, sizeof(ref)) == 0);
+}
+
+static uint32_t image_difference_check(struct image_t *img_a, struct image_t *img_b, struct image_t *diff)
+{
+  if (diff == NULL) {
+    uint32_t result = image_kernels_selected.difference(img_a, img_b, NULL);
+    image_kernels_report("image_difference", result == image_difference_c(img_a, img_b, NULL));
+    return result;
+  }
+
+  struct image_t ref;
+  image_create(&ref, diff->w, diff->h, diff->type);
+
+  uint32_t result = image_kernels_selected.difference(img_a, img_b, diff);
+  bool_t same = (result == image_difference_c(img_a, img_b, &ref));
+  same = same && image_kernels_same(diff, &ref, img_b->w, img_b->h, sizeof(int16_t));
+  image_kernels_report("image_difference", same);
+
+  image_free(&ref);
+  return result;
+}
+
+static int32_t image_multiply_check(struct image_t *img_a, struct image_t *img_b, struct image_t *mult)
+{
+  if (mult == NULL) {
+    int32_t result = image_kernels_selected.multiply(img_a, img_b, NULL);
+    image_kernels_report("image_multiply", result == image_multiply_c(img_a, img_b, NULL));
+    return result;
+  }
+
+  struct image_t ref;
+  image_create(&ref, mult->w, mult->h, mult->type);
+
+  int32_t result = image_kernels_selected.multiply(img_a, img_b, mult);
+  bool_t same = (result == image_multiply_c(img_a, img_b, &ref));
+  same = same && image_kernels_same(mult, &ref, img_a->w, img_a->h, sizeof(int16_t));
+  image_kernels_report("image_multiply", same);
+
+  image_free(&ref);
+  return result;
+}
+
+static void image_subpixel_window_check(struct image_t *input, struct image_t *output, struct point_t *center,
+                                        uint32_t subpixel_factor, uint8_t border_size)
+{
+  struct image_t ref;
+  image_create(&ref, output->w, output->h, output->type);
+
+  image_kernels_selected.subpixel_window(input, output, center, subpixel_factor, border_size);
+  image_subpixel_window_c(input, &ref, center, subpixel_factor, border_size);
+  image_kernels_report("image_subpixel_window", memcmp(output->buf, ref.buf, output->buf_size) == 0);
+
+  image_free(&ref);
+}
+
+/**
+ * Select the kernel variants, should be called once at startup before any tracking.
+ * @param[in] level The highest level to use, normally cpu_detect_level(). Higher levels than the
+ *                  CPU supports are lowered, lower ones can be given to compare variants.
+ * @param[in] self_check Compare every call with the C reference and report differences on stderr
+ * @return The level that was selected
+ */
+enum cpu_level image_kernels_init(enum cpu_level level, bool_t self_check)
+{
+  enum cpu_level detected = cpu_detect_level();
+  if (level > detected) {
+    level = detected;
+  }
+
+  struct image_kernels_t selected = {
+    image_to_grayscale_c,
+    image_calculate_g_c,
+    image_difference_c,
+    image_multiply_c,
+    image_subpixel_window_c
+  };
+
+#ifdef IMAGE_KERNELS_X86
+  if (level == CPU_LEVEL_SSE41) {
+    selected.to_grayscale = image_to_grayscale_sse41;
+    selected.calculate_g = image_calculate_g_sse41;
+    selected.difference = image_difference_sse41;
+    selected.multiply = image_multiply_sse41;
+    selected.subpixel_window = image_subpixel_window_sse41;
+  } else if (level == CPU_LEVEL_AVX2) {
+    selected.to_grayscale = image_to_grayscale_avx2;
+    selected.calculate_g = image_calculate_g_avx2;
+    selected.difference = image_difference_avx2;
+    selected.multiply = image_multiply_avx2;
+    selected.subpixel_window = image_subpixel_window_avx2;
+  } else if (level == CPU_LEVEL_AVX512) {
+    selected.to_grayscale = image_to_grayscale_avx512;
+    selected.calculate_g = image_calculate_g_avx512;
+    selected.difference = image_difference_avx512;
+    selected.multiply = image_multiply_avx512;
+    selected.subpixel_window = image_subpixel_window_avx2;
+  }
+#else
+  level = CPU_LEVEL_SCALAR;
+#endif
+
+  image_kernels_selected = selected;
+  image_kernels_selected_level = level;
+  __atomic_store_n(&image_kernels_check_cnt, 0, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&image_kernels_mismatch_cnt, 0, __ATOMIC_SEQ_CST);
+
+  if (self_check) {
+    image_kernels.to_grayscale = image_to_grayscale_check;
+    image_kernels.calculate_g = image_calculate_g_check;
+    image_kernels.difference = image_difference_check;
+    image_kernels.multiply = image_multiply_check;
+    image_kernels.subpixel_window = image_subpixel_window_check;
+  } else {
+    image_kernels = selected;
+  }
+
+  return level;
+}
+
+/**
+ * The level image_kernels_init() selected
+ * @return The level of the kernels in use
+ */
+enum cpu_level image_kernels_level(void)
+{
+  return image_kernels_selected_level;
+}
+
+/**
+ * Amount of calls compared in self-check mode since image_kernels_init()
+ * @return The amount of compared calls
+ */
+uint32_t image_kernels_checks(void)
+{
+  return __atomic_load_n(&image_kernels_check_cnt, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Amount of compared calls that gave a different result than the reference
+ * @return The amount of mismatches
+ */
+uint32_t image_kernels_mismatches(void)
+{
+  return __atomic_load_n(&image_kernels_mismatch_cnt, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,50 @@
+/*
+ * image_kernels.h
+ *
+ *  Created on: Apr 5, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file image_kernels.h
+ * @brief instruction set specific variants of the hot image.c kernels and their runtime dispatch
+ *
+ * The public functions in image.c call through the image_kernels table. image_kernels_init() fills
+ * it with the best variants for a cpu_level, until then the C reference kernels are used. In self-check
+ * mode every call runs the selected variant and the C reference on the same (live) data and
+ * reports every difference, which is how a new variant or a new machine is validated.
+ */
+
+#ifndef IMAGE_KERNELS_H
+#define IMAGE_KERNELS_H
+
+#include "std.h"
+#include "image.h"
+#include "cpu_dispatch.h"
+
+/* Kernels that have optimized variants */
+struct image_kernels_t {
+  void (*to_grayscale)(struct image_t *input, struct image_t *output);
+  void (*calculate_g)(struct image_t *dx, struct image_t *dy, int32_t *g);
+  uint32_t (*difference)(struct image_t *img_a, struct image_t *img_b, struct image_t *diff);
+  int32_t (*multiply)(struct image_t *img_a, struct image_t *img_b, struct image_t *mult);
+  void (*subpixel_window)(struct image_t *input, struct image_t *output, struct point_t *center, uint32_t subpixel_factor,
+                          uint8_t border_size);
+};
+
+extern struct image_kernels_t image_kernels;
+
+/* C reference kernels (image.c) */
+void image_to_grayscale_c(struct image_t *input, struct image_t *output);
+void image_calculate_g_c(struct image_t *dx, struct image_t *dy, int32_t *g);
+uint32_t image_difference_c(struct image_t *img_a, struct image_t *img_b, struct image_t *diff);
+int32_t image_multiply_c(struct image_t *img_a, struct image_t *img_b, struct image_t *mult);
+void image_subpixel_window_c(struct image_t *input, struct image_t *output, struct point_t *center, uint32_t subpixel_factor,
+                             uint8_t border_size);
+
+enum cpu_level image_kernels_init(enum cpu_level level, bool_t self_check);
+enum cpu_level image_kernels_level(void);
+uint32_t image_kernels_checks(void);
+uint32_t image_kernels_mismatches(void);
+
+#endif /* IMAGE_KERNELS_H */
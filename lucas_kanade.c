@@ -35,12 +35,111 @@
  * - Publication: http://robots.stanford.edu/cs223b04/algo_tracking.pdf
  */
 
+#define _POSIX_C_SOURCE 199309L  // clock_gettime() under -std=c99
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <time.h>
 #include "lucas_kanade.h"
 
+/* Template of a point on one pyramid level: everything that only depends on the old image */
+struct lk_template {
+	struct image_t I;       ///< Padded subpixel window around the point in the old image
+	struct image_t DX;      ///< X gradient of I
+	struct image_t DY;      ///< Y gradient of I
+	int32_t G[4];           ///< The 'G'-matrix [sum(Axx) sum(Axy); sum(Axy) sum(Ayy)] over the window
+	int64_t Det;            ///< Determinant of G
+};
+
+/* Window images used while tracking a single point, allocated once per call */
+struct lk_windows {
+	struct lk_template tmpl;    ///< Template of the point that is tracked
+	struct image_t J;       ///< Subpixel window around the current guess in the new image
+	struct image_t diff;    ///< Difference between I and J
+	struct lk_accumulators acc; ///< Accumulator widths for the window size and subpixel factor
+	const struct lk_convergence_t *convergence;  ///< Extra termination criteria of the level, can be NULL
+	struct lk_iteration_stats *stats;            ///< Statistics of the level, can be NULL
+};
+
+static void lk_template_create(struct lk_template *tmpl, uint16_t half_window_size);
+static void lk_template_free(struct lk_template *tmpl);
+static void lk_windows_create(struct lk_windows *win, const struct lk_level_params *params, uint32_t subpixel_factor);
+static void lk_windows_free(struct lk_windows *win);
+static bool_t lk_template_take(struct image_t *img_old, struct point_t *pos, struct lk_template *tmpl, const struct lk_accumulators *acc,
+		uint32_t subpixel_factor, uint8_t border_size);
+static bool_t lk_track_iterate(struct image_t *img_new, struct flow_t *vector, struct lk_template *tmpl, struct lk_windows *win,
+		uint32_t subpixel_factor, uint8_t max_iterations, uint32_t step_threshold, uint32_t error_threshold, uint8_t border_size,
+		uint32_t *last_error);
+static bool_t lk_track_point(struct image_t *img_new, struct image_t *img_old, struct flow_t *vector, struct lk_windows *win,
+		uint32_t subpixel_factor, uint8_t max_iterations, uint32_t step_threshold, uint32_t error_threshold, uint8_t border_size);
+
+/**
+ * The amount of iterations a fraction of all runs stayed within
+ * @param[in] *stats The gathered statistics
+ * @param[in] fraction The fraction of runs (e.g. 0.99 for the 99th percentile)
+ * @return The amount of iterations (at most LK_STATS_HISTOGRAM_SIZE - 1)
+ */
+uint8_t opticFlowLK_stats_percentile(const struct lk_iteration_stats *stats, float fraction)
+{
+	uint32_t needed = (uint32_t)ceilf(fraction * stats->runs);
+	uint32_t sum = 0;
+	for (uint8_t i = 0; i < LK_STATS_HISTOGRAM_SIZE; i++) {
+		sum += stats->histogram[i];
+		if (sum >= needed) {
+			return i;
+		}
+	}
+	return LK_STATS_HISTOGRAM_SIZE - 1;
+}
+
+/**
+ * Add a single run of lk_track_point() to the statistics, if they are gathered
+ * @param[in,out] *stats The statistics, NULL when they are not gathered
+ * @param[in] iterations The amount of iterations done
+ * @param[in] reason Why the iterations stopped
+ */
+static void lk_stats_add(struct lk_iteration_stats *stats, uint8_t iterations, enum lk_stop_reason reason)
+{
+	if (stats == NULL) {
+		return;
+	}
+
+	stats->runs++;
+	stats->iterations += iterations;
+	if (iterations > stats->max_iterations) {
+		stats->max_iterations = iterations;
+	}
+	stats->histogram[(iterations < LK_STATS_HISTOGRAM_SIZE) ? iterations : LK_STATS_HISTOGRAM_SIZE - 1]++;
+	stats->stops[reason]++;
+}
+
+/**
+ * Limit a step so adding it to a flow inside the image can not overflow, larger steps lose the point anyway
+ */
+static inline int32_t lk_step_clamp(int64_t step)
+{
+	if (step > INT32_MAX / 2) {
+		return INT32_MAX / 2;
+	}
+	if (step < -(INT32_MAX / 2)) {
+		return -(INT32_MAX / 2);
+	}
+	return step;
+}
+
+/**
+ * Border size with which the pyramids for opticFlowLK_pyramids() have to be padded
+ * @param[in] half_window_size Half the window size (in both x and y direction) to search inside
+ * @return The border size in pixels
+ */
+uint8_t opticFlowLK_border_size(uint16_t half_window_size)
+{
+	uint16_t patch_size = 2 * half_window_size + 1;
+	uint16_t padded_patch_size = patch_size + 2;
+	return padded_patch_size / 2;
+}
 
 /**
  * Compute the optical flow of several points using the Lucas-Kanade algorithm by Yves Bouguet
@@ -60,6 +159,83 @@
 struct flow_t *opticFlowLK(struct image_t *new_img, struct image_t *old_img, struct point_t *points, uint16_t *points_cnt, uint16_t half_window_size,
 		uint32_t subpixel_factor, uint8_t max_iterations, uint8_t step_threshold, uint16_t max_points, uint8_t pyramid_level) {
 
+	uint8_t border_size = opticFlowLK_border_size(half_window_size);
+
+	// Allocate memory for image pyramids
+	struct image_t *pyramid_old = (struct image_t *)malloc(sizeof(struct image_t) * (pyramid_level+1));
+	struct image_t *pyramid_new = (struct image_t *)malloc(sizeof(struct image_t) * (pyramid_level+1));
+
+	pyramid_build(old_img, pyramid_old, pyramid_level, border_size);
+	pyramid_build(new_img, pyramid_new, pyramid_level, border_size);
+
+	struct flow_t *vectors = opticFlowLK_pyramids(pyramid_new, pyramid_old, points, points_cnt, half_window_size,
+			subpixel_factor, max_iterations, step_threshold, max_points, pyramid_level);
+
+	for (int8_t i = pyramid_level; i!= -1; i--){
+		image_free(&pyramid_old[i]);
+		image_free(&pyramid_new[i]);
+	}
+	free(pyramid_old);
+	free(pyramid_new);
+
+	// Return the vectors
+	return vectors;
+}
+
+/**
+ * Same as opticFlowLK(), but on pyramids that were already built with pyramid_build().
+ * This allows a pyramid to be built once per frame and reused for the next image pair.
+ * @param[in] *pyramid_new Pyramid of the newest image with at least pyramid_level + 1 levels
+ * @param[in] *pyramid_old Pyramid of the old image with at least pyramid_level + 1 levels
+ * The pyramids have to be padded with opticFlowLK_border_size(half_window_size), the other
+ * parameters and the return value are the same as for opticFlowLK().
+ */
+struct flow_t *opticFlowLK_pyramids(struct image_t *pyramid_new, struct image_t *pyramid_old, struct point_t *points, uint16_t *points_cnt,
+		uint16_t half_window_size, uint32_t subpixel_factor, uint8_t max_iterations, uint8_t step_threshold, uint16_t max_points, uint8_t pyramid_level) {
+
+	// The same settings on every level
+	struct lk_level_params levels[pyramid_level + 1];
+	for (uint8_t i = 0; i <= pyramid_level; i++) {
+		levels[i].half_window_size = half_window_size;
+		levels[i].max_iterations = max_iterations;
+		levels[i].step_threshold = step_threshold;
+		levels[i].convergence = NULL;
+		levels[i].stats = NULL;
+	}
+
+	return opticFlowLK_levels(pyramid_new, pyramid_old, points, points_cnt, levels, opticFlowLK_border_size(half_window_size),
+			subpixel_factor, max_points, pyramid_level);
+}
+
+/**
+ * Border size with which the pyramids for opticFlowLK_levels() have to be padded
+ * @param[in] *levels The settings of every level, pyramid_level + 1 entries
+ * @param[in] pyramid_level The top level of the pyramid
+ * @return The border size in pixels, the one needed by the largest window
+ */
+uint8_t opticFlowLK_levels_border_size(const struct lk_level_params *levels, uint8_t pyramid_level)
+{
+	uint8_t border_size = 0;
+	for (uint8_t i = 0; i <= pyramid_level; i++) {
+		uint8_t level_border = opticFlowLK_border_size(levels[i].half_window_size);
+		if (level_border > border_size) {
+			border_size = level_border;
+		}
+	}
+	return border_size;
+}
+
+/**
+ * Same as opticFlowLK_pyramids(), but with separate settings for every pyramid level.
+ * The coarse levels are small and cheap, so they can afford large windows that catch large motions,
+ * while the smaller windows and iteration budgets on the fine levels keep the total cost down.
+ * @param[in] *levels The window size, iterations and step threshold of every level, index 0 is the full resolution
+ * @param[in] border_size The padding the pyramids were built with, at least opticFlowLK_levels_border_size(levels)
+ * The other parameters and the return value are the same as for opticFlowLK_pyramids().
+ */
+struct flow_t *opticFlowLK_levels(struct image_t *pyramid_new, struct image_t *pyramid_old, struct point_t *points, uint16_t *points_cnt,
+		const struct lk_level_params *levels, uint8_t border_size, uint32_t subpixel_factor, uint16_t max_points, uint8_t pyramid_level) {
+
 	//CHANGED step_threshold
 	// A straightforward one-level implementation of Lucas-Kanade.
 	// For all points:
@@ -75,34 +251,20 @@ struct flow_t *opticFlowLK(struct image_t *new_img, struct image_t *old_img, str
 	// Allocate some memory for returning the vectors
 	struct flow_t *vectors = malloc(sizeof(struct flow_t) * max_points);
 
-	// determine patch sizes and initialize neighborhoods
-	uint16_t patch_size = 2 * half_window_size + 1; //CHANGED to put pixel in center, doesnt seem to impact results much, keep in mind.
-	uint32_t error_threshold = (10 * 10) * (patch_size * patch_size);
-	uint16_t padded_patch_size = patch_size + 2;
-	uint8_t border_size = padded_patch_size / 2;
-	step_threshold = step_threshold*(subpixel_factor/100);
-	// 3 values related to tracking window size, wont overflow
-
-	// Allocate memory for image pyramids
-	struct image_t *pyramid_old = (struct image_t *)malloc(sizeof(struct image_t) * (pyramid_level+1));
-	struct image_t *pyramid_new = (struct image_t *)malloc(sizeof(struct image_t) * (pyramid_level+1));
-
-	pyramid_build(old_img, pyramid_old, pyramid_level, border_size);
-	pyramid_build(new_img, pyramid_new, pyramid_level, border_size);
-
-	// Create the window images
-	struct image_t window_I, window_J, window_DX, window_DY, window_diff;
-	image_create(&window_I, padded_patch_size, padded_patch_size, IMAGE_GRAYSCALE);
-	image_create(&window_J, patch_size, patch_size, IMAGE_GRAYSCALE);
-	image_create(&window_DX, patch_size, patch_size, IMAGE_GRADIENT);
-	image_create(&window_DY, patch_size, patch_size, IMAGE_GRADIENT);
-	image_create(&window_diff, patch_size, patch_size, IMAGE_GRADIENT);
-
-
 	for (int8_t LVL = pyramid_level; LVL != -1; LVL--) {
 
 		//printf("Pyramid level %d \n", LVL);
 
+		// determine patch sizes and initialize neighborhoods for this level
+		uint16_t patch_size = 2 * levels[LVL].half_window_size + 1; //CHANGED to put pixel in center, doesnt seem to impact results much, keep in mind.
+		uint32_t error_threshold = (10 * 10) * (patch_size * patch_size);
+		uint32_t step_threshold = levels[LVL].step_threshold*(subpixel_factor/100);
+		// 3 values related to tracking window size, wont overflow
+
+		// Create the window images
+		struct lk_windows win;
+		lk_windows_create(&win, &levels[LVL], subpixel_factor);
+
 		uint16_t points_orig = *points_cnt;
 		*points_cnt = 0;
 		uint16_t new_p = 0;
@@ -142,122 +304,838 @@ struct flow_t *opticFlowLK(struct image_t *new_img, struct image_t *old_img, str
 				//sleep(1);
 
 			}
-			// If the pixel is outside ROI, do not track it
-			if ((((int32_t) vectors[new_p].pos.x + vectors[new_p].flow_x) < 0)
-				|| ((vectors[new_p].pos.x + vectors[new_p].flow_x) > ((pyramid_new[LVL].w - 1 - 2 * border_size)* subpixel_factor))
-				|| (((int32_t) vectors[new_p].pos.y + vectors[new_p].flow_y) < 0)
-				|| ((vectors[new_p].pos.y + vectors[new_p].flow_y) > ((pyramid_new[LVL].h - 1 - 2 * border_size)* subpixel_factor)))
-			{
-				continue;
+
+			// If we tracked the point we update the index and the count
+			if (lk_track_point(&pyramid_new[LVL], &pyramid_old[LVL], &vectors[new_p], &win, subpixel_factor, levels[LVL].max_iterations,
+					step_threshold, error_threshold, border_size)) {
+				new_p++;
+				(*points_cnt)++;
 			}
+		} // go through all points
+
+		// Free the images
+		lk_windows_free(&win);
+
+	} // LVL of pyramid
+
+	// Return the vectors
+	return vectors;
+}
+
+/**
+ * Interleave the bits of two tile coordinates into a Morton (Z-order) code
+ * @param[in] x, y The tile coordinates
+ * @return The Morton code, bit 2n is bit n of x and bit 2n+1 is bit n of y
+ */
+static uint32_t lk_morton_code(uint16_t x, uint16_t y)
+{
+	uint32_t mx = x, my = y;
+	mx = (mx | (mx << 8)) & 0x00FF00FF;
+	mx = (mx | (mx << 4)) & 0x0F0F0F0F;
+	mx = (mx | (mx << 2)) & 0x33333333;
+	mx = (mx | (mx << 1)) & 0x55555555;
+	my = (my | (my << 8)) & 0x00FF00FF;
+	my = (my | (my << 4)) & 0x0F0F0F0F;
+	my = (my | (my << 2)) & 0x33333333;
+	my = (my | (my << 1)) & 0x55555555;
+	return mx | (my << 1);
+}
+
+/* Tile of a point in opticFlowLK_tile_order() */
+struct lk_tile_key {
+	uint32_t key;           ///< Morton code of the tile
+	uint16_t index;         ///< Index of the point
+};
+
+/**
+ * Tiles in Morton order, inside a tile the input order, so the sort is stable
+ */
+static int lk_tile_key_cmp(const void *a, const void *b)
+{
+	const struct lk_tile_key *ka = (const struct lk_tile_key *)a;
+	const struct lk_tile_key *kb = (const struct lk_tile_key *)b;
+	if (ka->key != kb->key) {
+		return (ka->key < kb->key) ? -1 : 1;
+	}
+	return (ka->index < kb->index) ? -1 : (ka->index > kb->index);
+}
+
+/**
+ * Tracking order that keeps the sampled image regions in cache.
+ * The points are bucketed by image tile and the tiles are visited in Morton (Z) order, so consecutive
+ * points sample the same or neighbouring tiles on every pyramid level. Inside a tile the input order is kept.
+ * @param[in] *points The points
+ * @param[in] points_cnt The amount of points
+ * @param[in] tile_size Width and height of a tile in pixels of the full resolution, at least 1
+ * @param[out] *order Indices into *points in tracking order, points_cnt entries
+ * @return FALSE when the working memory can not be allocated, *order is then the input order
+ */
+bool_t opticFlowLK_tile_order(const struct point_t *points, uint16_t points_cnt, uint16_t tile_size, uint16_t *order)
+{
+	for (uint16_t i = 0; i < points_cnt; i++) {
+		order[i] = i;
+	}
+
+	struct lk_tile_key *keys = malloc(sizeof(struct lk_tile_key) * points_cnt);
+	if (keys == NULL) {
+		return FALSE;
+	}
+
+	for (uint16_t i = 0; i < points_cnt; i++) {
+		keys[i].key = lk_morton_code(points[i].x / tile_size, points[i].y / tile_size);
+		keys[i].index = i;
+	}
+	qsort(keys, points_cnt, sizeof(struct lk_tile_key), lk_tile_key_cmp);
+	for (uint16_t i = 0; i < points_cnt; i++) {
+		order[i] = keys[i].index;
+	}
+
+	free(keys);
+	return TRUE;
+}
 
-			// (1) determine the subpixel neighborhood in the old image
-			image_subpixel_window(&pyramid_old[LVL], &window_I, &vectors[new_p].pos, subpixel_factor, border_size);
+/**
+ * Same as opticFlowLK_levels(), but the points are tracked tile by tile in the order of opticFlowLK_tile_order().
+ * At high resolutions a level of the pyramid is much larger than the cache, and points in detector or caller
+ * order make every window fetch a miss. The points are still tracked level by level, but the windows of
+ * consecutive points now come from the same part of the level.
+ * @param[in] tile_size Width and height of a tile in pixels of the full resolution, at least 1
+ * The other parameters are the same as for opticFlowLK_levels().
+ * @return The vectors of the tracked points in subpixels, in the order of *points like opticFlowLK_levels().
+ *         Without points, or when the working memory can not be allocated, none are tracked (*points_cnt is 0)
+ */
+struct flow_t *opticFlowLK_tiled(struct image_t *pyramid_new, struct image_t *pyramid_old, struct point_t *points, uint16_t *points_cnt,
+		const struct lk_level_params *levels, uint8_t border_size, uint32_t subpixel_factor, uint16_t max_points,
+		uint8_t pyramid_level, uint16_t tile_size)
+{
+	// The points that are tracked, skipping points like opticFlowLK_levels()
+	uint16_t points_orig = *points_cnt;
+	float skip_points = (points_orig > max_points) ? (float)points_orig / max_points : 1;
+	uint16_t points_todo = (points_orig < max_points) ? points_orig : max_points;
+	struct flow_t *vectors = malloc(sizeof(struct flow_t) * max_points);
+	*points_cnt = 0;
+	if (points_todo == 0) {
+		return vectors;
+	}
+
+	struct point_t *selected = malloc(sizeof(struct point_t) * points_todo);
+	uint16_t *order = malloc(sizeof(uint16_t) * points_todo);
+	struct flow_t *tracks = malloc(sizeof(struct flow_t) * points_todo);
+	bool_t *tracked = malloc(sizeof(bool_t) * points_todo);
+	if (vectors == NULL || selected == NULL || order == NULL || tracks == NULL || tracked == NULL) {
+		// Nothing is tracked, the caller gets an empty (or NULL) list like for zero points
+		free(tracked);
+		free(tracks);
+		free(order);
+		free(selected);
+		return vectors;
+	}
 
-			// (2) get the x- and y- gradients
-			image_gradients(&window_I, &window_DX, &window_DY);
+	for (uint16_t i = 0; i < points_todo; i++) {
+		selected[i] = points[(uint16_t)(i * skip_points)];
+	}
+	if (!opticFlowLK_tile_order(selected, points_todo, tile_size, order)) {
+		free(tracked);
+		free(tracks);
+		free(order);
+		free(selected);
+		return vectors;
+	}
 
-			// (3) determine the 'G'-matrix [sum(Axx) sum(Axy); sum(Axy) sum(Ayy)], where sum is over the window
-			int32_t G[4];
-			image_calculate_g(&window_DX, &window_DY, G);
+	for (uint16_t i = 0; i < points_todo; i++) {
+		tracks[i].pos.x = (selected[i].x * subpixel_factor) >> pyramid_level;
+		tracks[i].pos.y = (selected[i].y * subpixel_factor) >> pyramid_level;
+		tracks[i].flow_x = 0;
+		tracks[i].flow_y = 0;
+		tracked[i] = TRUE;
+	}
 
-			// calculate G's determinant in subpixel units:
-			int32_t Det = ( G[0] * G[3] - G[1] * G[2]);//	/ subpixel_factor; // 1000 * 1000
-			//printf("Max umnozak za det: %d \n", G[0]*G[3]); // milijuni za subpix = 10 000 i wind 10; za wind 31 deset mil
-			//printf("DEterminanta: %d for point %d %d \n ", Det,vectors[new_p].pos.y/subpixel_factor,vectors[new_p].pos.x/subpixel_factor );
+	for (int8_t LVL = pyramid_level; LVL != -1; LVL--) {
+		uint16_t patch_size = 2 * levels[LVL].half_window_size + 1;
+		uint32_t error_threshold = (10 * 10) * (patch_size * patch_size);
+		uint32_t step_threshold = levels[LVL].step_threshold*(subpixel_factor/100);
 
+		struct lk_windows win;
+		lk_windows_create(&win, &levels[LVL], subpixel_factor);
 
-			// Check if the determinant is bigger than 1
-			if (Det < 1) {
-				//printf("bad determinant: %d \n", Det);
+		for (uint16_t k = 0; k < points_todo; k++) {
+			struct flow_t *vector = &tracks[order[k]];
+			if (!tracked[order[k]]) {
 				continue;
 			}
 
-			// (4) iterate over taking steps in the image to minimize the error:
-			bool_t tracked = TRUE;
+			// Convert last pyramid level flow into this pyramid level flow guess
+			if (LVL != pyramid_level) {
+				vector->pos.x = vector->pos.x << 1;
+				vector->pos.y = vector->pos.y << 1;
+				vector->flow_x = vector->flow_x << 1;
+				vector->flow_y = vector->flow_y << 1;
+			}
 
-			for (uint8_t it = max_iterations; it--; ) {
-				struct point_t new_point = { vectors[new_p].pos.x  + vectors[new_p].flow_x,
-											 vectors[new_p].pos.y + vectors[new_p].flow_y };
+			tracked[order[k]] = lk_track_point(&pyramid_new[LVL], &pyramid_old[LVL], vector, &win, subpixel_factor,
+					levels[LVL].max_iterations, step_threshold, error_threshold, border_size);
+		}
 
+		lk_windows_free(&win);
+	}
 
-				// If the pixel is outside ROI, do not track it
-				if ( (( (int32_t)vectors[new_p].pos.x  + vectors[new_p].flow_x) < 0)
-					|| ( new_point.x > ((pyramid_new[LVL].w - 1 - 2*border_size)*subpixel_factor))
-					|| (((int32_t)vectors[new_p].pos.y  + vectors[new_p].flow_y) < 0)
-					|| ( new_point.y > ((pyramid_new[LVL].h - 1 - 2*border_size)*subpixel_factor)) )
-				{
-					tracked = FALSE;
-					//printf("*New point outside ROI %d, %d; window size w %u h %u \n",
-					//		((int32_t)vectors[new_p].pos.x  + vectors[new_p].flow_x),
-					//		((int32_t)vectors[new_p].pos.y  + vectors[new_p].flow_y),
-					//		pyramid_new[LVL].w,	pyramid_new[LVL].h); //ADDED
-					break;
-				}
+	// Return the tracked points in their original order
+	for (uint16_t i = 0; i < points_todo; i++) {
+		if (tracked[i]) {
+			vectors[(*points_cnt)++] = tracks[i];
+		}
+	}
 
+	free(tracked);
+	free(tracks);
+	free(order);
+	free(selected);
+	return vectors;
+}
 
-				//     [a] get the subpixel neighborhood in the new image
-				image_subpixel_window(&pyramid_new[LVL], &window_J, &new_point, subpixel_factor, border_size);
+/**
+ * Time in microseconds, for the deadline of opticFlowLK_deadline(). The monotonic clock, so adjustments
+ * of the wall clock during a frame do not stretch or cut its budget.
+ * @return Microseconds since an arbitrary starting point
+ */
+static uint64_t lk_time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-				//     [b] determine the image difference between the two neighborhoods
-				uint32_t error = image_difference(&window_I, &window_J, &window_diff);
+/**
+ * Time-budgeted version of opticFlowLK_levels().
+ * Instead of going through the pyramid level by level for all points, every point is tracked through
+ * all levels before the next one is started, in the given priority order. Once the deadline has passed
+ * no new points are started and the remaining ones are marked as skipped, so the run time is bounded
+ * by the deadline plus the time needed for a single point.
+ * @param[in] *pyramid_new Pyramid of the newest image with at least pyramid_level + 1 levels
+ * @param[in] *pyramid_old Pyramid of the old image with at least pyramid_level + 1 levels
+ * @param[in] *points Points to start tracking from
+ * @param[in,out] points_cnt The amount of points and it returns the amount of points tracked
+ * @param[in] *order Indices into *points in the order they should be tracked (e.g. by corner score or
+ *                   track age), NULL to track them in the given order
+ * @param[out] *status Status of every point (indexed like *points), can be NULL
+ * @param[in] deadline_us Time budget in microseconds from the start of the call, 0 for no deadline
+ * @param[in] *levels The window size, iterations and step threshold of every level, index 0 is the full resolution,
+ *                    with their termination criteria and statistics
+ * @param[in] border_size The padding the pyramids were built with, at least opticFlowLK_levels_border_size(levels)
+ * The other parameters are the same as for opticFlowLK_levels().
+ * @return The vectors of the tracked points in subpixels, in the order they were tracked
+ */
+struct flow_t *opticFlowLK_deadline(struct image_t *pyramid_new, struct image_t *pyramid_old, struct point_t *points, uint16_t *points_cnt,
+		uint16_t *order, uint8_t *status, uint32_t deadline_us, const struct lk_level_params *levels, uint8_t border_size,
+		uint32_t subpixel_factor, uint8_t pyramid_level)
+{
+	uint64_t start = lk_time_us();
+	uint16_t points_orig = *points_cnt;
+	struct flow_t *vectors = malloc(sizeof(struct flow_t) * points_orig);
 
-				if (error > error_threshold && it < max_iterations / 2) {
-					tracked = FALSE;
-				//printf("*Error larger than error treshold for %d %d \n", vectors[new_p].pos.x/subpixel_factor, vectors[new_p].pos.y/subpixel_factor); //ADDED
-					break;
-				}
+	// Every point goes through all levels, so the windows and thresholds of all of them are set up front
+	struct lk_windows win[pyramid_level + 1];
+	uint32_t error_threshold[pyramid_level + 1];
+	uint32_t step_threshold[pyramid_level + 1];
+	for (uint8_t LVL = 0; LVL <= pyramid_level; LVL++) {
+		uint16_t patch_size = 2 * levels[LVL].half_window_size + 1;
+		error_threshold[LVL] = (10 * 10) * (patch_size * patch_size);
+		step_threshold[LVL] = levels[LVL].step_threshold*(subpixel_factor/100);
+		lk_windows_create(&win[LVL], &levels[LVL], subpixel_factor);
+	}
 
-				int32_t b_x = image_multiply(&window_diff, &window_DX, NULL) / 255;
-				int32_t b_y = image_multiply(&window_diff, &window_DY, NULL) / 255;
+	uint16_t new_p = 0;
+	for (uint16_t i = 0; i < points_orig; i++) {
+		uint16_t p = (order != NULL) ? order[i] : i;
 
+		if (deadline_us > 0 && (lk_time_us() - start) >= deadline_us) {
+			// Out of time, the rest is skipped
+			for (; status != NULL && i < points_orig; i++) {
+				status[(order != NULL) ? order[i] : i] = LK_POINT_SKIPPED;
+			}
+			break;
+		}
 
-				//     [d] calculate the additional flow step and possibly terminate the iteration
-				int32_t step_x = (( (int64_t) G[3] * b_x - G[1] * b_y) * subpixel_factor) / Det; //CHANGED 16 -> 32; changes made so DET is in subpixel now (less point rejection)
-				int32_t step_y = (( (int64_t) G[0] * b_y - G[2] * b_x) * subpixel_factor) / Det; //CHANGED 16 -> 32; possibly change subpx factor and then this datatype to 32
-				// Converting step into subpixel directly instead via Det ensures less good points rejection; memory impact?
-				//printf("step x %d step y %d \n", step_x, step_y);
-				//printf("is it large? %ld \n", (((int64_t)G[3] * b_x - G[1] * b_y)*subpixel_factor));
+		// Start at the top level and take the flow down to level 0
+		vectors[new_p].pos.x = (points[p].x * subpixel_factor) >> pyramid_level;
+		vectors[new_p].pos.y = (points[p].y * subpixel_factor) >> pyramid_level;
+		vectors[new_p].flow_x = 0;
+		vectors[new_p].flow_y = 0;
 
+		bool_t tracked = TRUE;
+		for (int8_t LVL = pyramid_level; LVL != -1 && tracked; LVL--) {
+			if (LVL != pyramid_level) {
+				vectors[new_p].pos.x = vectors[new_p].pos.x << 1;
+				vectors[new_p].pos.y = vectors[new_p].pos.y << 1;
+				vectors[new_p].flow_x = vectors[new_p].flow_x << 1;
+				vectors[new_p].flow_y = vectors[new_p].flow_y << 1;
+			}
 
-				vectors[new_p].flow_x = vectors[new_p].flow_x + step_x;
-				vectors[new_p].flow_y = vectors[new_p].flow_y + step_y;
-				//printf("suma flow x %d  flow y %d \n",vectors[new_p].flow_x, vectors[new_p].flow_y);
+			tracked = lk_track_point(&pyramid_new[LVL], &pyramid_old[LVL], &vectors[new_p], &win[LVL], subpixel_factor,
+					levels[LVL].max_iterations, step_threshold[LVL], error_threshold[LVL], border_size);
+		}
 
-				//printf("Flows: %d %d \n", vectors[new_p].flow_x, vectors[new_p].flow_x);
+		if (status != NULL) {
+			status[p] = tracked ? LK_POINT_TRACKED : LK_POINT_LOST;
+		}
+		if (tracked) {
+			new_p++;
+		}
+	}
+	*points_cnt = new_p;
 
-				// Check if we exceeded the treshold CHANGED made this better for 0.03
-				if ((abs(step_x) + abs(step_y)) < step_threshold) {
-					//printf("step x %ld and step threshold %u \n", step_x, (step_threshold*(subpixel_factor/100)));
-					break;
-				}
-			} // lucas kanade step iteration
+	for (uint8_t LVL = 0; LVL <= pyramid_level; LVL++) {
+		lk_windows_free(&win[LVL]);
+	}
+	return vectors;
+}
 
-			// If we tracked the point we update the index and the count
-			if (tracked) {
-				new_p++;
-				(*points_cnt)++;
+/**
+ * Refine already estimated flow vectors with Lucas-Kanade iterations on a single image (pyramid level).
+ * This is used to add subpixel accuracy to flow found by other means, like block matching.
+ * @param[in] *img_new The newest image (or pyramid level)
+ * @param[in] *img_old The old image (or pyramid level)
+ * @param[in,out] *vectors The flow vectors in subpixels at this level, used as the initial guess. Vectors that
+ *                         can not be tracked are removed and the rest is moved to the front of the array.
+ * @param[in,out] vectors_cnt The amount of vectors and it returns the amount of vectors tracked
+ * @param[in] *params The window size, iterations, step threshold, termination criteria and statistics
+ * @param[in] border_size The padding the images were built with, at least opticFlowLK_border_size(params->half_window_size)
+ * @param[in] subpixel_factor The subpixel factor which calculations should be based on
+ */
+void opticFlowLK_refine(struct image_t *img_new, struct image_t *img_old, struct flow_t *vectors, uint16_t *vectors_cnt,
+		const struct lk_level_params *params, uint8_t border_size, uint32_t subpixel_factor)
+{
+	uint16_t patch_size = 2 * params->half_window_size + 1;
+	uint32_t error_threshold = (10 * 10) * (patch_size * patch_size);
+	uint32_t scaled_step_threshold = params->step_threshold*(subpixel_factor/100);
+
+	struct lk_windows win;
+	lk_windows_create(&win, params, subpixel_factor);
+
+	uint16_t new_p = 0;
+	for (uint16_t i = 0; i < *vectors_cnt; i++) {
+		vectors[new_p] = vectors[i];
+		if (lk_track_point(img_new, img_old, &vectors[new_p], &win, subpixel_factor, params->max_iterations,
+				scaled_step_threshold, error_threshold, border_size)) {
+			new_p++;
+		}
+	}
+	*vectors_cnt = new_p;
+
+	lk_windows_free(&win);
+}
+
+/**
+ * Start a track at a point
+ * @param[out] *track The track
+ * @param[in] *point The position in pixels on the full resolution
+ * @param[in] subpixel_factor The subpixel factor which calculations should be based on
+ */
+void opticFlowLK_track_init(struct lk_track *track, struct point_t *point, uint32_t subpixel_factor)
+{
+	track->pos.x = point->x * subpixel_factor;
+	track->pos.y = point->y * subpixel_factor;
+	track->flow_x = 0;
+	track->flow_y = 0;
+	track->tracked = FALSE;
+	track->ref = track->pos;
+	track->age = 0;
+	track->drifted = TRUE;
+	track->template_levels = 0;
+	track->templates = NULL;
+	track->id = 0;
+}
+
+/**
+ * Free the templates of a track
+ * @param[in] *track The track
+ */
+void opticFlowLK_track_free(struct lk_track *track)
+{
+	for (uint8_t i = 0; i < track->template_levels; i++) {
+		lk_template_free(&track->templates[i]);
+	}
+	free(track->templates);
+	track->templates = NULL;
+	track->template_levels = 0;
+	track->drifted = TRUE;
+}
+
+/**
+ * Take the templates of a track on every level at its current position
+ * @param[in] *pyramid_old Pyramid of the old image
+ * @param[in,out] *track The track
+ * @param[in] *levels The settings of every level
+ * @param[in] *win The window images of every level, for the accumulator widths
+ * @param[in] subpixel_factor The subpixel factor which calculations should be based on
+ * @param[in] pyramid_level The top level of the pyramid
+ * @param[in] border_size The padding of the pyramid levels
+ * @return TRUE if the templates could be taken on all levels
+ */
+static bool_t lk_track_refresh(struct image_t *pyramid_old, struct lk_track *track, const struct lk_level_params *levels,
+		struct lk_windows *win, uint32_t subpixel_factor, uint8_t pyramid_level, uint8_t border_size)
+{
+	// New templates when the pyramid or a window size changed
+	bool_t resize = (track->template_levels != pyramid_level + 1);
+	for (uint8_t LVL = 0; LVL < track->template_levels && !resize; LVL++) {
+		resize = (track->templates[LVL].I.w != 2 * levels[LVL].half_window_size + 3);
+	}
+	if (resize) {
+		opticFlowLK_track_free(track);
+		track->templates = malloc(sizeof(struct lk_template) * (pyramid_level + 1));
+		track->template_levels = pyramid_level + 1;
+		for (uint8_t LVL = 0; LVL <= pyramid_level; LVL++) {
+			lk_template_create(&track->templates[LVL], levels[LVL].half_window_size);
+		}
+	}
+
+	track->ref = track->pos;
+	track->age = 0;
+	track->drifted = FALSE;
+	for (uint8_t LVL = 0; LVL <= pyramid_level; LVL++) {
+		struct point_t pos = { track->ref.x >> LVL, track->ref.y >> LVL };
+		if (pos.x > (uint32_t)(pyramid_old[LVL].w - 1 - 2 * border_size) * subpixel_factor
+				|| pos.y > (uint32_t)(pyramid_old[LVL].h - 1 - 2 * border_size) * subpixel_factor
+				|| !lk_template_take(&pyramid_old[LVL], &pos, &track->templates[LVL], &win[LVL].acc, subpixel_factor, border_size)) {
+			track->drifted = TRUE;
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * Track points over several frames, reusing their templates.
+ * For a point that is followed from frame to frame, taking the window in the old image, its gradients and
+ * the G-matrix is the same work every frame. Here they are taken once per track on every level and the
+ * following frames are matched against them, until they are max_age frames old or the window difference
+ * after tracking grew above max_error (the appearance drifted away from the template). Then they are
+ * taken again from the old image at the current position.
+ * @param[in] *pyramid_new Pyramid of the newest image with at least pyramid_level + 1 levels
+ * @param[in] *pyramid_old Pyramid of the old image, the newest image of the previous call
+ * @param[in,out] *tracks The tracks, started with opticFlowLK_track_init(). Returns their new position and flow,
+ *                        the tracks that were lost should be freed with opticFlowLK_track_free() by the caller.
+ * @param[in] tracks_cnt The amount of tracks
+ * @param[in] *levels The window size, iterations and step threshold of every level, index 0 is the full resolution
+ * @param[in] border_size The padding the pyramids were built with, at least opticFlowLK_levels_border_size(levels)
+ * @param[in] subpixel_factor The subpixel factor which calculations should be based on
+ * @param[in] pyramid_level The top level of the pyramid
+ * @param[in] *policy When the templates are taken again
+ * @param[out] *templates_taken The amount of tracks that took new templates, can be NULL
+ * @return The amount of tracks that were tracked
+ */
+uint16_t opticFlowLK_tracks(struct image_t *pyramid_new, struct image_t *pyramid_old, struct lk_track *tracks, uint16_t tracks_cnt,
+		const struct lk_level_params *levels, uint8_t border_size, uint32_t subpixel_factor, uint8_t pyramid_level,
+		const struct lk_template_policy *policy, uint16_t *templates_taken)
+{
+	struct lk_windows win[pyramid_level + 1];
+	for (uint8_t LVL = 0; LVL <= pyramid_level; LVL++) {
+		lk_windows_create(&win[LVL], &levels[LVL], subpixel_factor);
+	}
+
+	uint16_t patch_size = 2 * levels[0].half_window_size + 1;
+	uint32_t max_error = policy->max_error * (patch_size * patch_size);
+	uint16_t tracked = 0, taken = 0;
+
+	for (uint16_t i = 0; i < tracks_cnt; i++) {
+		struct lk_track *track = &tracks[i];
+		track->tracked = FALSE;
+
+		if (track->drifted || track->age >= policy->max_age || track->template_levels != pyramid_level + 1) {
+			taken++;
+			if (!lk_track_refresh(pyramid_old, track, levels, win, subpixel_factor, pyramid_level, border_size)) {
+				lk_stats_add(levels[pyramid_level].stats, 0, LK_STOP_LOST);
+				continue;
 			}
-		} // go through all points
+		}
 
-	} // LVL of pyramid
+		// Start at the current position, relative to where the templates were taken
+		struct flow_t vector;
+		int32_t flow_x = (int32_t)(track->pos.x - track->ref.x);
+		int32_t flow_y = (int32_t)(track->pos.y - track->ref.y);
+		uint32_t error = 0;
+		bool_t ok = TRUE;
+		for (int8_t LVL = pyramid_level; LVL != -1 && ok; LVL--) {
+			vector.pos.x = track->ref.x >> LVL;
+			vector.pos.y = track->ref.y >> LVL;
+			if (LVL == pyramid_level) {
+				vector.flow_x = flow_x / (1 << LVL);
+				vector.flow_y = flow_y / (1 << LVL);
+			} else {
+				vector.flow_x = vector.flow_x << 1;
+				vector.flow_y = vector.flow_y << 1;
+			}
 
-	// Free the images
-	image_free(&window_I);
-	image_free(&window_J);
-	image_free(&window_DX);
-	image_free(&window_DY);
-	image_free(&window_diff);
+			uint16_t level_patch_size = 2 * levels[LVL].half_window_size + 1;
+			uint32_t error_threshold = (10 * 10) * (level_patch_size * level_patch_size);
+			uint32_t step_threshold = levels[LVL].step_threshold*(subpixel_factor/100);
+			ok = lk_track_iterate(&pyramid_new[LVL], &vector, &track->templates[LVL], &win[LVL], subpixel_factor,
+					levels[LVL].max_iterations, step_threshold, error_threshold, border_size, &error);
+		}
 
-	for (int8_t i = pyramid_level; i!= -1; i--){
-		image_free(&pyramid_old[i]);
-		image_free(&pyramid_new[i]);
+		int64_t x = (int64_t)track->ref.x + vector.flow_x;
+		int64_t y = (int64_t)track->ref.y + vector.flow_y;
+		if (!ok || x < 0 || y < 0) {
+			continue;
+		}
+
+		track->flow_x = (int32_t)(x - track->pos.x);
+		track->flow_y = (int32_t)(y - track->pos.y);
+		track->pos.x = x;
+		track->pos.y = y;
+		track->age++;
+		track->drifted = (policy->max_error > 0 && error > max_error);
+		track->tracked = TRUE;
+		tracked++;
 	}
-	pyramid_old = NULL;
-	pyramid_new = NULL;
 
-	// Return the vectors
-	return vectors;
+	for (uint8_t LVL = 0; LVL <= pyramid_level; LVL++) {
+		lk_windows_free(&win[LVL]);
+	}
+
+	if (templates_taken != NULL) {
+		*templates_taken = taken;
+	}
+	return tracked;
+}
+
+/**
+ * Score tracks by how well they can be tracked, before tracking them.
+ * The templates of every track are taken at its current position on all levels, as opticFlowLK_tracks()
+ * takes them, and the score is the smallest eigenvalue of their G-matrices (Shi-Tomasi): G is what the
+ * iterations invert, so a small eigenvalue means a step that is badly defined in one direction, more
+ * iterations and a point that gets lost. It is divided by the window area to compare levels with different
+ * windows, and the smallest level counts because the point is lost on any level where G can not be inverted.
+ * The templates stay with the tracks, so the next opticFlowLK_tracks() call with this pyramid as the old one
+ * uses them (and their G) instead of taking them again. Tracks that can not be tracked score 0 and are marked
+ * as drifted.
+ * @param[in] *pyramid_old Pyramid of the image the tracks are in, the old pyramid of the next opticFlowLK_tracks() call
+ * @param[in,out] *tracks The tracks, started with opticFlowLK_track_init(). Their templates are taken.
+ * @param[in] tracks_cnt The amount of tracks
+ * @param[in] *levels The window size, iterations and step threshold of every level, index 0 is the full resolution
+ * @param[in] border_size The padding the pyramid was built with, at least opticFlowLK_levels_border_size(levels)
+ * @param[in] subpixel_factor The subpixel factor which calculations should be based on
+ * @param[in] pyramid_level The top level of the pyramid
+ * @param[out] *scores The score of every track, in the units of G per window pixel
+ * @return The amount of tracks with a score above 0
+ */
+uint16_t opticFlowLK_tracks_score(struct image_t *pyramid_old, struct lk_track *tracks, uint16_t tracks_cnt,
+		const struct lk_level_params *levels, uint8_t border_size, uint32_t subpixel_factor, uint8_t pyramid_level,
+		float *scores)
+{
+	struct lk_windows win[pyramid_level + 1];
+	for (uint8_t LVL = 0; LVL <= pyramid_level; LVL++) {
+		lk_windows_create(&win[LVL], &levels[LVL], subpixel_factor);
+	}
+
+	uint16_t trackable = 0;
+	for (uint16_t i = 0; i < tracks_cnt; i++) {
+		scores[i] = 0;
+		if (!lk_track_refresh(pyramid_old, &tracks[i], levels, win, subpixel_factor, pyramid_level, border_size)) {
+			continue;
+		}
+
+		float score = 0;
+		for (uint8_t LVL = 0; LVL <= pyramid_level; LVL++) {
+			// Smallest eigenvalue of the symmetric [G0 G1; G1 G3]
+			const int32_t *G = tracks[i].templates[LVL].G;
+			float half_trace = ((float)G[0] + G[3]) / 2;
+			float half_diff = ((float)G[0] - G[3]) / 2;
+			float patch_size = 2 * levels[LVL].half_window_size + 1;
+			float min_eig = (half_trace - sqrtf(half_diff * half_diff + (float)G[1] * G[1])) / (patch_size * patch_size);
+			if (LVL == 0 || min_eig < score) {
+				score = min_eig;
+			}
+		}
+
+		// Det >= 1 makes both eigenvalues positive, up to the float rounding
+		scores[i] = (score > 0) ? score : 0;
+		if (scores[i] > 0) {
+			trackable++;
+		}
+	}
+
+	for (uint8_t LVL = 0; LVL <= pyramid_level; LVL++) {
+		lk_windows_free(&win[LVL]);
+	}
+	return trackable;
+}
+
+/**
+ * Narrowest accumulators that can not overflow for a window size and subpixel factor.
+ * The gradients and the window difference are at most 255, so every element of G and b is at most
+ * patch_size^2 * 255 (the sums are divided by 255). The window sums themselves stay within int32
+ * up to a 181x181 window.
+ * @param[in] half_window_size Half the window size (in both x and y direction) to search inside
+ * @param[in] subpixel_factor The subpixel factor which calculations should be based on
+ * @param[out] *acc The accumulator widths
+ */
+void opticFlowLK_accumulators(uint16_t half_window_size, uint32_t subpixel_factor, struct lk_accumulators *acc)
+{
+	uint64_t patch_size = 2 * half_window_size + 1;
+	uint64_t g_max = patch_size * patch_size * 255;
+
+	acc->blend_bits = image_subpixel_blend_bits(subpixel_factor);
+	// G is symmetric positive semi-definite, so only the products G[0]*G[3] and G[1]*G[2] have to fit
+	acc->det_bits = (g_max * g_max <= INT32_MAX) ? 32 : 64;
+	acc->step_bits = (2 * g_max * g_max * subpixel_factor <= INT32_MAX) ? 32 : 64;
+}
+
+/**
+ * Allocate the window images used for tracking a single point on a level
+ * @param[out] *win The window images
+ * @param[in] *params The settings of the level: the window size, termination criteria and statistics
+ * @param[in] subpixel_factor The subpixel factor which calculations should be based on
+ */
+static void lk_windows_create(struct lk_windows *win, const struct lk_level_params *params, uint32_t subpixel_factor)
+{
+	uint16_t patch_size = 2 * params->half_window_size + 1;
+
+	lk_template_create(&win->tmpl, params->half_window_size);
+	image_create(&win->J, patch_size, patch_size, IMAGE_GRAYSCALE);
+	image_create(&win->diff, patch_size, patch_size, IMAGE_GRADIENT);
+	opticFlowLK_accumulators(params->half_window_size, subpixel_factor, &win->acc);
+	win->convergence = params->convergence;
+	win->stats = params->stats;
+}
+
+/**
+ * Free the window images
+ * @param[in] *win The window images
+ */
+static void lk_windows_free(struct lk_windows *win)
+{
+	lk_template_free(&win->tmpl);
+	image_free(&win->J);
+	image_free(&win->diff);
+}
+
+/**
+ * Allocate the images of a template
+ * @param[out] *tmpl The template
+ * @param[in] half_window_size Half the window size (in both x and y direction) to search inside
+ */
+static void lk_template_create(struct lk_template *tmpl, uint16_t half_window_size)
+{
+	uint16_t patch_size = 2 * half_window_size + 1;
+	uint16_t padded_patch_size = patch_size + 2;
+
+	image_create(&tmpl->I, padded_patch_size, padded_patch_size, IMAGE_GRAYSCALE);
+	image_create(&tmpl->DX, patch_size, patch_size, IMAGE_GRADIENT);
+	image_create(&tmpl->DY, patch_size, patch_size, IMAGE_GRADIENT);
+}
+
+/**
+ * Free the images of a template
+ * @param[in] *tmpl The template
+ */
+static void lk_template_free(struct lk_template *tmpl)
+{
+	image_free(&tmpl->I);
+	image_free(&tmpl->DX);
+	image_free(&tmpl->DY);
+}
+
+/**
+ * Take the template of a point: the window in the old image, its gradients and G-matrix
+ * @param[in] *img_old The padded pyramid level of the old image
+ * @param[in] *pos Position of the point in subpixels
+ * @param[out] *tmpl The template
+ * @param[in] *acc The accumulator widths for the window size and subpixel factor
+ * @param[in] subpixel_factor The subpixel factor which calculations should be based on
+ * @param[in] border_size The padding of the pyramid levels
+ * @return TRUE if the G-matrix can be inverted
+ */
+static bool_t lk_template_take(struct image_t *img_old, struct point_t *pos, struct lk_template *tmpl, const struct lk_accumulators *acc,
+		uint32_t subpixel_factor, uint8_t border_size)
+{
+	// (1) determine the subpixel neighborhood in the old image
+	image_subpixel_window(img_old, &tmpl->I, pos, subpixel_factor, border_size);
+
+	// (2) get the x- and y- gradients
+	image_gradients(&tmpl->I, &tmpl->DX, &tmpl->DY);
+
+	// (3) determine the 'G'-matrix [sum(Axx) sum(Axy); sum(Axy) sum(Ayy)], where sum is over the window
+	int32_t *G = tmpl->G;
+	image_calculate_g(&tmpl->DX, &tmpl->DY, G);
+
+	// calculate G's determinant in subpixel units, 32 bit products overflow for windows larger than 13x13:
+	if (acc->det_bits == 32) {
+		tmpl->Det = ( G[0] * G[3] - G[1] * G[2]);//	/ subpixel_factor; // 1000 * 1000
+	} else {
+		tmpl->Det = (int64_t)G[0] * G[3] - (int64_t)G[1] * G[2];
+	}
+	//printf("Max umnozak za det: %d \n", G[0]*G[3]); // milijuni za subpix = 10 000 i wind 10; za wind 31 deset mil
+
+	// Check if the determinant is bigger than 1
+	return tmpl->Det >= 1;
+}
+
+/**
+ * Track a single point on one pyramid level
+ * @param[in] *img_new The padded pyramid level of the newest image
+ * @param[in] *img_old The padded pyramid level of the old image
+ * @param[in,out] *vector Position and initial flow guess in subpixels, returns the tracked flow
+ * @param[in] *win The window images to work in
+ * @param[in] subpixel_factor The subpixel factor which calculations should be based on
+ * @param[in] max_iterations Maximum amount of iterations to find the new point
+ * @param[in] step_threshold The threshold at which the iterations should stop (in subpixels)
+ * @param[in] error_threshold The maximum squared difference between the windows
+ * @param[in] border_size The padding of the pyramid levels
+ * @return TRUE if the point was tracked
+ */
+static bool_t lk_track_point(struct image_t *img_new, struct image_t *img_old, struct flow_t *vector, struct lk_windows *win,
+		uint32_t subpixel_factor, uint8_t max_iterations, uint32_t step_threshold, uint32_t error_threshold, uint8_t border_size)
+{
+	// If the pixel is outside ROI, do not track it
+	if ((((int32_t) vector->pos.x + vector->flow_x) < 0)
+		|| ((vector->pos.x + vector->flow_x) > ((img_new->w - 1 - 2 * border_size)* subpixel_factor))
+		|| (((int32_t) vector->pos.y + vector->flow_y) < 0)
+		|| ((vector->pos.y + vector->flow_y) > ((img_new->h - 1 - 2 * border_size)* subpixel_factor)))
+	{
+		lk_stats_add(win->stats, 0, LK_STOP_LOST);
+		return FALSE;
+	}
+
+	if (!lk_template_take(img_old, &vector->pos, &win->tmpl, &win->acc, subpixel_factor, border_size)) {
+		//printf("bad determinant: %d \n", Det);
+		lk_stats_add(win->stats, 0, LK_STOP_LOST);
+		return FALSE;
+	}
+
+	return lk_track_iterate(img_new, vector, &win->tmpl, win, subpixel_factor, max_iterations, step_threshold, error_threshold,
+			border_size, NULL);
+}
+
+/**
+ * The iterations of a point on one pyramid level, against a template taken with lk_template_take()
+ * @param[in] *img_new The padded pyramid level of the newest image
+ * @param[in,out] *vector Position of the template and initial flow guess in subpixels, returns the tracked flow
+ * @param[in] *tmpl The template of the point
+ * @param[in] *win The window images to work in
+ * @param[out] *last_error The squared difference between the windows in the last iteration, can be NULL
+ * The other parameters and the return value are the same as for lk_track_point().
+ */
+static bool_t lk_track_iterate(struct image_t *img_new, struct flow_t *vector, struct lk_template *tmpl, struct lk_windows *win,
+		uint32_t subpixel_factor, uint8_t max_iterations, uint32_t step_threshold, uint32_t error_threshold, uint8_t border_size,
+		uint32_t *last_error)
+{
+	const int32_t *G = tmpl->G;
+	int64_t Det = tmpl->Det;
+
+	// State of the extra termination criteria
+	const struct lk_convergence_t *conv = win->convergence;
+	int32_t prev_step_x = 0, prev_step_y = 0;
+	uint32_t prev_error = UINT32_MAX;
+	int32_t min_step = INT32_MAX;
+	uint8_t stalled = 0, halvings = 0, iterations = 0;
+	enum lk_stop_reason reason = LK_STOP_MAX_ITERATIONS;
+
+	// (4) iterate over taking steps in the image to minimize the error:
+	for (uint8_t it = max_iterations; it--; ) {
+		struct point_t new_point = { vector->pos.x  + vector->flow_x,
+									 vector->pos.y + vector->flow_y };
+
+
+		// If the pixel is outside ROI, do not track it
+		if ( (( (int32_t)vector->pos.x  + vector->flow_x) < 0)
+			|| ( new_point.x > ((img_new->w - 1 - 2*border_size)*subpixel_factor))
+			|| (((int32_t)vector->pos.y  + vector->flow_y) < 0)
+			|| ( new_point.y > ((img_new->h - 1 - 2*border_size)*subpixel_factor)) )
+		{
+			lk_stats_add(win->stats, iterations, LK_STOP_LOST);
+			return FALSE;
+		}
+		iterations++;
+
+
+		//     [a] get the subpixel neighborhood in the new image
+		image_subpixel_window(img_new, &win->J, &new_point, subpixel_factor, border_size);
+
+		//     [b] determine the image difference between the two neighborhoods
+		uint32_t error = image_difference(&tmpl->I, &win->J, &win->diff);
+		if (last_error != NULL) {
+			*last_error = error;
+		}
+
+		if (error > error_threshold && it < max_iterations / 2) {
+		//printf("*Error larger than error treshold for %d %d \n", vector->pos.x/subpixel_factor, vector->pos.y/subpixel_factor); //ADDED
+			lk_stats_add(win->stats, iterations, LK_STOP_LOST);
+			return FALSE;
+		}
+
+		// The last step made the match worse: retry with half of it or go back to the previous position
+		if (conv != NULL && conv->error_increase && error > prev_error) {
+			if (halvings < conv->step_halvings && (prev_step_x / 2 != 0 || prev_step_y / 2 != 0)) {
+				vector->flow_x -= prev_step_x - prev_step_x / 2;
+				vector->flow_y -= prev_step_y - prev_step_y / 2;
+				prev_step_x /= 2;
+				prev_step_y /= 2;
+				halvings++;
+				continue;
+			}
+			vector->flow_x -= prev_step_x;
+			vector->flow_y -= prev_step_y;
+			reason = LK_STOP_ERROR_INCREASE;
+			break;
+		}
+		prev_error = error;
+
+		int32_t b_x = image_multiply(&win->diff, &tmpl->DX, NULL) / 255;
+		int32_t b_y = image_multiply(&win->diff, &tmpl->DY, NULL) / 255;
+
+
+		//     [d] calculate the additional flow step and possibly terminate the iteration
+		int32_t step_x, step_y;
+		if (win->acc.step_bits == 32) {
+			step_x = ((G[3] * b_x - G[1] * b_y) * (int32_t)subpixel_factor) / (int32_t)Det;
+			step_y = ((G[0] * b_y - G[2] * b_x) * (int32_t)subpixel_factor) / (int32_t)Det;
+		} else {
+			step_x = lk_step_clamp((((int64_t)G[3] * b_x - (int64_t)G[1] * b_y) * subpixel_factor) / Det); //CHANGED 16 -> 32; changes made so DET is in subpixel now (less point rejection)
+			step_y = lk_step_clamp((((int64_t)G[0] * b_y - (int64_t)G[2] * b_x) * subpixel_factor) / Det); //CHANGED 16 -> 32; possibly change subpx factor and then this datatype to 32
+		}
+		// Converting step into subpixel directly instead via Det ensures less good points rejection; memory impact?
+		//printf("step x %d step y %d \n", step_x, step_y);
+		int32_t step = abs(step_x) + abs(step_y);
+
+		// Stepping back about as far as the last step went forward, the minimum is in between
+		if (conv != NULL && conv->oscillation
+				&& ((int64_t)step_x * prev_step_x + (int64_t)step_y * prev_step_y) < 0
+				&& 2 * step >= abs(prev_step_x) + abs(prev_step_y)) {
+			vector->flow_x += step_x / 2;
+			vector->flow_y += step_y / 2;
+			reason = LK_STOP_OSCILLATION;
+			break;
+		}
+
+		vector->flow_x = vector->flow_x + step_x;
+		vector->flow_y = vector->flow_y + step_y;
+		//printf("suma flow x %d  flow y %d \n",vector->flow_x, vector->flow_y);
+
+		// Check if we exceeded the treshold CHANGED made this better for 0.03
+		if ((uint32_t)step < step_threshold) {
+			//printf("step x %ld and step threshold %u \n", step_x, (step_threshold*(subpixel_factor/100)));
+			reason = LK_STOP_THRESHOLD;
+			break;
+		}
+
+		// The steps stopped getting smaller, more iterations will not converge
+		if (conv != NULL && conv->stagnation_iterations > 0) {
+			if (step < min_step) {
+				min_step = step;
+				stalled = 0;
+			} else if (++stalled >= conv->stagnation_iterations) {
+				reason = LK_STOP_STAGNATION;
+				break;
+			}
+		}
+
+		prev_step_x = step_x;
+		prev_step_y = step_y;
+	} // lucas kanade step iteration
+
+	lk_stats_add(win->stats, iterations, reason);
+	return TRUE;
 }
 
 /*uint8_t show_level = pyramid_level;
@@ -34,7 +34,109 @@
 #include "std.h"
 #include "image.h"
 
+/* Status of a point after opticFlowLK_deadline() */
+enum lk_point_status {
+  LK_POINT_TRACKED,   ///< Tracked through all levels
+  LK_POINT_LOST,      ///< Lost on one of the levels
+  LK_POINT_SKIPPED    ///< Not processed because the deadline had passed
+};
+
+/* Reason a point stopped iterating on a pyramid level */
+enum lk_stop_reason {
+  LK_STOP_THRESHOLD,        ///< The step was smaller than the step threshold
+  LK_STOP_MAX_ITERATIONS,   ///< All iterations were used
+  LK_STOP_OSCILLATION,      ///< The step changed direction without getting smaller
+  LK_STOP_STAGNATION,       ///< The step did not get smaller for several iterations
+  LK_STOP_ERROR_INCREASE,   ///< The window difference increased after a step
+  LK_STOP_LOST,             ///< The point was lost (outside the image, bad G-matrix or too large error)
+  LK_STOP_REASONS
+};
+
+/* Extra termination criteria for the iterations of every point, all disabled gives the original behaviour */
+struct lk_convergence_t {
+  bool_t oscillation;             ///< Stop halfway when the step flips direction and is at least half the previous step
+  bool_t error_increase;          ///< Undo the last step and stop when it increased the window difference
+  uint8_t step_halvings;          ///< With error_increase, first retry with half the step this many times
+  uint8_t stagnation_iterations;  ///< Stop when the step was not the smallest so far this many times in a row, 0 to disable
+};
+
+#define LK_STATS_HISTOGRAM_SIZE 32
+
+/* Iteration counts of every point on every pyramid level */
+struct lk_iteration_stats {
+  uint32_t runs;                                ///< Amount of points tracked on a level
+  uint32_t iterations;                          ///< Total amount of iterations
+  uint8_t max_iterations;                       ///< Most iterations done in a single run
+  uint32_t histogram[LK_STATS_HISTOGRAM_SIZE];  ///< Runs per amount of iterations, the last bin holds all longer runs
+  uint32_t stops[LK_STOP_REASONS];              ///< Runs per stop reason
+};
+
+/* Tracking settings of a single pyramid level */
+struct lk_level_params {
+  uint16_t half_window_size;  ///< Half the window size (in both x and y direction) to search inside
+  uint8_t max_iterations;     ///< Maximum amount of iterations to find the new point
+  uint8_t step_threshold;     ///< The threshold at which the iterations should stop
+  const struct lk_convergence_t *convergence;  ///< Extra termination criteria, NULL for only the two above (fixed-point only)
+  struct lk_iteration_stats *stats;            ///< Statistics every point tracked on the level is added to, NULL to not gather them
+};
+
+/* Accumulator widths for a window size and subpixel factor, see opticFlowLK_accumulators() */
+struct lk_accumulators {
+  uint8_t blend_bits;         ///< Bilinear interpolation of the windows: 16 or 32 bit SIMD lanes, 64 bit C
+  uint8_t det_bits;           ///< Determinant of the G-matrix: 32 or 64
+  uint8_t step_bits;          ///< Step numerator (G times b times the subpixel factor): 32 or 64
+};
+
+/* Refresh policy of the templates cached by opticFlowLK_tracks() */
+struct lk_template_policy {
+  uint8_t max_age;            ///< Frames a template is used for before it is taken again, 1 to take it every frame
+  uint16_t max_error;         ///< Mean squared window difference per pixel above which the template is taken again, 0 to disable
+};
+
+struct lk_template;
+
+/* Point tracked over several frames, with the windows, gradients and G-matrices of the frame it was last refreshed in */
+struct lk_track {
+  struct point_t pos;             ///< Current position in subpixels on the full resolution
+  int32_t flow_x;                 ///< X flow of the last opticFlowLK_tracks() call in subpixels
+  int32_t flow_y;                 ///< Y flow of the last opticFlowLK_tracks() call in subpixels
+  bool_t tracked;                 ///< Tracked in the last opticFlowLK_tracks() call
+  struct point_t ref;             ///< Position the templates were taken at (subpixels, full resolution)
+  uint8_t age;                    ///< Frames tracked with the current templates
+  bool_t drifted;                 ///< The window difference exceeded the policy, the templates are taken again next frame
+  uint8_t template_levels;        ///< Amount of allocated templates (pyramid levels)
+  struct lk_template *templates;  ///< Template of every pyramid level
+  uint32_t id;                    ///< Free for the caller to tell tracks apart, 0 after opticFlowLK_track_init()
+};
+
+void opticFlowLK_accumulators(uint16_t half_window_size, uint32_t subpixel_factor, struct lk_accumulators *acc);
+uint8_t opticFlowLK_stats_percentile(const struct lk_iteration_stats *stats, float fraction);
 struct flow_t *opticFlowLK(struct image_t *new_img, struct image_t *old_img, struct point_t *points, uint16_t *points_cnt, uint16_t half_window_size,
                             uint32_t subpixel_factor, uint8_t max_iterations, uint8_t step_threshold, uint16_t max_points, uint8_t pyramid_level);
+struct flow_t *opticFlowLK_pyramids(struct image_t *pyramid_new, struct image_t *pyramid_old, struct point_t *points, uint16_t *points_cnt,
+                            uint16_t half_window_size, uint32_t subpixel_factor, uint8_t max_iterations, uint8_t step_threshold,
+                            uint16_t max_points, uint8_t pyramid_level);
+struct flow_t *opticFlowLK_levels(struct image_t *pyramid_new, struct image_t *pyramid_old, struct point_t *points, uint16_t *points_cnt,
+                            const struct lk_level_params *levels, uint8_t border_size, uint32_t subpixel_factor, uint16_t max_points,
+                            uint8_t pyramid_level);
+bool_t opticFlowLK_tile_order(const struct point_t *points, uint16_t points_cnt, uint16_t tile_size, uint16_t *order);
+struct flow_t *opticFlowLK_tiled(struct image_t *pyramid_new, struct image_t *pyramid_old, struct point_t *points, uint16_t *points_cnt,
+                            const struct lk_level_params *levels, uint8_t border_size, uint32_t subpixel_factor, uint16_t max_points,
+                            uint8_t pyramid_level, uint16_t tile_size);
+uint8_t opticFlowLK_levels_border_size(const struct lk_level_params *levels, uint8_t pyramid_level);
+void opticFlowLK_refine(struct image_t *img_new, struct image_t *img_old, struct flow_t *vectors, uint16_t *vectors_cnt,
+                            const struct lk_level_params *params, uint8_t border_size, uint32_t subpixel_factor);
+struct flow_t *opticFlowLK_deadline(struct image_t *pyramid_new, struct image_t *pyramid_old, struct point_t *points, uint16_t *points_cnt,
+                            uint16_t *order, uint8_t *status, uint32_t deadline_us, const struct lk_level_params *levels,
+                            uint8_t border_size, uint32_t subpixel_factor, uint8_t pyramid_level);
+void opticFlowLK_track_init(struct lk_track *track, struct point_t *point, uint32_t subpixel_factor);
+void opticFlowLK_track_free(struct lk_track *track);
+uint16_t opticFlowLK_tracks(struct image_t *pyramid_new, struct image_t *pyramid_old, struct lk_track *tracks, uint16_t tracks_cnt,
+                            const struct lk_level_params *levels, uint8_t border_size, uint32_t subpixel_factor, uint8_t pyramid_level,
+                            const struct lk_template_policy *policy, uint16_t *templates_taken);
+uint16_t opticFlowLK_tracks_score(struct image_t *pyramid_old, struct lk_track *tracks, uint16_t tracks_cnt,
+                            const struct lk_level_params *levels, uint8_t border_size, uint32_t subpixel_factor, uint8_t pyramid_level,
+                            float *scores);
+uint8_t opticFlowLK_border_size(uint16_t half_window_size);
 
 #endif /* OPTIC_FLOW_INT_H */
@@ -0,0 +1,1012 @@
+/*
+ * lucas_kanade_float.c
+ *
+ *  Created on: Apr 6, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file lucas_kanade_float.c
+ * @brief floating-point pyramidal Lucas-Kanade tracker with the interface of lucas_kanade.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "lucas_kanade_float.h"
+#include "cpu_dispatch.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LKF_X86
+#include <immintrin.h>
+#endif
+
+/* Window buffers of one point, allocated once per call for the largest window.
+ * The rows of I_inner, DX and DY are padded to a multiple of 8 floats, so the vector code needs no scalar tail. */
+struct lkf_windows {
+  float *I;       ///< Padded window in the old image, (size + 2)^2
+  float *I_inner; ///< The inner size^2 part of I, with row stride
+  float *DX;      ///< X gradient of I, with row stride (0 in the padding)
+  float *DY;      ///< Y gradient of I, with row stride (0 in the padding)
+  float *J;       ///< Window in the new image, only used at the image edges
+};
+
+/* Sums of one iteration over the window */
+struct lkf_sums {
+  float b_x, b_y;   ///< The b-vector
+  float error;      ///< Sum of the squared differences
+};
+
+/* One iteration over the window: bilinear sample of J, difference with I and the sums */
+typedef void (*lkf_window_func)(const uint8_t *J_tl, uint16_t img_w, const float *w, const struct lkf_windows *win,
+                                uint16_t size, uint16_t stride, struct lkf_sums *sums);
+
+/**
+ * Window iteration in plain C
+ * @param[in] *J_tl Top left pixel of the window in the new image
+ * @param[in] img_w Width of the new image
+ * @param[in] *w The bilinear weights (top left, top right, bottom left, bottom right)
+ * @param[in] *win The old window and its gradients
+ * @param[in] size Width and height of the window
+ * @param[in] stride Row stride of the window buffers
+ * @param[out] *sums The sums
+ */
+static void lkf_window_c(const uint8_t *J_tl, uint16_t img_w, const float *w, const struct lkf_windows *win,
+                         uint16_t size, uint16_t stride, struct lkf_sums *sums)
+{
+  float b_x = 0, b_y = 0, error = 0;
+
+  for (uint16_t j = 0; j < size; j++) {
+    const uint8_t *row0 = &J_tl[j * img_w];
+    const uint8_t *row1 = row0 + img_w;
+    for (uint16_t i = 0; i < size; i++) {
+      float J = w[0] * row0[i] + w[1] * row0[i + 1] + w[2] * row1[i] + w[3] * row1[i + 1];
+      float diff = win->I_inner[j * stride + i] - J;
+      b_x += diff * win->DX[j * stride + i];
+      b_y += diff * win->DY[j * stride + i];
+      error += diff * diff;
+    }
+  }
+
+  sums->b_x = b_x;
+  sums->b_y = b_y;
+  sums->error = error;
+}
+
+#ifdef LKF_X86
+__attribute__((target("avx2,fma")))
+static inline float lkf_hsum_avx2(__m256 v)
+{
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 lkf_load8_avx2(const uint8_t *p)
+{
+  return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p)));
+}
+
+/**
+ * Window iteration with AVX2 and FMA, 8 pixels at a time, same parameters as lkf_window_c().
+ * The padding lanes of every row read up to 8 pixels past the window, the caller makes sure these
+ * are inside the image, and they are masked out of the sums.
+ */
+__attribute__((target("avx2,fma")))
+static void lkf_window_avx2(const uint8_t *J_tl, uint16_t img_w, const float *w, const struct lkf_windows *win,
+                            uint16_t size, uint16_t stride, struct lkf_sums *sums)
+{
+  __m256 w00 = _mm256_set1_ps(w[0]), w01 = _mm256_set1_ps(w[1]);
+  __m256 w10 = _mm256_set1_ps(w[2]), w11 = _mm256_set1_ps(w[3]);
+  __m256 b_x = _mm256_setzero_ps(), b_y = _mm256_setzero_ps(), error = _mm256_setzero_ps();
+
+  // Lanes of the last block of a row that are inside the window
+  __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256 tail = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(size - (stride - 8)), lane));
+
+  for (uint16_t j = 0; j < size; j++) {
+    const uint8_t *row0 = &J_tl[j * img_w];
+    const uint8_t *row1 = row0 + img_w;
+    const float *I = &win->I_inner[j * stride];
+    const float *DX = &win->DX[j * stride];
+    const float *DY = &win->DY[j * stride];
+
+    for (uint16_t i = 0; i < stride; i += 8) {
+      __m256 J = _mm256_mul_ps(w00, lkf_load8_avx2(row0 + i));
+      J = _mm256_fmadd_ps(w01, lkf_load8_avx2(row0 + i + 1), J);
+      J = _mm256_fmadd_ps(w10, lkf_load8_avx2(row1 + i), J);
+      J = _mm256_fmadd_ps(w11, lkf_load8_avx2(row1 + i + 1), J);
+
+      __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(I + i), J);
+      if (i + 8 == stride) {
+        diff = _mm256_and_ps(diff, tail);
+      }
+      b_x = _mm256_fmadd_ps(diff, _mm256_loadu_ps(DX + i), b_x);
+      b_y = _mm256_fmadd_ps(diff, _mm256_loadu_ps(DY + i), b_y);
+      error = _mm256_fmadd_ps(diff, diff, error);
+    }
+  }
+
+  sums->b_x = lkf_hsum_avx2(b_x);
+  sums->b_y = lkf_hsum_avx2(b_y);
+  sums->error = lkf_hsum_avx2(error);
+}
+#endif
+
+/**
+ * Bilinear sample of a window, pixels outside the image are clamped to the edge
+ * @param[in] *img The padded pyramid level
+ * @param[in] x, y Top left of the window in padded pixel coordinates
+ * @param[in] size Width and height of the window
+ * @param[out] *out The window, size^2 floats
+ */
+static void lkf_sample_window(struct image_t *img, float x, float y, uint16_t size, float *out)
+{
+  uint8_t *buf = (uint8_t *)img->buf;
+  int32_t x0 = (int32_t)floorf(x), y0 = (int32_t)floorf(y);
+  float ax = x - x0, ay = y - y0;
+
+  // Inside the image no pixel needs clamping
+  if (x0 >= 0 && y0 >= 0 && x0 + size < img->w && y0 + size < img->h) {
+    float w00 = (1 - ax) * (1 - ay), w01 = ax * (1 - ay), w10 = (1 - ax) * ay, w11 = ax * ay;
+    for (uint16_t j = 0; j < size; j++) {
+      const uint8_t *row0 = &buf[(y0 + j) * img->w + x0];
+      const uint8_t *row1 = row0 + img->w;
+      for (uint16_t i = 0; i < size; i++) {
+        out[j * size + i] = w00 * row0[i] + w01 * row0[i + 1] + w10 * row1[i] + w11 * row1[i + 1];
+      }
+    }
+    return;
+  }
+
+  for (uint16_t j = 0; j < size; j++) {
+    int32_t r0 = y0 + j, r1 = r0 + 1;
+    Bound(r0, 0, img->h - 1);
+    Bound(r1, 0, img->h - 1);
+
+    for (uint16_t i = 0; i < size; i++) {
+      int32_t c0 = x0 + i, c1 = c0 + 1;
+      Bound(c0, 0, img->w - 1);
+      Bound(c1, 0, img->w - 1);
+
+      out[j * size + i] = (1 - ax) * (1 - ay) * buf[r0 * img->w + c0] + ax * (1 - ay) * buf[r0 * img->w + c1]
+                          + (1 - ax) * ay * buf[r1 * img->w + c0] + ax * ay * buf[r1 * img->w + c1];
+    }
+  }
+}
+
+/**
+ * Track a single point on one pyramid level
+ * @param[in] *img_new, *img_old The padded pyramid levels
+ * @param[in] *win The window buffers
+ * @param[in] window The window iteration function to use
+ * @param[in] pos_x, pos_y The position in the old level in pixels
+ * @param[in,out] *flow_x, *flow_y The initial flow guess, returns the tracked flow (pixels)
+ * @param[in] *params The settings of this level
+ * @param[in] border_size The padding of the pyramid levels
+ * @return TRUE if the point was tracked
+ */
+static bool_t lkf_track_point(struct image_t *img_new, struct image_t *img_old, struct lkf_windows *win, lkf_window_func window,
+                              float pos_x, float pos_y, float *flow_x, float *flow_y, const struct lk_level_params *params,
+                              uint8_t border_size)
+{
+  uint16_t hw = params->half_window_size;
+  uint16_t size = 2 * hw + 1;
+  uint16_t padded = size + 2;
+  uint16_t stride = (size + 7) & ~7;
+  float max_x = img_new->w - 1 - 2 * border_size;
+  float max_y = img_new->h - 1 - 2 * border_size;
+  float step_threshold = params->step_threshold / 100.f;
+  float error_threshold = (10 * 10) * (size * size);
+
+  if (pos_x + *flow_x < 0 || pos_x + *flow_x > max_x || pos_y + *flow_y < 0 || pos_y + *flow_y > max_y) {
+    return FALSE;
+  }
+
+  // (1) the padded window in the old image and (2) its gradients, as real derivatives
+  lkf_sample_window(img_old, pos_x + border_size - hw - 1, pos_y + border_size - hw - 1, padded, win->I);
+
+  // (3) the G-matrix
+  float G_xx = 0, G_xy = 0, G_yy = 0;
+  for (uint16_t j = 0; j < size; j++) {
+    for (uint16_t i = 0; i < stride; i++) {
+      if (i >= size) {
+        win->I_inner[j * stride + i] = 0;
+        win->DX[j * stride + i] = 0;
+        win->DY[j * stride + i] = 0;
+        continue;
+      }
+
+      float *c = &win->I[(j + 1) * padded + i + 1];
+      float dx = (c[1] - c[-1]) * 0.5f;
+      float dy = (c[padded] - c[-padded]) * 0.5f;
+      win->I_inner[j * stride + i] = c[0];
+      win->DX[j * stride + i] = dx;
+      win->DY[j * stride + i] = dy;
+      G_xx += dx * dx;
+      G_xy += dx * dy;
+      G_yy += dy * dy;
+    }
+  }
+
+  float det = G_xx * G_yy - G_xy * G_xy;
+  if (det < 1.f) {
+    return FALSE;
+  }
+  float inv_det = 1.f / det;
+
+  // (4) iterate
+  for (uint8_t it = params->max_iterations; it--; ) {
+    if (pos_x + *flow_x < 0 || pos_x + *flow_x > max_x || pos_y + *flow_y < 0 || pos_y + *flow_y > max_y) {
+      return FALSE;
+    }
+
+    // Top left of J in padded coordinates, every pixel of J shares the bilinear weights
+    float x = pos_x + *flow_x + border_size - hw;
+    float y = pos_y + *flow_y + border_size - hw;
+    int32_t x0 = (int32_t)floorf(x), y0 = (int32_t)floorf(y);
+    float ax = x - x0, ay = y - y0;
+    float w[4] = { (1 - ax) * (1 - ay), ax * (1 - ay), (1 - ax) * ay, ax * ay };
+
+    struct lkf_sums sums;
+    if (x0 + size + 1 <= img_new->w && y0 + size + 2 <= img_new->h) {
+      // Inside the image, with one row to spare for the reads past the window in the row padding
+      window((uint8_t *)img_new->buf + y0 * img_new->w + x0, img_new->w, w, win, size, stride, &sums);
+    } else {
+      // At the very edge sample with clamping
+      lkf_sample_window(img_new, x, y, size, win->J);
+      sums.b_x = sums.b_y = sums.error = 0;
+      for (uint16_t j = 0; j < size; j++) {
+        for (uint16_t i = 0; i < size; i++) {
+          float diff = win->I_inner[j * stride + i] - win->J[j * size + i];
+          sums.b_x += diff * win->DX[j * stride + i];
+          sums.b_y += diff * win->DY[j * stride + i];
+          sums.error += diff * diff;
+        }
+      }
+    }
+
+    if (sums.error > error_threshold && it < params->max_iterations / 2) {
+      return FALSE;
+    }
+
+    float step_x = (G_yy * sums.b_x - G_xy * sums.b_y) * inv_det;
+    float step_y = (G_xx * sums.b_y - G_xy * sums.b_x) * inv_det;
+    *flow_x += step_x;
+    *flow_y += step_y;
+
+    if (fabsf(step_x) + fabsf(step_y) < step_threshold) {
+      break;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Point-parallel engine: a group of points is tracked at once, one point per SIMD lane. The points of a
+ * level are queued and a lane takes the next point as soon as its point converged or got lost, so the lanes
+ * stay busy although every point needs a different amount of iterations. */
+#define LKL_MAX_LANES 16
+
+enum lkl_state {
+  LKL_FREE,       ///< No point in the lane
+  LKL_ACTIVE,     ///< Still iterating on this level
+  LKL_DONE,       ///< Converged or out of iterations on this level
+  LKL_LOST        ///< Lost, not tracked on the following levels
+};
+
+/* A group of points in SoA layout, every array has one entry per lane */
+struct lkl_group {
+  uint8_t lanes;                      ///< Lanes of the group, 8 for AVX2 and 16 for AVX-512
+  uint16_t point[LKL_MAX_LANES];      ///< Index of the point in the input
+  float pos_x[LKL_MAX_LANES];         ///< Position on the current level in pixels
+  float pos_y[LKL_MAX_LANES];
+  float flow_x[LKL_MAX_LANES];        ///< Flow on the current level in pixels
+  float flow_y[LKL_MAX_LANES];
+  float G_xx[LKL_MAX_LANES];          ///< The G-matrix
+  float G_xy[LKL_MAX_LANES];
+  float G_yy[LKL_MAX_LANES];
+  float inv_det[LKL_MAX_LANES];       ///< 1 / det(G)
+  int32_t offset[LKL_MAX_LANES];      ///< Top left pixel of J in the new level (y0 * w + x0)
+  float ax[LKL_MAX_LANES];            ///< Bilinear weights of J
+  float ay[LKL_MAX_LANES];
+  float b_x[LKL_MAX_LANES];           ///< Sums of the last window pass
+  float b_y[LKL_MAX_LANES];
+  float error[LKL_MAX_LANES];
+  uint8_t iterations[LKL_MAX_LANES];  ///< Iterations left
+  uint8_t state[LKL_MAX_LANES];       ///< enum lkl_state
+  float *I;                           ///< Windows in the old level, pixel k of lane l at [k * lanes + l]
+  float *DX;                          ///< X gradients, same layout
+  float *DY;                          ///< Y gradients, same layout
+  float *padded;                      ///< Padded window of one lane while sampling I
+  float *J;                           ///< Window of one lane at the image edge
+};
+
+/* One iteration over the windows of the lanes in mask: bilinear sample of J, difference with I and the sums.
+ * Only called for lanes whose window rows, read in blocks of 16 pixels (LKL_ROW_PIXELS), and the row below the
+ * window are inside the level. */
+typedef void (*lkl_window_func)(const uint8_t *buf, uint16_t img_w, struct lkl_group *g, uint16_t size, uint32_t mask);
+
+/* Sample the padded windows in the old level for the lanes in mask, with their gradients and G-matrices.
+ * g->offset, g->ax and g->ay hold the top left of every padded window, which is inside the level like the
+ * windows of lkl_window_func. */
+typedef void (*lkl_start_func)(const uint8_t *buf, uint16_t img_w, struct lkl_group *g, uint16_t size, uint32_t mask);
+
+/* Pixels of a row read for a window of the given size: blocks of 16 that overlap by one */
+#define LKL_ROW_PIXELS(size) (15 * (((size) - 1) / 15) + 16)
+
+#ifdef LKF_X86
+/**
+ * Transpose 16 pixels of a row of 8 lanes, so every pixel has its 8 lanes next to each other
+ * @param[in] *rows The 16 pixels of every lane
+ * @param[out] *cols Pixels 2c and 2c+1 of all lanes in cols[c] (lanes 0-7 in the low, lanes 0-7 in the high half)
+ */
+static inline void lkl_transpose8x16(const __m128i *rows, __m128i *cols)
+{
+  __m128i a[8], b[8];
+  for (uint8_t l = 0; l < 4; l++) {
+    a[2 * l] = _mm_unpacklo_epi8(rows[2 * l], rows[2 * l + 1]);
+    a[2 * l + 1] = _mm_unpackhi_epi8(rows[2 * l], rows[2 * l + 1]);
+  }
+  for (uint8_t h = 0; h < 2; h++) {
+    b[4 * h] = _mm_unpacklo_epi16(a[4 * h], a[4 * h + 2]);
+    b[4 * h + 1] = _mm_unpackhi_epi16(a[4 * h], a[4 * h + 2]);
+    b[4 * h + 2] = _mm_unpacklo_epi16(a[4 * h + 1], a[4 * h + 3]);
+    b[4 * h + 3] = _mm_unpackhi_epi16(a[4 * h + 1], a[4 * h + 3]);
+  }
+  for (uint8_t c = 0; c < 4; c++) {
+    cols[2 * c] = _mm_unpacklo_epi32(b[c], b[c + 4]);
+    cols[2 * c + 1] = _mm_unpackhi_epi32(b[c], b[c + 4]);
+  }
+}
+
+/**
+ * Load a block of 16 pixels of a window row for 8 lanes, starting at lane first
+ * @param[in] *buf The new level
+ * @param[in] *offset Start of the block for every lane, the lanes outside mask read the block of lane safe
+ */
+static inline void lkl_load_rows8(const uint8_t *buf, const int32_t *offset, uint32_t mask, uint8_t first, int32_t safe,
+                                  int32_t add, __m128i *rows)
+{
+  for (uint8_t l = 0; l < 8; l++) {
+    int32_t o = (mask & (1u << (first + l))) ? offset[first + l] : safe;
+    rows[l] = _mm_loadu_si128((const __m128i *)&buf[o + add]);
+  }
+}
+
+/**
+ * Horizontal bilinear blends of a window row for 8 lanes
+ * @param[in] *buf The level
+ * @param[in] *offset Start of the row for every lane, the lanes outside mask read the row of lane safe
+ * @param[in] first The first of the 8 lanes
+ * @param[in] add Offset of the row from the window top left
+ * @param[in] width Amount of blends
+ * @param[in] ax The horizontal weight of every lane
+ * @param[out] *out The blends, one vector per pixel
+ */
+__attribute__((target("avx2,fma")))
+static inline void lkl_blend_row8(const uint8_t *buf, const int32_t *offset, uint32_t mask, uint8_t first, int32_t safe,
+                                  int32_t add, uint16_t width, __m256 ax, __m256 *out)
+{
+  for (uint16_t c = 0; c < width; c += 15) {
+    __m128i rows[8], cols[8];
+    lkl_load_rows8(buf, offset, mask, first, safe, add + c, rows);
+    lkl_transpose8x16(rows, cols);
+
+    __m256 p = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(cols[0]));
+    for (uint16_t i = 0; i < 15 && c + i < width; i++) {
+      __m128i next = (i & 1) ? cols[(i + 1) / 2] : _mm_unpackhi_epi64(cols[i / 2], cols[i / 2]);
+      __m256 p_next = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(next));
+      out[c + i] = _mm256_fmadd_ps(ax, _mm256_sub_ps(p_next, p), p);
+      p = p_next;
+    }
+  }
+}
+
+/**
+ * Window iteration of 8 lanes with AVX2 and FMA. The rows of the lanes are loaded in blocks of 16 pixels and
+ * transposed, so every pixel is one vector with a lane per point. Every row is loaded once for the two window
+ * rows it is part of.
+ */
+__attribute__((target("avx2,fma")))
+static void lkl_window_avx2(const uint8_t *buf, uint16_t img_w, struct lkl_group *g, uint16_t size, uint32_t mask)
+{
+  int32_t safe = g->offset[__builtin_ctz(mask)];
+  __m256 ax = _mm256_loadu_ps(g->ax), ay = _mm256_loadu_ps(g->ay);
+  __m256 b_x = _mm256_setzero_ps(), b_y = _mm256_setzero_ps(), error = _mm256_setzero_ps();
+
+  // Horizontal blends of the previous and the current row
+  __m256 blends[2][size];
+  __m256 *prev = blends[0], *cur = blends[1];
+
+  for (uint16_t r = 0; r <= size; r++) {
+    lkl_blend_row8(buf, g->offset, mask, 0, safe, r * img_w, size, ax, cur);
+
+    if (r > 0) {
+      uint32_t k = (r - 1) * size * 8;
+      for (uint16_t i = 0; i < size; i++, k += 8) {
+        __m256 J = _mm256_fmadd_ps(ay, _mm256_sub_ps(cur[i], prev[i]), prev[i]);
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(&g->I[k]), J);
+        b_x = _mm256_fmadd_ps(diff, _mm256_loadu_ps(&g->DX[k]), b_x);
+        b_y = _mm256_fmadd_ps(diff, _mm256_loadu_ps(&g->DY[k]), b_y);
+        error = _mm256_fmadd_ps(diff, diff, error);
+      }
+    }
+
+    __m256 *swap = prev;
+    prev = cur;
+    cur = swap;
+  }
+
+  // The lanes outside the mask are overwritten by the caller
+  _mm256_storeu_ps(g->b_x, b_x);
+  _mm256_storeu_ps(g->b_y, b_y);
+  _mm256_storeu_ps(g->error, error);
+}
+
+/**
+ * Start of the lanes in mask with AVX2 and FMA, 8 lanes at a time (also for the 16 lanes of AVX-512).
+ * The padded windows are sampled like in lkl_window_avx2(), the samples are kept for 3 rows to get the
+ * gradients of the middle one. Only the lanes in mask are written.
+ */
+__attribute__((target("avx2,fma")))
+static void lkl_start_avx2(const uint8_t *buf, uint16_t img_w, struct lkl_group *g, uint16_t size, uint32_t mask)
+{
+  uint16_t padded = size + 2;
+  uint8_t lanes = g->lanes;
+  __m256i lane_bit = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  __m256 half = _mm256_set1_ps(0.5f);
+
+  for (uint8_t first = 0; first < lanes; first += 8) {
+    uint32_t mask8 = (mask >> first) & 0xFF;
+    if (mask8 == 0) {
+      continue;
+    }
+    int32_t safe = g->offset[first + __builtin_ctz(mask8)];
+    __m256i store = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask8), lane_bit), lane_bit);
+    __m256 ax = _mm256_loadu_ps(&g->ax[first]), ay = _mm256_loadu_ps(&g->ay[first]);
+    __m256 G_xx = _mm256_setzero_ps(), G_xy = _mm256_setzero_ps(), G_yy = _mm256_setzero_ps();
+
+    __m256 blends[2][padded], samples[3][padded];
+    __m256 *prev = blends[0], *cur = blends[1];
+
+    for (uint16_t r = 0; r <= padded; r++) {
+      lkl_blend_row8(buf, g->offset, mask, first, safe, r * img_w, padded, ax, cur);
+
+      if (r > 0) {
+        __m256 *down = samples[(r - 1) % 3];
+        for (uint16_t i = 0; i < padded; i++) {
+          down[i] = _mm256_fmadd_ps(ay, _mm256_sub_ps(cur[i], prev[i]), prev[i]);
+        }
+
+        // With 3 sample rows the gradients of the middle one are known
+        if (r >= 3) {
+          __m256 *up = samples[(r - 3) % 3], *mid = samples[(r - 2) % 3];
+          uint32_t k = (r - 3) * size * lanes + first;
+          for (uint16_t i = 0; i < size; i++, k += lanes) {
+            __m256 dx = _mm256_mul_ps(_mm256_sub_ps(mid[i + 2], mid[i]), half);
+            __m256 dy = _mm256_mul_ps(_mm256_sub_ps(down[i + 1], up[i + 1]), half);
+            _mm256_maskstore_ps(&g->I[k], store, mid[i + 1]);
+            _mm256_maskstore_ps(&g->DX[k], store, dx);
+            _mm256_maskstore_ps(&g->DY[k], store, dy);
+            G_xx = _mm256_fmadd_ps(dx, dx, G_xx);
+            G_xy = _mm256_fmadd_ps(dx, dy, G_xy);
+            G_yy = _mm256_fmadd_ps(dy, dy, G_yy);
+          }
+        }
+      }
+
+      __m256 *swap = prev;
+      prev = cur;
+      cur = swap;
+    }
+
+    float xx[8], xy[8], yy[8];
+    _mm256_storeu_ps(xx, G_xx);
+    _mm256_storeu_ps(xy, G_xy);
+    _mm256_storeu_ps(yy, G_yy);
+    for (uint8_t l = 0; l < 8; l++) {
+      if (mask8 & (1u << l)) {
+        g->G_xx[first + l] = xx[l];
+        g->G_xy[first + l] = xy[l];
+        g->G_yy[first + l] = yy[l];
+      }
+    }
+  }
+}
+
+/**
+ * Window iteration of 16 lanes with AVX-512, same as lkl_window_avx2() with the lanes transposed in two halves
+ */
+__attribute__((target("avx512f")))
+static void lkl_window_avx512(const uint8_t *buf, uint16_t img_w, struct lkl_group *g, uint16_t size, uint32_t mask)
+{
+  int32_t safe = g->offset[__builtin_ctz(mask)];
+  __m512 ax = _mm512_loadu_ps(g->ax), ay = _mm512_loadu_ps(g->ay);
+  __m512 b_x = _mm512_setzero_ps(), b_y = _mm512_setzero_ps(), error = _mm512_setzero_ps();
+
+  __m512 blends[2][size];
+  __m512 *prev = blends[0], *cur = blends[1];
+
+  for (uint16_t r = 0; r <= size; r++) {
+    for (uint16_t c = 0; c < size; c += 15) {
+      __m128i rows[8], lo[8], hi[8];
+      lkl_load_rows8(buf, g->offset, mask, 0, safe, r * img_w + c, rows);
+      lkl_transpose8x16(rows, lo);
+      lkl_load_rows8(buf, g->offset, mask, 8, safe, r * img_w + c, rows);
+      lkl_transpose8x16(rows, hi);
+
+      __m512 p = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_unpacklo_epi64(lo[0], hi[0])));
+      for (uint16_t i = 0; i < 15 && c + i < size; i++) {
+        uint16_t n = (i + 1) / 2;
+        __m128i next = (i & 1) ? _mm_unpacklo_epi64(lo[n], hi[n]) : _mm_unpackhi_epi64(lo[n], hi[n]);
+        __m512 p_next = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(next));
+        cur[c + i] = _mm512_fmadd_ps(ax, _mm512_sub_ps(p_next, p), p);
+        p = p_next;
+      }
+    }
+
+    if (r > 0) {
+      uint32_t k = (r - 1) * size * 16;
+      for (uint16_t i = 0; i < size; i++, k += 16) {
+        __m512 J = _mm512_fmadd_ps(ay, _mm512_sub_ps(cur[i], prev[i]), prev[i]);
+        __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(&g->I[k]), J);
+        b_x = _mm512_fmadd_ps(diff, _mm512_loadu_ps(&g->DX[k]), b_x);
+        b_y = _mm512_fmadd_ps(diff, _mm512_loadu_ps(&g->DY[k]), b_y);
+        error = _mm512_fmadd_ps(diff, diff, error);
+      }
+    }
+
+    __m512 *swap = prev;
+    prev = cur;
+    cur = swap;
+  }
+
+  _mm512_storeu_ps(g->b_x, b_x);
+  _mm512_storeu_ps(g->b_y, b_y);
+  _mm512_storeu_ps(g->error, error);
+}
+#endif
+
+/**
+ * The padded window of one lane in the old level, its gradients and G-matrix, in plain C with clamping at the edges
+ * @param[in] *img_old The padded pyramid level of the old image
+ * @param[in,out] *g The group
+ * @param[in] l The lane
+ * @param[in] size Width and height of the window
+ * @param[in] x, y Top left of the padded window in padded pixel coordinates
+ */
+static void lkl_start_lane_c(struct image_t *img_old, struct lkl_group *g, uint8_t l, uint16_t size, float x, float y)
+{
+  uint16_t padded = size + 2;
+  uint8_t lanes = g->lanes;
+  lkf_sample_window(img_old, x, y, padded, g->padded);
+
+  float G_xx = 0, G_xy = 0, G_yy = 0;
+  for (uint16_t j = 0; j < size; j++) {
+    for (uint16_t i = 0; i < size; i++) {
+      float *c = &g->padded[(j + 1) * padded + i + 1];
+      float dx = (c[1] - c[-1]) * 0.5f;
+      float dy = (c[padded] - c[-padded]) * 0.5f;
+      uint32_t k = (j * size + i) * lanes + l;
+      g->I[k] = c[0];
+      g->DX[k] = dx;
+      g->DY[k] = dy;
+      G_xx += dx * dx;
+      G_xy += dx * dy;
+      G_yy += dy * dy;
+    }
+  }
+  g->G_xx[l] = G_xx;
+  g->G_xy[l] = G_xy;
+  g->G_yy[l] = G_yy;
+}
+
+/**
+ * Start tracking the points in the lanes of mask, their position and flow have to be set.
+ * The lanes become active, or lost if their G-matrix is singular.
+ * @param[in] *img_old The padded pyramid level of the old image
+ * @param[in,out] *g The group
+ * @param[in] start The vector start for the lanes with the window inside the level
+ * @param[in] mask The lanes to start
+ * @param[in] *params The settings of this level
+ * @param[in] border_size The padding of the pyramid levels
+ */
+static void lkl_start(struct image_t *img_old, struct lkl_group *g, lkl_start_func start, uint32_t mask,
+                      const struct lk_level_params *params, uint8_t border_size)
+{
+  uint16_t hw = params->half_window_size;
+  uint16_t size = 2 * hw + 1;
+  uint16_t padded = size + 2;
+
+  uint32_t vector = 0;
+  for (uint8_t l = 0; l < g->lanes; l++) {
+    if (!(mask & (1u << l))) {
+      continue;
+    }
+
+    float x = g->pos_x[l] + border_size - hw - 1;
+    float y = g->pos_y[l] + border_size - hw - 1;
+    int32_t x0 = (int32_t)floorf(x), y0 = (int32_t)floorf(y);
+    if (x0 >= 0 && y0 >= 0 && x0 + LKL_ROW_PIXELS(padded) <= img_old->w && y0 + padded + 1 <= img_old->h) {
+      g->offset[l] = y0 * img_old->w + x0;
+      g->ax[l] = x - x0;
+      g->ay[l] = y - y0;
+      vector |= 1u << l;
+    } else {
+      lkl_start_lane_c(img_old, g, l, size, x, y);
+    }
+  }
+  if (vector != 0) {
+    start((const uint8_t *)img_old->buf, img_old->w, g, size, vector);
+  }
+
+  for (uint8_t l = 0; l < g->lanes; l++) {
+    if (!(mask & (1u << l))) {
+      continue;
+    }
+
+    float det = g->G_xx[l] * g->G_yy[l] - g->G_xy[l] * g->G_xy[l];
+    if (det < 1.f) {
+      g->state[l] = LKL_LOST;
+      continue;
+    }
+    g->inv_det[l] = 1.f / det;
+    g->iterations[l] = params->max_iterations;
+    g->state[l] = LKL_ACTIVE;
+  }
+}
+
+/**
+ * One iteration of all active lanes, same steps and termination as lkf_track_point()
+ * @param[in] *img_new The padded pyramid level of the new image
+ * @param[in,out] *g The group, lanes that converged or got lost change state
+ * @param[in] window The window iteration function for the lanes
+ * @param[in] *params The settings of this level
+ * @param[in] border_size The padding of the pyramid levels
+ * @param[in] max_x, max_y The largest position inside the level
+ */
+static void lkl_iterate(struct image_t *img_new, struct lkl_group *g, lkl_window_func window, const struct lk_level_params *params,
+                        uint8_t border_size, float max_x, float max_y)
+{
+  uint16_t hw = params->half_window_size;
+  uint16_t size = 2 * hw + 1;
+  uint8_t lanes = g->lanes;
+  float step_threshold = params->step_threshold / 100.f;
+  float error_threshold = (10 * 10) * (size * size);
+
+  // Bilinear weights of every lane, the lanes with J inside the level go through the vector code
+  uint32_t active = 0, vector = 0;
+  for (uint8_t l = 0; l < lanes; l++) {
+    if (g->state[l] != LKL_ACTIVE) {
+      continue;
+    }
+    if (g->iterations[l] == 0) {
+      g->state[l] = LKL_DONE;
+      continue;
+    }
+
+    float x = g->pos_x[l] + g->flow_x[l], y = g->pos_y[l] + g->flow_y[l];
+    if (x < 0 || x > max_x || y < 0 || y > max_y) {
+      g->state[l] = LKL_LOST;
+      continue;
+    }
+    active |= 1u << l;
+
+    x += border_size - hw;
+    y += border_size - hw;
+    int32_t x0 = (int32_t)floorf(x), y0 = (int32_t)floorf(y);
+    g->ax[l] = x - x0;
+    g->ay[l] = y - y0;
+    if (x0 >= 0 && y0 >= 0 && x0 + LKL_ROW_PIXELS(size) <= img_new->w && y0 + size + 1 <= img_new->h) {
+      g->offset[l] = y0 * img_new->w + x0;
+      vector |= 1u << l;
+    }
+  }
+
+  if (vector != 0) {
+    window((const uint8_t *)img_new->buf, img_new->w, g, size, vector);
+  }
+
+  for (uint8_t l = 0; l < lanes; l++) {
+    if (!(active & (1u << l))) {
+      continue;
+    }
+    uint8_t it = --g->iterations[l];
+
+    // At the very edge sample with clamping
+    if (!(vector & (1u << l))) {
+      lkf_sample_window(img_new, g->pos_x[l] + g->flow_x[l] + border_size - hw, g->pos_y[l] + g->flow_y[l] + border_size - hw,
+                        size, g->J);
+      g->b_x[l] = g->b_y[l] = g->error[l] = 0;
+      for (uint32_t k = 0; k < (uint32_t)size * size; k++) {
+        float diff = g->I[k * lanes + l] - g->J[k];
+        g->b_x[l] += diff * g->DX[k * lanes + l];
+        g->b_y[l] += diff * g->DY[k * lanes + l];
+        g->error[l] += diff * diff;
+      }
+    }
+
+    if (g->error[l] > error_threshold && it < params->max_iterations / 2) {
+      g->state[l] = LKL_LOST;
+      continue;
+    }
+
+    float step_x = (g->G_yy[l] * g->b_x[l] - g->G_xy[l] * g->b_y[l]) * g->inv_det[l];
+    float step_y = (g->G_xx[l] * g->b_y[l] - g->G_xy[l] * g->b_x[l]) * g->inv_det[l];
+    g->flow_x[l] += step_x;
+    g->flow_y[l] += step_y;
+
+    if (fabsf(step_x) + fabsf(step_y) < step_threshold) {
+      g->state[l] = LKL_DONE;
+    }
+  }
+}
+
+/**
+ * Same as opticFlowLK(), in floating point. The pyramids are built here.
+ */
+struct flow_t *opticFlowLK_float(struct image_t *new_img, struct image_t *old_img, struct point_t *points, uint16_t *points_cnt,
+                                 uint16_t half_window_size, uint32_t subpixel_factor, uint8_t max_iterations, uint8_t step_threshold,
+                                 uint16_t max_points, uint8_t pyramid_level)
+{
+  uint8_t border_size = opticFlowLK_border_size(half_window_size);
+  struct image_t pyramid_old[pyramid_level + 1];
+  struct image_t pyramid_new[pyramid_level + 1];
+  pyramid_build(old_img, pyramid_old, pyramid_level, border_size);
+  pyramid_build(new_img, pyramid_new, pyramid_level, border_size);
+
+  struct lk_level_params levels[pyramid_level + 1];
+  for (uint8_t i = 0; i <= pyramid_level; i++) {
+    levels[i].half_window_size = half_window_size;
+    levels[i].max_iterations = max_iterations;
+    levels[i].step_threshold = step_threshold;
+    levels[i].convergence = NULL;
+    levels[i].stats = NULL;
+  }
+
+  struct flow_t *vectors = opticFlowLK_float_levels(pyramid_new, pyramid_old, points, points_cnt, levels, border_size,
+                           subpixel_factor, max_points, pyramid_level);
+
+  for (uint8_t i = 0; i <= pyramid_level; i++) {
+    image_free(&pyramid_old[i]);
+    image_free(&pyramid_new[i]);
+  }
+  return vectors;
+}
+
+/**
+ * Same as opticFlowLK_levels(), in floating point. Every point is taken through all levels before the
+ * next one, the flow is kept in float pixels and only converted to subpixels for the result.
+ */
+struct flow_t *opticFlowLK_float_levels(struct image_t *pyramid_new, struct image_t *pyramid_old, struct point_t *points, uint16_t *points_cnt,
+                                        const struct lk_level_params *levels, uint8_t border_size, uint32_t subpixel_factor,
+                                        uint16_t max_points, uint8_t pyramid_level)
+{
+  lkf_window_func window = lkf_window_c;
+#ifdef LKF_X86
+  if (cpu_detect_level() >= CPU_LEVEL_AVX2) {
+    window = lkf_window_avx2;
+  }
+#endif
+
+  // Buffers for the largest window
+  uint16_t max_size = 0;
+  for (uint8_t i = 0; i <= pyramid_level; i++) {
+    if (2 * levels[i].half_window_size + 1 > max_size) {
+      max_size = 2 * levels[i].half_window_size + 1;
+    }
+  }
+  uint16_t max_stride = (max_size + 7) & ~7;
+  struct lkf_windows win;
+  win.I = malloc(sizeof(float) * (max_size + 2) * (max_size + 2));
+  win.I_inner = malloc(sizeof(float) * max_size * max_stride);
+  win.DX = malloc(sizeof(float) * max_size * max_stride);
+  win.DY = malloc(sizeof(float) * max_size * max_stride);
+  win.J = malloc(sizeof(float) * max_size * max_size);
+
+  struct flow_t *vectors = malloc(sizeof(struct flow_t) * max_points);
+  uint16_t points_orig = *points_cnt;
+  float skip_points = (points_orig > max_points) ? (float)points_orig / max_points : 1;
+  uint16_t new_p = 0;
+
+  for (uint16_t i = 0; i < max_points && i < points_orig; i++) {
+    uint16_t p = i * skip_points;
+    float flow_x = 0, flow_y = 0;
+    bool_t tracked = TRUE;
+
+    for (int8_t LVL = pyramid_level; LVL != -1 && tracked; LVL--) {
+      float scale = 1.f / (1 << LVL);
+      tracked = lkf_track_point(&pyramid_new[LVL], &pyramid_old[LVL], &win, window, points[p].x * scale, points[p].y * scale,
+                                &flow_x, &flow_y, &levels[LVL], border_size);
+      if (LVL != 0) {
+        flow_x *= 2;
+        flow_y *= 2;
+      }
+    }
+
+    if (tracked) {
+      vectors[new_p].pos.x = points[p].x * subpixel_factor;
+      vectors[new_p].pos.y = points[p].y * subpixel_factor;
+      vectors[new_p].flow_x = (int32_t)lroundf(flow_x * subpixel_factor);
+      vectors[new_p].flow_y = (int32_t)lroundf(flow_y * subpixel_factor);
+      new_p++;
+    }
+  }
+  *points_cnt = new_p;
+
+  free(win.I);
+  free(win.I_inner);
+  free(win.DX);
+  free(win.DY);
+  free(win.J);
+  return vectors;
+}
+
+/**
+ * Same as opticFlowLK_float_levels(), with the point-parallel engine: 8 (AVX2) or 16 (AVX-512) points are
+ * tracked at once, one point per lane, with the lane state in SoA layout and the lanes without an active
+ * point masked out. The levels are done one after the other for all points. With small windows this keeps
+ * all lanes busy where the pixel-parallel engine wastes the ends of the rows. Without AVX2 this is
+ * opticFlowLK_float_levels().
+ */
+struct flow_t *opticFlowLK_float_lanes(struct image_t *pyramid_new, struct image_t *pyramid_old, struct point_t *points, uint16_t *points_cnt,
+                                       const struct lk_level_params *levels, uint8_t border_size, uint32_t subpixel_factor,
+                                       uint16_t max_points, uint8_t pyramid_level)
+{
+  struct lkl_group g;
+  lkl_window_func window = NULL;
+  lkl_start_func start = NULL;
+#ifdef LKF_X86
+  enum cpu_level level = cpu_detect_level();
+  if (level >= CPU_LEVEL_AVX512) {
+    window = lkl_window_avx512;
+    g.lanes = 16;
+  } else if (level >= CPU_LEVEL_AVX2) {
+    window = lkl_window_avx2;
+    g.lanes = 8;
+  }
+  start = lkl_start_avx2;
+#endif
+  if (window == NULL) {
+    return opticFlowLK_float_levels(pyramid_new, pyramid_old, points, points_cnt, levels, border_size, subpixel_factor,
+                                    max_points, pyramid_level);
+  }
+
+  // Buffers for the largest window, zeroed so the unused lanes never hold garbage floats
+  uint16_t max_size = 0;
+  for (uint8_t i = 0; i <= pyramid_level; i++) {
+    if (2 * levels[i].half_window_size + 1 > max_size) {
+      max_size = 2 * levels[i].half_window_size + 1;
+    }
+  }
+  g.I = calloc((uint32_t)max_size * max_size * g.lanes, sizeof(float));
+  g.DX = calloc((uint32_t)max_size * max_size * g.lanes, sizeof(float));
+  g.DY = calloc((uint32_t)max_size * max_size * g.lanes, sizeof(float));
+  g.padded = malloc(sizeof(float) * (max_size + 2) * (max_size + 2));
+  g.J = malloc(sizeof(float) * max_size * max_size);
+  for (uint8_t l = 0; l < g.lanes; l++) {
+    g.state[l] = LKL_FREE;
+    g.offset[l] = 0;
+    g.ax[l] = g.ay[l] = 0;
+  }
+
+  // The points to track with their flow (pixels on the current level)
+  uint16_t points_orig = *points_cnt;
+  float skip_points = (points_orig > max_points) ? (float)points_orig / max_points : 1;
+  uint16_t points_todo = (points_orig < max_points) ? points_orig : max_points;
+  float *flow_x = calloc(points_todo, sizeof(float));
+  float *flow_y = calloc(points_todo, sizeof(float));
+  bool_t *lost = calloc(points_todo, sizeof(bool_t));
+
+  for (int8_t LVL = pyramid_level; LVL != -1; LVL--) {
+    struct image_t *img_new = &pyramid_new[LVL];
+    float scale = 1.f / (1 << LVL);
+    float max_x = img_new->w - 1 - 2 * border_size;
+    float max_y = img_new->h - 1 - 2 * border_size;
+    uint16_t next = 0;
+
+    while (TRUE) {
+      // Hand back the finished points
+      uint32_t active = 0, free_lanes = 0;
+      for (uint8_t l = 0; l < g.lanes; l++) {
+        if (g.state[l] == LKL_DONE || g.state[l] == LKL_LOST) {
+          uint16_t i = g.point[l];
+          flow_x[i] = g.flow_x[l];
+          flow_y[i] = g.flow_y[l];
+          lost[i] = (g.state[l] == LKL_LOST);
+          g.state[l] = LKL_FREE;
+        }
+        if (g.state[l] == LKL_FREE) {
+          free_lanes |= 1u << l;
+        } else {
+          active |= 1u << l;
+        }
+      }
+
+      // Give the free lanes the next points once at least half of them are free, so the start is vectorized
+      if (next < points_todo && (2 * __builtin_popcount(free_lanes) >= g.lanes || active == 0)) {
+        uint32_t started = 0;
+        for (uint8_t l = 0; l < g.lanes && next < points_todo; l++) {
+          if (!(free_lanes & (1u << l))) {
+            continue;
+          }
+          while (next < points_todo) {
+            uint16_t i = next++;
+            uint16_t p = i * skip_points;
+            float x = points[p].x * scale + flow_x[i], y = points[p].y * scale + flow_y[i];
+            if (lost[i]) {
+              continue;
+            }
+            if (x < 0 || x > max_x || y < 0 || y > max_y) {
+              lost[i] = TRUE;
+              continue;
+            }
+            g.point[l] = i;
+            g.pos_x[l] = points[p].x * scale;
+            g.pos_y[l] = points[p].y * scale;
+            g.flow_x[l] = flow_x[i];
+            g.flow_y[l] = flow_y[i];
+            started |= 1u << l;
+            break;
+          }
+        }
+
+        lkl_start(&pyramid_old[LVL], &g, start, started, &levels[LVL], border_size);
+        for (uint8_t l = 0; l < g.lanes; l++) {
+          if (!(started & (1u << l))) {
+            continue;
+          }
+          if (g.state[l] == LKL_ACTIVE) {
+            active |= 1u << l;
+          } else {
+            lost[g.point[l]] = TRUE;
+            g.state[l] = LKL_FREE;
+          }
+        }
+      }
+
+      if (active == 0) {
+        if (next < points_todo) {
+          continue;
+        }
+        break;
+      }
+      lkl_iterate(img_new, &g, window, &levels[LVL], border_size, max_x, max_y);
+    }
+
+    if (LVL != 0) {
+      for (uint16_t i = 0; i < points_todo; i++) {
+        flow_x[i] *= 2;
+        flow_y[i] *= 2;
+      }
+    }
+  }
+
+  struct flow_t *vectors = malloc(sizeof(struct flow_t) * max_points);
+  uint16_t new_p = 0;
+  for (uint16_t i = 0; i < points_todo; i++) {
+    if (lost[i]) {
+      continue;
+    }
+    uint16_t p = i * skip_points;
+    vectors[new_p].pos.x = points[p].x * subpixel_factor;
+    vectors[new_p].pos.y = points[p].y * subpixel_factor;
+    vectors[new_p].flow_x = (int32_t)lroundf(flow_x[i] * subpixel_factor);
+    vectors[new_p].flow_y = (int32_t)lroundf(flow_y[i] * subpixel_factor);
+    new_p++;
+  }
+  *points_cnt = new_p;
+
+  free(flow_x);
+  free(flow_y);
+  free(lost);
+  free(g.I);
+  free(g.DX);
+  free(g.DY);
+  free(g.padded);
+  free(g.J);
+  return vectors;
+}
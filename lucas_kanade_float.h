@@ -0,0 +1,41 @@
+/*
+ * lucas_kanade_float.h
+ *
+ *  Created on: Apr 6, 2016
+ *      Author: hrvoje
+ */
+
+/**
+ * @file lucas_kanade_float.h
+ * @brief floating-point pyramidal Lucas-Kanade tracker with the interface of lucas_kanade.h
+ *
+ * The fixed-point tracker was written for microcontrollers: all coordinates are scaled by the subpixel
+ * factor, the solve needs int64 promotions and integer divisions, and the gradient scaling halves every
+ * step. This engine works in float pixels with the proper Newton step. The iteration loop (bilinear
+ * window, difference and b-vector in one pass) uses AVX2/FMA when cpu_detect_level() allows it, with a
+ * plain C fallback otherwise. It takes the same pyramids, points and settings and returns the flow in
+ * the same subpixel format, so it can replace opticFlowLK_levels() at runtime. The AVX2 and C paths
+ * can differ in the last float bits (FMA rounding), not in the tracked points.
+ *
+ * opticFlowLK_float_lanes() does the same steps point-parallel (one point per SIMD lane) instead of
+ * pixel-parallel, which suits large point counts with small windows.
+ */
+
+#ifndef LUCAS_KANADE_FLOAT_H
+#define LUCAS_KANADE_FLOAT_H
+
+#include "std.h"
+#include "image.h"
+#include "lucas_kanade.h"
+
+struct flow_t *opticFlowLK_float(struct image_t *new_img, struct image_t *old_img, struct point_t *points, uint16_t *points_cnt,
+                                 uint16_t half_window_size, uint32_t subpixel_factor, uint8_t max_iterations, uint8_t step_threshold,
+                                 uint16_t max_points, uint8_t pyramid_level);
+struct flow_t *opticFlowLK_float_levels(struct image_t *pyramid_new, struct image_t *pyramid_old, struct point_t *points, uint16_t *points_cnt,
+                                        const struct lk_level_params *levels, uint8_t border_size, uint32_t subpixel_factor,
+                                        uint16_t max_points, uint8_t pyramid_level);
+struct flow_t *opticFlowLK_float_lanes(struct image_t *pyramid_new, struct image_t *pyramid_old, struct point_t *points, uint16_t *points_cnt,
+                                       const struct lk_level_params *levels, uint8_t border_size, uint32_t subpixel_factor,
+                                       uint16_t max_points, uint8_t pyramid_level);
+
+#endif /* LUCAS_KANADE_FLOAT_H */
@@ -13,28 +13,150 @@
 #include <iomanip>
 
 #include "read_dir_contents.h"
-#include "optFlow_opencv.h"
+#include "optFlow_backend.h"
 #include "optFlow_paparazzi.h"
+#include "autoTuner.h"
+#include "tilingBenchmark.h"
+#include "stagePipeline.h"
+#include "threadBudget.h"
+#include "detectorBenchmark.h"
+#include "accumulatorCheck.h"
+#include "trackerService.h"
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <sys/stat.h>
 
-#include "rgb2yuv422.h"
 extern "C" {
 #include "fast_rosten.h"
+#include "fast_simd.h"
+#include "good_features.h"
 #include "image.h"
+#include "image_kernels.h"
 }
 
 
 // algorithms for detecting trackable features in images
 enum find_points{
 	GOOD_FEATURES,	// use openCV algorith goodFeaturesToTrack
-	FAST			// use FAST algorithm
+	FAST,			// use FAST algorithm
+	NATIVE_GOOD_FEATURES,	// Shi-Tomasi detector of good_features.c, goodFeaturesToTrack without OpenCV
+	FAST_PYRAMID	// FAST on the coarser levels of the tracking pyramid of the first paparazzi backend
 };
 
 
 using namespace cv;
 using namespace std;
 
+// One frame of the sequence on its way through the stages. Frame k carries the flow of the pair k-1 -> k.
+struct sequenceFrame {
+	unsigned int index;                   // position in the sequence, the first frame (0) has no pair
+	string path;
+	string ground_truth;                  // of the pair k-1 -> k
+	shared_ptr<preloadedFrame> frame;
+	shared_ptr<preloadedFrame> previous;
+	vector<Point2f> points;               // detected in this frame, tracked into the next one
+	vector<Point2f> tracked;              // points of the previous frame tracked into this one
+	vector<vector<flow_t_> > flow;        // per backend
+	vector<flowResults> data;
+	vector<string> details;               // backend state right after tracking, printed with the results
+};
+
+// Sums of the results of one backend over the sequence, for GLOBAL_FLOW_BENCHMARK
+struct sequenceTotals {
+	unsigned int pairs;
+	double prepare_time, track_time;      // in miliseconds
+	double mag_err, ang_err;
+};
+
+/* EdgeFlow (global translation and divergence from edge histograms) against the paparazzi LK tracker the
+ * same frames went through: mean time per frame pair and mean errors over the sequence. Frame preparation
+ * counts, that is where EdgeFlow builds its histograms and paparazzi its pyramids.
+ */
+static void printGlobalFlowBenchmark(const vector<optFlowBackend*>& backends, const vector<sequenceTotals>& totals, bool have_ground_truth)
+{
+	vector<optFlowBackend*>::size_type edgeflow = backends.size(), paparazzi = backends.size();
+	for (vector<optFlowBackend*>::size_type b = 0; b != backends.size(); b++) {
+		if (edgeflow == backends.size() && string(backends[b]->name()) == "edgeflow")
+			edgeflow = b;
+		if (paparazzi == backends.size() && string(backends[b]->name()) == "paparazzi")
+			paparazzi = b;
+	}
+	if (edgeflow == backends.size() || paparazzi == backends.size() || totals[edgeflow].pairs == 0) {
+		cout << "Global flow benchmark needs the edgeflow and paparazzi backends" << endl;
+		return;
+	}
+
+	streamsize precision = cout.precision();
+	cout << "Global flow benchmark over " << totals[edgeflow].pairs << " frame pairs (mean per pair):" << endl;
+	cout << "  " << left << setw(12) << "backend" << right << setw(12) << "prepare ms" << setw(12) << "track ms"
+			<< setw(12) << "total ms";
+	if (have_ground_truth)
+		cout << setw(12) << "mag error" << setw(12) << "ang error";
+	cout << endl;
+
+	vector<optFlowBackend*>::size_type rows[] = { edgeflow, paparazzi };
+	for (unsigned int r = 0; r != 2; r++) {
+		const sequenceTotals& t = totals[rows[r]];
+		cout << "  " << left << setw(12) << backends[rows[r]]->name() << right << fixed << setprecision(3)
+				<< setw(12) << t.prepare_time / t.pairs << setw(12) << t.track_time / t.pairs
+				<< setw(12) << (t.prepare_time + t.track_time) / t.pairs;
+		if (have_ground_truth)
+			cout << setw(12) << t.mag_err / t.pairs << setw(12) << t.ang_err / t.pairs;
+		cout << endl;
+	}
+
+	const sequenceTotals& e = totals[edgeflow];
+	const sequenceTotals& p = totals[paparazzi];
+	double e_total = e.prepare_time + e.track_time, p_total = p.prepare_time + p.track_time;
+	if (e_total > 0)
+		cout << "  edgeflow is " << setprecision(1) << p_total / e_total << "x the speed of paparazzi" << endl;
+	cout.unsetf(ios::fixed);
+	cout.precision(precision);
+}
+
+static void releaseFrame(preloadedFrame *frame)
+{
+	freeFrame(*frame);
+	delete frame;
+}
+
+/* Paparazzi specific results. The backend moves on to the next frame before these are printed, so they are
+ * captured right after tracking.
+ */
+static string backendDetails(optFlowBackend *backend)
+{
+	stringstream details;
+	paparazziBackend *paparazzi = dynamic_cast<paparazziBackend*>(backend);
+	if (paparazzi == NULL)
+		return details.str();
+
+	if (paparazzi->fit_motion) {
+		details << "Ego-motion flow: " << paparazzi->motion.flow_x << " " << paparazzi->motion.flow_y
+				<< " divergence: " << paparazzi->motion.divergence << " rotation: " << paparazzi->motion.rotation
+				<< " (" << paparazzi->motion.inliers << " inliers)" << endl;
+	}
+	if (paparazzi->iteration_stats.runs > 0) {
+		details << "LK iterations per point and level: mean " << float(paparazzi->iteration_stats.iterations) / paparazzi->iteration_stats.runs
+				<< " p99 " << int(opticFlowLK_stats_percentile(&paparazzi->iteration_stats, 0.99))
+				<< " max " << int(paparazzi->iteration_stats.max_iterations) << endl;
+	}
+	if (!paparazzi->float_engine) {
+		struct lk_accumulators acc;
+		opticFlowLK_accumulators(paparazzi->window_size / 2, paparazzi->subpixel_factor, &acc);
+		details << "LK accumulators (bits): blend " << int(acc.blend_bits) << " determinant " << int(acc.det_bits)
+				<< " step " << int(acc.step_bits) << endl;
+	}
+	if (paparazzi->cache_templates)
+		details << "LK tracks continued: " << paparazzi->tracks_continued << ", took new templates: " << paparazzi->templates_taken << endl;
+	if (paparazzi->deadline_ms > 0)
+		details << "Points skipped by the deadline: " << paparazzi->points_skipped << endl;
+
+	return details.str();
+}
+
 int main()
 {
 	vector<string> *image_filenames;
@@ -53,214 +175,531 @@ int main()
 	bool SAVE_FLOW_IMAGES  = 0;
 	bool PRINT_DEBUG_STUFF = 1;
 	bool RESULTS_TO_FILE   = 0;
+	bool AUTO_TUNE         = 0;
+	bool SIMD_SELF_CHECK   = 0; // compare the vectorized image kernels with the C reference on every call
+	const unsigned int BATCH_FRAMES = 0; // track the first frames as one batch with the first paparazzi backend, 0 to skip
+	const unsigned int SERVICE_STREAMS = 0; // replay the test set as this many camera streams on one trackerService, 0 to skip
+	bool TILING_BENCHMARK  = 0; // tiled against untiled tracking on synthetic 4K and 8K sequences before the test set
+	bool DETECTOR_BENCHMARK = 0; // feature detectors on the first frame of the test set
+	bool GLOBAL_FLOW_BENCHMARK = 0; // mean time and error of edgeflow against paparazzi over the test set, printed after it
+	bool ACCUMULATOR_CHECK = 0; // fixed-point LK with 64 bit blend (window 31, subpixel factor 10000) on a synthetic motion beyond int16
+	bool FAST_ON_YUV       = 0; // FAST scans the UYVY camera image with the vectorized detector instead of the grayscale copy
+	const uint8_t FAST_ARC_LENGTH = 9;       // FAST-N, FAST_MIN_ARC to FAST_MAX_ARC: shorter finds more corners, longer is more selective
+	bool PIPELINED         = 0; // overlap the stages of consecutive frames, each stage on its own threads
+	bool PIPELINE_CHECK    = 0; // run the test set serially and pipelined, writing and comparing the result files of both
+	const size_t PIPELINE_QUEUE = 4;         // frames that can wait between two stages
+	const unsigned int DECODE_THREADS = 2;   // threads of the stages that may handle several frames at once
+	const unsigned int EVALUATE_THREADS = 2;
+	const unsigned int THREAD_BUDGET = 0;    // threads of the whole run (stages, OpenCV, native pools), 1 for single-threaded timings, 0 for all cores
+	bool PIN_THREADS       = 0; // keep all threads on the first THREAD_BUDGET cores, so every backend runs on the same ones
 	const int MAX_POINTS   = 25;
-	int thres = 20;
-	vector<string>::const_iterator ground_truth_file = ground_truth_filenames->begin() + 2;
-	int frame = 1;
-
-	ofstream pointCount, avgMagErr, avgAngErr, time;
-
-	if (RESULTS_TO_FILE) {
-		string pointCount_dir = testset_dir + "/results/pointCount.txt";
-		string avgMagErr_dir = testset_dir + "/results/avgMagErr.txt";
-		string avgAngErr_dir = testset_dir + "/results/avgAngErr.txt";
-		string time_dir = testset_dir + "/results/time.txt";
-
-		pointCount.open(
-				pointCount_dir.c_str(),
-				std::ofstream::out | std::ofstream::trunc);
-		avgMagErr.open(
-				avgMagErr_dir.c_str(),
-				std::ofstream::out | std::ofstream::trunc);
-		avgAngErr.open(
-				avgAngErr_dir.c_str(),
-				std::ofstream::out | std::ofstream::trunc);
-		time.open(
-				time_dir.c_str(),
-				std::ofstream::out | std::ofstream::trunc);
+	const uint8_t PYRAMID_DETECT_LEVEL = 1; // finest pyramid level FAST_PYRAMID detects on, 0 includes the full resolution
+	bool RANK_POINTS       = 0; // keep the most trackable of the detected points, scored on the pyramid of the first paparazzi backend
+	const unsigned int RANK_CANDIDATES = 4;  // with RANK_POINTS, detect this many times the points to choose from
+	bool FEED_TRACKS       = 0; // the first paparazzi backend keeps its tracks (cache_templates): the next frame tracks from where they ended, topped up with detected points
+	const float DEADLINE_MS = 0;             // tracking budget of the first paparazzi backend per frame, 0 tracks all points; the best ranked points go first
+	const float TARGET_LATENCY = 5; // p99 of the paparazzi frame latency the tuner aims for, in miliseconds
+	const int FAST_THRESHOLD = 20; // FAST threshold of the first frame, adapted frame by frame from there
+
+	// Before anything starts threads, so OpenCV and the native pools share the budget and inherit the pinning
+	threadBudget budget;
+	budget.threads = THREAD_BUDGET;
+	budget.pinned = PIN_THREADS;
+	applyThreadBudget(budget);
+	cout << "Thread budget: " << describeThreadBudget() << endl;
+	const bool threaded = budgetThreads() > 1;
+
+	// Pick the widest image kernels this CPU supports
+	enum cpu_level simd_level = image_kernels_init(cpu_detect_level(), SIMD_SELF_CHECK);
+	cout << "Image kernels: " << cpu_level_name(simd_level) << (SIMD_SELF_CHECK ? " (self-check)" : "") << endl;
+
+	if (TILING_BENCHMARK) {
+		vector<uint16_t> tile_sizes;
+		tile_sizes.push_back(32);
+		tile_sizes.push_back(64);
+		tile_sizes.push_back(128);
+		tile_sizes.push_back(256);
+		printTilingBenchmark(3840, 2160, runTilingBenchmark(3840, 2160, 20000, tile_sizes, 5));
+		printTilingBenchmark(7680, 4320, runTilingBenchmark(7680, 4320, 40000, tile_sizes, 5));
+	}
+
+	if (ACCUMULATOR_CHECK)
+		printAccumulatorCheck(15, 10000, runAccumulatorCheck(15, 10000, 5, -4));
+
+	if (DETECTOR_BENCHMARK && image_filenames->size() > 2) {
+		preloadedFrame first;
+		loadFrame((*image_filenames)[2], first);
+		printDetectorBenchmark(runDetectorBenchmark(first, MAX_POINTS, 10));
+		freeFrame(first);
 	}
 
-	// Iterate through image files and calculate optical flow
-	for (vector<string>::const_iterator image_file = image_filenames->begin() + 2; image_file != (image_filenames->end() - 1); image_file++)
-	{
-		//if (PRINT_DEBUG_STUFF)
-			cout << "Frames " << frame << " - " << frame + 1 << endl;
-			//if (frame == 2)break;
+	tunerBounds bounds = { 4, 10, 5, 20, 0, 2, 10, MAX_POINTS };
+
+	if (BATCH_FRAMES > 1) {
+		// A tracker of its own, trackBatch() does not depend on the frames the sequence runs prepare
+		paparazziBackend batch_tracker;
+		trackerAutoTuner batch_tuner(TARGET_LATENCY, bounds);
+		if (AUTO_TUNE)
+			batch_tuner.apply(batch_tracker);
+
+		// Chained tracking of FAST points of the first frame with skip-ahead comparisons, pyramids pipelined
+		vector<preloadedFrame> batch_frames(min(size_t(BATCH_FRAMES), image_filenames->size() - 2));
+		vector<const preloadedFrame*> batch;
+		for (vector<preloadedFrame>::size_type f = 0; f != batch_frames.size(); f++) {
+			loadFrame((*image_filenames)[f + 2], batch_frames[f]);
+			batch.push_back(&batch_frames[f]);
+		}
 
-		const char *first_image = (*image_file).c_str();
-		const char *second_image = (*(image_file + 1)).c_str();
-		const char *ground_truth = (*ground_truth_file).c_str();
-		ground_truth_file++;
-		frame++;
-		stringstream save_path;
-		string type = ".jpg";
+		vector<Point2f> batch_points;
+		if (!batch.empty()) {
+			uint16_t corner_cnt;
+			struct point_t *corners = fast9_detect(&batch_frames[0].gray_img, FAST_THRESHOLD, 20, 0, 0, &corner_cnt);
+			for (uint16_t i = 0; i < corner_cnt && i < MAX_POINTS; i++)
+				batch_points.push_back(Point2f(corners[i].x, corners[i].y));
+			free(corners);
+		}
 
-		Mat current_frame;
-		vector<Point2f> points;
+		vector<unsigned int> skips;
+		skips.push_back(2);
+		skips.push_back(4);
+		vector<batchPair> pairs = batch_tracker.trackBatch(batch, batch_points, skips, threaded);
+		for (vector<batchPair>::size_type p = 0; p != pairs.size(); p++)
+			cout << "Batch frames " << pairs[p].from << " - " << pairs[p].to << ": " << pairs[p].flow.size()
+					<< " points, " << pairs[p].time << " ms" << endl;
 
+		for (vector<preloadedFrame>::size_type f = 0; f != batch_frames.size(); f++)
+			freeFrame(batch_frames[f]);
+	}
 
-		switch (algorithm) {
-		case GOOD_FEATURES:
+	if (SERVICE_STREAMS > 0 && image_filenames->size() > 3) {
+		// Every stream gets the whole test set with its own paparazzi backend. The first one has priority, like the
+		// camera a vehicle steers by. Nothing is dropped, so the tracked vectors are the same in every run.
+		unsigned int service_frames = image_filenames->size() - 2;
+		vector<uint64_t> vectors(SERVICE_STREAMS, 0);   // written by the callbacks of one stream at a time
+		budgetOpenCV(1);
 		{
-			//Find good points to track
-			current_frame = imread(first_image, IMREAD_GRAYSCALE);
-			goodFeaturesToTrack(current_frame, points, MAX_POINTS, 0.01, 10, Mat(), 3, 0, 0.04);
-			break;
+			trackerService service(0);
+			for (unsigned int s = 0; s < SERVICE_STREAMS; s++) {
+				streamConfig config = { "paparazzi", (s == 0) ? 1u : 0u, 1, service_frames };
+				service.addStream(config, [&vectors](unsigned int stream, const vector<flow_t_>& flow) {
+					vectors[stream] += flow.size();
+				});
+			}
+
+			for (unsigned int f = 0; f < service_frames; f++) {
+				for (unsigned int s = 0; s < SERVICE_STREAMS; s++) {
+					preloadedFrame frame;
+					loadFrame((*image_filenames)[f + 2], frame);
+
+					vector<Point2f> service_points;
+					uint16_t corner_cnt;
+					struct point_t *corners = fast9_detect(&frame.gray_img, FAST_THRESHOLD, 20, 0, 0, &corner_cnt);
+					for (uint16_t i = 0; i < corner_cnt && i < MAX_POINTS; i++)
+						service_points.push_back(Point2f(corners[i].x, corners[i].y));
+					free(corners);
+
+					service.submitFrame(s, frame, service_points);
+				}
+			}
+			service.drain();
+
+			cout << "Tracker service: " << SERVICE_STREAMS << " streams of " << service_frames << " frames on "
+					<< service.pool().workers() << " workers, " << service.pool().steals() << " steals" << endl;
+			for (unsigned int s = 0; s < SERVICE_STREAMS; s++) {
+				streamStats stats = service.stats(s);
+				cout << "  stream " << s << ": " << stats.frames << " frames, " << stats.dropped << " dropped, "
+						<< stats.failed << " failed, " << vectors[s] << " vectors, latency mean " << stats.mean_ms
+						<< " p50 " << stats.p50_ms << " p99 " << stats.p99_ms << " max " << stats.max_ms << " ms" << endl;
+			}
 		}
+		budgetOpenCV(budgetThreads());
+	}
 
-		case FAST:
-		{
-			current_frame = imread(first_image, CV_LOAD_IMAGE_COLOR);
+	// One run over the test set with fresh backends, tuner and detector state, so runs can be compared.
+	// Returns whether the stages overlapped.
+	auto runSequence = [&](bool pipelined, const string& results_dir, bool write_results) -> bool {
+		// Optical flow engines to compare, any name from listBackends() can be used.
+		// Backends that are not available in this build (e.g. "dis" before OpenCV 4) are skipped.
+		const char *backend_names[] = { "paparazzi", "paparazzi_levels", "paparazzi_float", "paparazzi_lanes", "opencv", "blockmatch", "edgeflow", "farneback", "dis" };
+		vector<string> available_backends = listBackends();
+		vector<optFlowBackend*> backends;
+		for (unsigned int b = 0; b != sizeof(backend_names) / sizeof(*backend_names); b++) {
+			if (find(available_backends.begin(), available_backends.end(), backend_names[b]) == available_backends.end()) {
+				cout << "Backend " << backend_names[b] << " not available, skipping." << endl;
+				continue;
+			}
+			backends.push_back(createBackend(backend_names[b]));
+		}
 
-			image_t current_YUV;
-			image_create(&current_YUV, uint16_t(current_frame.cols), uint16_t(current_frame.rows), IMAGE_YUV422);
+		// The tuner drives the first paparazzi backend and the amount of points that are detected
+		paparazziBackend *tuned = NULL;
+		for (vector<optFlowBackend*>::size_type b = 0; b != backends.size() && tuned == NULL; b++)
+			tuned = dynamic_cast<paparazziBackend*>(backends[b]);
+
+		trackerAutoTuner tuner(TARGET_LATENCY, bounds);
+		if (AUTO_TUNE && tuned != NULL)
+			tuner.apply(*tuned);
+		if (tuned != NULL) {
+			tuned->deadline_ms = DEADLINE_MS;
+			tuned->cache_templates = tuned->cache_templates || FEED_TRACKS;
+		}
+
+		atomic<int> max_points(MAX_POINTS); // written by the tuner in the track stage, read by the detect stage
+		int thres = FAST_THRESHOLD;
+
+		ofstream pointCount, avgMagErr, avgAngErr, time;
+
+		if (write_results) {
+			string pointCount_dir = results_dir + "/pointCount.txt";
+			string avgMagErr_dir = results_dir + "/avgMagErr.txt";
+			string avgAngErr_dir = results_dir + "/avgAngErr.txt";
+			string time_dir = results_dir + "/time.txt";
+
+			pointCount.open(
+					pointCount_dir.c_str(),
+					std::ofstream::out | std::ofstream::trunc);
+			avgMagErr.open(
+					avgMagErr_dir.c_str(),
+					std::ofstream::out | std::ofstream::trunc);
+			avgAngErr.open(
+					avgAngErr_dir.c_str(),
+					std::ofstream::out | std::ofstream::trunc);
+			time.open(
+					time_dir.c_str(),
+					std::ofstream::out | std::ofstream::trunc);
+		}
 
-			// Convert RGB image to YUV 4:2:2 format and place it in curYUV/nextYUV
-			if (rgb2yuv422(current_frame, &current_YUV)) {
-				printf("Image conversion failed! Exiting...");
+		// The work per frame as a chain of stages. Decoding, conversion and scoring may run for several frames at
+		// once, detection (adaptive threshold), tracking (backend state, tuner) and output see the frames in order.
+		// With pipelined the stages of consecutive frames overlap, otherwise (and with a budget below one thread
+		// per stage) every frame goes through all of them before the next one is read.
+		// Overlapping, the stage threads are the whole thread budget and OpenCV runs sequentially inside them.
+		vector<unsigned int> wanted_threads(6, 1);
+		wanted_threads[0] = DECODE_THREADS;
+		wanted_threads[4] = EVALUATE_THREADS;
+		vector<unsigned int> stage_threads = pipelined ? splitThreadBudget(wanted_threads) : vector<unsigned int>();
+		const bool overlap = !stage_threads.empty();
+		if (!overlap)
+			stage_threads.assign(wanted_threads.size(), 1);
+		stagePipeline<sequenceFrame> pipeline(PIPELINE_QUEUE);
+
+		pipeline.addStage("decode", [&](sequenceFrame& item) {
+			decodeFrame(item.path, *item.frame);
+		}, stage_threads[0]);
+
+		pipeline.addStage("convert", [&](sequenceFrame& item) {
+			convertFrame(*item.frame);
+		});
+
+		const unsigned int candidates = (RANK_POINTS && tuned != NULL) ? RANK_CANDIDATES : 1;
+
+		pipeline.addStage("detect", [&](sequenceFrame& item) {
+			int detect_points = max_points * candidates;
+
+			switch (algorithm) {
+			case GOOD_FEATURES:
+			{
+				//Find good points to track
+				goodFeaturesToTrack(item.frame->gray, item.points, detect_points, 0.01, 10, Mat(), 3, 0, 0.04);
 				break;
 			}
 
-			// Create grayscale image from yuv image
-			image_t current_gray_YUV;
-			image_create(&current_gray_YUV, current_YUV.w, current_YUV.h, IMAGE_GRAYSCALE);
-			image_to_grayscale(&current_YUV, &current_gray_YUV);
-			uint16_t corner_cnt;
+			case FAST:
+			{
+				uint16_t corner_cnt;
+
+				// FAST corner detection (TODO: non fixed threshold)
+				struct image_t *fast_img = FAST_ON_YUV ? &item.frame->yuv : &item.frame->gray_img;
+				struct point_t *corners = (FAST_ON_YUV || FAST_ARC_LENGTH != 9)
+						? fast_detect_simd(fast_img, FAST_ARC_LENGTH, thres, 20, 0, 0, &corner_cnt)
+						: fast9_detect(fast_img, thres, 20, 0, 0, &corner_cnt);
+				//printf("FAST points num: %u threshold: %d \n", corner_cnt, thres);
 
-			// FAST corner detection (TODO: non fixed threshold)
-			struct point_t *corners = fast9_detect(&current_gray_YUV, thres, 20, 0, 0, &corner_cnt);
-			//printf("FAST points num: %u threshold: %d \n", corner_cnt, thres);
+				 // Adaptive threshold
+				if (1) {
 
-			 // Adaptive threshold
-			if (1) {
+					// Decrease and increase the threshold based on previous values
+					if (corner_cnt < 40 && thres > 5) {
+						thres--;
+					} else if (corner_cnt > 50 && thres < 60) {
+						thres++;
+					}
 
-				// Decrease and increase the threshold based on previous values
-				if (corner_cnt < 40 && thres > 5) {
-					thres--;
-				} else if (corner_cnt > 50 && thres < 60) {
-					thres++;
 				}
 
-			}
+				float skip_points =	(corner_cnt > detect_points) ? (float)corner_cnt / detect_points : 1;
+				uint16_t p;
 
-			float skip_points =	(corner_cnt > MAX_POINTS) ? (float)corner_cnt / MAX_POINTS : 1;
-			uint16_t p;
+				for (uint16_t i = 0; i < detect_points && i < corner_cnt; i++) {
+					Point2f temp;
+					p = i * skip_points;
+					temp.x = corners[p].x; // column
+					temp.y = corners[p].y; // row
+					item.points.push_back(temp);
+				}
 
-			for (uint16_t i = 0; i < MAX_POINTS && i < corner_cnt; i++) {
-				Point2f temp;
-				p = i * skip_points;
-				temp.x = corners[p].x; // column
-				temp.y = corners[p].y; // row
-				points.push_back(temp);
+				free(corners);
+				break;
 			}
 
-			image_free(&current_YUV);
-			image_free(&current_gray_YUV);
-			break;
-		}
-
-		default:
-			cout << "Error - please select algorithm for finding features."	<< endl;
-			break;
-		}
-
+			case FAST_PYRAMID:
+				// Needs the pyramid of the frame, detected in the track stage once the frame is prepared
+				break;
 
-		/*cout << "Points for both algorithms (column -- row)" << endl;
-		cout << "size : " << points.size() << endl;
-		for (unsigned int i = 0; i != points.size(); i++)
-			cout << i << "    " << points[i].x << "   " << points[i].y << endl;*/
+			case NATIVE_GOOD_FEATURES:
+			{
+				uint16_t corner_cnt;
+				struct point_t *corners = good_features_detect(&item.frame->gray_img, detect_points, 0.01, 10, 3, CORNER_MIN_EIGEN, 0.04, &corner_cnt);
+				for (uint16_t i = 0; i < corner_cnt; i++)
+					item.points.push_back(Point2f(corners[i].x, corners[i].y));
 
+				free(corners);
+				break;
+			}
 
+			default:
+				cout << "Error - please select algorithm for finding features."	<< endl;
+				break;
+			}
+		}, 1, true);
+
+		// The backends keep state of the last two prepared frames, so those stay alive here until they are replaced
+		shared_ptr<preloadedFrame> prepared[2];
+		vector<Point2f> previous_points;
+		sequenceTotals no_totals = { 0, 0, 0, 0, 0 };
+		vector<sequenceTotals> totals(backends.size(), no_totals);
+
+		pipeline.addStage("track", [&](sequenceFrame& item) {
+			for (vector<optFlowBackend*>::size_type b = 0; b != backends.size(); b++)
+				backendPrepareFrame(*backends[b], *item.frame);
+			prepared[0] = prepared[1];
+			prepared[1] = item.frame;
+
+			if (algorithm == FAST_PYRAMID && tuned != NULL)
+				item.points = tuned->detectOnPyramid(thres, 20, PYRAMID_DETECT_LEVEL, tuned->pyramid_level, max_points * candidates);
+
+			if (item.index > 0) {
+				item.previous = prepared[0];
+				item.tracked.swap(previous_points);
+
+				// Initalize containers for optical flow results and calculate flow
+				item.flow.resize(backends.size());
+				item.data.resize(backends.size());
+				for (vector<optFlowBackend*>::size_type b = 0; b != backends.size(); b++)
+					backendTrack(*backends[b], item.tracked, item.flow[b], item.data[b]);
+
+				// Settings picked by the tuner take effect from the next frame on
+				if (AUTO_TUNE && tuned != NULL) {
+					vector<optFlowBackend*>::size_type b = find(backends.begin(), backends.end(), tuned) - backends.begin();
+					tuner.update(item.data[b].prepare_time + item.data[b].time, item.tracked.size(), item.data[b].points_left);
+					tuner.apply(*tuned);
+					max_points = tuner.max_points;
+				}
 
+				for (vector<optFlowBackend*>::size_type b = 0; b != backends.size(); b++) {
+					stringstream details;
+					details << backendDetails(backends[b]);
+					if (AUTO_TUNE && backends[b] == tuned) {
+						details << "Tuner p99 latency: " << tuner.latencyPercentile(0.99) << " window: " << tuner.window_size
+								<< " iterations: " << int(tuner.max_iterations) << " levels: " << int(tuner.pyramid_level)
+								<< " points: " << tuner.max_points << endl;
+					}
+					item.details.push_back(details.str());
+				}
+			}
 
-		// Initalize containers for optical flow results
-		flowResults dataOpencv, dataPaparazzi, dataOpencvPyr;
+			// The tracks go on from where they ended, the detected points fill up what was lost
+			vector<Point2f> ends;
+			vector<uint32_t> end_tracks;
+			if (FEED_TRACKS && tuned != NULL)
+				tuned->trackEnds(ends, end_tracks);
+			int fill = max(0, int(max_points) - int(ends.size()));
+
+			// After tracking into this frame, so the templates taken for the kept points are the ones the next frame uses
+			if (candidates > 1)
+				item.points = tuned->rankPoints(item.points, fill);
+
+			if (FEED_TRACKS && tuned != NULL) {
+				vector<uint32_t> fill_tracks;
+				if (candidates > 1)
+					fill_tracks = tuned->point_tracks;  // set by rankPoints() when it kept templates
+				for (vector<Point2f>::size_type p = 0; p != item.points.size() && int(p) < fill; p++) {
+					ends.push_back(item.points[p]);
+					end_tracks.push_back(fill_tracks.size() == item.points.size() ? fill_tracks[p] : 0);
+				}
+				item.points.swap(ends);
+				tuned->point_tracks.swap(end_tracks);
+			}
+			previous_points = item.points;
+		}, 1, true);
+
+		pipeline.addStage("evaluate", [&](sequenceFrame& item) {
+			for (vector<flowResults>::size_type b = 0; b != item.data.size(); b++)
+				backendScore(*item.previous, *item.frame, item.ground_truth.c_str(), item.flow[b], item.data[b], HAVE_GROUND_TRUTH);
+		}, stage_threads[4]);
+
+		pipeline.addStage("render", [&](sequenceFrame& item) {
+			if (item.index == 0)
+				return;
+
+			const vector<flowResults>& data = item.data;
+			int frame = item.index;
+			stringstream save_path;
+			string type = ".jpg";
+
+			//if (PRINT_DEBUG_STUFF)
+				cout << "Frames " << frame << " - " << frame + 1 << endl;
+
+			for (vector<flowResults>::size_type b = 0; b != data.size(); b++) {
+				totals[b].pairs++;
+				totals[b].prepare_time += data[b].prepare_time;
+				totals[b].track_time += data[b].time;
+				totals[b].mag_err += data[b].magErr;
+				totals[b].ang_err += data[b].angErr;
+			}
 
-		// Calculate flow
-		optFlow_paparazzi(first_image, second_image, ground_truth, points, dataPaparazzi, MAX_POINTS, HAVE_GROUND_TRUTH);
-		optFlow_opencv(first_image, second_image, ground_truth, points, 2, dataOpencv, HAVE_GROUND_TRUTH);
+			// Output flow to console
+			if (PRINT_DEBUG_STUFF) {
+				cout << endl;
+				cout << "Starting number of points: " << item.tracked.size() << endl;
+				for (vector<optFlowBackend*>::size_type b = 0; b != backends.size(); b++) {
+					cout << endl;
+					cout << backends[b]->name() << " results: " << endl;
+					cout << "Number of points left: " << data[b].points_left << endl;
+					if (HAVE_GROUND_TRUTH) {
+						cout << "Average magnitude error: " << data[b].magErr << endl;
+						cout << "Average angular error: " << data[b].angErr << endl;
+					}
+					cout << "Time passed in miliseconds: " << data[b].time << endl;
+					cout << "Frame preparation in miliseconds: " << data[b].prepare_time << endl;
+					cout << "Pyramid building in miliseconds: " << data[b].pyramid_time << endl;
+					if (data[b].fit_time > 0)
+						cout << "Ego-motion fit in miliseconds: " << data[b].fit_time << endl;
+					cout << item.details[b];
+				}
+				cout << "====================================================="
+						<< endl;
+			}
+			if (SHOW_FLOW) {
+				// Illustrate optical flow
+				for (vector<optFlowBackend*>::size_type b = 0; b != backends.size(); b++) {
+					string window = string(backends[b]->name()) + " optical flow";
+					namedWindow(window, WINDOW_AUTOSIZE);
+					imshow(window, data[b].flow_viz);
+				}
+				waitKey();
+			}
 
-		// Output flow to console
-		if (PRINT_DEBUG_STUFF) {
-			cout << endl;
-			cout << "Starting number of points: " << points.size() << endl;
-			cout << endl;
-			cout << "Paparazzi results: " << endl;
-			cout << "Number of points left: " << dataPaparazzi.points_left<< endl;
-			if (HAVE_GROUND_TRUTH) {
-				cout << "Average magnitude error: " << dataPaparazzi.magErr	<< endl;
-				cout << "Average angular error: " << dataPaparazzi.angErr << endl;
+			if (SAVE_FLOW_IMAGES){
+				for (vector<optFlowBackend*>::size_type b = 0; b != backends.size(); b++) {
+					save_path << output_dir << "/" << backends[b]->name() << "/flow_1" << setw(5) << setfill('0') << frame << type;
+					string filename = save_path.str();
+					imwrite(filename, data[b].flow_viz);
+					save_path.str("");
+				}
 			}
-			cout << "Time passed in miliseconds: " << dataPaparazzi.time<< endl;
-
-			cout << endl;
-			cout << "OpenCV results: " << endl;
-			cout << "Number of points left: " << dataOpencv.points_left << endl;
-			if (HAVE_GROUND_TRUTH) {
-				cout << "Average magnitude error: " << dataOpencv.magErr << endl;
-				cout << "Average angular error: " << dataOpencv.angErr << endl;
+
+			if (write_results) {
+				// One column per backend, in the order of backend_names
+				for (vector<optFlowBackend*>::size_type b = 0; b != backends.size(); b++) {
+					const char *separator = (b + 1 == backends.size()) ? "\n" : " ";
+
+					if (pointCount.is_open())
+						pointCount << data[b].points_left << separator;
+					else
+						cout << "Unable to open file";
+
+					if (avgMagErr.is_open())
+						avgMagErr << data[b].magErr << separator;
+					else
+						cout << "Unable to open file";
+
+					if (avgAngErr.is_open())
+						avgAngErr << data[b].angErr << separator;
+					else
+						cout << "Unable to open file";
+
+					if (time.is_open())
+						time << data[b].time << separator;
+					else
+						cout << "Unable to open file";
+				}
 			}
-			cout << "Time passed in miliseconds: " << dataOpencv.time << endl;
-			cout << "====================================================="
-					<< endl;
-		}
-		if (SHOW_FLOW) {
-			// Illustrate optical flow
-			namedWindow("Paparazzi optical flow", WINDOW_AUTOSIZE);
-			namedWindow("OpenCV optical flow", WINDOW_AUTOSIZE);
-			imshow("Paparazzi optical flow", dataPaparazzi.flow_viz);
-			imshow("OpenCV optical flow", dataOpencv.flow_viz);
-			waitKey();
+		}, 1, true);
+
+		// Iterate through image files and calculate optical flow, frame k is paired with ground truth k - 1
+		vector<string>::const_iterator image_file = image_filenames->begin() + 2;
+		vector<string>::const_iterator ground_truth_file = ground_truth_filenames->begin() + 2;
+		unsigned int frame_index = 0;
+		if (overlap)
+			budgetOpenCV(1);
+		pipeline.run([&](sequenceFrame& item) {
+			if (image_file == image_filenames->end())
+				return false;
+
+			item.index = frame_index++;
+			item.path = *image_file++;
+			item.frame.reset(new preloadedFrame, releaseFrame);
+			if (item.index > 0 && ground_truth_file != ground_truth_filenames->end())
+				item.ground_truth = *ground_truth_file++;
+			return true;
+		}, overlap);
+
+		if (overlap) {
+			budgetOpenCV(budgetThreads());
+			printPipelineMetrics(pipeline.metrics());
 		}
+		if (GLOBAL_FLOW_BENCHMARK)
+			printGlobalFlowBenchmark(backends, totals, HAVE_GROUND_TRUTH);
 
-		if (SAVE_FLOW_IMAGES){
-			save_path << output_dir << "/paparazzi/flow_1" << setw(5) << setfill('0') << frame -1 << type;
-			string filename = save_path.str();
-			imwrite(filename, dataPaparazzi.flow_viz);
-			save_path.str("");
+		prepared[0].reset();
+		prepared[1].reset();
+		for (vector<optFlowBackend*>::size_type b = 0; b != backends.size(); b++)
+			delete backends[b];
 
-			save_path << output_dir << "/opencv/flow_1" << setw(5) <<setfill('0') << frame - 1 << type;
-			filename = save_path.str();
-			imwrite(filename, dataOpencv.flow_viz);
-			save_path.str("");
-		}
 
-		if (RESULTS_TO_FILE) {
+		if (write_results) {
 			if (pointCount.is_open())
-				pointCount << dataPaparazzi.points_left << " " << dataOpencv.points_left << endl;
-			else
-				cout << "Unable to open file";
+				pointCount.close();
 
 			if (avgMagErr.is_open())
-				avgMagErr << dataPaparazzi.magErr << " " << dataOpencv.magErr << endl;
-			else
-				cout << "Unable to open file";
+				avgMagErr.close();
 
 			if (avgAngErr.is_open())
-				avgAngErr << dataPaparazzi.angErr << " " << dataOpencv.angErr << endl;
-			else
-				cout << "Unable to open file";
+				avgAngErr.close();
 
 			if (time.is_open())
-				time << dataPaparazzi.time<< " " << dataOpencv.time << endl;
-			else
-				cout << "Unable to open file";
+				time.close();
+		}
+		return overlap;
+	};
+
+	if (PIPELINE_CHECK) {
+		// The frames reach the output in order whatever the stages overlap, so the result files of a serial and
+		// a pipelined run are the same byte for byte. Not the timings, and not with AUTO_TUNE, which acts on them.
+		string serial_dir = testset_dir + "/results/serial", pipelined_dir = testset_dir + "/results/pipelined";
+		mkdir(serial_dir.c_str(), 0755);
+		mkdir(pipelined_dir.c_str(), 0755);
+		runSequence(false, serial_dir, true);
+		bool overlapped_run = runSequence(true, pipelined_dir, true);
+
+		const char *compared[] = { "pointCount.txt", "avgMagErr.txt", "avgAngErr.txt" };
+		for (unsigned int f = 0; f != sizeof(compared) / sizeof(*compared); f++) {
+			ifstream serial((serial_dir + "/" + compared[f]).c_str()), overlapped((pipelined_dir + "/" + compared[f]).c_str());
+			stringstream serial_bytes, overlapped_bytes;
+			serial_bytes << serial.rdbuf();
+			overlapped_bytes << overlapped.rdbuf();
+			bool same = serial.is_open() && overlapped.is_open() && serial_bytes.str() == overlapped_bytes.str();
+			cout << "Pipeline check " << compared[f] << ": " << (same ? "identical" : "DIFFERENT") << endl;
 		}
+		if (!overlapped_run)
+			cout << "Pipeline check: the thread budget is below one thread per stage, both runs were serial" << endl;
+	} else {
+		runSequence(PIPELINED, testset_dir + "/results", RESULTS_TO_FILE);
 	}
 
-	if (RESULTS_TO_FILE) {
-		if (pointCount.is_open())
-			pointCount.close();
-
-		if (avgMagErr.is_open())
-			avgMagErr.close();
-
-		if (avgAngErr.is_open())
-			avgAngErr.close();
-
-		if (time.is_open())
-			time.close();
-	}
+	if (SIMD_SELF_CHECK)
+		cout << "Image kernel self-check: " << image_kernels_mismatches() << " mismatches in " << image_kernels_checks() << " calls" << endl;
 
 	return 0;
 }
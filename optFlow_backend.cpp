@@ -0,0 +1,128 @@
+/*
+ * optFlow_backend.cpp
+ *
+ *  Created on: Mar 30, 2016
+ *      Author: hrvoje
+ */
+
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/core.hpp"
+
+#include <map>
+#include <stdexcept>
+
+#include "rgb2yuv422.h"
+#include "showFlow.h"
+#include "optFlow_backend.h"
+
+using namespace cv;
+using namespace std;
+
+/* Function local so the map exists before the static registrars of the backends run */
+static map<string, backendFactory>& backendRegistry()
+{
+	static map<string, backendFactory> registry;
+	return registry;
+}
+
+void registerBackend(const string& name, backendFactory factory)
+{
+	backendRegistry()[name] = factory;
+}
+
+optFlowBackend *createBackend(const string& name)
+{
+	map<string, backendFactory>::const_iterator it = backendRegistry().find(name);
+	if (it == backendRegistry().end())
+		throw invalid_argument("createBackend : unknown backend " + name);
+
+	return it->second();
+}
+
+vector<string> listBackends()
+{
+	vector<string> names;
+	for (map<string, backendFactory>::const_iterator it = backendRegistry().begin(); it != backendRegistry().end(); it++)
+		names.push_back(it->first);
+
+	return names;
+}
+
+void loadFrame(const string& path, preloadedFrame& frame)
+{
+	decodeFrame(path, frame);
+	convertFrame(frame);
+}
+
+void decodeFrame(const string& path, preloadedFrame& frame)
+{
+	frame.path = path;
+	frame.color = imread(path, IMREAD_COLOR);
+
+	if (!frame.color.data)
+		throw invalid_argument("loadFrame : image has not loaded properly!");
+}
+
+void convertFrame(preloadedFrame& frame)
+{
+	image_create(&frame.yuv, uint16_t(frame.color.cols), uint16_t(frame.color.rows), IMAGE_YUV422);
+
+	// Convert RGB image to YUV 4:2:2 format, the input the Paparazzi code gets from the camera
+	if (rgb2yuv422(frame.color, &frame.yuv))
+		throw runtime_error("Image conversion failed! Exiting...");
+
+	// Grayscale image is the Y channel, shared by all backends
+	image_create(&frame.gray_img, frame.yuv.w, frame.yuv.h, IMAGE_GRAYSCALE);
+	image_to_grayscale(&frame.yuv, &frame.gray_img);
+	frame.gray = Mat(frame.gray_img.h, frame.gray_img.w, CV_8UC1, frame.gray_img.buf);
+}
+
+void freeFrame(preloadedFrame& frame)
+{
+	frame.gray = Mat();
+	frame.color = Mat();
+	image_free(&frame.gray_img);
+	image_free(&frame.yuv);
+}
+
+void backendPrepareFrame(optFlowBackend& backend, const preloadedFrame& frame)
+{
+	backend.timings.pyramid = 0;
+	double time = (double)getTickCount();
+	backend.prepareFrame(frame);
+	backend.timings.prepare = (((double)getTickCount() - time)/getTickFrequency())*1000; //in miliseconds
+}
+
+void backendEvaluate(optFlowBackend& backend, const preloadedFrame& curFrame, const preloadedFrame& nextFrame, const char* groundTruthPath,
+		const vector<Point2f>& points, flowResults& results, bool HAVE_GROUND_TRUTH)
+{
+	vector<flow_t_> lk_flow;
+
+	backendTrack(backend, points, lk_flow, results);
+	backendScore(curFrame, nextFrame, groundTruthPath, lk_flow, results, HAVE_GROUND_TRUTH);
+}
+
+void backendTrack(optFlowBackend& backend, const vector<Point2f>& points, vector<flow_t_>& lk_flow, flowResults& results)
+{
+	backend.timings.fit = 0;
+	double time = (double)getTickCount();
+	backend.trackPoints(points, lk_flow);
+	backend.timings.track = (((double)getTickCount() - time)/getTickFrequency())*1000 - backend.timings.fit; //in miliseconds
+
+	results.time = backend.timings.track;
+	results.prepare_time = backend.timings.prepare;
+	results.pyramid_time = backend.timings.pyramid;
+	results.fit_time = backend.timings.fit;
+}
+
+void backendScore(const preloadedFrame& curFrame, const preloadedFrame& nextFrame, const char* groundTruthPath,
+		const vector<flow_t_>& lk_flow, flowResults& results, bool HAVE_GROUND_TRUTH)
+{
+	if (HAVE_GROUND_TRUTH)
+		calcErrorMetrics(groundTruthPath, lk_flow, results.angErr, results.magErr);
+
+	results.points_left = lk_flow.size();
+
+	//Vizualise calculated optical flow with arrow field
+	results.flow_viz = showFlow(curFrame.color, nextFrame.color, lk_flow);
+}
@@ -0,0 +1,93 @@
+/*
+ * optFlow_backend.h
+ *
+ *  Created on: Mar 30, 2016
+ *      Author: hrvoje
+ */
+
+#ifndef OPTFLOW_BACKEND_H_
+#define OPTFLOW_BACKEND_H_
+
+#include <string>
+#include <vector>
+#include "opencv2/core.hpp"
+
+#include "calcErrorMetrics.h"
+extern "C" {
+#include "image.h"
+}
+
+/* One decoded input frame. Every backend is fed from the same preloaded frame, so the decode and
+ * colour conversion happen once per frame and all engines see exactly the same pixels.
+ */
+struct preloadedFrame {
+	std::string path;          // file the frame was read from
+	cv::Mat color;             // BGR image as decoded by imread
+	struct image_t yuv;        // UYVY (YUV 4:2:2) version of color, as delivered by the camera
+	struct image_t gray_img;   // Y channel of yuv
+	cv::Mat gray;              // cv::Mat header sharing the buffer of gray_img (no copy)
+};
+
+void loadFrame(const std::string&, preloadedFrame&);
+void decodeFrame(const std::string&, preloadedFrame&);   // the two halves of loadFrame, so they can run
+void convertFrame(preloadedFrame&);                       // as separate pipeline stages
+void freeFrame(preloadedFrame&);
+
+/* Timings of the last prepareFrame()/trackPoints() calls in miliseconds, filled in by the harness.
+ * pyramid is the part of them spent building image pyramids, fit the time spent on work after tracking
+ * (the ego-motion fit), both reported by the backends themselves. track does not include fit.
+ */
+struct backendTimings {
+	float prepare;
+	float track;
+	float pyramid;
+	float fit;
+};
+
+/* Abstract optical flow engine.
+ * prepareFrame() is called once for every frame of the sequence, in order. The backend may keep
+ * whatever per-frame state it needs (pyramids, converted images, ...) for the previous and the
+ * current frame. The caller keeps the last two prepared frames alive, older ones may be released.
+ * trackPoints() then tracks points from the previously prepared frame into the last one.
+ */
+class optFlowBackend {
+public:
+	optFlowBackend() { timings.prepare = 0; timings.track = 0; timings.pyramid = 0; timings.fit = 0; }
+	virtual ~optFlowBackend() {}
+
+	virtual const char *name() const = 0;
+
+	virtual void prepareFrame(const preloadedFrame& frame) = 0;
+
+	// points are (column, row) coordinates in the previous frame, flow is in pixels. Points that
+	// could not be tracked are left out of the output.
+	virtual void trackPoints(const std::vector<cv::Point2f>& points, std::vector<flow_t_>& flow) = 0;
+
+	backendTimings timings;
+};
+
+/* Registry of available backends, so engines only have to register themselves to be benchmarked */
+typedef optFlowBackend *(*backendFactory)();
+
+void registerBackend(const std::string& name, backendFactory factory);
+optFlowBackend *createBackend(const std::string& name);
+std::vector<std::string> listBackends();
+
+struct backendRegistrar {
+	backendRegistrar(const std::string& name, backendFactory factory) { registerBackend(name, factory); }
+};
+
+#define REGISTER_OPTFLOW_BACKEND(name, type) \
+	static optFlowBackend *create_##type() { return new type; } \
+	static backendRegistrar registrar_##type(name, create_##type);
+
+/* Common harness plumbing: timing, error metrics and visualisation for any backend */
+void backendPrepareFrame(optFlowBackend&, const preloadedFrame&);
+void backendEvaluate(optFlowBackend&, const preloadedFrame&, const preloadedFrame&, const char*,
+		const std::vector<cv::Point2f>&, flowResults&, bool);
+
+// backendEvaluate in two steps: the tracking, which needs the backend, and the scoring, which only needs its output
+void backendTrack(optFlowBackend&, const std::vector<cv::Point2f>&, std::vector<flow_t_>&, flowResults&);
+void backendScore(const preloadedFrame&, const preloadedFrame&, const char*, const std::vector<flow_t_>&, flowResults&, bool);
+
+#endif /* OPTFLOW_BACKEND_H_ */
@@ -0,0 +1,70 @@
+/*
+ * optFlow_blockmatch.cpp
+ *
+ *  Created on: Mar 31, 2016
+ *      Author: hrvoje
+ */
+
+#include <cstdlib>
+#include <stdexcept>
+
+extern "C" {
+#include "block_matching.h"
+#include "lucas_kanade.h"
+}
+
+#include "optFlow_blockmatch.h"
+
+using namespace cv;
+using namespace std;
+
+REGISTER_OPTFLOW_BACKEND("blockmatch", blockMatchBackend)
+
+blockMatchBackend::blockMatchBackend()
+	: search_level(2),
+	  block_size(16),
+	  search_range(8),
+	  lk_refine(true)
+{
+}
+
+void blockMatchBackend::trackPoints(const vector<Point2f>& points, vector<flow_t_>& bm_flow)
+{
+	if (search_level > pyramid_level)
+		throw invalid_argument("blockMatchBackend : search_level larger than pyramid_level");
+
+	bm_flow.clear();
+	if (points.empty())
+		return;
+
+	updatePyramids();
+
+	vector<struct point_t> corners(points.size());
+	for (vector<Point2f>::size_type i = 0; i != points.size(); i++) {
+		corners[i].x = points[i].x; // column
+		corners[i].y = points[i].y; // row
+	}
+
+	uint16_t numTracked = corners.size();
+	struct flow_t *vectors = block_matching_flow(&curPyramid.levels[0], &prevPyramid.levels[0], &corners[0], &numTracked,
+			curPyramid.border_size, search_level, block_size, search_range, subpixel_factor);
+
+	// With the settings of level 0 and the padding the pyramids were built with (pyramidBorderSize(), the
+	// opticFlowLK_levels_border_size() of all levels), which is larger than level 0 needs with level_params
+	if (lk_refine) {
+		vector<struct lk_level_params> levels = trackingLevels();
+		opticFlowLK_refine(&curPyramid.levels[0], &prevPyramid.levels[0], vectors, &numTracked,
+				&levels[0], curPyramid.border_size, subpixel_factor);
+	}
+
+	flow_t_ var;
+	for (uint16_t i = 0; i < numTracked; i++) {
+		var.pos.x = vectors[i].pos.x / subpixel_factor;
+		var.pos.y = vectors[i].pos.y / subpixel_factor;
+		var.flow_x = float(vectors[i].flow_x) / subpixel_factor;
+		var.flow_y = float(vectors[i].flow_y) / subpixel_factor;
+		bm_flow.push_back(var);
+	}
+
+	free(vectors);
+}
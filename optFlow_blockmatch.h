@@ -0,0 +1,29 @@
+/*
+ * optFlow_blockmatch.h
+ *
+ *  Created on: Mar 31, 2016
+ *      Author: hrvoje
+ */
+
+#ifndef OPTFLOW_BLOCKMATCH_H_
+#define OPTFLOW_BLOCKMATCH_H_
+
+#include "optFlow_paparazzi.h"
+
+/* SAD block matching (block_matching.c) on one level of the Paparazzi pyramid, optionally refined
+ * to subpixel accuracy by one Lucas-Kanade pass on level 0 with the paparazziBackend settings.
+ */
+class blockMatchBackend : public paparazziBackend {
+public:
+	blockMatchBackend();
+
+	const char *name() const { return "blockmatch"; }
+	void trackPoints(const std::vector<cv::Point2f>& points, std::vector<flow_t_>& flow);
+
+	uint8_t search_level;   // pyramid level to search on, at most pyramid_level
+	uint8_t block_size;     // compared block is block_size x block_size pixels on search_level
+	uint8_t search_range;   // +- range in pixels on search_level
+	bool lk_refine;         // refine the integer flow with Lucas-Kanade on level 0
+};
+
+#endif /* OPTFLOW_BLOCKMATCH_H_ */
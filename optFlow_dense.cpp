@@ -0,0 +1,90 @@
+/*
+ * optFlow_dense.cpp
+ *
+ *  Created on: Mar 30, 2016
+ *      Author: hrvoje
+ */
+
+#include "opencv2/video/video.hpp"
+#include "opencv2/core.hpp"
+
+#include <stdexcept>
+
+#include "optFlow_dense.h"
+
+using namespace cv;
+using namespace std;
+
+REGISTER_OPTFLOW_BACKEND("farneback", farnebackBackend)
+#ifdef HAVE_DIS_OPTICAL_FLOW
+REGISTER_OPTFLOW_BACKEND("dis", disBackend)
+#endif
+
+void denseBackend::prepareFrame(const preloadedFrame& frame)
+{
+	// Mats are reference counted, this only shares the preloaded grayscale buffer
+	prevFrame = curFrame;
+	curFrame = frame.gray;
+}
+
+void denseBackend::trackPoints(const vector<Point2f>& points, vector<flow_t_>& dense_flow)
+{
+	Mat flow;
+	flow_t_ var;
+
+	dense_flow.clear();
+
+	if (!prevFrame.data || !curFrame.data)
+		throw invalid_argument ("Images have not loaded properly!");
+
+	calcDenseFlow(prevFrame, curFrame, flow);
+
+	// Sample the flow field at the requested points
+	for (vector<Point2f>::const_iterator iter = points.begin(); iter != points.end(); iter++) {
+		int col = cvRound(iter->x);
+		int row = cvRound(iter->y);
+		if (col < 0 || row < 0 || col >= flow.cols || row >= flow.rows)
+			continue;
+
+		const Vec2f& f = flow.at<Vec2f>(row, col);
+		var.pos.x = iter->x; // column
+		var.pos.y = iter->y; // row
+		var.flow_x = f[0];
+		var.flow_y = f[1];
+		dense_flow.push_back(var);
+	}
+}
+
+farnebackBackend::farnebackBackend()
+	: pyr_scale(0.5),
+	  levels(3),
+	  winsize(15),
+	  iterations(3),
+	  poly_n(5),
+	  poly_sigma(1.2)
+{
+}
+
+void farnebackBackend::calcDenseFlow(const Mat& prev, const Mat& next, Mat& flow)
+{
+	calcOpticalFlowFarneback(prev, next, flow, pyr_scale, levels, winsize, iterations, poly_n, poly_sigma, 0);
+}
+
+#ifdef HAVE_DIS_OPTICAL_FLOW
+disBackend::disBackend()
+	: preset(DISOpticalFlow::PRESET_MEDIUM),
+	  disPreset(-1)
+{
+}
+
+void disBackend::calcDenseFlow(const Mat& prev, const Mat& next, Mat& flow)
+{
+	// Creating the instance allocates its internal buffers, only do it when the preset changes
+	if (!dis || disPreset != preset) {
+		dis = DISOpticalFlow::create(preset);
+		disPreset = preset;
+	}
+
+	dis->calc(prev, next, flow);
+}
+#endif
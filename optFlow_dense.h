@@ -0,0 +1,70 @@
+/*
+ * optFlow_dense.h
+ *
+ *  Created on: Mar 30, 2016
+ *      Author: hrvoje
+ */
+
+#ifndef OPTFLOW_DENSE_H_
+#define OPTFLOW_DENSE_H_
+
+#include "opencv2/video/video.hpp"
+#include "optFlow_backend.h"
+
+/* Dense OpenCV optical flow used as a reference for the sparse trackers. The flow field is
+ * computed for the whole image and then sampled at the requested points.
+ */
+class denseBackend : public optFlowBackend {
+public:
+	void prepareFrame(const preloadedFrame& frame);
+	void trackPoints(const std::vector<cv::Point2f>& points, std::vector<flow_t_>& flow);
+
+protected:
+	// Fill flow (CV_32FC2, same size as the images) with the flow from prev to next
+	virtual void calcDenseFlow(const cv::Mat& prev, const cv::Mat& next, cv::Mat& flow) = 0;
+
+private:
+	cv::Mat prevFrame;
+	cv::Mat curFrame;
+};
+
+/* calcOpticalFlowFarneback */
+class farnebackBackend : public denseBackend {
+public:
+	farnebackBackend();
+
+	const char *name() const { return "farneback"; }
+
+	double pyr_scale;
+	int levels;
+	int winsize;
+	int iterations;
+	int poly_n;
+	double poly_sigma;
+
+protected:
+	void calcDenseFlow(const cv::Mat& prev, const cv::Mat& next, cv::Mat& flow);
+};
+
+#if CV_VERSION_MAJOR >= 4
+#define HAVE_DIS_OPTICAL_FLOW 1
+
+/* DISOpticalFlow, part of the video module since OpenCV 4.0 */
+class disBackend : public denseBackend {
+public:
+	disBackend();
+
+	const char *name() const { return "dis"; }
+
+	int preset;   // cv::DISOpticalFlow::PRESET_*
+
+protected:
+	void calcDenseFlow(const cv::Mat& prev, const cv::Mat& next, cv::Mat& flow);
+
+private:
+	cv::Ptr<cv::DISOpticalFlow> dis;
+	int disPreset;  // preset dis was created with
+};
+#endif
+
+#endif /* OPTFLOW_DENSE_H_ */
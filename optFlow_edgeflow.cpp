@@ -0,0 +1,67 @@
+/*
+ * optFlow_edgeflow.cpp
+ *
+ *  Created on: Apr 1, 2016
+ *      Author: hrvoje
+ */
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "optFlow_edgeflow.h"
+
+using namespace cv;
+using namespace std;
+
+REGISTER_OPTFLOW_BACKEND("edgeflow", edgeflowBackend)
+
+edgeflowBackend::edgeflowBackend()
+	: window(10),
+	  max_disp(10),
+	  subpixel_factor(100),
+	  width(0),
+	  height(0)
+{
+	global_flow.flow_x = 0;
+	global_flow.flow_y = 0;
+	global_flow.div_x = 0;
+	global_flow.div_y = 0;
+}
+
+void edgeflowBackend::prepareFrame(const preloadedFrame& frame)
+{
+	struct image_t *gray = const_cast<struct image_t *>(&frame.gray_img);
+
+	prevHistX.swap(curHistX);
+	prevHistY.swap(curHistY);
+	curHistX.resize(gray->w);
+	curHistY.resize(gray->h);
+	width = gray->w;
+	height = gray->h;
+	if (work.size() < EDGEFLOW_BUFFER_SIZE(max(width, height)))
+		work.resize(EDGEFLOW_BUFFER_SIZE(max(width, height)));
+
+	image_edge_histogram(gray, &curHistX[0], TRUE);
+	image_edge_histogram(gray, &curHistY[0], FALSE);
+}
+
+void edgeflowBackend::trackPoints(const vector<Point2f>& points, vector<flow_t_>& edge_flow)
+{
+	if (prevHistX.size() != curHistX.size() || prevHistY.size() != curHistY.size() || curHistX.empty())
+		throw logic_error("edgeflowBackend : two frames of the same size have to be prepared before tracking");
+
+	edgeflow_calc(&prevHistX[0], &prevHistY[0], &curHistX[0], &curHistY[0], width, height,
+			window, max_disp, subpixel_factor, &work[0], &global_flow);
+
+	// Evaluate the global flow model at every point
+	float sf = subpixel_factor;
+	flow_t_ var;
+	edge_flow.clear();
+	for (vector<Point2f>::const_iterator iter = points.begin(); iter != points.end(); iter++) {
+		var.pos.x = iter->x; // column
+		var.pos.y = iter->y; // row
+		var.flow_x = (global_flow.flow_x + global_flow.div_x * (iter->x - width / 2) / sf) / sf;
+		var.flow_y = (global_flow.flow_y + global_flow.div_y * (iter->y - height / 2) / sf) / sf;
+		edge_flow.push_back(var);
+	}
+}
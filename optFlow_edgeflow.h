@@ -0,0 +1,41 @@
+/*
+ * optFlow_edgeflow.h
+ *
+ *  Created on: Apr 1, 2016
+ *      Author: hrvoje
+ */
+
+#ifndef OPTFLOW_EDGEFLOW_H_
+#define OPTFLOW_EDGEFLOW_H_
+
+#include "optFlow_backend.h"
+extern "C" {
+#include "edge_flow.h"
+}
+
+/* Global translation and divergence from edge histograms (edge_flow.c). The edge histograms are
+ * computed once per frame in prepareFrame(); trackPoints() evaluates the global flow model at the points.
+ * The SAD work buffer of the matching is kept between calls and only grows with the frame size.
+ */
+class edgeflowBackend : public optFlowBackend {
+public:
+	edgeflowBackend();
+
+	const char *name() const { return "edgeflow"; }
+	void prepareFrame(const preloadedFrame& frame);
+	void trackPoints(const std::vector<cv::Point2f>& points, std::vector<flow_t_>& flow);
+
+	uint8_t window;             // half size of the compared histogram window
+	uint8_t max_disp;           // maximum displacement in pixels
+	uint32_t subpixel_factor;
+
+	struct edgeflow_t global_flow;   // result of the last trackPoints() call
+
+private:
+	std::vector<int32_t> prevHistX, prevHistY;
+	std::vector<int32_t> curHistX, curHistY;
+	std::vector<uint32_t> work;      // EDGEFLOW_BUFFER_SIZE(max(width, height)) elements for edgeflow_calc()
+	uint16_t width, height;
+};
+
+#endif /* OPTFLOW_EDGEFLOW_H_ */
@@ -5,56 +5,72 @@
  *      Author: hrvoje
  */
 
-#include "opencv2/imgcodecs.hpp" //imread now part of this module (not corrected in opencv documentation)
 #include "opencv2/video/video.hpp"
 #include "opencv2/core.hpp"
 
 #include <iostream>
 #include <stdexcept>
 
-
-#include "showFlow.h"
-#include <time.h>
 #include "optFlow_opencv.h"
 
 using namespace cv;
 using namespace std;
 
+REGISTER_OPTFLOW_BACKEND("opencv", opencvBackend)
+
+opencvBackend::opencvBackend()
+	: win_size(10),
+	  pyramid_level(2),
+	  max_iterations(20),
+	  epsilon(0.03),
+	  pyramidLevel(-1)
+{
+}
+
+void opencvBackend::buildPyramid(const Mat& frame, vector<Mat>& pyramid)
+{
+	double time = (double)getTickCount();
+	pyramidWinSize = Size(win_size, win_size);
+	pyramidLevel = pyramid_level;
+	buildOpticalFlowPyramid(frame, pyramid, pyramidWinSize, pyramidLevel, true);
+	timings.pyramid += (((double)getTickCount() - time)/getTickFrequency())*1000; //in miliseconds
+}
+
+void opencvBackend::prepareFrame(const preloadedFrame& frame)
+{
+	// Mats are reference counted, this only shares the preloaded grayscale buffer
+	prevFrame = curFrame;
+	curFrame = frame.gray;
+	swap(prevPyramid, curPyramid);
+	buildPyramid(curFrame, curPyramid);
+}
 
-void optFlow_opencv(const char* curImagePath, const char* nextImagePath, const char* groundTruthPath, const vector<Point2f>& currPoints,
-		int pyrLevel, flowResults& results, bool HAVE_GROUND_TRUTH )
+void opencvBackend::trackPoints(const vector<Point2f>& currPoints, vector<flow_t_>& lk_flow)
 {
-	TermCriteria termcrit(TermCriteria::COUNT | TermCriteria::EPS, 20, 0.03);
-	Size subPixWinSize(10, 10), winSize(10, 10);
+	TermCriteria termcrit(TermCriteria::COUNT | TermCriteria::EPS, max_iterations, epsilon);
+	Size winSize(win_size, win_size);
 	vector<Point2f> nextPoints; //typedef Point_<float> Point2f;
 	//REMEMBER! currPoints.x == width == columns; currPoints.y == height == rows;
 	vector<uchar> status;
 	vector<float> err;
-	vector<flow_t_> lk_flow;
 	flow_t_ var;
 
-	//Read images into openCV Mat image container, automatically convert to gray
-	Mat currFrame, nextFrame;
-	currFrame = imread(curImagePath,	IMREAD_GRAYSCALE);
-	nextFrame = imread(nextImagePath,	IMREAD_GRAYSCALE);
+	lk_flow.clear();
 
-
-	if (!currFrame.data || !nextFrame.data)
+	if (!prevFrame.data || !curFrame.data)
 		throw invalid_argument ("Images have not loaded properly!");
 
+	if (currPoints.empty())
+		return;
 
-	/*cout << "OpenCV points (column -- row)" << endl;
-	cout << "size : " << currPoints.size() << endl;
-	for (unsigned int i = 0; i != currPoints.size(); i++)
-		cout << i << "    " << currPoints[i].x << "   " << currPoints[i].y << endl;*/
-
+	// Rebuild the cached pyramids if the settings changed since they were built
+	if (prevPyramid.empty() || pyramidWinSize.width != win_size || pyramidLevel != pyramid_level) {
+		buildPyramid(prevFrame, prevPyramid);
+		buildPyramid(curFrame, curPyramid);
+	}
 
 	//Based on selected features find their position in next frame
-	double time = (double)getTickCount();
-	calcOpticalFlowPyrLK(currFrame, nextFrame, currPoints, nextPoints, status, err, winSize, pyrLevel, termcrit, 0, 0.001);
-	time = (((double)getTickCount() - time)/getTickFrequency())*1000;
-	results.time = time;
-
+	calcOpticalFlowPyrLK(prevPyramid, curPyramid, currPoints, nextPoints, status, err, winSize, pyramid_level, termcrit, 0, 0.001);
 
 	/*cout << endl;
 	cout << "OpenCV tracked points(column -- row) " << endl;
@@ -74,19 +90,6 @@ void optFlow_opencv(const char* curImagePath, const char* nextImagePath, const c
 		lk_flow.push_back(var);}
 		//cout << var.pos.x << " " << var.pos.y << endl;
 	}
-/*
-	cout << endl;
-	cout << "OpenCV size " << lk_flow.size() << endl;
-	cout << "OpenCV error" << endl;
-	for (vector<float>::const_iterator it = err.begin(); it != err.end(); it++)
-		cout << *it << endl;
-	cout << endl;
-*/
-	if (HAVE_GROUND_TRUTH)
-		calcErrorMetrics(groundTruthPath, lk_flow, results.angErr, results.magErr);
-
-	results.points_left = lk_flow.size();
-	results.flow_viz = showFlow(currFrame, nextFrame, curImagePath, lk_flow);
 }
 
 /*
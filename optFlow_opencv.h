@@ -8,17 +8,33 @@
 #ifndef OPTFLOW_OPENCV_H_
 #define OPTFLOW_OPENCV_H_
 
-/*struct flowResults {
-	float angErr;
-	float magErr;
-	float time;
-	cv::Mat flow_viz;
-};*/
-
-#include "calcErrorMetrics.h"
-#include <vector>
-#include "opencv2/core.hpp"
-
-void optFlow_opencv(const char*, const char*, const char*, const std::vector<cv::Point2f>&, int pyrLevel, flowResults&, bool);
+#include "optFlow_backend.h"
+
+/* OpenCV pyramidal Lucas-Kanade (calcOpticalFlowPyrLK).
+ * Pyramids (with derivatives) are built once per frame with buildOpticalFlowPyramid and reused for the next pair.
+ */
+class opencvBackend : public optFlowBackend {
+public:
+	opencvBackend();
+
+	const char *name() const { return "opencv"; }
+	void prepareFrame(const preloadedFrame& frame);
+	void trackPoints(const std::vector<cv::Point2f>& points, std::vector<flow_t_>& flow);
+
+	int win_size;
+	int pyramid_level;
+	int max_iterations;
+	double epsilon;
+
+private:
+	void buildPyramid(const cv::Mat& frame, std::vector<cv::Mat>& pyramid);
+
+	cv::Mat prevFrame;
+	cv::Mat curFrame;
+	std::vector<cv::Mat> prevPyramid;
+	std::vector<cv::Mat> curPyramid;
+	cv::Size pyramidWinSize;   // settings the cached pyramids were built with
+	int pyramidLevel;
+};
 
 #endif /* OPTFLOW_OPENCV_H_ */
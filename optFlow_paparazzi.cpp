@@ -5,52 +5,343 @@
  *      Author: hrvoje
  */
 
-#include "opencv2/imgproc/imgproc.hpp"
-#include "opencv2/highgui/highgui.hpp"
-#include "opencv2/imgcodecs.hpp"
+#include "opencv2/core.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <thread>
 #include <stdexcept>
 
 #include <iostream>
-#include "rgb2yuv422.h"
 extern "C" {
 #include "fast_rosten.h"
-#include "lucas_kanade.h"
 }
 
-#include "time.h"
-#include "showFlow.h"
 #include "optFlow_paparazzi.h"
 
 using namespace cv;
 using namespace std;
 
-void optFlow_paparazzi(const char* curImagePath, const char* nextImagePath, const char* groundTruthPath, const vector<Point2f>& points,
-		flowResults& results, const int MAX_POINTS, bool HAVE_GROUND_TRUTH)
+REGISTER_OPTFLOW_BACKEND("paparazzi", paparazziBackend)
+REGISTER_OPTFLOW_BACKEND("paparazzi_levels", paparazziLevelsBackend)
+REGISTER_OPTFLOW_BACKEND("paparazzi_float", paparazziFloatBackend)
+REGISTER_OPTFLOW_BACKEND("paparazzi_lanes", paparazziLanesBackend)
+
+/* Orders point indices by descending priority */
+struct priorityGreater {
+	priorityGreater(const vector<float>& priority) : priority(priority) {}
+	bool operator()(uint16_t a, uint16_t b) const { return priority[a] > priority[b]; }
+	const vector<float>& priority;
+};
+
+paparazziBackend::paparazziBackend()
+	: window_size(10), // za ovu 31 vrijednost rezultati fantasticni
+	  subpixel_factor(100), //changed 16 -> 32 here, lucas_kanade.c, lucas_kanade.h; also all functions that use subpixel_factor: image subpixel window,
+	  max_iterations(20),
+	  step_threshold(3),
+	  pyramid_level(2),
+	  tile_size(0),
+	  float_engine(false),
+	  point_parallel(false),
+	  cache_templates(false),
+	  templates_taken(0),
+	  tracks_continued(0),
+	  adaptive_termination(false),
+	  fit_motion(false),
+	  fit_model(FLOW_FIT_SIMILARITY),
+	  fit_inlier_threshold(1.0),
+	  fit_max_iterations(100),
+	  deadline_ms(0),
+	  points_skipped(0),
+	  prevFrame(NULL),
+	  curFrame(NULL),
+	  next_track_id(1)
+{
+	prevPyramid.border_size = 0;
+	curPyramid.border_size = 0;
+	memset(&motion, 0, sizeof(motion));
+	memset(&iteration_stats, 0, sizeof(iteration_stats));
+
+	convergence.oscillation = TRUE;
+	convergence.error_increase = TRUE;
+	convergence.step_halvings = 0;
+	convergence.stagnation_iterations = 2;
+
+	template_policy.max_age = 10;
+	template_policy.max_error = 25;
+
+	/* good settings:
+		 * uint16_t window_size = 31; // za ovu 31 vrijednost rezultati fantasticni
+		 * 	uint32_t subpixel_factor = 10000;
+		 * 	uint8_t max_iterations = 40;
+		 * 	uint8_t step_threshold = 0.03;
+		 * the accumulators for them are 64 bit, see opticFlowLK_accumulators()
+	*/
+}
+
+paparazziBackend::~paparazziBackend()
+{
+	freePyramid(prevPyramid);
+	freePyramid(curPyramid);
+	freeTracks();
+}
+
+void paparazziBackend::freeTracks()
+{
+	for (vector<struct lk_track>::size_type t = 0; t != tracks.size(); t++)
+		opticFlowLK_track_free(&tracks[t]);
+	tracks.clear();
+}
+
+/* Padding the pyramids need for the current window sizes */
+uint8_t paparazziBackend::pyramidBorderSize() const
+{
+	if (level_params.empty())
+		return opticFlowLK_border_size(window_size / 2);
+
+	if (level_params.size() != size_t(pyramid_level + 1))
+		throw invalid_argument("paparazziBackend : level_params needs one entry per pyramid level");
+
+	return opticFlowLK_levels_border_size(&level_params[0], pyramid_level);
+}
+
+/* Settings of every level: level_params, or the uniform settings when it is empty */
+vector<struct lk_level_params> paparazziBackend::trackingLevels() const
+{
+	if (!level_params.empty())
+		return level_params;
+
+	struct lk_level_params uniform = { uint16_t(window_size / 2), max_iterations, step_threshold, NULL, NULL };
+	return vector<struct lk_level_params>(pyramid_level + 1, uniform);
+}
+
+void paparazziBackend::buildPyramid(const preloadedFrame& frame, lkPyramid& pyramid)
+{
+	freePyramid(pyramid);
+
+	double time = (double)getTickCount();
+	pyramid.border_size = pyramidBorderSize();
+	pyramid.levels.resize(pyramid_level + 1);
+	pyramid_build(const_cast<struct image_t *>(&frame.gray_img), &pyramid.levels[0], pyramid_level, pyramid.border_size);
+	timings.pyramid += (((double)getTickCount() - time)/getTickFrequency())*1000; //in miliseconds
+}
+
+void paparazziBackend::freePyramid(lkPyramid& pyramid)
+{
+	for (vector<struct image_t>::iterator it = pyramid.levels.begin(); it != pyramid.levels.end(); it++)
+		image_free(&(*it));
+	pyramid.levels.clear();
+}
+
+/* Rebuild the cached pyramids if the settings changed since they were built */
+void paparazziBackend::updatePyramids()
+{
+	if (prevFrame == NULL || curFrame == NULL)
+		throw logic_error("paparazziBackend : two frames have to be prepared before tracking");
+
+	uint8_t border_size = pyramidBorderSize();
+	if (prevPyramid.border_size != border_size || prevPyramid.levels.size() != size_t(pyramid_level + 1))
+		buildPyramid(*prevFrame, prevPyramid);
+	if (curPyramid.border_size != border_size || curPyramid.levels.size() != size_t(pyramid_level + 1))
+		buildPyramid(*curFrame, curPyramid);
+}
+
+void paparazziBackend::prepareFrame(const preloadedFrame& frame)
+{
+	// The grayscale image is already part of the preloaded frame, only the pyramid has to be built
+	prevFrame = curFrame;
+	curFrame = &frame;
+	swap(prevPyramid, curPyramid);
+	buildPyramid(frame, curPyramid);
+}
+
+vector<Point2f> paparazziBackend::detectOnPyramid(uint8_t threshold, uint16_t min_dist, uint8_t first_level, uint8_t last_level,
+		unsigned int max_points)
+{
+	if (curFrame == NULL)
+		throw logic_error("paparazziBackend : a frame has to be prepared before detecting");
+
+	if (curPyramid.border_size != pyramidBorderSize() || curPyramid.levels.size() != size_t(pyramid_level + 1))
+		buildPyramid(*curFrame, curPyramid);
+	last_level = min(last_level, pyramid_level);
+
+	vector<Point2f> points;
+	if (first_level > last_level || max_points == 0)
+		return points;
+
+	uint16_t corner_cnt;
+	struct point_t *corners = fast9_detect_pyramid(&curPyramid.levels[0], first_level, last_level, curPyramid.border_size,
+			threshold, min_dist, &corner_cnt);
+
+	float skip_points = (corner_cnt > max_points) ? (float)corner_cnt / max_points : 1;
+	for (unsigned int i = 0; i < max_points && i < corner_cnt; i++) {
+		uint16_t p = i * skip_points;
+		points.push_back(Point2f(corners[p].x, corners[p].y));
+	}
+
+	free(corners);
+	return points;
+}
+
+vector<Point2f> paparazziBackend::rankPoints(const vector<Point2f>& points, unsigned int max_points)
+{
+	if (curFrame == NULL)
+		throw logic_error("paparazziBackend : a frame has to be prepared before ranking points");
+
+	if (curPyramid.border_size != pyramidBorderSize() || curPyramid.levels.size() != size_t(pyramid_level + 1))
+		buildPyramid(*curFrame, curPyramid);
+
+	vector<Point2f> ranked;
+	if (points.empty() || max_points == 0)
+		return ranked;
+
+	// Tracks at the points as trackCached() starts them
+	uint16_t candidate_cnt = uint16_t(min(points.size(), size_t(0xFFFF)));
+	vector<struct lk_track> candidates(candidate_cnt);
+	for (uint16_t i = 0; i < candidate_cnt; i++) {
+		struct point_t point = { 0, 0 };
+		opticFlowLK_track_init(&candidates[i], &point, subpixel_factor);
+		candidates[i].pos.x = candidates[i].ref.x = uint32_t(points[i].x * subpixel_factor + 0.5f);
+		candidates[i].pos.y = candidates[i].ref.y = uint32_t(points[i].y * subpixel_factor + 0.5f);
+	}
+
+	vector<float> scores(candidate_cnt);
+	vector<struct lk_level_params> levels = trackingLevels();
+	opticFlowLK_tracks_score(&curPyramid.levels[0], &candidates[0], candidate_cnt, &levels[0], curPyramid.border_size,
+			subpixel_factor, pyramid_level, &scores[0]);
+
+	// Most trackable first, the ones the tracker would lose right away are dropped
+	vector<uint16_t> order;
+	for (uint16_t i = 0; i < candidate_cnt; i++)
+		if (scores[i] > 0)
+			order.push_back(i);
+	stable_sort(order.begin(), order.end(), priorityGreater(scores));
+	if (order.size() > max_points)
+		order.resize(max_points);
+
+	// The templates of the kept points are the ones the next trackPoints() would take, when it uses templates
+	bool keep_templates = cache_templates && deadline_ms <= 0 && !float_engine;
+	vector<bool> kept(candidate_cnt, false);
+	point_priority.clear();
+	point_tracks.clear();
+	for (vector<uint16_t>::size_type k = 0; k != order.size(); k++) {
+		ranked.push_back(points[order[k]]);
+		point_priority.push_back(scores[order[k]]);
+		kept[order[k]] = true;
+		if (keep_templates) {
+			candidates[order[k]].id = next_track_id++;
+			point_tracks.push_back(candidates[order[k]].id);
+		}
+	}
+	for (uint16_t i = 0; i < candidate_cnt; i++) {
+		if (kept[i] && keep_templates)
+			tracks.push_back(candidates[i]);
+		else
+			opticFlowLK_track_free(&candidates[i]);
+	}
+	return ranked;
+}
+
+void paparazziBackend::trackPoints(const vector<Point2f>& points, vector<flow_t_>& lk_flow)
 {
-	Mat curImg = imread(curImagePath, CV_LOAD_IMAGE_COLOR);
-	Mat nextImg = imread(nextImagePath, CV_LOAD_IMAGE_COLOR);
+	lk_flow.clear();
+	if (points.empty())
+		return;
+
+	updatePyramids();
+	trackPair(prevPyramid, curPyramid, points, lk_flow, NULL, true, point_tracks);
+	if (!cache_templates)
+		freeTracks();
+}
 
+vector<batchPair> paparazziBackend::trackBatch(const vector<const preloadedFrame*>& frames, const vector<Point2f>& points,
+		const vector<unsigned int>& skips, bool pipelined)
+{
+	vector<batchPair> pairs;
+	if (frames.size() < 2)
+		return pairs;
 
-	image_t curYUV;
-	image_t nextYUV;
-	image_create(&curYUV, uint16_t (curImg.cols), uint16_t (curImg.rows), IMAGE_YUV422);
-	image_create(&nextYUV, uint16_t (nextImg.cols), uint16_t (nextImg.rows), IMAGE_YUV422);
+	// Checked here, the builder thread can not throw
+	pyramidBorderSize();
 
-	// Convert RGB image to YUV 4:2:2 format and place it in curYUV/nextYUV
-	if ( rgb2yuv422(curImg, &curYUV) )
-		throw runtime_error ("Image conversion failed! Exiting...");
+	unsigned int max_skip = 1;
+	for (vector<unsigned int>::size_type s = 0; s != skips.size(); s++)
+		max_skip = max(max_skip, skips[s]);
 
-	if ( rgb2yuv422(nextImg, &nextYUV) )
-		throw runtime_error ("Image conversion failed! Exiting...");
+	// Pyramids and chained points of the last max_skip + 1 frames, the back one is the current frame
+	deque<lkPyramid> pyramids(1);
+	deque<vector<Point2f> > chain(1, points);
+	vector<uint32_t> chain_tracks = point_tracks;  // tracks the chained points continue
+	// The priorities belong to the points of trackPoints(), a deadline tracks the chained points in their order
+	vector<float> priority;
+	priority.swap(point_priority);
+	buildPyramid(*frames[0], pyramids.back());
+	lkPyramid next;
+	buildPyramid(*frames[1], next);
 
-	// Create grayscale image from yuv image
-	image_t curGray;
-	image_t nextGray;
-	image_create(&curGray, curYUV.w, curYUV.h, IMAGE_GRAYSCALE);
-	image_create(&nextGray, nextYUV.w, nextYUV.h, IMAGE_GRAYSCALE);
-	image_to_grayscale(&curYUV, &curGray);
-	image_to_grayscale(&nextYUV, &nextGray);
+	for (unsigned int k = 1; k < frames.size(); k++) {
+		pyramids.push_back(lkPyramid());
+		swap(pyramids.back(), next);
+		chain.push_back(vector<Point2f>());
+		if (pyramids.size() > max_skip + 1) {
+			freePyramid(pyramids.front());
+			pyramids.pop_front();
+			chain.pop_front();
+		}
 
+		// Meanwhile the next pyramid is built
+		thread builder;
+		if (pipelined && k + 1 < frames.size())
+			builder = thread(&paparazziBackend::buildPyramid, this, cref(*frames[k + 1]), ref(next));
+
+		// The chain into frame k, then the skips that end there
+		for (unsigned int skip = 1; skip <= max_skip && skip <= k; skip++) {
+			if (skip > 1 && find(skips.begin(), skips.end(), skip) == skips.end())
+				continue;
+
+			batchPair pair;
+			pair.from = k - skip;
+			pair.to = k;
+			const vector<Point2f>& from_points = chain[chain.size() - 1 - skip];
+			double time = (double)getTickCount();
+			trackPair(pyramids[pyramids.size() - 1 - skip], pyramids.back(), from_points, pair.flow,
+					(skip == 1) ? &chain.back() : NULL, skip == 1, chain_tracks);
+			if (skip == 1) {
+				vector<Point2f> ends;
+				trackEnds(ends, chain_tracks);
+			}
+			pair.time = (((double)getTickCount() - time)/getTickFrequency())*1000; //in miliseconds
+			pairs.push_back(pair);
+		}
+
+		if (builder.joinable())
+			builder.join();
+		else if (k + 1 < frames.size())
+			buildPyramid(*frames[k + 1], next);
+	}
+
+	for (deque<lkPyramid>::iterator it = pyramids.begin(); it != pyramids.end(); it++)
+		freePyramid(*it);
+	if (!cache_templates)
+		freeTracks();
+	point_priority.swap(priority);
+	return pairs;
+}
+
+/* Track points from the prev pyramid into the cur pyramid with the current settings. With ends the
+ * subpixel end positions of the tracked points are returned as well, in the order of the flow.
+ * use_tracks continues the tracks of cache_templates given by ids, without it the points are tracked from scratch. */
+void paparazziBackend::trackPair(lkPyramid& prev, lkPyramid& cur, const vector<Point2f>& points, vector<flow_t_>& lk_flow,
+		vector<Point2f> *ends, bool use_tracks, const vector<uint32_t>& ids)
+{
+	lk_flow.clear();
+	if (ends != NULL)
+		ends->clear();
+	if (points.empty())
+		return;
 
 	struct point_t corners[points.size()];
 	//REMEMBER! points.x == width == columns; points.y == height == rows;
@@ -64,38 +355,52 @@ void optFlow_paparazzi(const char* curImagePath, const char* nextImagePath, cons
 	}
 
 	uint16_t numTracked = (sizeof(corners)/sizeof(*corners));
-	uint16_t window_size = 10; // za ovu 31 vrijednost rezultati fantasticni
-	uint32_t subpixel_factor = 100; //changed 16 -> 32 here, lucas_kanade.c, lucas_kanade.h; also all functions that use subpixel_factor: image subpixel window,
-	uint8_t max_iterations = 20;
-	uint8_t step_threshold = 3;
-	uint8_t pyramid_level = 2; // 0 for no pyramids
-	uint16_t max_track_corners = MAX_POINTS;
-	vector<flow_t_> lk_flow;
+	uint16_t max_track_corners = numTracked;
 	flow_t_ var;
 
-	/* good settings:
-		 * uint16_t window_size = 31; // za ovu 31 vrijednost rezultati fantasticni
-		 * 	uint32_t subpixel_factor = 10000;
-		 * 	uint8_t max_iterations = 40;
-		 * 	uint8_t step_threshold = 0.03;
-	*/
+	struct flow_t *vectors;
+	points_skipped = 0;
+	tracks_continued = 0;
 
-	/*cout << "Paparazzi points (column -- row)" << endl;
-		cout << "size : " << points.size() << endl;
-		for (unsigned int i = 0; i != points.size(); i++)
-			cout << i << "    " << points[i].x << "   " << points[i].y << endl;*/
+	// The termination criteria and statistics go along with the settings of every level
+	memset(&iteration_stats, 0, sizeof(iteration_stats));
+	vector<struct lk_level_params> levels = trackingLevels();
+	for (vector<struct lk_level_params>::size_type l = 0; l != levels.size(); l++) {
+		levels[l].convergence = adaptive_termination ? &convergence : NULL;
+		levels[l].stats = &iteration_stats;
+	}
 
+	if (deadline_ms > 0) {
+		// Track in priority order (highest first) until the time budget is used up
+		vector<uint16_t> order(numTracked);
+		for (uint16_t i = 0; i < numTracked; i++)
+			order[i] = i;
+		if (!point_priority.empty()) {
+			if (point_priority.size() != points.size())
+				throw invalid_argument("paparazziBackend : point_priority needs one entry per point");
+			stable_sort(order.begin(), order.end(), priorityGreater(point_priority));
+		}
 
-	double time = (double)getTickCount();
-	struct flow_t *vectors = opticFlowLK(&nextGray, &curGray, corners, &numTracked,
-	                                       window_size / 2, subpixel_factor, max_iterations,
-										   step_threshold, max_track_corners, pyramid_level);
-	time = (((double)getTickCount() - time)/getTickFrequency())*1000; //in miliseconds
-	results.time = time;
-
-	//cout << endl;
-	//cout << "Paparazzi tracked points (column -- row)" << endl;
-	//cout << "Total number of points: "<< numTracked << endl;
+		vector<uint8_t> status(numTracked);
+		vectors = opticFlowLK_deadline(&cur.levels[0], &prev.levels[0], corners, &numTracked,
+				&order[0], &status[0], uint32_t(deadline_ms * 1000), &levels[0], cur.border_size, subpixel_factor, pyramid_level);
+		points_skipped = count(status.begin(), status.end(), uint8_t(LK_POINT_SKIPPED));
+	} else if (float_engine) {
+		if (point_parallel)
+			vectors = opticFlowLK_float_lanes(&cur.levels[0], &prev.levels[0], corners, &numTracked,
+					&levels[0], cur.border_size, subpixel_factor, max_track_corners, pyramid_level);
+		else
+			vectors = opticFlowLK_float_levels(&cur.levels[0], &prev.levels[0], corners, &numTracked,
+					&levels[0], cur.border_size, subpixel_factor, max_track_corners, pyramid_level);
+	} else if (cache_templates && use_tracks) {
+		vectors = trackCached(prev, cur, points, ids, levels, numTracked);
+	} else if (tile_size > 0) {
+		vectors = opticFlowLK_tiled(&cur.levels[0], &prev.levels[0], corners, &numTracked,
+				&levels[0], cur.border_size, subpixel_factor, max_track_corners, pyramid_level, tile_size);
+	} else {
+		vectors = opticFlowLK_levels(&cur.levels[0], &prev.levels[0], corners, &numTracked,
+				&levels[0], cur.border_size, subpixel_factor, max_track_corners, pyramid_level);
+	}
 
 	// Go through all the points
 	for (uint16_t i = 0; i < numTracked; i++) {
@@ -106,29 +411,97 @@ void optFlow_paparazzi(const char* curImagePath, const char* nextImagePath, cons
 		var.flow_y = float(vectors[i].flow_y) / subpixel_factor;
 		lk_flow.push_back(var);
 		//cout << var.flow_x << " " << var.flow_y << endl;
+		if (ends != NULL)
+			ends->push_back(Point2f(float(vectors[i].pos.x + vectors[i].flow_x) / subpixel_factor,
+					float(vectors[i].pos.y + vectors[i].flow_y) / subpixel_factor));
 	}
 
-/*
-	cout << endl;
-	cout << "Paparazzi flow (hor_flow -- vert_flow)" << endl;
-	for (vector<flow_t_>::const_iterator it = lk_flow.begin();
-			it != lk_flow.end(); it++)
-		cout << it->flow_x << " " << it->flow_y << endl;
-	cout << endl;
-*/
-	if (HAVE_GROUND_TRUTH)
-		calcErrorMetrics(groundTruthPath, lk_flow, results.angErr, results.magErr);
+	// Ego-motion (translation, divergence, rotation) around the image center
+	if (fit_motion) {
+		double time = (double)getTickCount();
+		flow_fit(vectors, numTracked, subpixel_factor, (cur.levels[0].w - 2 * cur.border_size) / 2.f,
+				(cur.levels[0].h - 2 * cur.border_size) / 2.f,
+				fit_model, fit_inlier_threshold, fit_max_iterations, 0.99, &motion);
+		timings.fit += (((double)getTickCount() - time)/getTickFrequency())*1000; //in miliseconds
+	}
 
-	results.points_left = numTracked;
+	free(vectors);
+}
 
-	//Vizualise calculated optical flow with arrow field
-	results.flow_viz = showFlow(curImg, nextImg, curImagePath, lk_flow);
+/* Continue the tracks the ids (one per point, when given) ask for with their own templates and start new tracks
+ * for the other points. Tracks that are not continued or get lost are dropped. */
+struct flow_t *paparazziBackend::trackCached(lkPyramid& prev, lkPyramid& cur, const vector<Point2f>& points,
+		const vector<uint32_t>& ids, const vector<struct lk_level_params>& levels, uint16_t& numTracked)
+{
+	map<uint32_t, vector<struct lk_track>::size_type> by_id;
+	for (vector<struct lk_track>::size_type t = 0; t != tracks.size(); t++)
+		by_id[tracks[t].id] = t;
+	bool have_ids = ids.size() == points.size();
 
+	vector<struct lk_track> requested(points.size());
+	vector<bool> continued(tracks.size(), false);
+	for (vector<Point2f>::size_type i = 0; i != points.size(); i++) {
+		map<uint32_t, vector<struct lk_track>::size_type>::const_iterator track = have_ids ? by_id.find(ids[i]) : by_id.end();
+		if (track != by_id.end() && ids[i] != 0 && !continued[track->second]) {
+			requested[i] = tracks[track->second];
+			continued[track->second] = true;
+			tracks_continued++;
+		} else {
+			struct point_t point = { 0, 0 };
+			opticFlowLK_track_init(&requested[i], &point, subpixel_factor);
+			requested[i].pos.x = uint32_t(points[i].x * subpixel_factor + 0.5f);
+			requested[i].pos.y = uint32_t(points[i].y * subpixel_factor + 0.5f);
+			requested[i].id = next_track_id++;
+		}
+	}
+	for (vector<struct lk_track>::size_type t = 0; t != tracks.size(); t++)
+		if (!continued[t])
+			opticFlowLK_track_free(&tracks[t]);
+	tracks.swap(requested);
+
+	opticFlowLK_tracks(&cur.levels[0], &prev.levels[0], &tracks[0], tracks.size(), &levels[0],
+			cur.border_size, subpixel_factor, pyramid_level, &template_policy, &templates_taken);
+
+	// Vectors from where the tracks were to where they are now, lost tracks are dropped
+	struct flow_t *vectors = (struct flow_t *)malloc(sizeof(struct flow_t) * tracks.size());
+	vector<struct lk_track> alive;
+	numTracked = 0;
+	for (vector<struct lk_track>::size_type t = 0; t != tracks.size(); t++) {
+		if (!tracks[t].tracked) {
+			opticFlowLK_track_free(&tracks[t]);
+			continue;
+		}
+		vectors[numTracked].pos.x = tracks[t].pos.x - tracks[t].flow_x;
+		vectors[numTracked].pos.y = tracks[t].pos.y - tracks[t].flow_y;
+		vectors[numTracked].flow_x = tracks[t].flow_x;
+		vectors[numTracked].flow_y = tracks[t].flow_y;
+		numTracked++;
+		alive.push_back(tracks[t]);
+	}
+	tracks.swap(alive);
+	return vectors;
+}
+
+void paparazziBackend::trackEnds(vector<Point2f>& ends, vector<uint32_t>& ids) const
+{
+	ends.clear();
+	ids.clear();
+	for (vector<struct lk_track>::size_type t = 0; t != tracks.size(); t++) {
+		ends.push_back(Point2f(float(tracks[t].pos.x) / subpixel_factor, float(tracks[t].pos.y) / subpixel_factor));
+		ids.push_back(tracks[t].id);
+	}
+}
 
-	image_free(&nextGray);
-	image_free(&curGray);
-	image_free(&nextYUV);
-	image_free(&curYUV);
+paparazziLevelsBackend::paparazziLevelsBackend()
+{
+	// Window area 121 + 49 + 169 pixels against 3 * 121 for the uniform default
+	struct lk_level_params levels[3] = {
+		{ 5, 20, 3, NULL, NULL },   // full resolution
+		{ 3, 8, 3, NULL, NULL },
+		{ 6, 20, 3, NULL, NULL }    // coarsest level, catches the large motions
+	};
+	level_params.assign(levels, levels + 3);
+	pyramid_level = 2;
 }
 
 /**
@@ -148,5 +521,3 @@ void optFlow_paparazzi(const char* curImagePath, const char* nextImagePath, cons
  */
 //struct flow_t *opticFlowLK(struct image_t *new_img, struct image_t *old_img, struct point_t *points, uint16_t *points_cnt,
 //                         uint16_t half_window_size, uint16_t subpixel_factor, uint8_t max_iterations, uint8_t step_threshold, uint16_t max_points)
-
-
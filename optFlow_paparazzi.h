@@ -8,17 +8,162 @@
 #ifndef OPTFLOW_PAPARAZZI_H_
 #define OPTFLOW_PAPARAZZI_H_
 
-/*struct flowResults {
-	float angErr;
-	float magErr;
-	float time;
-	cv::Mat flow_viz;
-};*/
-#include "calcErrorMetrics.h"
-#include <vector>
-#include "opencv2/core.hpp"
-
-void optFlow_paparazzi(const char*, const char*, const char*, const std::vector<cv::Point2f>&, flowResults&, const int, bool);
+#include "optFlow_backend.h"
+extern "C" {
+#include "flow_fit.h"
+#include "lucas_kanade.h"
+#include "lucas_kanade_float.h"
+}
 
+/* Padded image pyramid as built by pyramid_build() */
+struct lkPyramid {
+	std::vector<struct image_t> levels;
+	uint8_t border_size;
+};
+
+/* Flow of one frame pair of paparazziBackend::trackBatch() */
+struct batchPair {
+	unsigned int from, to;          // indices of the frames in the batch
+	std::vector<flow_t_> flow;      // flow of the points of frame from that were tracked
+	float time;                     // tracking time in miliseconds
+};
+
+/* Fixed-point Lucas-Kanade tracker from Paparazzi (lucas_kanade.c).
+ * The pyramid of every frame is built once in prepareFrame() and reused for both pairs the frame is part of.
+ */
+class paparazziBackend : public optFlowBackend {
+public:
+	paparazziBackend();
+	~paparazziBackend();
+
+	const char *name() const { return "paparazzi"; }
+	void prepareFrame(const preloadedFrame& frame);
+	void trackPoints(const std::vector<cv::Point2f>& points, std::vector<flow_t_>& flow);
+
+	// Track a window of consecutive frames in one call, independent of the frames given to prepareFrame().
+	// The pyramid of every frame is built once. The points are chained through the frames 0->1->...->N-1,
+	// the points of a pair are where the previous pair tracked them to (so cache_templates keeps its tracks).
+	// With a deadline the points are tracked in their order, point_priority is left for trackPoints().
+	// For every skip above 1 the chained points of frame k are also tracked directly into frame k+skip,
+	// to compare against the chain. With pipelined the pyramid of the next frame is built on a second
+	// thread while the pairs into the current frame are tracked. Pairs are returned in the order tracked.
+	std::vector<batchPair> trackBatch(const std::vector<const preloadedFrame*>& frames, const std::vector<cv::Point2f>& points,
+			const std::vector<unsigned int>& skips, bool pipelined);
+
+	// FAST corners of the last prepared frame, detected on the levels first_level to last_level of its tracking
+	// pyramid (fast9_detect_pyramid()) and given in full resolution coordinates, so no extra images are built.
+	// Coarse levels add larger-scale features at a fraction of the cost of the full resolution. At most
+	// max_points corners are returned, evenly spread over the ones found.
+	std::vector<cv::Point2f> detectOnPyramid(uint8_t threshold, uint16_t min_dist, uint8_t first_level, uint8_t last_level,
+			unsigned int max_points);
+
+	// The points, candidates found in the last prepared frame, ranked by how well they can be tracked: the
+	// smallest eigenvalue of the G-matrix of their windows on all pyramid levels (opticFlowLK_tracks_score()).
+	// Points the tracker would lose right away are dropped, at most max_points are returned, best first (so
+	// a deadline tracks them first, their scores become point_priority). With cache_templates the next
+	// trackPoints() call uses the templates and G-matrices taken here for the returned points, so scoring
+	// them costs nothing extra.
+	std::vector<cv::Point2f> rankPoints(const std::vector<cv::Point2f>& points, unsigned int max_points);
+
+	uint16_t window_size;
+	uint32_t subpixel_factor;
+	uint8_t max_iterations;
+	uint8_t step_threshold;
+	uint8_t pyramid_level; // 0 for no pyramids
+
+	// Separate window size, iterations and step threshold for every level (index 0 is the full resolution),
+	// pyramid_level + 1 entries. When empty the settings above are used on all levels.
+	std::vector<struct lk_level_params> level_params;
+
+	// Track the points tile by tile with the tiles in Morton order (opticFlowLK_tiled()), tile width and height
+	// in pixels, 0 to track them in the given order. Pays off from about 4K on. Fixed-point engine without a deadline.
+	uint16_t tile_size;
+
+	// Track with the floating-point engine (lucas_kanade_float.c) instead of the fixed-point one.
+	// Same settings and output; adaptive_termination, iteration_stats and the deadline are fixed-point only.
+	bool float_engine;
+	// With float_engine: track one point per SIMD lane (opticFlowLK_float_lanes()) instead of one window
+	// row per vector, faster for many points with small windows
+	bool point_parallel;
+
+	// Keep the tracks between trackPoints() calls and continue them with their own templates (opticFlowLK_tracks()),
+	// instead of taking new ones from the previous frame. Which track a point continues is given by point_tracks,
+	// so feed the ends of trackEnds() back as the next points for this to pay off. Fixed-point engine without a deadline.
+	bool cache_templates;
+	struct lk_template_policy template_policy;
+	std::vector<uint32_t> point_tracks; // one per point: id of the track it continues (from trackEnds()), 0 for a new track
+	uint16_t templates_taken;       // tracks that took new templates in the last trackPoints() call
+	uint16_t tracks_continued;      // points of the last trackPoints() call that continued a track
+
+	// Where the tracks kept by cache_templates are now and their ids, in the order of the flow of the last
+	// trackPoints() call (followed by the ones rankPoints() started). A continued track starts from its own
+	// subpixel end, the position given for its point is not used.
+	void trackEnds(std::vector<cv::Point2f>& ends, std::vector<uint32_t>& ids) const;
+
+	// Stop the iterations of a point early on oscillation, stagnation or an increasing error
+	bool adaptive_termination;
+	struct lk_convergence_t convergence;
+	struct lk_iteration_stats iteration_stats;  // iterations per point of the last trackPoints() call
+
+	// Robust ego-motion fit over the tracked vectors, off by default. Done in the same trackPoints() call
+	// but timed apart in timings.fit, so it does not count as tracking time
+	bool fit_motion;
+	enum flow_fit_model fit_model;
+	float fit_inlier_threshold;     // in pixels
+	uint16_t fit_max_iterations;
+	struct flow_fit_t motion;       // result of the last fit
+
+	// Time budget for trackPoints() in miliseconds, 0 to track all points. With a budget the points are
+	// tracked in order of point_priority (one value per point, higher first, filled in by rankPoints();
+	// empty tracks them in the given order, any other size throws) and the points left when the budget
+	// runs out are skipped.
+	float deadline_ms;
+	std::vector<float> point_priority;
+	uint16_t points_skipped;        // points skipped in the last trackPoints() call
+
+protected:
+	void buildPyramid(const preloadedFrame& frame, lkPyramid& pyramid);
+	void freePyramid(lkPyramid& pyramid);
+	void updatePyramids();
+	uint8_t pyramidBorderSize() const;
+	std::vector<struct lk_level_params> trackingLevels() const;
+	void trackPair(lkPyramid& prev, lkPyramid& cur, const std::vector<cv::Point2f>& points, std::vector<flow_t_>& flow,
+			std::vector<cv::Point2f> *ends, bool use_tracks, const std::vector<uint32_t>& ids);
+	struct flow_t *trackCached(lkPyramid& prev, lkPyramid& cur, const std::vector<cv::Point2f>& points,
+			const std::vector<uint32_t>& ids, const std::vector<struct lk_level_params>& levels, uint16_t& numTracked);
+	void freeTracks();
+
+	const preloadedFrame *prevFrame;
+	const preloadedFrame *curFrame;
+	lkPyramid prevPyramid;
+	lkPyramid curPyramid;
+	std::vector<struct lk_track> tracks;   // tracks of the last trackPoints() call with cache_templates
+	uint32_t next_track_id;
+};
+
+/* Paparazzi tracker with larger windows on the coarse level and a smaller, cheaper window on the middle one,
+ * at a lower total window area than the uniform default, to compare against it */
+class paparazziLevelsBackend : public paparazziBackend {
+public:
+	paparazziLevelsBackend();
+
+	const char *name() const { return "paparazzi_levels"; }
+};
+
+/* Paparazzi tracker settings on the floating-point engine, to compare against the fixed-point one */
+class paparazziFloatBackend : public paparazziBackend {
+public:
+	paparazziFloatBackend() { float_engine = true; }
+
+	const char *name() const { return "paparazzi_float"; }
+};
+
+/* Floating-point engine with the points in the SIMD lanes, to compare against paparazzi_float */
+class paparazziLanesBackend : public paparazziBackend {
+public:
+	paparazziLanesBackend() { float_engine = true; point_parallel = true; }
+
+	const char *name() const { return "paparazzi_lanes"; }
+};
 
 #endif /* OPTFLOW_PAPARAZZI_H_ */
@@ -18,11 +18,11 @@ using namespace std;
 using namespace cv;
 
 
-Mat showFlow(const Mat& currFrame, const Mat& nextFrame, const string& imgPath, const vector<flow_t_>& lk_flow)
+Mat showFlow(const Mat& currFrame, const Mat& /* nextFrame, not drawn */, const vector<flow_t_>& lk_flow)
 {
 	static const double pi = 3.14159265358979323846;
 
-	Mat flowField = imread(imgPath, IMREAD_UNCHANGED);
+	Mat flowField = currFrame.clone();
 
 	/* For fun (and debugging :)), let's draw the flow field. */
 	for (vector<flow_t_>::size_type i = 0; i < lk_flow.size(); i++) {
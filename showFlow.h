@@ -6,7 +6,7 @@
 
 
 
-cv::Mat showFlow(const cv::Mat&, const cv::Mat&, const std::string&, const std::vector<flow_t_>&);
+cv::Mat showFlow(const cv::Mat&, const cv::Mat&, const std::vector<flow_t_>&);
 
 
 
@@ -0,0 +1,44 @@
+/*
+ * stagePipeline.cpp
+ *
+ *  Created on: Apr 12, 2016
+ *      Author: hrvoje
+ */
+
+#include <iostream>
+#include <iomanip>
+
+#include "stagePipeline.h"
+
+using namespace std;
+
+void pipelineBackoff::pause()
+{
+	if (rounds < 16)
+		;                                   // busy spin, the other side is usually only a few instructions away
+	else if (rounds < 64)
+		this_thread::yield();
+	else
+		this_thread::sleep_for(chrono::microseconds(50));
+	rounds++;
+}
+
+void printPipelineMetrics(const vector<stageMetrics>& stages)
+{
+	ios::fmtflags flags = cout.flags();
+	streamsize precision = cout.precision();
+
+	cout << "Pipeline stage       threads  items   busy ms  starved (ms)      blocked (ms)      queue depth mean/max/capacity" << endl;
+	for (vector<stageMetrics>::size_type s = 0; s != stages.size(); s++) {
+		const stageMetrics& m = stages[s];
+		cout << left << setw(20) << (m.name + (m.ordered ? " (ordered)" : "")) << right
+				<< setw(8) << m.threads << setw(7) << m.items
+				<< fixed << setprecision(1) << setw(10) << m.busy_ms
+				<< setw(7) << m.starved << " (" << setw(7) << m.starved_ms << ")"
+				<< setw(7) << m.blocked << " (" << setw(7) << m.blocked_ms << ")"
+				<< "   " << setprecision(2) << m.mean_depth << "/" << m.max_depth << "/" << m.capacity << endl;
+	}
+
+	cout.flags(flags);
+	cout.precision(precision);
+}
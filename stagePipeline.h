@@ -0,0 +1,343 @@
+/*
+ * stagePipeline.h
+ *
+ *  Created on: Apr 12, 2016
+ *      Author: hrvoje
+ */
+
+#ifndef STAGEPIPELINE_H_
+#define STAGEPIPELINE_H_
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "boundedQueue.h"
+
+/* Counters of one stage, for tuning queue sizes and thread counts.
+ * A stage that is often starved waits for the stages before it, a stage that is often blocked for the ones after it;
+ * the stage with the highest busy time per thread sets the throughput of the whole pipeline.
+ */
+struct stageMetrics {
+	std::string name;
+	unsigned int threads;
+	bool ordered;
+	unsigned long items;
+	double busy_ms;            // in the stage function, summed over the threads of the stage
+	unsigned long starved;     // pops that found the input queue empty
+	double starved_ms;         // waiting for input
+	unsigned long blocked;     // pushes that found the output queue full
+	double blocked_ms;         // waiting for room in the output queue
+	size_t capacity;           // of the input queue
+	size_t max_depth;          // input queue depth seen at a pop, including the popped item
+	double mean_depth;
+};
+
+void printPipelineMetrics(const std::vector<stageMetrics>&);
+
+/* Spins a few rounds, then yields, then sleeps, so waiting threads neither burn a core nor add latency for long */
+class pipelineBackoff {
+public:
+	pipelineBackoff() : rounds(0) {}
+	void pause();
+private:
+	unsigned int rounds;
+};
+
+/* Chain of stages connected by bounded lock-free queues, every stage with its own threads.
+ * Items are numbered by the source. Stages that keep state from item to item are added as ordered and run on one
+ * thread that processes the items in source order, whatever order the parallel stages before them finish in.
+ * The last stage runs on the thread that calls run(), so it can use APIs that want the main thread (highgui).
+ * An exception thrown by a stage marks the item as failed: later stages skip it and run() rethrows the first one
+ * once all items are through. run(source, false) does all stages of an item one after the other on the calling
+ * thread, the reference the threaded run is compared with.
+ */
+template<typename Item>
+class stagePipeline {
+public:
+	typedef std::function<void(Item&)> stageFunction;
+	typedef std::function<bool(Item&)> itemSource;    // fills in the next item, false at the end
+
+	explicit stagePipeline(size_t queue_capacity = 4) : capacity(queue_capacity ? queue_capacity : 1) {}
+
+	void addStage(const std::string& name, const stageFunction& work, unsigned int threads = 1, bool ordered = false)
+	{
+		if (threads == 0 || (ordered && threads > 1))
+			throw std::invalid_argument("stagePipeline::addStage : ordered stages run on exactly one thread");
+
+		std::unique_ptr<stage> s(new stage);
+		s->work = work;
+		s->stats = stageMetrics();
+		s->stats.name = name;
+		s->stats.threads = threads;
+		s->stats.ordered = ordered;
+		s->stats.capacity = capacity;
+		stages.push_back(std::move(s));
+	}
+
+	// Items pushed through all stages
+	unsigned long run(const itemSource& source, bool threaded = true)
+	{
+		if (stages.empty())
+			throw std::logic_error("stagePipeline::run : no stages");
+
+		for (size_t s = 0; s != stages.size(); s++) {
+			std::string name = stages[s]->stats.name;
+			unsigned int threads = stages[s]->stats.threads;
+			bool ordered = stages[s]->stats.ordered;
+			stages[s]->stats = stageMetrics();
+			stages[s]->stats.name = name;
+			stages[s]->stats.threads = threads;
+			stages[s]->stats.ordered = ordered;
+			stages[s]->stats.capacity = capacity;
+		}
+		error = std::exception_ptr();
+
+		return threaded ? runThreaded(source) : runSerial(source);
+	}
+
+	std::vector<stageMetrics> metrics() const
+	{
+		std::vector<stageMetrics> all;
+		for (size_t s = 0; s != stages.size(); s++)
+			all.push_back(stages[s]->stats);
+		return all;
+	}
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	struct envelope {
+		unsigned long seq;
+		bool failed;
+		Item item;
+	};
+
+	struct stage {
+		stageFunction work;
+		std::unique_ptr<boundedQueue<envelope*> > input;
+		std::atomic<unsigned int> running;              // threads that have not seen the end of the input yet
+		std::mutex lock;                                // guards stats while the threads merge their counters
+		stageMetrics stats;
+	};
+
+	// Counters of one thread, merged into the stage when the thread is done
+	struct threadMetrics {
+		threadMetrics() : items(0), busy_ms(0), starved(0), starved_ms(0), blocked(0), blocked_ms(0), depth_sum(0), max_depth(0) {}
+		unsigned long items;
+		double busy_ms;
+		unsigned long starved;
+		double starved_ms;
+		unsigned long blocked;
+		double blocked_ms;
+		double depth_sum;
+		size_t max_depth;
+	};
+
+	static double since(clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+	}
+
+	void fail()
+	{
+		std::lock_guard<std::mutex> lock(error_lock);
+		if (!error)
+			error = std::current_exception();
+	}
+
+	void process(stage& s, envelope *e, threadMetrics& m)
+	{
+		if (e->failed)
+			return;
+
+		clock::time_point start = clock::now();
+		try {
+			s.work(e->item);
+		} catch (...) {
+			e->failed = true;
+			fail();
+		}
+		m.busy_ms += since(start);
+		m.items++;
+	}
+
+	// Queue of stage s, or the end of the pipeline
+	void push(size_t s, envelope *e, threadMetrics& m)
+	{
+		if (s == stages.size()) {
+			delete e;
+			return;
+		}
+
+		boundedQueue<envelope*>& queue = *stages[s]->input;
+		if (queue.try_push(e))
+			return;
+
+		clock::time_point start = clock::now();
+		pipelineBackoff backoff;
+		m.blocked++;
+		while (!queue.try_push(e))
+			backoff.pause();
+		m.blocked_ms += since(start);
+	}
+
+	envelope *pop(stage& s, threadMetrics& m)
+	{
+		envelope *e;
+		if (!s.input->try_pop(e)) {
+			clock::time_point start = clock::now();
+			pipelineBackoff backoff;
+			m.starved++;
+			while (!s.input->try_pop(e))
+				backoff.pause();
+			m.starved_ms += since(start);
+		}
+
+		if (e != NULL) {
+			size_t depth = s.input->depth() + 1;
+			m.depth_sum += depth;
+			if (depth > m.max_depth)
+				m.max_depth = depth;
+		}
+		return e;
+	}
+
+	// The end of the input is one NULL per consumer thread, sent once the last producer thread is done
+	void finish(size_t s, threadMetrics& m)
+	{
+		for (unsigned int t = 0; s != stages.size() && t < stages[s]->stats.threads; t++)
+			push(s, NULL, m);
+	}
+
+	void worker(size_t s)
+	{
+		stage& st = *stages[s];
+		threadMetrics m;
+		std::map<unsigned long, envelope*> pending;     // reorder buffer of an ordered stage
+		unsigned long next_seq = 0;
+
+		for (envelope *e = pop(st, m); e != NULL; e = pop(st, m)) {
+			if (!st.stats.ordered) {
+				process(st, e, m);
+				push(s + 1, e, m);
+				continue;
+			}
+
+			pending[e->seq] = e;
+			while (!pending.empty() && pending.begin()->first == next_seq) {
+				envelope *ready = pending.begin()->second;
+				pending.erase(pending.begin());
+				process(st, ready, m);
+				push(s + 1, ready, m);
+				next_seq++;
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(st.lock);
+			st.stats.items += m.items;
+			st.stats.busy_ms += m.busy_ms;
+			st.stats.starved += m.starved;
+			st.stats.starved_ms += m.starved_ms;
+			st.stats.blocked += m.blocked;
+			st.stats.blocked_ms += m.blocked_ms;
+			if (m.max_depth > st.stats.max_depth)
+				st.stats.max_depth = m.max_depth;
+			st.stats.mean_depth += m.depth_sum;     // divided by the item count when all threads are done
+		}
+
+		if (--st.running == 0)
+			finish(s + 1, m);
+	}
+
+	unsigned long runThreaded(const itemSource& source)
+	{
+		// A ring with one producer and one consumer thread needs no atomic read-modify-writes
+		for (size_t s = 0; s != stages.size(); s++) {
+			unsigned int producers = (s == 0) ? 1 : stages[s - 1]->stats.threads;
+			if (producers == 1 && stages[s]->stats.threads == 1)
+				stages[s]->input.reset(new spscQueue<envelope*>(capacity));
+			else
+				stages[s]->input.reset(new mpmcQueue<envelope*>(capacity));
+			stages[s]->running = stages[s]->stats.threads;
+		}
+
+		unsigned long count = 0;
+		std::thread producer([this, &source, &count] {
+			threadMetrics m;
+			try {
+				for (;;) {
+					std::unique_ptr<envelope> e(new envelope());
+					e->seq = count;
+					e->failed = false;
+					if (!source(e->item))
+						break;
+					push(0, e.release(), m);
+					count++;
+				}
+			} catch (...) {
+				fail();
+			}
+			finish(0, m);
+		});
+
+		std::vector<std::thread> threads;
+		for (size_t s = 0; s != stages.size(); s++)
+			for (unsigned int t = 0; t < stages[s]->stats.threads; t++)
+				if (s + 1 != stages.size() || t != 0)
+					threads.push_back(std::thread(&stagePipeline::worker, this, s));
+
+		worker(stages.size() - 1);
+
+		producer.join();
+		for (size_t t = 0; t != threads.size(); t++)
+			threads[t].join();
+
+		for (size_t s = 0; s != stages.size(); s++) {
+			stageMetrics& stats = stages[s]->stats;
+			stats.mean_depth = (stats.items > 0) ? stats.mean_depth / stats.items : 0;
+			stages[s]->input.reset();
+		}
+
+		if (error)
+			std::rethrow_exception(error);
+
+		return count;
+	}
+
+	unsigned long runSerial(const itemSource& source)
+	{
+		unsigned long count = 0;
+		for (;;) {
+			Item item;
+			if (!source(item))
+				break;
+
+			for (size_t s = 0; s != stages.size(); s++) {
+				clock::time_point start = clock::now();
+				stages[s]->work(item);
+				stages[s]->stats.busy_ms += since(start);
+				stages[s]->stats.items++;
+			}
+			count++;
+		}
+
+		return count;
+	}
+
+	size_t capacity;
+	std::vector<std::unique_ptr<stage> > stages;
+	std::mutex error_lock;
+	std::exception_ptr error;
+};
+
+#endif /* STAGEPIPELINE_H_ */
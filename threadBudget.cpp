@@ -0,0 +1,155 @@
+/*
+ * threadBudget.cpp
+ *
+ *  Created on: Apr 13, 2016
+ *      Author: hrvoje
+ */
+
+#include "opencv2/core.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/types.h>
+#endif
+
+#include "read_dir_contents.h"
+#include "threadBudget.h"
+
+using namespace std;
+
+static atomic<unsigned int> budget_threads(0);   // 0 while no budget was applied
+static mutex budget_lock;                         // guards budget_cores
+static vector<int> budget_cores;
+
+static unsigned int machineThreads()
+{
+	unsigned int threads = thread::hardware_concurrency();
+	return threads ? threads : 1;
+}
+
+#ifdef __linux__
+/* Every thread of the process, OpenCV workers that already exist included, is moved to the core set */
+static void pinProcess(const vector<int>& cores)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (vector<int>::size_type c = 0; c != cores.size(); c++) {
+		if (cores[c] < 0 || cores[c] >= CPU_SETSIZE)
+			throw invalid_argument("applyThreadBudget : core out of range");
+		CPU_SET(cores[c], &set);
+	}
+
+	vector<string> *tasks = listdir("/proc/self/task");
+	bool failed = false;
+	for (vector<string>::size_type t = 0; t != tasks->size(); t++) {
+		pid_t tid = atoi((*tasks)[t].c_str() + (*tasks)[t].rfind('/') + 1);
+		if (tid > 0 && sched_setaffinity(tid, sizeof(set), &set) != 0)
+			failed = true;
+	}
+	delete tasks;
+
+	// The calling thread in any case, /proc may not be mounted
+	if (sched_setaffinity(0, sizeof(set), &set) != 0 || failed)
+		throw runtime_error("applyThreadBudget : could not pin the threads to the core set");
+}
+
+static vector<int> allowedCores(unsigned int count)
+{
+	cpu_set_t set;
+	vector<int> cores;
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+		throw runtime_error("applyThreadBudget : could not read the cores of the process");
+
+	for (int c = 0; c < CPU_SETSIZE && (count == 0 || cores.size() < count); c++)
+		if (CPU_ISSET(c, &set))
+			cores.push_back(c);
+	return cores;
+}
+#endif
+
+void applyThreadBudget(const threadBudget& budget)
+{
+	vector<int> cores;
+	if (budget.pinned) {
+#ifdef __linux__
+		cores = budget.cores.empty() ? allowedCores(budget.threads) : budget.cores;
+		pinProcess(cores);
+#else
+		throw runtime_error("applyThreadBudget : pinning is only supported on Linux");
+#endif
+	}
+
+	unsigned int threads = budget.threads;
+	if (threads == 0)
+		threads = cores.empty() ? machineThreads() : cores.size();
+
+	budget_threads = threads;
+	budgetOpenCV(threads);
+
+	lock_guard<mutex> lock(budget_lock);
+	budget_cores = cores;
+}
+
+void budgetOpenCV(unsigned int threads)
+{
+	threads = min(threads, budgetThreads());
+
+	// 0 is the documented way to make OpenCV run its parallel sections sequentially
+	cv::setNumThreads(threads > 1 ? int(threads) : 0);
+}
+
+vector<unsigned int> splitThreadBudget(const vector<unsigned int>& wanted)
+{
+	unsigned int left = budgetThreads();
+	if (wanted.empty() || left < wanted.size())
+		return vector<unsigned int>();
+
+	vector<unsigned int> threads(wanted.size(), 1);
+	left -= wanted.size();
+	for (bool handed = true; left > 0 && handed; ) {
+		handed = false;
+		for (vector<unsigned int>::size_type p = 0; p != wanted.size() && left > 0; p++) {
+			if (threads[p] < wanted[p]) {
+				threads[p]++;
+				left--;
+				handed = true;
+			}
+		}
+	}
+	return threads;
+}
+
+unsigned int budgetThreads()
+{
+	unsigned int threads = budget_threads;
+	return threads ? threads : machineThreads();
+}
+
+vector<int> budgetCores()
+{
+	lock_guard<mutex> lock(budget_lock);
+	return budget_cores;
+}
+
+string describeThreadBudget()
+{
+	stringstream description;
+	unsigned int threads = budgetThreads();
+	description << threads << (threads == 1 ? " thread" : " threads");
+
+	vector<int> cores = budgetCores();
+	if (!cores.empty()) {
+		description << ", pinned to cores";
+		for (vector<int>::size_type c = 0; c != cores.size(); c++)
+			description << " " << cores[c];
+	}
+	return description.str();
+}
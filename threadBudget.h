@@ -0,0 +1,49 @@
+/*
+ * threadBudget.h
+ *
+ *  Created on: Apr 13, 2016
+ *      Author: hrvoje
+ */
+
+#ifndef THREADBUDGET_H_
+#define THREADBUDGET_H_
+
+#include <string>
+#include <vector>
+
+/* One thread budget for OpenCV and the native pools.
+ * OpenCV parallelizes inside imread, calcOpticalFlowPyrLK, goodFeaturesToTrack, ... with its own threads, the
+ * native code with workPool, the stage pipeline and the pyramid builder of trackBatch. Left alone both size
+ * themselves for the whole machine, oversubscribe it and make the timings of the backends incomparable.
+ *
+ * The budget is the total amount of threads that work at the same time, the calling thread included, over
+ * everything that runs at once: sections that run next to each other split it, they do not get it each.
+ * applyThreadBudget() gives all of it to OpenCV (a parallel section of OpenCV uses at most that many threads,
+ * the caller included), for the usual case of one frame at a time on the main thread. Sections with threads
+ * of their own take their share with splitThreadBudget() and meanwhile run OpenCV sequentially inside those
+ * threads with budgetOpenCV(1), handing the budget back to it with budgetOpenCV(budgetThreads()) afterwards.
+ * A budget smaller than the threads a section needs at least makes it run serially.
+ *
+ * applyThreadBudget() can also pin all threads of the process to a core set. Threads created later inherit
+ * the core set of their creator, so it is best applied first thing in main, before any pool exists.
+ */
+struct threadBudget {
+	unsigned int threads;      // total for the process, see above; 1 runs everything single-threaded, 0 takes all cores
+	bool pinned;               // keep all threads on the cores below
+	std::vector<int> cores;    // core set when pinned, empty for the first cores the process may use (as many as threads)
+};
+
+void applyThreadBudget(const threadBudget&);
+unsigned int budgetThreads();      // the total, all cores while no budget was applied
+std::vector<int> budgetCores();    // the pinned core set, empty when not pinned
+std::string describeThreadBudget();
+
+// Threads of the parts of a section that run at the same time, wanted[i] at most and at least 1 each, the
+// extra threads handed out round robin in the order of the parts, summing to no more than the budget.
+// Empty when the budget can not give every part a thread, then the section should run serially.
+std::vector<unsigned int> splitThreadBudget(const std::vector<unsigned int>& wanted);
+
+// Threads of the parallel sections of OpenCV from now on, at most the budget, 1 to run them sequentially
+void budgetOpenCV(unsigned int threads);
+
+#endif /* THREADBUDGET_H_ */
@@ -0,0 +1,209 @@
+/*
+ * tilingBenchmark.cpp
+ *
+ *  Created on: Apr 9, 2016
+ *      Author: hrvoje
+ */
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+extern "C" {
+#include "fast_rosten.h"
+#include "image.h"
+#include "lucas_kanade.h"
+}
+
+#include "tilingBenchmark.h"
+
+using namespace cv;
+using namespace std;
+
+/* Last level cache read misses of the calling thread */
+class cacheMissCounter {
+public:
+	cacheMissCounter() : fd(-1)
+	{
+#ifdef __linux__
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+	}
+	~cacheMissCounter()
+	{
+#ifdef __linux__
+		if (fd >= 0)
+			close(fd);
+#endif
+	}
+
+	bool available() const { return fd >= 0; }
+
+	void start()
+	{
+#ifdef __linux__
+		if (fd >= 0) {
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+
+	long long stop()
+	{
+		long long count = -1;
+#ifdef __linux__
+		if (fd >= 0) {
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(fd, &count, sizeof(count)) != sizeof(count))
+				count = -1;
+		}
+#endif
+		return count;
+	}
+
+private:
+	int fd;
+};
+
+/* Touch a buffer larger than the last level cache, so every run starts with cold image data */
+static void flushCaches(vector<uint8_t>& buffer)
+{
+	for (vector<uint8_t>::size_type i = 0; i < buffer.size(); i += 64)
+		buffer[i]++;
+}
+
+static void freePyramids(vector<vector<struct image_t> >& pyramids)
+{
+	for (vector<vector<struct image_t> >::size_type f = 0; f != pyramids.size(); f++)
+		for (vector<struct image_t>::size_type l = 0; l != pyramids[f].size(); l++)
+			image_free(&pyramids[f][l]);
+}
+
+vector<tilingBenchmarkResult> runTilingBenchmark(uint16_t width, uint16_t height, uint16_t max_points,
+		const vector<uint16_t>& tile_sizes, unsigned int frames)
+{
+	const int shift_x = 3, shift_y = 2;    // motion per frame in pixels
+	const uint8_t pyramid_level = 2;
+	const uint32_t subpixel_factor = 100;
+	struct lk_level_params params = { 5, 20, 3, NULL, NULL };
+	vector<struct lk_level_params> levels(pyramid_level + 1, params);
+	uint8_t border_size = opticFlowLK_levels_border_size(&levels[0], pyramid_level);
+
+	// Texture large enough for all frames, blurred so the gradients are smooth at the window scale
+	Mat texture(height + frames * shift_y, width + frames * shift_x, CV_8UC1);
+	RNG rng(0x1234);
+	rng.fill(texture, RNG::UNIFORM, 0, 256);
+	GaussianBlur(texture, texture, Size(0, 0), 2.0);
+
+	// Pyramids of every frame, the camera moves right and down so the content moves left and up
+	vector<vector<struct image_t> > pyramids(frames, vector<struct image_t>(pyramid_level + 1));
+	struct image_t frame;
+	image_create(&frame, width, height, IMAGE_GRAYSCALE);
+	Mat frame_mat(height, width, CV_8UC1, frame.buf);
+	vector<struct point_t> points;
+	for (unsigned int f = 0; f < frames; f++) {
+		texture(Rect(f * shift_x, f * shift_y, width, height)).copyTo(frame_mat);
+		pyramid_build(&frame, &pyramids[f][0], pyramid_level, border_size);
+
+		if (f == 0) {
+			uint16_t corner_cnt;
+			struct point_t *corners = fast9_detect(&frame, 20, 5, 0, 0, &corner_cnt);
+			points.assign(corners, corners + corner_cnt);
+			free(corners);
+		}
+	}
+	image_free(&frame);
+
+	// Shuffle the raster order of the detector and keep max_points of them
+	for (vector<struct point_t>::size_type i = points.size(); i > 1; i--)
+		swap(points[i - 1], points[rng.uniform(0, int(i))]);
+	if (points.size() > max_points)
+		points.resize(max_points);
+
+	vector<tilingBenchmarkResult> results;
+	if (points.empty()) {
+		freePyramids(pyramids);
+		return results;
+	}
+
+	cacheMissCounter counter;
+	vector<uint8_t> flush(64 << 20);
+	vector<uint16_t> runs(1, 0);
+	runs.insert(runs.end(), tile_sizes.begin(), tile_sizes.end());
+
+	for (vector<uint16_t>::size_type r = 0; r != runs.size(); r++) {
+		tilingBenchmarkResult result = { runs[r], 0, counter.available() ? 0. : -1., 0 };
+
+		for (unsigned int f = 0; f + 1 < frames; f++) {
+			uint16_t points_cnt = points.size();
+			flushCaches(flush);
+
+			double time = (double)getTickCount();
+			counter.start();
+			struct flow_t *vectors;
+			if (runs[r] == 0)
+				vectors = opticFlowLK_levels(&pyramids[f + 1][0], &pyramids[f][0], &points[0], &points_cnt, &levels[0],
+						border_size, subpixel_factor, points.size(), pyramid_level);
+			else
+				vectors = opticFlowLK_tiled(&pyramids[f + 1][0], &pyramids[f][0], &points[0], &points_cnt, &levels[0],
+						border_size, subpixel_factor, points.size(), pyramid_level, runs[r]);
+			long long misses = counter.stop();
+			result.time_ms += (((double)getTickCount() - time)/getTickFrequency())*1000;
+
+			if (counter.available())
+				result.cache_misses += misses;
+			result.points_tracked += points_cnt;
+			free(vectors);
+		}
+
+		unsigned int pairs = max(frames, 2u) - 1;
+		result.time_ms /= pairs;
+		if (counter.available())
+			result.cache_misses /= pairs;
+		result.points_tracked /= pairs;
+		results.push_back(result);
+	}
+
+	freePyramids(pyramids);
+
+	return results;
+}
+
+void printTilingBenchmark(uint16_t width, uint16_t height, const vector<tilingBenchmarkResult>& results)
+{
+	cout << "Tiled tracking " << width << "x" << height << ":" << endl;
+	for (vector<tilingBenchmarkResult>::size_type r = 0; r != results.size(); r++) {
+		if (results[r].tile_size == 0)
+			cout << "  untiled   ";
+		else
+			cout << "  tile " << setw(4) << results[r].tile_size << " ";
+		cout << fixed << setprecision(2) << setw(8) << results[r].time_ms << " ms  "
+				<< setprecision(0) << setw(6) << results[r].points_tracked << " points  ";
+		if (results[r].cache_misses >= 0)
+			cout << setw(10) << results[r].cache_misses << " LLC read misses";
+		else
+			cout << "LLC read misses not available";
+		cout << endl;
+	}
+	cout.unsetf(ios::fixed);
+}
@@ -0,0 +1,32 @@
+/*
+ * tilingBenchmark.h
+ *
+ *  Created on: Apr 9, 2016
+ *      Author: hrvoje
+ */
+
+#ifndef TILINGBENCHMARK_H_
+#define TILINGBENCHMARK_H_
+
+#include <vector>
+#include "opencv2/core.hpp"
+
+/* Result of one tile size in runTilingBenchmark(), averaged over the frame pairs */
+struct tilingBenchmarkResult {
+	uint16_t tile_size;        // 0 for opticFlowLK_levels() in the given point order
+	double time_ms;            // tracking time per frame pair
+	double cache_misses;       // last level cache read misses per frame pair, -1 when the counter is not available
+	double points_tracked;     // tracked points per frame pair
+};
+
+/* Cache-blocked tracking benchmark on a synthetic high-resolution sequence.
+ * A blurred noise texture is moved by a few pixels per frame, FAST corners of the first frame are shuffled
+ * (like points from a track list or another detector) and tracked with opticFlowLK_levels() and with
+ * opticFlowLK_tiled() for every tile size. The caches are flushed before every frame pair, the pyramids are
+ * built outside the measurement. Cache misses are counted with perf_event_open() on Linux.
+ */
+std::vector<tilingBenchmarkResult> runTilingBenchmark(uint16_t width, uint16_t height, uint16_t max_points,
+		const std::vector<uint16_t>& tile_sizes, unsigned int frames);
+void printTilingBenchmark(uint16_t width, uint16_t height, const std::vector<tilingBenchmarkResult>& results);
+
+#endif /* TILINGBENCHMARK_H_ */
@@ -0,0 +1,186 @@
+/*
+ * trackerService.cpp
+ *
+ *  Created on: Apr 11, 2016
+ *      Author: hrvoje
+ */
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "trackerService.h"
+
+using namespace cv;
+using namespace std;
+
+trackerService::trackerService(unsigned int workers)
+	: in_flight(0),
+	  workers(workers)
+{
+}
+
+trackerService::~trackerService()
+{
+	drain();
+
+	for (vector<unique_ptr<stream> >::size_type s = 0; s != streams.size(); s++) {
+		// The backends go first, they may refer to the prepared frames
+		streams[s]->backend.reset();
+		for (deque<pendingFrame*>::size_type f = 0; f != streams[s]->prepared.size(); f++)
+			release(streams[s]->prepared[f]);
+	}
+}
+
+unsigned int trackerService::addStream(const streamConfig& config, const flowCallback& on_flow)
+{
+	unique_ptr<stream> added(new stream);
+	added->config = config;
+	added->config.weight = max(config.weight, 1u);
+	added->config.max_pending = max(config.max_pending, 1u);
+	added->backend.reset(createBackend(config.backend));
+	added->on_flow = on_flow;
+	added->running = false;
+	added->frames = 0;
+	added->dropped = 0;
+	added->failed = 0;
+
+	lock_guard<mutex> guard(lock);
+	// Start at the least used stream, a new stream has no share to catch up on
+	added->pass = 0;
+	for (vector<unique_ptr<stream> >::size_type s = 0; s != streams.size(); s++)
+		added->pass = (s == 0) ? streams[s]->pass : min(added->pass, streams[s]->pass);
+
+	streams.push_back(move(added));
+	return streams.size() - 1;
+}
+
+void trackerService::submitFrame(unsigned int s, preloadedFrame& frame, const vector<Point2f>& points)
+{
+	pendingFrame *submitted = new pendingFrame;
+	submitted->frame = frame;
+	submitted->points = points;
+	submitted->submitted = (double)getTickCount();
+	frame = preloadedFrame();
+
+	lock_guard<mutex> guard(lock);
+	if (s >= streams.size()) {
+		release(submitted);
+		throw out_of_range("trackerService : unknown stream");
+	}
+
+	// Keep the newest frames, a late frame is worth less than a current one
+	stream& target = *streams[s];
+	while (target.pending.size() >= target.config.max_pending) {
+		release(target.pending.front());
+		target.pending.pop_front();
+		target.dropped++;
+	}
+	target.pending.push_back(submitted);
+	dispatch();
+}
+
+void trackerService::drain()
+{
+	unique_lock<mutex> guard(lock);
+	drained.wait(guard, [this] {
+		if (in_flight > 0)
+			return false;
+		for (vector<unique_ptr<stream> >::size_type s = 0; s != streams.size(); s++)
+			if (!streams[s]->pending.empty())
+				return false;
+		return true;
+	});
+}
+
+streamStats trackerService::stats(unsigned int s) const
+{
+	lock_guard<mutex> guard(lock);
+	const stream& source = *streams.at(s);
+
+	streamStats result = { source.frames, source.dropped, source.failed, 0, 0, 0, 0 };
+	if (source.latencies.empty())
+		return result;
+
+	vector<float> sorted(source.latencies.begin(), source.latencies.end());
+	sort(sorted.begin(), sorted.end());
+	for (vector<float>::size_type i = 0; i != sorted.size(); i++)
+		result.mean_ms += sorted[i];
+	result.mean_ms /= sorted.size();
+	result.p50_ms = sorted[sorted.size() / 2];
+	result.p99_ms = sorted[min(sorted.size() - 1, vector<float>::size_type(0.99 * sorted.size()))];
+	result.max_ms = sorted.back();
+	return result;
+}
+
+/* Start waiting streams while workers are free, the lock has to be held */
+void trackerService::dispatch()
+{
+	while (in_flight < workers.workers()) {
+		stream *next = NULL;
+		unsigned int index = 0;
+		for (vector<unique_ptr<stream> >::size_type s = 0; s != streams.size(); s++) {
+			stream *candidate = streams[s].get();
+			if (candidate->running || candidate->pending.empty())
+				continue;
+			if (next == NULL || candidate->config.priority > next->config.priority
+					|| (candidate->config.priority == next->config.priority && candidate->pass < next->pass)) {
+				next = candidate;
+				index = s;
+			}
+		}
+		if (next == NULL)
+			return;
+
+		pendingFrame *frame = next->pending.front();
+		next->pending.pop_front();
+		next->running = true;
+		next->pass += stride / next->config.weight;
+		in_flight++;
+		workers.submit([this, index, next, frame] { process(index, next, frame); });
+	}
+}
+
+/* Prepare a frame on the backend of its stream and track the points of the previous frame into it.
+ * Only one frame of a stream runs at a time, so its backend and prepared frames need no lock. */
+void trackerService::process(unsigned int index, stream *target, pendingFrame *frame)
+{
+	vector<flow_t_> flow;
+	bool failed = false;
+	try {
+		target->backend->prepareFrame(frame->frame);
+		if (!target->prepared.empty()) {
+			target->backend->trackPoints(target->prepared.back()->points, flow);
+			if (target->on_flow)
+				target->on_flow(index, flow);
+		}
+	} catch (...) {
+		failed = true;
+	}
+
+	lock_guard<mutex> guard(lock);
+	float latency = (((double)getTickCount() - frame->submitted)/getTickFrequency())*1000; //in miliseconds
+	target->latencies.push_back(latency);
+	if (target->latencies.size() > latency_history)
+		target->latencies.pop_front();
+	target->frames++;
+	if (failed)
+		target->failed++;
+
+	// The backend refers to the last two prepared frames
+	target->prepared.push_back(frame);
+	while (target->prepared.size() > 2) {
+		release(target->prepared.front());
+		target->prepared.pop_front();
+	}
+
+	target->running = false;
+	in_flight--;
+	dispatch();
+	drained.notify_all();
+}
+
+void trackerService::release(pendingFrame *frame)
+{
+	freeFrame(frame->frame);
+	delete frame;
+}
@@ -0,0 +1,96 @@
+/*
+ * trackerService.h
+ *
+ *  Created on: Apr 11, 2016
+ *      Author: hrvoje
+ */
+
+#ifndef TRACKERSERVICE_H_
+#define TRACKERSERVICE_H_
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+#include "opencv2/core.hpp"
+
+#include "optFlow_backend.h"
+#include "workPool.h"
+
+/* Settings of one camera stream of trackerService */
+struct streamConfig {
+	std::string backend;        // any name from listBackends(), every stream gets its own instance
+	unsigned int priority;      // streams with a higher priority get the free workers first
+	unsigned int weight;        // share of the workers among streams of the same priority, at least 1
+	unsigned int max_pending;   // frames waiting before the oldest one is dropped, at least 1
+};
+
+/* Latency of a stream in miliseconds, from submitFrame() until its flow was delivered */
+struct streamStats {
+	uint64_t frames;            // frames processed
+	uint64_t dropped;           // frames dropped because max_pending were already waiting
+	uint64_t failed;            // frames the backend threw an exception on
+	float mean_ms, p50_ms, p99_ms, max_ms;
+};
+
+/* Flow of a stream from its previous processed frame into the current one, called on a worker thread */
+typedef std::function<void(unsigned int stream, const std::vector<flow_t_>& flow)> flowCallback;
+
+/* Optical flow for several camera streams on one shared workPool.
+ * Every stream has its own backend (and with it its own pyramids and tracks), so the frames of a stream are
+ * processed one after another while different streams run in parallel. When a worker is free, the waiting
+ * stream with the highest priority is started; among equal priorities the one that used the least of its
+ * share so far (stride scheduling by weight), so a busy stream can not starve the others.
+ */
+class trackerService {
+public:
+	explicit trackerService(unsigned int workers);   // 0 for budgetThreads()
+	~trackerService();
+
+	unsigned int addStream(const streamConfig& config, const flowCallback& on_flow);
+
+	// Takes the frame over, frame is left empty. points are features in this frame, tracked into the
+	// next processed frame of the stream.
+	void submitFrame(unsigned int stream, preloadedFrame& frame, const std::vector<cv::Point2f>& points);
+
+	void drain();   // wait until all submitted frames are processed or dropped
+	streamStats stats(unsigned int stream) const;
+	const workPool& pool() const { return workers; }
+
+private:
+	struct pendingFrame {
+		preloadedFrame frame;
+		std::vector<cv::Point2f> points;
+		double submitted;       // tick count
+	};
+
+	struct stream {
+		streamConfig config;
+		std::unique_ptr<optFlowBackend> backend;
+		flowCallback on_flow;
+		std::deque<pendingFrame*> pending;
+		std::deque<pendingFrame*> prepared;     // frames the backend may still refer to, the newest last
+		bool running;
+		uint64_t pass;                  // virtual time of stride scheduling
+		uint64_t frames, dropped, failed;
+		std::deque<float> latencies;    // the last latency_history ones
+	};
+
+	void dispatch();
+	void process(unsigned int index, stream *target, pendingFrame *frame);
+	void release(pendingFrame *frame);
+
+	static const uint64_t stride = 1 << 20;
+	static const unsigned int latency_history = 1000;
+
+	mutable std::mutex lock;            // guards everything below
+	std::condition_variable drained;
+	std::vector<std::unique_ptr<stream> > streams;
+	unsigned int in_flight;
+	workPool workers;                   // last, so the workers stop before the streams are gone
+};
+
+#endif /* TRACKERSERVICE_H_ */
@@ -0,0 +1,131 @@
+/*
+ * workPool.cpp
+ *
+ *  Created on: Apr 11, 2016
+ *      Author: hrvoje
+ */
+
+#include "threadBudget.h"
+#include "workPool.h"
+
+using namespace std;
+
+/* Pool and worker index of the calling thread, so tasks can queue follow-up work at their own worker */
+static thread_local workPool *current_pool = NULL;
+static thread_local unsigned int current_worker = 0;
+
+workPool::workPool(unsigned int workers)
+	: queued(0),
+	  unfinished(0),
+	  stopping(false),
+	  next_queue(0),
+	  steal_cnt(0)
+{
+	if (workers == 0)
+		workers = budgetThreads();
+
+	for (unsigned int i = 0; i < workers; i++)
+		queues.push_back(unique_ptr<workerQueue>(new workerQueue));
+	for (unsigned int i = 0; i < workers; i++)
+		threads.push_back(thread(&workPool::run, this, i));
+}
+
+workPool::~workPool()
+{
+	{
+		unique_lock<mutex> lock(sleep_lock);
+		idle.wait(lock, [this] { return unfinished == 0; });
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (vector<thread>::size_type i = 0; i != threads.size(); i++)
+		threads[i].join();
+}
+
+void workPool::submit(const function<void()>& task)
+{
+	unsigned int q = (current_pool == this) ? current_worker : next_queue++ % queues.size();
+
+	// Counted before it is visible, so wait() can not return in between
+	{
+		lock_guard<mutex> lock(sleep_lock);
+		unfinished++;
+	}
+	{
+		lock_guard<mutex> lock(queues[q]->lock);
+		queues[q]->tasks.push_back(task);
+	}
+	{
+		lock_guard<mutex> lock(sleep_lock);
+		queued++;
+	}
+	wake.notify_one();
+}
+
+void workPool::wait()
+{
+	unique_lock<mutex> lock(sleep_lock);
+	idle.wait(lock, [this] { return unfinished == 0; });
+
+	if (error) {
+		exception_ptr first = error;
+		error = exception_ptr();
+		rethrow_exception(first);
+	}
+}
+
+/* Own tasks newest first, then the oldest task of the other workers */
+bool workPool::take(unsigned int id, function<void()>& task)
+{
+	{
+		lock_guard<mutex> lock(queues[id]->lock);
+		if (!queues[id]->tasks.empty()) {
+			task = queues[id]->tasks.back();
+			queues[id]->tasks.pop_back();
+			return true;
+		}
+	}
+
+	for (unsigned int k = 1; k < queues.size(); k++) {
+		workerQueue& victim = *queues[(id + k) % queues.size()];
+		lock_guard<mutex> lock(victim.lock);
+		if (!victim.tasks.empty()) {
+			task = victim.tasks.front();
+			victim.tasks.pop_front();
+			steal_cnt++;
+			return true;
+		}
+	}
+	return false;
+}
+
+void workPool::run(unsigned int id)
+{
+	current_pool = this;
+	current_worker = id;
+
+	for (;;) {
+		function<void()> task;
+		if (take(id, task)) {
+			queued--;
+			try {
+				task();
+			} catch (...) {
+				lock_guard<mutex> lock(sleep_lock);
+				if (!error)
+					error = current_exception();
+			}
+
+			lock_guard<mutex> lock(sleep_lock);
+			if (--unfinished == 0)
+				idle.notify_all();
+			continue;
+		}
+
+		unique_lock<mutex> lock(sleep_lock);
+		wake.wait(lock, [this] { return stopping || queued > 0; });
+		if (stopping && queued <= 0)
+			return;
+	}
+}
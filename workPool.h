@@ -0,0 +1,61 @@
+/*
+ * workPool.h
+ *
+ *  Created on: Apr 11, 2016
+ *      Author: hrvoje
+ */
+
+#ifndef WORKPOOL_H_
+#define WORKPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Thread pool with a task deque per worker.
+ * Tasks submitted from a worker go to its own deque, tasks from outside are spread round robin. A worker
+ * takes its own tasks newest first (their data is most likely still in its cache) and, when it runs out,
+ * steals the oldest task of another worker, so uneven tasks spread over all workers without a shared queue.
+ * The first exception thrown by a task is rethrown by wait().
+ */
+class workPool {
+public:
+	explicit workPool(unsigned int workers);   // 0 for budgetThreads()
+	~workPool();
+
+	void submit(const std::function<void()>& task);
+	void wait();    // until all submitted tasks are done, not from inside a task
+
+	unsigned int workers() const { return threads.size(); }
+	uint64_t steals() const { return steal_cnt; }   // tasks run by another worker than they were queued at
+
+private:
+	struct workerQueue {
+		std::mutex lock;
+		std::deque<std::function<void()> > tasks;
+	};
+
+	void run(unsigned int id);
+	bool take(unsigned int id, std::function<void()>& task);
+
+	std::vector<std::unique_ptr<workerQueue> > queues;
+	std::vector<std::thread> threads;
+
+	std::mutex sleep_lock;                // guards the waits on queued, unfinished and stopping
+	std::condition_variable wake;         // a task was queued or the pool stops
+	std::condition_variable idle;         // all tasks are done
+	std::atomic<int> queued;              // tasks in the deques
+	unsigned int unfinished;              // tasks submitted and not done yet
+	bool stopping;
+	std::atomic<unsigned int> next_queue; // round robin for tasks from outside the pool
+	std::atomic<uint64_t> steal_cnt;
+	std::exception_ptr error;
+};
+
+#endif /* WORKPOOL_H_ */